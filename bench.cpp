@@ -0,0 +1,561 @@
+// Timings and sizes of the larger operations, kept out of the unit tests.
+// Built with optimization by "make bench". "./bench" runs all of them;
+// "./bench compact frozen" runs those named.
+
+#include <cstdio>
+#include <cstring>
+#include <chrono>
+#include <string>
+
+#include "tinyxml2/tinyxml2.h"
+
+using namespace tinyxml2;
+
+// Seconds of wall clock time since 'start'.
+static double Since(std::chrono::steady_clock::time_point start)
+{
+    const std::chrono::duration<double> took = std::chrono::steady_clock::now() - start;
+    return took.count();
+}
+
+static std::chrono::steady_clock::time_point Now()
+{
+    return std::chrono::steady_clock::now();
+}
+
+static void CompactDocument()
+{
+    XMLPrinter big;
+    big.OpenElement("root");
+    for (int i = 0; i < 100000; ++i) {
+        big.OpenElement("item");
+        big.PushAttribute("id", i);
+        big.PushText("text");
+        big.CloseElement();
+    }
+    big.CloseElement();
+    XMLCompactDocument compact;
+    const std::chrono::steady_clock::time_point start = Now();
+    compact.Parse(big.CStr());
+    const double parsed = Since(start);
+    printf("XMLCompactDocument: %.1f bytes per node (XMLElement is %d bytes, XMLAttribute %d), parse %.4fs\n",
+           double(compact.MemoryUsage()) / compact.NodeCount(), int(sizeof(XMLElement)), int(sizeof(XMLAttribute)), parsed);
+}
+
+// A root with many children, linked as they are made, or made first
+// and then linked: unlinked nodes are tracked until they are linked.
+static void WideTree()
+{
+    const int count = 300000;
+    XMLDocument linked;
+    std::chrono::steady_clock::time_point start = Now();
+    XMLElement* root = linked.NewElement("root");
+    linked.InsertEndChild(root);
+    for (int i = 0; i < count; ++i) {
+        root->InsertEndChild(linked.NewElement("item"));
+    }
+    const double linkedTime = Since(start);
+
+    XMLDocument batch;
+    XMLElement** items = new XMLElement*[count];
+    start = Now();
+    root = batch.NewElement("root");
+    for (int i = 0; i < count; ++i) {
+        items[i] = batch.NewElement("item");
+    }
+    for (int i = 0; i < count; ++i) {
+        root->InsertEndChild(items[i]);
+    }
+    batch.InsertEndChild(root);
+    const double batchTime = Since(start);
+    delete [] items;
+    printf("Wide tree of %d: linked as made %.4fs, made then linked %.4fs\n", count, linkedTime, batchTime);
+}
+
+// The same items built with the public API and with XMLBuilder.
+static void Builder()
+{
+    const int count = 200000;
+    std::chrono::steady_clock::time_point start = Now();
+    XMLDocument api;
+    XMLElement* root = api.NewElement("root");
+    api.InsertEndChild(root);
+    for (int i = 0; i < count; ++i) {
+        XMLElement* item = api.NewElement("item");
+        root->InsertEndChild(item);
+        item->SetAttribute("id", i);
+        item->SetAttribute("name", "value");
+        item->SetAttribute("ok", true);
+        XMLElement* price = item->InsertNewChildElement("price");
+        price->SetText(1.5);
+    }
+    const double apiTime = Since(start);
+
+    start = Now();
+    XMLDocument built;
+    XMLBuilder builder(&built, true);
+    builder.BeginElement("root");
+    for (int i = 0; i < count; ++i) {
+        builder.BeginElement("item");
+        builder.Attr("id", i);
+        builder.Attr("name", "value");
+        builder.Attr("ok", true);
+        builder.BeginElement("price");
+        builder.Text(1.5);
+        builder.EndElement();
+        builder.EndElement();
+    }
+    builder.EndElement();
+    const double builderTime = Since(start);
+    printf("Build %d items: public API %.4fs, XMLBuilder %.4fs\n", count, apiTime, builderTime);
+}
+
+// Copying shares the strings of the source rather than copying them.
+static void DeepCopy()
+{
+    XMLDocument doc;
+    doc.Parse("<root/>");
+    XMLElement* root = doc.RootElement();
+    for (int i = 0; i < 300000; ++i) {
+        XMLElement* item = root->InsertNewChildElement("item");
+        item->SetAttribute("id", i);
+        item->SetAttribute("name", "a name for the item");
+        item->InsertNewText("some text for the item");
+    }
+    XMLDocument copy;
+    const std::chrono::steady_clock::time_point start = Now();
+    doc.DeepCopy(&copy);
+    printf("DeepCopy of 300000 elements: %.4fs\n", Since(start));
+}
+
+// The same copy on more threads, in wall clock time.
+static void ParallelCopy()
+{
+    XMLDocument doc;
+    doc.Parse("<root/>");
+    XMLElement* root = doc.RootElement();
+    for (int i = 0; i < 300000; ++i) {
+        XMLElement* item = root->InsertNewChildElement("item");
+        item->SetAttribute("id", i);
+        item->SetAttribute("name", "a &name");
+        item->InsertNewChildElement("sub")->InsertNewText("text &lt;");
+    }
+    const int threads[] = { 1, 2, 4, 8 };
+    for (int i = 0; i < 4; ++i) {
+        XMLDocument copy;
+        const std::chrono::steady_clock::time_point start = Now();
+        doc.DeepCopy(&copy, threads[i]);
+        printf("DeepCopy of 300000 elements with %d threads: %.4fs\n", threads[i], Since(start));
+    }
+}
+
+// Hashing again after a change only hashes the path to it.
+static void Hash()
+{
+    XMLDocument doc;
+    XMLElement* root = doc.NewElement("root");
+    doc.InsertEndChild(root);
+    for (int i = 0; i < 300000; ++i) {
+        XMLElement* e = root->InsertNewChildElement("item");
+        e->SetAttribute("id", i);
+        e->InsertNewText("text");
+    }
+    std::chrono::steady_clock::time_point start = Now();
+    doc.Hash();
+    const double full = Since(start);
+    root->LastChildElement()->SetAttribute("id", -1);
+    start = Now();
+    doc.Hash();
+    printf("Hash of 300000 elements: %.4fs, again after a change: %.6fs\n", full, Since(start));
+}
+
+// A few changes to a large document make a small script.
+static void Diff()
+{
+    XMLDocument big, changed, script;
+    {
+        XMLBuilder builder(&big);
+        builder.BeginElement("root");
+        for (int i = 0; i < 100000; ++i) {
+            builder.BeginElement("item");
+            builder.Attr("id", i);
+            builder.Text("text");
+            builder.EndElement();
+        }
+        builder.EndElement();
+    }
+    big.DeepCopy(&changed);
+    XMLElement* root = changed.RootElement();
+    XMLElement* item = root->FirstChildElement();
+    for (int i = 0; i < 500; ++i) {
+        item = item->NextSiblingElement();
+    }
+    item->SetAttribute("id", "changed");
+    root->DeleteChild(item->NextSibling());
+    root->InsertFirstChild(root->LastChild());
+    root->InsertEndChild(changed.NewComment("added"));
+    std::chrono::steady_clock::time_point start = Now();
+    const int edits = big.Diff(&changed, &script);
+    const double diff = Since(start);
+    start = Now();
+    big.Patch(&script);
+    printf("Diff of 100000 elements: %.4fs, %d edits, patch: %.4fs\n", diff, edits, Since(start));
+}
+
+// Saving after a small change copies what didn't change.
+static void ReuseSource()
+{
+    XMLDocument big;
+    big.SetTrackSpans(true);
+    {
+        XMLDocument source;
+        XMLBuilder builder(&source);
+        builder.BeginElement("root");
+        for (int i = 0; i < 100000; ++i) {
+            builder.BeginElement("item");
+            builder.Attr("id", i);
+            builder.Attr("name", "a & b");
+            builder.Text("some <text>");
+            builder.EndElement();
+        }
+        builder.EndElement();
+        XMLPrinter printer;
+        source.Print(&printer);
+        big.Parse(printer.CStr());
+    }
+    big.RootElement()->LastChildElement()->SetAttribute("id", "last");
+    std::chrono::steady_clock::time_point start = Now();
+    XMLPrinter full;
+    big.Print(&full);
+    const double printed = Since(start);
+    start = Now();
+    XMLPrinter reused;
+    reused.SetReuseSource(true);
+    big.Print(&reused);
+    printf("Save 100000 elements after a change: printed %.4fs, reusing the source %.4fs\n", printed, Since(start));
+}
+
+// One edit in a large document, reparsed or parsed again.
+static void Reparse()
+{
+    std::string text;
+    {
+        XMLDocument source;
+        XMLBuilder builder(&source);
+        builder.BeginElement("root");
+        for (int i = 0; i < 100000; ++i) {
+            builder.BeginElement("item");
+            builder.Attr("id", i);
+            builder.Text("text");
+            builder.EndElement();
+        }
+        builder.EndElement();
+        XMLPrinter printer;
+        source.Print(&printer);
+        text = printer.CStr();
+    }
+    XMLDocument big;
+    big.SetTrackSpans(true);
+    big.Parse(text.c_str());
+    XMLElement* item = big.RootElement()->FirstChildElement();
+    for (int i = 0; i < 50000; ++i) {
+        item = item->NextSiblingElement();
+    }
+    size_t offset = 0, length = 0;
+    item->FirstChild()->GetSourceSpan(&offset, &length);
+    text.replace(offset, length, "changed");
+    std::chrono::steady_clock::time_point start = Now();
+    big.Reparse(text.c_str(), text.size(), offset, length);
+    const double reparsed = Since(start);
+    start = Now();
+    XMLDocument full;
+    full.Parse(text.c_str());
+    printf("Edit of 100000 elements: reparse %.4fs, parse %.4fs\n", reparsed, Since(start));
+}
+
+static void PrintFile()
+{
+    XMLDocument doc;
+    {
+        XMLBuilder builder(&doc);
+        builder.BeginElement("root");
+        for (int i = 0; i < 300000; ++i) {
+            builder.BeginElement("item");
+            builder.Attr("id", i);
+            builder.Text("a & b");
+            builder.EndElement();
+        }
+        builder.EndElement();
+    }
+    FILE* fp = tmpfile();
+    if (!fp) {
+        return;
+    }
+    const std::chrono::steady_clock::time_point start = Now();
+    {
+        XMLPrinter printer(fp);
+        doc.Print(&printer);
+    }
+    printf("Print 300000 elements to a FILE: %.4fs\n", Since(start));
+    fclose(fp);
+}
+
+// Printing to memory into a buffer that grows, one reserved up front,
+// or chunks.
+static void PrintMemory()
+{
+    XMLDocument doc;
+    {
+        XMLBuilder builder(&doc);
+        builder.BeginElement("root");
+        for (int i = 0; i < 200000; ++i) {
+            builder.BeginElement("item");
+            builder.Attr("id", i);
+            builder.Text("a & b");
+            builder.EndElement();
+        }
+        builder.EndElement();
+    }
+    std::chrono::steady_clock::time_point start = Now();
+    {
+        XMLPrinter memory;
+        doc.Print(&memory);
+    }
+    const double grown = Since(start);
+
+    start = Now();
+    {
+        XMLPrinter printer;
+        printer.Reserve(doc);
+        doc.Print(&printer);
+    }
+    const double reserved = Since(start);
+
+    start = Now();
+    {
+        XMLPrinter chunked;
+        chunked.SetChunked(true);
+        doc.Print(&chunked);
+    }
+    const double pieces = Since(start);
+    printf("Print 200000 elements to memory: growing %.4fs, reserved %.4fs (with measuring), chunked %.4fs\n", grown, reserved, pieces);
+}
+
+static void EscapeScan()
+{
+    std::string clean;
+    while (clean.size() < 1000000) {
+        clean += "Lorem ipsum dolor sit amet, consectetur \xC3\xA9 adipiscing. ";
+    }
+    XMLPrinter printer;
+    const std::chrono::steady_clock::time_point start = Now();
+    for (int i = 0; i < 100; ++i) {
+        printer.ClearBuffer();
+        printer.PushText(clean.c_str());
+    }
+    printf("Print 100 MB of text without entities: %.4fs\n", Since(start));
+}
+
+// Most values need no escaping when they are printed again.
+static void LoadModifySave()
+{
+    std::string big = "<root>";
+    for (int i = 0; i < 100000; ++i) {
+        big += "<item id='";
+        big += char('0' + i % 10);
+        big += "' title='a short title'>Lorem ipsum dolor sit amet, consectetur adipiscing elit.</item>";
+    }
+    big += "</root>";
+    const std::chrono::steady_clock::time_point start = Now();
+    XMLDocument doc;
+    doc.Parse(big.c_str());
+    doc.RootElement()->FirstChildElement()->SetAttribute("id", "x");
+    XMLPrinter printer;
+    doc.Print(&printer);
+    printf("Load, modify and save 100000 elements: %.4fs\n", Since(start));
+}
+
+static void ParallelPrint()
+{
+    XMLDocument big;
+    XMLBuilder builder(&big);
+    builder.BeginElement("root");
+    for (int i = 0; i < 300000; ++i) {
+        builder.BeginElement("item");
+        builder.Attr("id", i);
+        builder.Text("Lorem ipsum dolor sit amet, consectetur adipiscing elit.");
+        builder.EndElement();
+    }
+    builder.EndElement();
+    for (int threads = 1; threads <= 4; threads *= 2) {
+        XMLPrinter printer;
+        const std::chrono::steady_clock::time_point start = Now();
+        big.Print(&printer, threads);
+        printf("Print 300000 elements on %d thread(s): %.4fs\n", threads, Since(start));
+    }
+}
+
+// <root> with 'count' <group><item>i</item></group>.
+static std::string Groups(int count)
+{
+    XMLPrinter big;
+    big.OpenElement("root");
+    for (int i = 0; i < count; ++i) {
+        big.OpenElement("group");
+        big.OpenElement("item");
+        big.PushText(i);
+        big.CloseElement();
+        big.CloseElement();
+    }
+    big.CloseElement();
+    return big.CStr();
+}
+
+class ElementCounter : public XMLVisitor
+{
+public:
+    ElementCounter() : count(0) {}
+    virtual bool VisitEnter(const XMLElement&, const XMLAttribute*) { ++count; return true; }
+    int count;
+};
+
+class FrozenElementCounter : public XMLFrozenVisitor
+{
+public:
+    FrozenElementCounter() : count(0) {}
+    virtual bool VisitEnter(const XMLFrozenDocument&, int node) { if (node) ++count; return true; }
+    int count;
+};
+
+static void FrozenDocument()
+{
+    XMLDocument doc;
+    doc.Parse(Groups(200000).c_str());
+    XMLFrozenDocument frozen;
+    doc.Freeze(&frozen);
+
+    std::chrono::steady_clock::time_point start = Now();
+    ElementCounter domCounter;
+    doc.Accept(&domCounter);
+    const double domTime = Since(start);
+
+    start = Now();
+    FrozenElementCounter frozenCounter;
+    frozen.Accept(&frozenCounter);
+    const double visitTime = Since(start);
+
+    start = Now();
+    const int swept = frozen.CountElements();
+    const double sweepTime = Since(start);
+    printf("Count %d elements: XMLDocument::Accept %.4fs, XMLFrozenDocument::Accept %.4fs, CountElements %.4fs\n",
+           swept, domTime, visitTime, sweepTime);
+}
+
+class StaticElementCounter : public XMLStaticVisitor<StaticElementCounter>
+{
+public:
+    using XMLStaticVisitor<StaticElementCounter>::VisitEnter;
+    StaticElementCounter() : count(0) {}
+    bool VisitEnter(const XMLElement&, const XMLAttribute*) { ++count; return true; }
+    int count;
+};
+
+static void Traverse()
+{
+    XMLDocument doc;
+    doc.Parse(Groups(200000).c_str());
+
+    std::chrono::steady_clock::time_point start = Now();
+    ElementCounter virtualCounter;
+    doc.Accept(&virtualCounter);
+    const double virtualTime = Since(start);
+
+    start = Now();
+    StaticElementCounter staticCounter;
+    staticCounter.Traverse(doc);
+    const double staticTime = Since(start);
+    printf("Count %d elements: XMLNode::Accept %.4fs, Traverse %.4fs\n", staticCounter.count, virtualTime, staticTime);
+}
+
+// Loading a file while other work goes on, against loading it and then
+// doing the work.
+static void LoadAsync()
+{
+    const char* filename = "bench_load.xml";
+    {
+        XMLDocument source;
+        XMLBuilder builder(&source);
+        builder.BeginElement("root");
+        for (int i = 0; i < 300000; ++i) {
+            builder.BeginElement("item");
+            builder.Attr("id", i);
+            builder.Text("Lorem ipsum dolor sit amet, consectetur adipiscing elit.");
+            builder.EndElement();
+        }
+        builder.EndElement();
+        if (source.SaveFile(filename) != XML_SUCCESS) {
+            return;
+        }
+    }
+    const std::string other = Groups(100000);
+
+    std::chrono::steady_clock::time_point start = Now();
+    {
+        XMLDocument doc, work;
+        doc.LoadFile(filename);
+        work.Parse(other.c_str());
+    }
+    const double serial = Since(start);
+
+    start = Now();
+    {
+        XMLDocument doc, work;
+        XMLLoad load;
+        doc.LoadFileAsync(filename, &load);
+        work.Parse(other.c_str());
+        load.Wait();
+    }
+    const double overlapped = Since(start);
+    printf("Load 300000 elements and parse 100000 groups: LoadFile %.4fs, LoadFileAsync %.4fs\n", serial, overlapped);
+    remove(filename);
+}
+
+struct Bench
+{
+    const char* name;
+    void (*run)();
+};
+
+static const Bench benches[] = {
+    { "compact", CompactDocument },
+    { "frozen", FrozenDocument },
+    { "traverse", Traverse },
+    { "widetree", WideTree },
+    { "builder", Builder },
+    { "deepcopy", DeepCopy },
+    { "parallelcopy", ParallelCopy },
+    { "hash", Hash },
+    { "diff", Diff },
+    { "reusesource", ReuseSource },
+    { "reparse", Reparse },
+    { "file", PrintFile },
+    { "memory", PrintMemory },
+    { "escape", EscapeScan },
+    { "save", LoadModifySave },
+    { "parallelprint", ParallelPrint },
+    { "loadasync", LoadAsync },
+};
+
+int main(int argc, char** argv)
+{
+    for (size_t i = 0; i < sizeof(benches) / sizeof(benches[0]); ++i) {
+        bool run = argc < 2;
+        for (int a = 1; a < argc; ++a) {
+            run = run || strcmp(argv[a], benches[i].name) == 0;
+        }
+        if (run) {
+            benches[i].run();
+        }
+    }
+    return 0;
+}
@@ -29,6 +29,84 @@ TEST(TEST_StrPair, SetStr_TransferTo)
     EXPECT_STREQ(tmp, B.GetStr());
 }
 
+TEST(TEST_StrPair, SetStr_Arena)
+{
+    StrArena arena;
+    StrPair A, B;
+    A.SetStr("<this>", 0, &arena);
+    B.SetStr("<that>", 0, &arena);
+    EXPECT_STREQ("<this>", A.GetStr());
+    EXPECT_STREQ("<that>", B.GetStr());
+    EXPECT_EQ(A.GetStr() + 7, B.GetStr());
+    EXPECT_EQ(1, arena.Chunks());
+
+    // A shorter string goes where the old one was.
+    const char* old = A.GetStr();
+    A.SetStr("<a>", 0, &arena);
+    EXPECT_EQ(old, A.GetStr());
+    EXPECT_STREQ("<a>", A.GetStr());
+    A.SetStr("<longer>", 0, &arena);
+    EXPECT_STREQ("<longer>", A.GetStr());
+
+    // A big string has a chunk of its own.
+    char big[StrArena::MIN_CHUNK_SIZE];
+    memset(big, 'x', sizeof(big) - 1);
+    big[sizeof(big) - 1] = 0;
+    B.SetStr(big, 0, &arena);
+    EXPECT_STREQ(big, B.GetStr());
+    EXPECT_EQ(2, arena.Chunks());
+    EXPECT_EQ(size_t(2 * StrArena::MIN_CHUNK_SIZE), arena.Bytes());
+
+    A.Reset();
+    B.Reset();
+    arena.Reset();
+    EXPECT_EQ(1, arena.Chunks());
+    arena.Clear();
+    EXPECT_EQ(0, arena.Chunks());
+
+    // Strings set on a document live until it is cleared.
+    XMLDocument doc;
+    XMLElement* root = doc.NewElement("root");
+    doc.InsertEndChild(root);
+    for (int i = 0; i < 1000; ++i) {
+        XMLElement* item = root->InsertNewChildElement("item");
+        item->SetAttribute("id", i);
+        item->SetText("text");
+    }
+    root->SetName("r");
+    XMLPrinter printer;
+    doc.Print(&printer);
+    EXPECT_EQ(0, strncmp(printer.CStr(), "<r>\n    <item id=\"0\">text</item>", 32));
+    EXPECT_STREQ("999", root->LastChildElement()->Attribute("id"));
+    doc.Clear();
+    doc.Parse("<a b='c'/>");
+    doc.RootElement()->SetAttribute("b", "d");
+    EXPECT_STREQ("d", doc.RootElement()->Attribute("b"));
+}
+
+TEST(TEST_StrPair, Share_Arena)
+{
+    StrArena source;
+    StrPair A;
+    A.SetStr("<this>", 0, &source);
+    char* buffer = StrArena::NewBuffer(XMLAllocator::Default(), 14);
+
+    // Sharing with one arena and then another holds each chunk once.
+    StrArena first, second;
+    for (int i = 0; i < 1000; ++i) {
+        first.Share(source);
+        first.ShareBuffer(buffer);
+        second.Share(source);
+        second.ShareBuffer(buffer);
+    }
+    EXPECT_EQ(2, first.Chunks());
+    EXPECT_EQ(2, second.Chunks());
+    EXPECT_EQ(first.Bytes(), second.Bytes());
+    EXPECT_EQ(size_t(StrArena::MIN_CHUNK_SIZE + 14), first.Bytes());
+    EXPECT_TRUE(source.Shared());
+    StrArena::ReleaseBuffer(buffer);
+}
+
 TEST(TEST_StrPair, Set_Reset)
 {
     StrPair A, B;
@@ -395,6 +473,91 @@ TEST(TEST_MemPool, MemPool)
     intPool.Free(NULL);
 }
 
+TEST(TEST_MemPool, BumpAllocation)
+{
+    typedef MemPoolT< 16 > Pool;
+    Pool pool;
+    pool.SetBlockSize( 4, 16 );
+
+    // Consecutive allocations are adjacent.
+    char* a = static_cast<char*>( pool.Alloc() );
+    char* b = static_cast<char*>( pool.Alloc() );
+    EXPECT_EQ( a + 16, b );
+
+    // A freed item is reused first.
+    pool.Free( a );
+    EXPECT_EQ( a, pool.Alloc() );
+    EXPECT_EQ( b + 16, pool.Alloc() );
+
+    // Blocks double in size: 4, 8, 16, 16.
+    for ( int i = 0; i < 4 + 8 + 16 + 1 - 3; ++i ) {
+        pool.Alloc();
+    }
+    MemPoolStats stats;
+    pool.GetStats( &stats );
+    EXPECT_EQ( 16, stats.itemSize );
+    EXPECT_EQ( 4, stats.blocks );
+    EXPECT_EQ( size_t( ( 4 + 8 + 16 + 16 ) * 16 ), stats.bytes );
+    EXPECT_EQ( 29, stats.live );
+    EXPECT_EQ( 29, stats.watermark );
+    EXPECT_EQ( 30, stats.allocs );
+
+    // Reset() keeps one block of the largest size and starts over.
+    pool.Reset();
+    pool.GetStats( &stats );
+    EXPECT_EQ( 1, stats.blocks );
+    EXPECT_EQ( size_t( 16 * 16 ), stats.bytes );
+    EXPECT_EQ( 0, stats.live );
+    EXPECT_EQ( 0, stats.watermark );
+
+    // Reserve() makes room for that many items in one go.
+    pool.Reserve( 100 );
+    for ( int i = 0; i < 100; ++i ) {
+        pool.Alloc();
+    }
+    pool.GetStats( &stats );
+    EXPECT_EQ( 2, stats.blocks );
+    EXPECT_EQ( 100, stats.live );
+
+    pool.Clear();
+    pool.GetStats( &stats );
+    EXPECT_EQ( 0, stats.blocks );
+    EXPECT_EQ( size_t( 0 ), stats.bytes );
+
+    // The document pools are sized from the input, and emptied by Clear().
+    XMLDocument doc;
+    doc.Parse( "<a><b>1</b><b>2</b><b>3</b><!--c--></a>" );
+    ASSERT_FALSE( doc.Error() );
+    MemPoolStats elements, texts, comments;
+    doc.GetPoolStats( &elements, 0, &texts, &comments );
+    EXPECT_EQ( 4, elements.live );
+    EXPECT_EQ( 3, texts.live );
+    EXPECT_EQ( 1, comments.live );
+    EXPECT_EQ( 1, elements.blocks );
+
+    std::string big = "<root>\n";
+    for ( int i = 0; i < 1000; ++i ) {
+        big += "    <item id='12345' name='the name of the item'>the text of the item</item>\n";
+    }
+    big += "</root>\n";
+    XMLDocument bigDoc;
+    bigDoc.Parse( big.c_str() );
+    ASSERT_FALSE( bigDoc.Error() );
+    bigDoc.GetPoolStats( &elements, 0, 0, 0 );
+    EXPECT_EQ( 1001, elements.live );
+    EXPECT_EQ( 1, elements.blocks );
+
+    doc.Clear();
+    doc.GetPoolStats( &elements, 0, 0, 0 );
+    EXPECT_EQ( 0, elements.live );
+    EXPECT_EQ( 1, elements.blocks );
+
+    doc.SetPoolBlockSize( 1024, 1024 );
+    doc.Parse( "<a/>" );
+    doc.GetPoolStats( &elements, 0, 0, 0 );
+    EXPECT_EQ( 1, elements.live );
+}
+
 TEST(TEST_XMLNode, XMLNode)
 {
     XMLDocument doc;
@@ -1115,6 +1278,1013 @@ TEST(TEST_XMLDocument, XMLDocument)
     EXPECT_EQ(id, 0);
 }
 
+TEST(TEST_XMLDocument, LazyParsing)
+{
+    const char* xml =
+        "<?xml version='1.0'?>\n"
+        "<root a='1'\n b=\"x>y\">\n"
+        "  <!-- <not/> an element -->\n"
+        "  <item id='1'>one<![CDATA[ </item> ]]></item>\n"
+        "  <item id='2'/>\n"
+        "  <group><item id='3'>three</item></group>\n"
+        "  <empty></empty>\n"
+        "</root>";
+    XMLDocument eager, lazy;
+    lazy.SetLazyParsing(true);
+    EXPECT_TRUE(lazy.LazyParsing());
+    EXPECT_EQ(eager.Parse(xml), XML_SUCCESS);
+    EXPECT_EQ(lazy.Parse(xml), XML_SUCCESS);
+
+    XMLPrinter eagerPrinter, lazyPrinter;
+    eager.Print(&eagerPrinter);
+    lazy.Print(&lazyPrinter);
+    EXPECT_STREQ(eagerPrinter.CStr(), lazyPrinter.CStr());
+
+    // --------- Materialize on access ----------- //
+    lazy.Parse(xml);
+    XMLElement* root = lazy.RootElement();
+    EXPECT_STREQ(root->Attribute("b"), "x>y");
+    EXPECT_EQ(root->GetLineNum(), 2);
+    EXPECT_EQ(root->FindAttribute("b")->GetLineNum(), 3);
+    XMLElement* item = root->FirstChildElement("item");
+    EXPECT_EQ(item->GetLineNum(), 5);
+    EXPECT_EQ(item->IntAttribute("id"), 1);
+    EXPECT_STREQ(item->GetText(), "one");
+    EXPECT_EQ(root->FirstChildElement("group")->FirstChildElement()->IntAttribute("id"), 3);
+    EXPECT_TRUE(root->LastChildElement()->NoChildren());
+
+    // --------- Mutate unexpanded ----------- //
+    lazy.Parse(xml);
+    lazy.RootElement()->InsertEndChild(lazy.NewElement("last"));
+    EXPECT_STREQ(lazy.RootElement()->LastChildElement()->Name(), "last");
+    EXPECT_STREQ(lazy.RootElement()->FirstChildElement()->Name(), "item");
+    lazy.RootElement()->DeleteChildren();
+    EXPECT_TRUE(lazy.RootElement()->NoChildren());
+
+    // --------- Deferred errors ----------- //
+    EXPECT_EQ(lazy.Parse("<root><a></a></b>"), XML_ERROR_MISMATCHED_ELEMENT);
+    EXPECT_EQ(lazy.Parse("<root><a><b></a></b></root>"), XML_SUCCESS);
+    EXPECT_EQ(lazy.RootElement()->FirstChildElement(), (XMLElement*)0);
+    EXPECT_EQ(lazy.ErrorID(), XML_ERROR_MISMATCHED_ELEMENT);
+    EXPECT_EQ(lazy.Parse("<root><a x='1' x='2'/></root>"), XML_SUCCESS);
+    EXPECT_STREQ(lazy.RootElement()->FirstChildElement()->Attribute("x"), "1");
+    EXPECT_EQ(lazy.ErrorID(), XML_ERROR_PARSING_ATTRIBUTE);
+}
+
+TEST(TEST_XMLDocument, WideTree)
+{
+    const int count = 10000;
+
+    // Make all the nodes first, then link them in order.
+    XMLDocument batch;
+    XMLElement** items = new XMLElement*[count];
+    XMLElement* root = batch.NewElement("root");
+    for (int i = 0; i < count; ++i) {
+        items[i] = batch.NewElement("item");
+    }
+    for (int i = 0; i < count; ++i) {
+        root->InsertEndChild(items[i]);
+    }
+    batch.InsertEndChild(root);
+
+    int n = 0;
+    for (const XMLElement* e = root->FirstChildElement(); e; e = e->NextSiblingElement()) {
+        EXPECT_EQ(items[n], e);
+        ++n;
+    }
+    EXPECT_EQ(count, n);
+
+    // Unlinked nodes deleted out of order, and the rest by Clear().
+    for (int i = 0; i < 10; ++i) {
+        items[i] = batch.NewElement("loose");
+    }
+    batch.DeleteNode(items[3]);
+    batch.DeleteNode(items[9]);
+    batch.DeleteNode(items[0]);
+    root->InsertEndChild(items[5]);
+    EXPECT_EQ(items[5], root->LastChildElement());
+    batch.Clear();
+    EXPECT_TRUE(batch.NoChildren());
+    delete [] items;
+}
+
+TEST(TEST_XMLDocument, Adopt)
+{
+    const char* xml =
+        "<root>"
+        "<keep/>"
+        "<part id='1' note='a &amp; b'><!--c--><x>one &lt; two</x><![CDATA[<raw>]]><!X></part>"
+        "</root>";
+    for (int lazy = 0; lazy < 2; ++lazy) {
+        XMLDocument source;
+        source.SetLazyParsing(lazy != 0);
+        source.Parse(xml);
+        ASSERT_FALSE(source.Error());
+        XMLElement* part = source.RootElement()->FirstChildElement("part");
+        part->FirstChildElement("x")->SetAttribute("set", "later");
+
+        XMLDocument target;
+        target.Parse("<out/>");
+        XMLNode* adopted = target.Adopt(part);
+        ASSERT_TRUE(adopted != 0);
+        EXPECT_EQ(&target, adopted->GetDocument());
+        target.RootElement()->InsertEndChild(adopted);
+
+        XMLPrinter sourcePrinter(0, true);
+        source.Print(&sourcePrinter);
+        EXPECT_STREQ("<root><keep/></root>", sourcePrinter.CStr());
+
+        // The source can go; the target keeps its own copy.
+        source.Clear();
+        XMLPrinter targetPrinter(0, true);
+        target.Print(&targetPrinter);
+        EXPECT_STREQ("<out><part id=\"1\" note=\"a &amp; b\"><!--c--><x set=\"later\">one &lt; two</x>"
+                     "<![CDATA[<raw>]]><!X></part></out>", targetPrinter.CStr());
+        EXPECT_EQ(1, target.RootElement()->FirstChildElement("part")->GetLineNum());
+
+        // Adopting a node of the same document changes nothing.
+        XMLNode* out = target.RootElement();
+        EXPECT_EQ(out, target.Adopt(out));
+    }
+}
+
+class CountingAllocator : public XMLAllocator
+{
+public:
+    CountingAllocator() : allocs( 0 ), live( 0 ), largest( 0 ) {}
+    virtual void* Allocate( size_t size ) {
+        ++allocs;
+        live += size;
+        if ( size > largest ) {
+            largest = size;
+        }
+        return new char[size];
+    }
+    virtual void Deallocate( void* mem, size_t size ) {
+        live -= size;
+        delete [] static_cast<char*>( mem );
+    }
+    int allocs;
+    size_t live;
+    size_t largest;
+};
+
+TEST(TEST_XMLDocument, Allocator)
+{
+    CountingAllocator allocator;
+    {
+        XMLDocument doc;
+        EXPECT_EQ( XMLAllocator::Default(), doc.Allocator() );
+        doc.SetAllocator( &allocator );
+        EXPECT_EQ( &allocator, doc.Allocator() );
+        doc.LoadFile( "./testxml/test.xml" );
+        ASSERT_FALSE( doc.Error() );
+        for ( int i = 0; i < 20; ++i ) {
+            doc.RootElement()->InsertNewChildElement( "extra" )->SetAttribute( "i", i );
+        }
+        EXPECT_TRUE( allocator.allocs > 0 );
+        EXPECT_TRUE( allocator.live > 0 );
+
+        XMLPrinter printer;
+        printer.SetAllocator( &allocator );
+        const int before = allocator.allocs;
+        doc.Print( &printer );
+        EXPECT_TRUE( allocator.allocs > before );
+
+        doc.Parse( "<a/>" );
+        ASSERT_FALSE( doc.Error() );
+        doc.SetAllocator( 0 );
+        EXPECT_EQ( XMLAllocator::Default(), doc.Allocator() );
+        EXPECT_TRUE( doc.NoChildren() );
+        printer.SetAllocator( 0 );
+        EXPECT_TRUE( printer.CStrSize() > 1 );
+    }
+    EXPECT_EQ( size_t( 0 ), allocator.live );
+}
+
+TEST(TEST_XMLDocument, Splice)
+{
+    XMLDocument target;
+    target.Parse("<out><first/></out>");
+    XMLElement* out = target.RootElement();
+
+    XMLDocument a, b;
+    a.Parse("<a x='1 &amp; 2'><t>text</t></a><!--after-->");
+    b.SetLazyParsing(true);
+    b.Parse("<b><c y='3'/></b>");
+    XMLElement* loose = a.NewElement("loose");
+    loose->SetAttribute("set", "later");
+
+    XMLNode* first = target.Splice(&a, out);
+    ASSERT_TRUE(first != 0);
+    EXPECT_STREQ("a", first->Value());
+    EXPECT_EQ(&target, loose->GetDocument());
+    EXPECT_TRUE(a.NoChildren());
+    target.Splice(&b, out);
+    EXPECT_TRUE(b.NoChildren());
+
+    MemPoolStats elements;
+    target.GetPoolStats(&elements, 0, 0, 0);
+    EXPECT_EQ(7, elements.live);
+
+    // The nodes work as nodes of the target, and outlive their sources.
+    out->InsertEndChild(loose);
+    out->FirstChildElement("a")->SetAttribute("x", "changed");
+    a.Parse("<reused/>");
+    b.Clear();
+    XMLPrinter printer(0, true);
+    target.Print(&printer);
+    EXPECT_STREQ("<out><first/><a x=\"changed\"><t>text</t></a><!--after--><b><c y=\"3\"/></b><loose set=\"later\"/></out>",
+                 printer.CStr());
+    target.DeleteNode(out->FirstChildElement("b"));
+    target.Clear();
+    EXPECT_STREQ("reused", a.RootElement()->Name());
+
+    // Documents with different allocators move the nodes instead.
+    CountingAllocator allocator;
+    {
+        XMLDocument counted;
+        counted.SetAllocator(&allocator);
+        counted.Parse("<in><x/></in>");
+        XMLDocument plain;
+        EXPECT_TRUE(plain.Splice(&counted) != 0);
+        EXPECT_TRUE(counted.NoChildren());
+        EXPECT_STREQ("in", plain.RootElement()->Name());
+    }
+    EXPECT_EQ(size_t(0), allocator.live);
+}
+
+TEST(TEST_XMLDocument, SharedClone)
+{
+    const char* xml =
+        "<root a='1 &amp; 2'>"
+        "<x>one &lt; two</x><![CDATA[<raw>]]><!--c--><!X>"
+        "</root>";
+    for (int lazy = 0; lazy < 2; ++lazy) {
+        XMLDocument source;
+        source.SetLazyParsing(lazy != 0);
+        source.Parse(xml);
+        ASSERT_FALSE(source.Error());
+        source.RootElement()->SetAttribute("set", "later");
+
+        // The clone points at the strings of the source.
+        XMLDocument copy;
+        source.DeepCopy(&copy);
+        XMLElement* root = source.RootElement();
+        XMLElement* copyRoot = copy.RootElement();
+        EXPECT_EQ(root->Name(), copyRoot->Name());
+        EXPECT_EQ(root->Attribute("set"), copyRoot->Attribute("set"));
+        EXPECT_EQ(root->FirstChild()->FirstChild()->Value(), copyRoot->FirstChild()->FirstChild()->Value());
+        EXPECT_TRUE(copyRoot->FirstChild()->NextSibling()->ToText()->CData());
+
+        // Changing either one copies the string.
+        root->SetAttribute("set", "late");
+        copyRoot->SetName("copy");
+        EXPECT_STREQ("later", copyRoot->Attribute("set"));
+        EXPECT_STREQ("root", root->Name());
+
+        // The clone outlives the source.
+        source.Parse("<reused>reused reused reused</reused>");
+        XMLPrinter printer(0, true);
+        copy.Print(&printer);
+        EXPECT_STREQ("<copy a=\"1 &amp; 2\" set=\"later\"><x>one &lt; two</x><![CDATA[<raw>]]><!--c--><!X></copy>",
+                     printer.CStr());
+
+        // A clone in the same document doesn't change the original.
+        XMLNode* clone = source.RootElement()->DeepClone(0);
+        clone->FirstChild()->SetValue("changed");
+        EXPECT_STREQ("reused reused reused", source.RootElement()->GetText());
+        source.DeleteNode(clone);
+    }
+
+    XMLDocument doc;
+    doc.Parse("<root/>");
+    XMLElement* root = doc.RootElement();
+    for (int i = 0; i < 1000; ++i) {
+        XMLElement* item = root->InsertNewChildElement("item");
+        item->SetAttribute("id", i);
+        item->SetAttribute("name", "a name for the item");
+        item->InsertNewText("some text for the item");
+    }
+    XMLDocument copy;
+    doc.DeepCopy(&copy);
+    XMLPrinter printer, copyPrinter;
+    doc.Print(&printer);
+    doc.Clear();
+    copy.Print(&copyPrinter);
+    EXPECT_STREQ(printer.CStr(), copyPrinter.CStr());
+}
+
+TEST(TEST_XMLDocument, ParallelClone)
+{
+    XMLDocument doc;
+    doc.InsertEndChild(doc.NewDeclaration());
+    XMLElement* root = doc.NewElement("root");
+    doc.InsertEndChild(root);
+    for (int i = 0; i < 5000; ++i) {
+        XMLElement* item = root->InsertNewChildElement("item");
+        item->SetAttribute("id", i);
+        item->SetAttribute("name", "a &name");
+        XMLElement* sub = item->InsertNewChildElement("sub");
+        sub->InsertNewText("text &lt;")->SetCData(i % 2 == 0);
+        if (i % 100 == 0) {
+            item->InsertNewComment("comment");
+            item->InsertNewUnknown("UNKNOWN");
+        }
+    }
+    doc.InsertEndChild(doc.NewComment("end"));
+    XMLPrinter printer;
+    doc.Print(&printer);
+
+    // The same document, parsed lazily, so the clone expands it first.
+    XMLDocument parsed;
+    parsed.SetLazyParsing(true);
+    parsed.Parse(printer.CStr());
+    ASSERT_FALSE(parsed.Error());
+    XMLDocument expanded;
+    parsed.DeepCopy(&expanded, 4);
+    XMLPrinter expandedPrinter;
+    expanded.Print(&expandedPrinter);
+    EXPECT_STREQ(printer.CStr(), expandedPrinter.CStr());
+
+    const int threads[] = { 1, 2, 4, 8 };
+    for (int i = 0; i < 4; ++i) {
+        XMLDocument copy;
+        parsed.DeepCopy(&copy, threads[i]);
+        XMLPrinter copyPrinter;
+        copy.Print(&copyPrinter);
+        EXPECT_STREQ(printer.CStr(), copyPrinter.CStr());
+    }
+
+    // A subtree, into the same document, on as many threads as there are.
+    XMLNode* clone = doc.RootElement()->DeepClone(0, 0);
+    doc.InsertEndChild(clone);
+    XMLPrinter rootPrinter, clonePrinter;
+    doc.RootElement()->Accept(&rootPrinter);
+    clone->Accept(&clonePrinter);
+    EXPECT_STREQ(rootPrinter.CStr(), clonePrinter.CStr());
+    doc.DeleteNode(clone);
+
+    // The clone outlives the source.
+    XMLDocument copy;
+    doc.DeepCopy(&copy, 4);
+    doc.Clear();
+    XMLPrinter copyPrinter;
+    copy.Print(&copyPrinter);
+    EXPECT_STREQ(printer.CStr(), copyPrinter.CStr());
+}
+
+TEST(TEST_XMLDocument, DeepEqual)
+{
+    XMLDocument a, b;
+    a.Parse("<root x='1' y='2'><!--c--><item>some  text</item><item/></root>");
+    b.SetLazyParsing(true);
+    b.Parse("<root x='1' y='2'><!--c--><item>some  text</item><item/></root>");
+    EXPECT_TRUE(a.DeepEqual(&b));
+    EXPECT_EQ(a.Hash(), b.Hash());
+    EXPECT_TRUE(a.RootElement()->DeepEqual(b.RootElement()));
+    EXPECT_FALSE(a.RootElement()->DeepEqual(b.RootElement()->FirstChildElement()));
+
+    XMLDocument c;
+    c.Parse("<root y='2' x='1'>\n  <item>some\ttext </item>\n  <item/>\n</root>");
+    EXPECT_FALSE(a.DeepEqual(&c));
+    EXPECT_NE(a.Hash(), c.Hash());
+    const int all = XMLNode::IGNORE_ATTRIBUTE_ORDER | XMLNode::IGNORE_WHITESPACE | XMLNode::IGNORE_COMMENTS;
+    EXPECT_TRUE(a.DeepEqual(&c, all));
+    EXPECT_EQ(a.Hash(all), c.Hash(all));
+    EXPECT_FALSE(a.DeepEqual(&c, all & ~XMLNode::IGNORE_COMMENTS));
+    EXPECT_FALSE(a.DeepEqual(&c, all & ~XMLNode::IGNORE_ATTRIBUTE_ORDER));
+    EXPECT_NE(a.Hash(all & ~XMLNode::IGNORE_ATTRIBUTE_ORDER), c.Hash(all & ~XMLNode::IGNORE_ATTRIBUTE_ORDER));
+
+    // Changes reach the kept hashes.
+    const uint64_t hash = a.Hash();
+    XMLElement* item = a.RootElement()->FirstChildElement("item");
+    item->FirstChild()->SetValue("other");
+    EXPECT_NE(hash, a.Hash());
+    EXPECT_FALSE(a.DeepEqual(&b));
+    item->FirstChild()->SetValue("some  text");
+    EXPECT_EQ(hash, a.Hash());
+    item->SetAttribute("z", 3);
+    EXPECT_NE(hash, a.Hash());
+    item->DeleteAttribute("z");
+    EXPECT_EQ(hash, a.Hash());
+    XMLElement* added = item->InsertNewChildElement("added");
+    EXPECT_NE(hash, a.Hash());
+    item->DeleteChild(added);
+    EXPECT_EQ(hash, a.Hash());
+    EXPECT_TRUE(a.DeepEqual(&b));
+
+    // Hashing again after a change only hashes the path to it.
+    XMLDocument big;
+    XMLElement* root = big.NewElement("root");
+    big.InsertEndChild(root);
+    for (int i = 0; i < 1000; ++i) {
+        XMLElement* e = root->InsertNewChildElement("item");
+        e->SetAttribute("id", i);
+        e->InsertNewText("text");
+    }
+    const uint64_t first = big.Hash();
+    root->LastChildElement()->SetAttribute("id", -1);
+    EXPECT_NE(first, big.Hash());
+    root->LastChildElement()->SetAttribute("id", 999);
+    EXPECT_EQ(first, big.Hash());
+}
+
+TEST(TEST_XMLDocument, Diff)
+{
+    XMLDocument from, to, script;
+    from.Parse("<?xml version='1.0'?><root a='1' b='2' c='3'><!--c--><x>one</x><y/><z id='1'>two<w/></z><v>  text  </v></root>");
+    to.Parse("<?xml version='1.1'?><root a='1' c='4' b='2' d='5'><z id='2'>three<w/>four</z><x>one</x><new k='1'><deep/></new><v>text<![CDATA[ cdata ]]></v> </root>");
+    EXPECT_EQ(from.Diff(&from, &script), 0);
+    EXPECT_GT(from.Diff(&to, &script), 0);
+
+    // The script goes through text, and patches a copy of 'from'.
+    XMLPrinter printer;
+    script.Print(&printer);
+    XMLDocument parsed, patched;
+    EXPECT_EQ(parsed.Parse(printer.CStr()), XML_SUCCESS);
+    from.DeepCopy(&patched);
+    EXPECT_EQ(patched.Patch(&parsed), XML_SUCCESS);
+    EXPECT_TRUE(patched.DeepEqual(&to));
+    EXPECT_TRUE(patched.RootElement()->FirstChildElement("v")->LastChild()->ToText()->CData());
+
+    // Each child is moved and each attribute set once at most.
+    XMLDocument reversed;
+    reversed.Parse("<root><a/><b/><c/><d/><e/></root>");
+    XMLDocument shuffled;
+    shuffled.Parse("<root><e/><b/><c/><a/><d/></root>");
+    EXPECT_EQ(reversed.Diff(&shuffled, &script), 2);
+    EXPECT_EQ(reversed.Patch(&script), XML_SUCCESS);
+    EXPECT_TRUE(reversed.DeepEqual(&shuffled));
+
+    // Text that becomes CDATA, or stops being CDATA, prints as the target.
+    XMLDocument plain, cdata;
+    plain.Parse("<root><a>same</a><b>text<![CDATA[raw]]></b><c>kept</c></root>");
+    cdata.Parse("<root><a><![CDATA[same]]></a><b><![CDATA[text]]>raw</b><c>kept</c></root>");
+    for (int way = 0; way < 2; ++way) {
+        XMLDocument* source = way ? &cdata : &plain;
+        XMLDocument* target = way ? &plain : &cdata;
+        EXPECT_EQ(source->Diff(target, &script), 3);
+        XMLPrinter scriptPrinter;
+        script.Print(&scriptPrinter);
+        XMLDocument scriptParsed, result;
+        EXPECT_EQ(scriptParsed.Parse(scriptPrinter.CStr()), XML_SUCCESS);
+        source->DeepCopy(&result);
+        EXPECT_EQ(result.Patch(&scriptParsed), XML_SUCCESS);
+        XMLPrinter resultPrinter, targetPrinter;
+        result.Print(&resultPrinter);
+        target->Print(&targetPrinter);
+        EXPECT_STREQ(resultPrinter.CStr(), targetPrinter.CStr());
+    }
+    parsed.Parse("<patch><value path='0' value='x' cdata='true'/></patch>");
+    EXPECT_EQ(plain.Patch(&parsed), XML_ERROR_BAD_PATCH);
+
+    // An edit that doesn't fit stops the patch.
+    parsed.Parse("<patch><set path='0' name='a' value='1'/><delete path='9' index='0'/></patch>");
+    EXPECT_EQ(patched.Patch(&parsed), XML_ERROR_BAD_PATCH);
+    EXPECT_TRUE(patched.FirstChild()->ToDeclaration() != 0);
+    parsed.Parse("<other/>");
+    EXPECT_EQ(patched.Patch(&parsed), XML_ERROR_BAD_PATCH);
+
+    // A few changes to a large document make a small script.
+    XMLDocument big, changed;
+    {
+        XMLBuilder builder(&big);
+        builder.BeginElement("root");
+        for (int i = 0; i < 2000; ++i) {
+            builder.BeginElement("item");
+            builder.Attr("id", i);
+            builder.Text("text");
+            builder.EndElement();
+        }
+        builder.EndElement();
+    }
+    big.DeepCopy(&changed);
+    XMLElement* root = changed.RootElement();
+    XMLElement* item = root->FirstChildElement();
+    for (int i = 0; i < 500; ++i) {
+        item = item->NextSiblingElement();
+    }
+    item->SetAttribute("id", "changed");
+    root->DeleteChild(item->NextSibling());
+    root->InsertFirstChild(root->LastChild());
+    root->InsertEndChild(changed.NewComment("added"));
+    EXPECT_EQ(big.Diff(&changed, &script), 4);
+    EXPECT_EQ(big.Patch(&script), XML_SUCCESS);
+    EXPECT_TRUE(big.DeepEqual(&changed));
+}
+
+TEST(TEST_XMLDocument, SourceSpan)
+{
+    const char* xml =
+        "<?xml version='1.0'?>\n"
+        "<root a='1 &amp; 2' b = \"x\">\n"
+        "  <!-- comment -->\n"
+        "  <item id='1'>one &lt; two<![CDATA[ <raw> ]]></item>\n"
+        "  <item id='2'/>\n"
+        "</root>";
+    for (int lazy = 0; lazy < 2; ++lazy) {
+        XMLDocument doc;
+        doc.SetLazyParsing(lazy != 0);
+        doc.SetTrackSpans(true);
+        EXPECT_EQ(doc.Parse(xml), XML_SUCCESS);
+        EXPECT_EQ(doc.SourceSize(), strlen(xml));
+
+        size_t length = 0;
+        XMLElement* root = doc.RootElement();
+        XMLElement* item = root->FirstChildElement("item");
+        const char* outer = item->OuterXML(&length);
+        ASSERT_TRUE(outer != 0);
+        EXPECT_EQ(std::string(outer, length), "<item id='1'>one &lt; two<![CDATA[ <raw> ]]></item>");
+        outer = root->OuterXML(&length);
+        EXPECT_EQ(std::string(outer, length), std::string(strchr(xml, '\n') + 1));
+        outer = doc.FirstChild()->OuterXML(&length);
+        EXPECT_EQ(std::string(outer, length), "<?xml version='1.0'?>");
+        outer = root->FirstChild()->OuterXML(&length);
+        EXPECT_EQ(std::string(outer, length), "<!-- comment -->");
+        outer = item->FirstChild()->OuterXML(&length);
+        EXPECT_EQ(std::string(outer, length), "one &lt; two");
+        outer = item->LastChild()->OuterXML(&length);
+        EXPECT_EQ(std::string(outer, length), "<![CDATA[ <raw> ]]>");
+        outer = item->NextSiblingElement()->OuterXML(&length);
+        EXPECT_EQ(std::string(outer, length), "<item id='2'/>");
+
+        size_t offset = 0;
+        EXPECT_TRUE(root->FindAttribute("b")->GetSourceSpan(&offset, &length));
+        EXPECT_EQ(std::string(xml + offset, length), "b = \"x\"");
+        EXPECT_TRUE(root->FindAttribute("a")->GetValueSpan(&offset, &length));
+        EXPECT_EQ(std::string(xml + offset, length), "1 &amp; 2");
+
+        // Set values lose their spans; changes under a node don't.
+        root->SetAttribute("a", "3");
+        EXPECT_FALSE(root->FindAttribute("a")->GetSourceSpan(&offset, &length));
+        item->FirstChild()->SetValue("changed");
+        EXPECT_FALSE(item->FirstChild()->GetSourceSpan(&offset, &length));
+        EXPECT_TRUE(item->GetSourceSpan(&offset, &length));
+        EXPECT_FALSE(doc.NewElement("new")->GetSourceSpan(&offset, &length));
+    }
+
+    XMLDocument plain;
+    plain.Parse(xml);
+    size_t length = 0;
+    EXPECT_TRUE(plain.RootElement()->OuterXML(&length) == 0);
+    EXPECT_TRUE(plain.SourceText() == 0);
+}
+
+// Expects the nodes under 'a' and 'b' to be at the same lines and spans.
+static void ExpectSameSpans(const XMLNode* a, const XMLNode* b)
+{
+    size_t offsetA = 0, lengthA = 0, offsetB = 0, lengthB = 0;
+    EXPECT_EQ(a->GetLineNum(), b->GetLineNum());
+    EXPECT_EQ(a->GetSourceSpan(&offsetA, &lengthA), b->GetSourceSpan(&offsetB, &lengthB));
+    EXPECT_EQ(offsetA, offsetB);
+    EXPECT_EQ(lengthA, lengthB);
+    if (a->ToElement()) {
+        const XMLAttribute* y = b->ToElement()->FirstAttribute();
+        for (const XMLAttribute* x = a->ToElement()->FirstAttribute(); x && y; x = x->Next(), y = y->Next()) {
+            EXPECT_EQ(x->GetLineNum(), y->GetLineNum());
+            EXPECT_TRUE(x->GetValueSpan(&offsetA, &lengthA));
+            EXPECT_TRUE(y->GetValueSpan(&offsetB, &lengthB));
+            EXPECT_EQ(offsetA, offsetB);
+            EXPECT_EQ(lengthA, lengthB);
+        }
+    }
+    const XMLNode* y = b->FirstChild();
+    for (const XMLNode* x = a->FirstChild(); x && y; x = x->NextSibling(), y = y->NextSibling()) {
+        ExpectSameSpans(x, y);
+    }
+}
+
+TEST(TEST_XMLDocument, Reparse)
+{
+    const std::string xml =
+        "<root>\n"
+        "  <a x='1'>first</a>\n"
+        "  <b>\n"
+        "    <c>old</c>\n"
+        "  </b>\n"
+        "  <d y='2'><e/>after</d>\n"
+        "</root>\n";
+    const size_t at = xml.find("old");
+    const char* edits[] = { "new\nline<f z='3'/>", "old</c><c>", "<unclosed>" };
+    for (int lazy = 0; lazy < 2; ++lazy) {
+        for (int i = 0; i < 3; ++i) {
+            XMLDocument doc;
+            doc.SetLazyParsing(lazy != 0);
+            doc.SetTrackSpans(true);
+            doc.Parse(xml.c_str());
+            doc.RootElement()->FirstChildElement("a")->SetUserData(&doc);
+            doc.RootElement()->LastChildElement()->SetUserData(&doc);
+            std::string text = xml;
+            text.replace(at, 3, edits[i]);
+            doc.Reparse(text.c_str(), text.size(), at, 3);
+
+            XMLDocument fresh;
+            fresh.SetTrackSpans(true);
+            fresh.Parse(text.c_str());
+            EXPECT_EQ(doc.ErrorID(), fresh.ErrorID());
+            if (fresh.Error()) {
+                continue;
+            }
+            EXPECT_TRUE(doc.DeepEqual(&fresh));
+            ExpectSameSpans(&doc, &fresh);
+            EXPECT_FALSE(doc.Modified());
+            XMLPrinter printer;
+            printer.SetReuseSource(true);
+            doc.Print(&printer);
+            EXPECT_EQ(std::string(printer.CStr()), text);
+            // Only the edited element's content is new. Unless <b> has
+            // been read, that is where the second edit is, and it fits.
+            EXPECT_EQ(doc.RootElement()->FirstChildElement("a")->GetUserData() == &doc, i == 0 || lazy);
+            EXPECT_EQ(doc.RootElement()->LastChildElement()->GetUserData() == &doc, i == 0 || lazy);
+        }
+    }
+
+    // An edit outside of any element's content parses it all.
+    XMLDocument doc;
+    doc.SetTrackSpans(true);
+    doc.Parse(xml.c_str());
+    std::string text = "<!-- c -->" + xml;
+    EXPECT_EQ(doc.Reparse(text.c_str(), text.size(), 0, 0), XML_SUCCESS);
+    EXPECT_TRUE(doc.FirstChild()->ToComment() != 0);
+    EXPECT_EQ(doc.RootElement()->GetLineNum(), 1);
+
+    // One edit in a large document.
+    XMLDocument big;
+    {
+        XMLDocument source;
+        XMLBuilder builder(&source);
+        builder.BeginElement("root");
+        for (int i = 0; i < 2000; ++i) {
+            builder.BeginElement("item");
+            builder.Attr("id", i);
+            builder.Text("text");
+            builder.EndElement();
+        }
+        builder.EndElement();
+        XMLPrinter printer;
+        source.Print(&printer);
+        text = printer.CStr();
+    }
+    big.SetTrackSpans(true);
+    big.Parse(text.c_str());
+    XMLElement* item = big.RootElement()->FirstChildElement();
+    for (int i = 0; i < 1000; ++i) {
+        item = item->NextSiblingElement();
+    }
+    size_t offset = 0, length = 0;
+    ASSERT_TRUE(item->FirstChild()->GetSourceSpan(&offset, &length));
+    text.replace(offset, length, "changed");
+    EXPECT_EQ(big.Reparse(text.c_str(), text.size(), offset, length), XML_SUCCESS);
+    XMLDocument full;
+    full.Parse(text.c_str());
+    EXPECT_STREQ(item->GetText(), "changed");
+    EXPECT_TRUE(big.DeepEqual(&full));
+}
+
+// Adds a random subtree of about 'nodes' nodes: elements, text with
+// entities, CDATA and comments, so that text and markup mix.
+static void AddRandomTree(XMLBuilder* builder, int nodes, unsigned* seed)
+{
+    while (nodes > 0) {
+        *seed = *seed * 1103515245u + 12345u;
+        const unsigned pick = (*seed >> 16) % 10;
+        if (pick < 5) {
+            builder->BeginElement(pick == 0 ? "a" : "item");
+            if (pick % 2) {
+                builder->Attr("id", static_cast<int>(*seed % 1000));
+            }
+            const int inner = static_cast<int>((*seed >> 8) % static_cast<unsigned>(nodes));
+            AddRandomTree(builder, inner, seed);
+            builder->EndElement();
+            nodes -= inner + 1;
+        }
+        else if (pick < 8) {
+            builder->Text(pick == 5 ? "a < b & c" : "text");
+            --nodes;
+        }
+        else if (pick == 8) {
+            builder->Text("<raw>", true);
+            --nodes;
+        }
+        else {
+            builder->Current()->InsertEndChild(builder->Current()->GetDocument()->NewComment("note"));
+            --nodes;
+        }
+    }
+}
+
+static void AppendOutput(const char* data, size_t size, void* context)
+{
+    std::string* out = static_cast<std::string*>(context);
+    out->append(data, size);
+    out->push_back('|');
+}
+
+TEST(TEST_XMLDocument, ParallelPrint)
+{
+    unsigned seed = 7;
+    for (int round = 0; round < 6; ++round) {
+        XMLDocument doc;
+        doc.SetBOM(round % 3 == 0);
+        doc.InsertEndChild(doc.NewDeclaration());
+        XMLBuilder builder(&doc);
+        builder.BeginElement("root");
+        AddRandomTree(&builder, 5000 + round * 1000, &seed);
+        builder.EndElement();
+        doc.InsertEndChild(doc.NewComment("end"));
+
+        for (int compact = 0; compact < 2; ++compact) {
+            XMLPrinter serial(0, compact != 0);
+            doc.Print(&serial);
+            const int threads[] = { 0, 2, 3, 7 };
+            for (int i = 0; i < 4; ++i) {
+                XMLPrinter parallel(0, compact != 0);
+                doc.Print(&parallel, threads[i]);
+                EXPECT_STREQ(parallel.CStr(), serial.CStr());
+            }
+
+            // In the middle of other output, and to an output function.
+            XMLPrinter outer(0, compact != 0);
+            outer.OpenElement("outer");
+            outer.PushText("before");
+            doc.Print(&outer);
+            outer.CloseElement();
+            std::string streamed;
+            XMLPrinter streamer(0, compact != 0);
+            streamer.SetOutput(AppendOutput, &streamed);
+            streamer.OpenElement("outer");
+            streamer.PushText("before");
+            doc.Print(&streamer, 4);
+            streamer.CloseElement();
+            streamed.erase(std::remove(streamed.begin(), streamed.end(), '|'), streamed.end());
+            EXPECT_EQ(streamed, std::string(outer.CStr()));
+        }
+    }
+
+    // Lazily parsed content is read before the threads start.
+    XMLDocument source;
+    XMLBuilder builder(&source);
+    builder.BeginElement("root");
+    AddRandomTree(&builder, 8000, &seed);
+    builder.EndElement();
+    XMLPrinter sourcePrinter;
+    source.Print(&sourcePrinter);
+    XMLDocument lazy;
+    lazy.SetLazyParsing(true);
+    lazy.Parse(sourcePrinter.CStr());
+    XMLPrinter lazyPrinter;
+    lazy.Print(&lazyPrinter, 4);
+    EXPECT_STREQ(lazyPrinter.CStr(), sourcePrinter.CStr());
+
+    XMLDocument big;
+    XMLBuilder bigBuilder(&big);
+    bigBuilder.BeginElement("root");
+    for (int i = 0; i < 5000; ++i) {
+        bigBuilder.BeginElement("item");
+        bigBuilder.Attr("id", i);
+        bigBuilder.Text("Lorem ipsum dolor sit amet, consectetur adipiscing elit.");
+        bigBuilder.EndElement();
+    }
+    bigBuilder.EndElement();
+    XMLPrinter single;
+    big.Print(&single, 1);
+    for (int threads = 2; threads <= 8; threads *= 2) {
+        XMLPrinter printer;
+        big.Print(&printer, threads);
+        EXPECT_STREQ(printer.CStr(), single.CStr());
+    }
+}
+
+static void WriteBytes(const char* filename, const unsigned char* data, size_t size)
+{
+    FILE* fp = fopen(filename, "wb");
+    ASSERT_TRUE(fp != 0);
+    fwrite(data, 1, size, fp);
+    fclose(fp);
+}
+
+TEST(TEST_XMLDocument, Compressed)
+{
+    // <root><a x="1">text</a></root>, from gzip and from zstd.
+    static const unsigned char gzipped[] = {
+        0x1f, 0x8b, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x02, 0x03, 0xb3, 0x29, 0xca, 0xcf, 0x2f, 0xb1,
+        0xb3, 0x49, 0x54, 0xa8, 0xb0, 0x55, 0x32, 0x54, 0xb2, 0x2b, 0x49, 0xad, 0x28, 0xb1, 0xd1, 0x4f,
+        0xb4, 0xb3, 0xd1, 0x07, 0x8b, 0x03, 0x00, 0xf0, 0x07, 0xe0, 0xbe, 0x1e, 0x00, 0x00, 0x00
+    };
+    static const unsigned char zstded[] = {
+        0x28, 0xb5, 0x2f, 0xfd, 0x04, 0x58, 0xf1, 0x00, 0x00, 0x3c, 0x72, 0x6f, 0x6f, 0x74, 0x3e, 0x3c,
+        0x61, 0x20, 0x78, 0x3d, 0x22, 0x31, 0x22, 0x3e, 0x74, 0x65, 0x78, 0x74, 0x3c, 0x2f, 0x61, 0x3e,
+        0x3c, 0x2f, 0x72, 0x6f, 0x6f, 0x74, 0x3e, 0xa1, 0x7b, 0x28, 0xd3
+    };
+    struct Codec {
+        XMLCompressor::Format format;
+        const char* filename;
+        const unsigned char* data;
+        size_t size;
+    };
+    const Codec codecs[] = {
+        { XMLCompressor::GZIP, "./testxml/compressed.xml.gz", gzipped, sizeof(gzipped) },
+        { XMLCompressor::ZSTD, "./testxml/compressed.xml.zst", zstded, sizeof(zstded) }
+    };
+
+    XMLDocument big;
+    XMLBuilder builder(&big);
+    builder.BeginElement("root");
+    for (int i = 0; i < 20000; ++i) {
+        builder.BeginElement("item");
+        builder.Attr("id", i);
+        builder.Text("Lorem ipsum dolor sit amet, consectetur adipiscing elit.");
+        builder.EndElement();
+    }
+    builder.EndElement();
+    XMLPrinter bigPrinter;
+    big.Print(&bigPrinter);
+
+    // The sizes the files say they decompress to are only hints: ~4G at
+    // the end of a gzip member, and ~2^56 in the header of a zstd frame.
+    std::vector<unsigned char> bigGzip(gzipped, gzipped + sizeof(gzipped));
+    bigGzip[bigGzip.size() - 4] = 0xf0;
+    bigGzip[bigGzip.size() - 3] = 0xff;
+    bigGzip[bigGzip.size() - 2] = 0xff;
+    bigGzip[bigGzip.size() - 1] = 0xff;
+    static const unsigned char bigZstdHeader[] = {
+        0x28, 0xb5, 0x2f, 0xfd, 0xc4, 0x58, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01
+    };
+    std::vector<unsigned char> bigZstd(bigZstdHeader, bigZstdHeader + sizeof(bigZstdHeader));
+    bigZstd.insert(bigZstd.end(), zstded + 6, zstded + sizeof(zstded));
+    const std::vector<unsigned char>* lies[] = { &bigGzip, &bigZstd };
+
+    for (size_t i = 0; i < sizeof(codecs) / sizeof(codecs[0]); ++i) {
+        const Codec& codec = codecs[i];
+        WriteBytes(codec.filename, &(*lies[i])[0], lies[i]->size());
+        CountingAllocator allocator;
+        {
+            XMLDocument lied;
+            lied.SetAllocator(&allocator);
+            EXPECT_EQ(lied.LoadFile(codec.filename), XML_ERROR_COMPRESSION);
+        }
+        EXPECT_LT(allocator.largest, static_cast<size_t>(1024 * 1024));
+
+        WriteBytes(codec.filename, codec.data, codec.size);
+        XMLDocument doc;
+        if (!XMLCompressor::Supported(codec.format)) {
+            EXPECT_EQ(doc.LoadFile(codec.filename), XML_ERROR_COMPRESSION);
+            EXPECT_EQ(big.SaveFile(codec.filename), XML_ERROR_COMPRESSION);
+            continue;
+        }
+        ASSERT_EQ(doc.LoadFile(codec.filename), XML_SUCCESS);
+        EXPECT_STREQ(doc.RootElement()->FirstChildElement("a")->GetText(), "text");
+
+        // Two members or frames, one after the other.
+        std::vector<unsigned char> twice(codec.data, codec.data + codec.size);
+        twice.insert(twice.end(), codec.data, codec.data + codec.size);
+        WriteBytes(codec.filename, &twice[0], twice.size());
+        XMLDocument concatenated;
+        ASSERT_EQ(concatenated.LoadFile(codec.filename), XML_SUCCESS);
+        EXPECT_TRUE(concatenated.RootElement()->NextSiblingElement("root") != 0);
+
+        // Cut short.
+        WriteBytes(codec.filename, codec.data, codec.size - 6);
+        XMLDocument truncated;
+        EXPECT_EQ(truncated.LoadFile(codec.filename), XML_ERROR_COMPRESSION);
+
+        // Larger than the compressor's blocks.
+        ASSERT_EQ(big.SaveFile(codec.filename), XML_SUCCESS);
+        XMLDocument loaded;
+        ASSERT_EQ(loaded.LoadFile(codec.filename), XML_SUCCESS);
+        XMLPrinter loadedPrinter;
+        loaded.Print(&loadedPrinter);
+        EXPECT_STREQ(loadedPrinter.CStr(), bigPrinter.CStr());
+
+        // A printer can write compressed output anywhere.
+        FILE* fp = fopen(codec.filename, "wb");
+        ASSERT_TRUE(fp != 0);
+        {
+            XMLCompressor compressor(fp, codec.format, 1);
+            XMLPrinter printer;
+            printer.SetOutput(XMLCompressor::Output, &compressor);
+            doc.Print(&printer);
+            printer.Flush();
+            EXPECT_EQ(compressor.Finish(), XML_SUCCESS);
+        }
+        fclose(fp);
+        XMLDocument printed;
+        ASSERT_EQ(printed.LoadFile(codec.filename), XML_SUCCESS);
+        EXPECT_STREQ(printed.RootElement()->FirstChildElement("a")->Attribute("x"), "1");
+    }
+    for (size_t i = 0; i < sizeof(codecs) / sizeof(codecs[0]); ++i) {
+        remove(codecs[i].filename);
+    }
+}
+
+TEST(TEST_XMLDocument, LoadFileAsync)
+{
+    XMLDocument source;
+    XMLBuilder builder(&source);
+    builder.BeginElement("root");
+    for (int i = 0; i < 5000; ++i) {
+        builder.BeginElement("item");
+        builder.Attr("id", i);
+        builder.Text("Lorem ipsum dolor sit amet, consectetur adipiscing elit.");
+        builder.EndElement();
+    }
+    builder.EndElement();
+    ASSERT_EQ(source.SaveFile("./testxml/loadasync.xml"), XML_SUCCESS);
+    XMLPrinter sourcePrinter;
+    source.Print(&sourcePrinter);
+
+    XMLLoad load;
+    EXPECT_TRUE(load.Ready());
+    EXPECT_EQ(load.Wait(), XML_SUCCESS);
+
+    XMLDocument doc;
+    doc.LoadFileAsync("./testxml/loadasync.xml", &load);
+    // Other work, while the file loads.
+    XMLDocument other;
+    EXPECT_EQ(other.Parse("<other/>"), XML_SUCCESS);
+    EXPECT_EQ(load.Wait(), XML_SUCCESS);
+    EXPECT_TRUE(load.Ready());
+    XMLPrinter printer;
+    doc.Print(&printer);
+    EXPECT_STREQ(printer.CStr(), sourcePrinter.CStr());
+
+    // The handle is used again; a missing file fails as with LoadFile().
+    doc.LoadFileAsync("./testxml/nonexistent.xml", &load);
+    EXPECT_EQ(load.Wait(), XML_ERROR_FILE_NOT_FOUND);
+    EXPECT_EQ(doc.ErrorID(), XML_ERROR_FILE_NOT_FOUND);
+
+    // Several files at once; the handles wait when they go.
+    XMLDocument docs[3];
+    {
+        XMLLoad loads[3];
+        for (int i = 0; i < 3; ++i) {
+            docs[i].LoadFileAsync("./testxml/loadasync.xml", &loads[i]);
+        }
+    }
+    for (int i = 0; i < 3; ++i) {
+        ASSERT_FALSE(docs[i].Error());
+        EXPECT_EQ(docs[i].RootElement()->LastChildElement()->IntAttribute("id"), 4999);
+    }
+    remove("./testxml/loadasync.xml");
+}
+
+TEST(TEST_XMLDocument, Snapshot)
+{
+    const char* xml =
+        "\xEF\xBB\xBF<?xml version='1.0'?>\n"
+        "<!DOCTYPE root>\n"
+        "<root a='1 &amp; 2' b='1 &amp; 2'>\n"
+        "  <!-- comment -->\n"
+        "  <item id='1'>one &lt; two<![CDATA[ <raw> ]]></item>\n"
+        "  <item id='2'/>\n"
+        "</root>";
+    XMLDocument doc, copy;
+    doc.Parse(xml);
+
+    std::FILE* f = tmpfile();
+    EXPECT_EQ(doc.SaveSnapshot(f), XML_SUCCESS);
+    EXPECT_EQ(copy.LoadSnapshot(f), XML_SUCCESS);
+    std::fclose(f);
+
+    XMLPrinter printer, copyPrinter;
+    doc.Print(&printer);
+    copy.Print(&copyPrinter);
+    EXPECT_STREQ(printer.CStr(), copyPrinter.CStr());
+    EXPECT_TRUE(copy.HasBOM());
+
+    XMLElement* root = copy.RootElement();
+    EXPECT_EQ(root->GetLineNum(), 3);
+    EXPECT_STREQ(root->Attribute("b"), "1 & 2");
+    EXPECT_STREQ(root->FirstChildElement("item")->GetText(), "one < two");
+    EXPECT_TRUE(root->FirstChildElement("item")->LastChild()->ToText()->CData());
+    EXPECT_EQ(root->LastChildElement("item")->IntAttribute("id"), 2);
+
+    // --------- Mutable ----------- //
+    root->SetAttribute("a", "changed");
+    root->InsertEndChild(copy.NewElement("added"));
+    EXPECT_STREQ(root->Attribute("a"), "changed");
+    EXPECT_STREQ(root->Attribute("b"), "1 & 2");
+    EXPECT_STREQ(root->LastChildElement()->Name(), "added");
+
+    // --------- Errors ----------- //
+    EXPECT_EQ(copy.LoadSnapshot((const char*)NULL), XML_ERROR_FILE_COULD_NOT_BE_OPENED);
+    EXPECT_EQ(copy.LoadSnapshot("./testxml/nonexistent.snapshot"), XML_ERROR_FILE_NOT_FOUND);
+    f = tmpfile();
+    std::fputs(xml, f);
+    EXPECT_EQ(copy.LoadSnapshot(f), XML_ERROR_BAD_SNAPSHOT);
+    std::fclose(f);
+    EXPECT_TRUE(copy.NoChildren());
+
+    f = tmpfile();
+    doc.SaveSnapshot(f);
+    std::fseek(f, -1, SEEK_END);
+    std::fputc('x', f);
+    std::fputc('x', f);
+    EXPECT_EQ(copy.LoadSnapshot(f), XML_ERROR_BAD_SNAPSHOT);
+    std::fclose(f);
+}
+
 
 
 TEST(TEST_XMLPrinter, XMLPrinter)
@@ -1219,6 +2389,354 @@ TEST(TEST_XMLPrinter, XMLPrinter)
 
 }
 
+TEST(TEST_XMLPrinter, ReuseSource)
+{
+    const char* xml =
+        "\xEF\xBB\xBF<?xml version='1.0'?>\n"
+        "<root a = '1 &amp; 2'>\n"
+        "\t<!-- kept as is -->\n"
+        "\t<item id='1'>one &#x41; two<![CDATA[ <raw> ]]></item>\n"
+        "\t<item id='2'  />\n"
+        "\t<list><x/> <y/></list>\n"
+        "</root>\n";
+    for (int lazy = 0; lazy < 2; ++lazy) {
+        XMLDocument doc;
+        doc.SetLazyParsing(lazy != 0);
+        doc.SetTrackSpans(true);
+        doc.Parse(xml);
+        XMLPrinter same;
+        same.SetReuseSource(true);
+        doc.Print(&same);
+        EXPECT_STREQ(same.CStr(), xml);
+        EXPECT_FALSE(doc.Modified());
+
+        XMLElement* root = doc.RootElement();
+        XMLElement* second = root->FirstChildElement("item")->NextSiblingElement();
+        second->SetAttribute("id", "3");
+        root->InsertAfterChild(second, doc.NewElement("new"));
+        root->FirstChildElement("list")->FirstChild()->SetValue("z");
+        EXPECT_TRUE(root->Modified());
+        EXPECT_FALSE(root->FirstChildElement("item")->Modified());
+
+        XMLPrinter printer;
+        printer.SetReuseSource(true);
+        doc.Print(&printer);
+        EXPECT_STREQ(printer.CStr(),
+            "\xEF\xBB\xBF<?xml version='1.0'?>\n"
+            "<root a=\"1 &amp; 2\">\n"
+            "\t<!-- kept as is -->\n"
+            "\t<item id='1'>one &#x41; two<![CDATA[ <raw> ]]></item>\n"
+            "\t<item id=\"3\"/>\n"
+            "\t<new/>\n"
+            "\t<list><z/> <y/></list>\n"
+            "</root>\n");
+        XMLDocument reparsed;
+        reparsed.Parse(printer.CStr());
+        EXPECT_TRUE(reparsed.DeepEqual(&doc));
+
+        // The printer's own mode is kept for other documents.
+        XMLDocument untracked;
+        untracked.Parse(xml);
+        XMLPrinter pretty;
+        untracked.Print(&pretty);
+        printer.ClearBuffer();
+        untracked.Print(&printer);
+        EXPECT_STREQ(printer.CStr(), pretty.CStr());
+        printer.SetReuseSource(false);
+        printer.ClearBuffer();
+        doc.Print(&printer);
+        printer.ClearBuffer();
+        untracked.Print(&printer);
+        EXPECT_STREQ(printer.CStr(), pretty.CStr());
+    }
+
+    // The source's whitespace isn't written next to text, which it would
+    // become part of when the file is read again.
+    {
+        XMLDocument doc;
+        doc.SetTrackSpans(true);
+        doc.Parse("<r>\n  <a> <x-y/></a>\n  <b>text</b>\n  <c><![CDATA[data]]>\n  <d/></c>\n</r>");
+        XMLElement* root = doc.RootElement();
+        root->FirstChildElement("a")->SetText("txt&");
+        root->FirstChildElement("b")->InsertEndChild(doc.NewElement("e"));
+        root->FirstChildElement("c")->FirstChild()->ToText()->SetCData(false);
+        root->InsertEndChild(doc.NewText("end"));
+        XMLPrinter printer;
+        printer.SetReuseSource(true);
+        doc.Print(&printer);
+        EXPECT_STREQ(printer.CStr(), "<r>\n  <a>txt&amp;<x-y/></a>\n  <b>text<e/></b>\n  <c>data<d/></c>end</r>");
+        XMLDocument reloaded;
+        reloaded.Parse(printer.CStr());
+        EXPECT_TRUE(reloaded.DeepEqual(&doc));
+    }
+
+    // Saving after a small change copies what didn't change.
+    XMLDocument big;
+    big.SetTrackSpans(true);
+    {
+        XMLDocument source;
+        XMLBuilder builder(&source);
+        builder.BeginElement("root");
+        for (int i = 0; i < 2000; ++i) {
+            builder.BeginElement("item");
+            builder.Attr("id", i);
+            builder.Attr("name", "a & b");
+            builder.Text("some <text>");
+            builder.EndElement();
+        }
+        builder.EndElement();
+        XMLPrinter printer;
+        source.Print(&printer);
+        big.Parse(printer.CStr());
+    }
+    big.RootElement()->LastChildElement()->SetAttribute("id", "last");
+    XMLPrinter full;
+    big.Print(&full);
+    XMLPrinter reused;
+    reused.SetReuseSource(true);
+    big.Print(&reused);
+    EXPECT_STREQ(full.CStr(), reused.CStr());
+}
+
+TEST(TEST_XMLPrinter, Output)
+{
+    XMLDocument doc;
+    {
+        XMLBuilder builder(&doc);
+        builder.BeginElement("root");
+        for (int i = 0; i < 20000; ++i) {
+            builder.BeginElement("item");
+            builder.Attr("id", i);
+            builder.Text("a & b");
+            builder.EndElement();
+        }
+        builder.EndElement();
+    }
+    XMLPrinter memory;
+    doc.Print(&memory);
+
+    // The output comes in large pieces, the last at the end of the document.
+    std::string out;
+    {
+        XMLPrinter printer;
+        printer.SetOutput(AppendOutput, &out);
+        doc.Print(&printer);
+        const size_t pieces = std::count(out.begin(), out.end(), '|');
+        EXPECT_GT(pieces, 1u);
+        EXPECT_LE(pieces, out.size() / (64 * 1024) + 1);
+        out.erase(std::remove(out.begin(), out.end(), '|'), out.end());
+        EXPECT_EQ(out, memory.CStr());
+        EXPECT_STREQ(printer.CStr(), "");
+    }
+
+    // Streaming passes each top level element on when it is closed.
+    out.clear();
+    {
+        XMLPrinter printer;
+        printer.SetOutput(AppendOutput, &out);
+        printer.PushComment("first");
+        printer.OpenElement("a");
+        printer.PushText(1);
+        EXPECT_TRUE(out.empty());
+        printer.CloseElement();
+        EXPECT_EQ(out, "<!--first-->\n<a>1</a>\n|");
+        printer.PushComment("last");
+    }
+    EXPECT_EQ(out, "<!--first-->\n<a>1</a>\n|\n<!--last-->|");
+
+    // A FILE is written the same way.
+    FILE* fp = tmpfile();
+    ASSERT_TRUE(fp != 0);
+    {
+        XMLPrinter printer(fp);
+        doc.Print(&printer);
+    }
+    std::string read(memory.CStrSize() - 1, '\0');
+    rewind(fp);
+    EXPECT_EQ(fread(&read[0], 1, read.size(), fp), read.size());
+    fclose(fp);
+    EXPECT_EQ(read, memory.CStr());
+
+    // The FILE has each element once it is closed.
+    fp = tmpfile();
+    ASSERT_TRUE(fp != 0);
+    {
+        XMLPrinter printer(fp);
+        printer.OpenElement("a");
+        printer.OpenElement("b");
+        printer.PushText(1);
+        printer.CloseElement();
+        EXPECT_STREQ(printer.CStr(), "");
+        fflush(fp);
+        EXPECT_EQ(ftell(fp), long(strlen("<a>\n    <b>1</b>")));
+        printer.PushComment("c");
+        EXPECT_STREQ(printer.CStr(), "\n    <!--c-->");
+        printer.CloseElement();
+    }
+    fclose(fp);
+}
+
+TEST(TEST_XMLPrinter, ChunkedAndReserve)
+{
+    XMLDocument doc;
+    {
+        XMLBuilder builder(&doc);
+        builder.BeginElement("root");
+        for (int i = 0; i < 20000; ++i) {
+            builder.BeginElement("item");
+            builder.Attr("id", i);
+            builder.Text("a & b");
+            builder.EndElement();
+        }
+        builder.EndElement();
+    }
+    XMLPrinter memory;
+    doc.Print(&memory);
+    const std::string expected = memory.CStr();
+
+    // Measured first, printing doesn't allocate.
+    CountingAllocator allocator;
+    {
+        XMLPrinter printer;
+        printer.SetAllocator(&allocator);
+        EXPECT_EQ(printer.Reserve(doc), expected.size());
+        const int allocs = allocator.allocs;
+        doc.Print(&printer);
+        EXPECT_EQ(allocator.allocs, allocs);
+        EXPECT_EQ(printer.CStr(), expected);
+    }
+
+    // Chunked, the pieces make up the output.
+    XMLPrinter chunked;
+    chunked.SetChunked(true);
+    doc.Print(&chunked);
+    EXPECT_GT(chunked.ChunkCount(), 1);
+    std::string joined;
+    for (int i = 0; i < chunked.ChunkCount(); ++i) {
+        size_t size = 0;
+        const char* chunk = chunked.Chunk(i, &size);
+        joined.append(chunk, size);
+    }
+    EXPECT_EQ(joined, expected);
+    chunked.ClearBuffer();
+    EXPECT_EQ(chunked.ChunkCount(), 0);
+    chunked.PushText("short");
+    size_t size = 0;
+    EXPECT_EQ(chunked.ChunkCount(), 1);
+    const char* chunk = chunked.Chunk(0, &size);
+    EXPECT_EQ(std::string(chunk, size), "short");
+}
+
+// Escapes 'text' the way XMLPrinter is documented to: every entity
+// character in an attribute, only &, < and > in text.
+static std::string Escape(const std::string& text, bool attribute)
+{
+    std::string out;
+    for (size_t i = 0; i < text.size(); ++i) {
+        switch (text[i]) {
+            case '&':  out += "&amp;"; break;
+            case '<':  out += "&lt;"; break;
+            case '>':  out += "&gt;"; break;
+            case '"':  out += attribute ? "&quot;" : "\""; break;
+            case '\'': out += attribute ? "&apos;" : "'"; break;
+            default:   out += text[i]; break;
+        }
+    }
+    return out;
+}
+
+TEST(TEST_XMLPrinter, EscapeScan)
+{
+    // Entities on each side of the 16 byte blocks, and bytes above 127.
+    const char chars[] = "ab &<>\"'\xC3\xA9\x01\x7F";
+    unsigned seed = 1;
+    for (int length = 0; length < 80; ++length) {
+        for (int round = 0; round < 20; ++round) {
+            std::string text;
+            for (int i = 0; i < length; ++i) {
+                seed = seed * 1103515245u + 12345u;
+                // Mostly plain letters, as in real text.
+                const unsigned pick = (seed >> 16) % 40;
+                text += pick < sizeof(chars) - 1 ? chars[pick] : 'x';
+            }
+            XMLPrinter printer;
+            printer.OpenElement("e", true);
+            printer.PushAttribute("a", text.c_str());
+            printer.PushText(text.c_str());
+            printer.CloseElement(true);
+            EXPECT_EQ(std::string(printer.CStr()), "<e a=\"" + Escape(text, true) + "\">" + Escape(text, false) + "</e>");
+        }
+    }
+
+    // A long run without entities is copied as it is.
+    std::string clean;
+    while (clean.size() < 100000) {
+        clean += "Lorem ipsum dolor sit amet, consectetur \xC3\xA9 adipiscing. ";
+    }
+    XMLPrinter printer;
+    printer.PushText(clean.c_str());
+    EXPECT_EQ(std::string(printer.CStr()), clean);
+}
+
+TEST(TEST_XMLPrinter, NoEscapes)
+{
+    const char* xml =
+        "<root a='plain' b='say \"hi\"' c=\"it's\" d='1 &lt; 2' e='&#38;'>"
+        "<t>plain text</t><t>a > b</t><t>a &amp; b</t><t>line\r\nbreak</t>"
+        "<t><![CDATA[<raw>]]></t><t>x &#60; y</t><t>it's \"quoted\"</t>"
+        "</root>";
+    const char* printed =
+        "<root a=\"plain\" b=\"say &quot;hi&quot;\" c=\"it&apos;s\" d=\"1 &lt; 2\" e=\"&amp;\">"
+        "<t>plain text</t><t>a &gt; b</t><t>a &amp; b</t><t>line\nbreak</t>"
+        "<t><![CDATA[<raw>]]></t><t>x &lt; y</t><t>it's \"quoted\"</t>"
+        "</root>";
+    XMLDocument doc;
+    doc.Parse(xml);
+    ASSERT_FALSE(doc.Error());
+    XMLElement* root = doc.RootElement();
+    EXPECT_STREQ(root->Attribute("a"), "plain");
+    EXPECT_STREQ(root->Attribute("e"), "&");
+    EXPECT_STREQ(root->FirstChildElement()->NextSiblingElement("t")->NextSiblingElement("t")->NextSiblingElement("t")->GetText(), "line\nbreak");
+
+    // Printing only reads the document, so printing again is the same.
+    for (int i = 0; i < 2; ++i) {
+        XMLPrinter printer(0, true);
+        doc.Print(&printer);
+        EXPECT_STREQ(printer.CStr(), printed);
+    }
+
+    // Values set later are looked through when they are set.
+    StrPair pair;
+    pair.SetStr("plain");
+    EXPECT_TRUE(pair.NoEscapes(false));
+    pair.SetStr("it's");
+    EXPECT_TRUE(pair.NoEscapes(true));
+    EXPECT_FALSE(pair.NoEscapes(false));
+    pair.SetStr("a < b");
+    EXPECT_FALSE(pair.NoEscapes(true));
+    root->SetAttribute("b", "it's");
+    root->SetAttribute("a", "<set>");
+    root->FirstChildElement()->SetText("a & b");
+    root->LastChildElement()->SetText("plain");
+    for (int i = 0; i < 2; ++i) {
+        XMLPrinter printer(0, true);
+        doc.Print(&printer);
+        const std::string out = printer.CStr();
+        EXPECT_NE(out.find("a=\"&lt;set&gt;\" b=\"it&apos;s\""), std::string::npos);
+        EXPECT_NE(out.find("<t>a &amp; b</t><t>a &gt; b</t>"), std::string::npos);
+        EXPECT_NE(out.find("<t>plain</t></root>"), std::string::npos);
+    }
+
+    // Without entity processing the text is written as it is.
+    XMLDocument raw(false);
+    raw.Parse("<t a='1 &lt; 2'>a &amp; b &gt; c</t>");
+    XMLPrinter rawPrinter(0, true);
+    raw.Print(&rawPrinter);
+    EXPECT_STREQ(rawPrinter.CStr(), "<t a=\"1 &lt; 2\">a &amp; b &gt; c</t>");
+}
+
+
+
 TEST(TEST_XMLVisitor, XMLVisitor)
 {
     XMLVisitor theVisitor;
@@ -1238,6 +2756,375 @@ TEST(TEST_XMLVisitor, XMLVisitor)
 
 }
 
+class ElementCounter : public XMLVisitor
+{
+public:
+    ElementCounter() : count(0) {}
+    virtual bool VisitEnter(const XMLElement&, const XMLAttribute*) { ++count; return true; }
+    int count;
+};
+
+// Records the calls, for comparing the traversals.
+class TraceVisitor : public XMLVisitor
+{
+public:
+    virtual bool VisitEnter(const XMLDocument&) { trace += "D("; return true; }
+    virtual bool VisitExit(const XMLDocument&) { trace += ")D"; return true; }
+    virtual bool VisitEnter(const XMLElement& e, const XMLAttribute* a) {
+        trace += e.Name();
+        trace += a ? a->Value() : "";
+        trace += "(";
+        return strcmp(e.Name(), "skip") != 0;
+    }
+    virtual bool VisitExit(const XMLElement& e) { trace += ")"; return strcmp(e.Name(), "stop") != 0; }
+    virtual bool Visit(const XMLText& t) { trace += t.Value(); return true; }
+    virtual bool Visit(const XMLComment&) { trace += "C"; return true; }
+    virtual bool Visit(const XMLDeclaration&) { trace += "X"; return true; }
+    virtual bool Visit(const XMLUnknown&) { trace += "U"; return true; }
+    std::string trace;
+};
+
+class StaticTraceVisitor : public XMLStaticVisitor<StaticTraceVisitor>
+{
+public:
+    bool VisitEnter(const XMLDocument&) { trace += "D("; return true; }
+    bool VisitExit(const XMLDocument&) { trace += ")D"; return true; }
+    bool VisitEnter(const XMLElement& e, const XMLAttribute* a) {
+        trace += e.Name();
+        trace += a ? a->Value() : "";
+        trace += "(";
+        return strcmp(e.Name(), "skip") != 0;
+    }
+    bool VisitExit(const XMLElement& e) { trace += ")"; return strcmp(e.Name(), "stop") != 0; }
+    bool Visit(const XMLText& t) { trace += t.Value(); return true; }
+    bool Visit(const XMLComment&) { trace += "C"; return true; }
+    bool Visit(const XMLDeclaration&) { trace += "X"; return true; }
+    bool Visit(const XMLUnknown&) { trace += "U"; return true; }
+    std::string trace;
+};
+
+class StaticElementCounter : public XMLStaticVisitor<StaticElementCounter>
+{
+public:
+    using XMLStaticVisitor<StaticElementCounter>::VisitEnter;
+    StaticElementCounter() : count(0) {}
+    bool VisitEnter(const XMLElement&, const XMLAttribute*) { ++count; return true; }
+    int count;
+};
+
+TEST(TEST_XMLVisitor, Traverse)
+{
+    XMLDocument doc;
+    doc.Parse("<?xml version='1.0'?><!DOCTYPE a>"
+              "<a x='1'><!--c-->t<skip><b/></skip><c><stop/><d/></c>"
+              "<e><![CDATA[cd]]></e></a>");
+
+    EXPECT_EQ(doc.Kind(), XMLNode::DOCUMENT_NODE);
+    EXPECT_EQ(doc.FirstChild()->Kind(), XMLNode::DECLARATION_NODE);
+    EXPECT_EQ(doc.FirstChild()->NextSibling()->Kind(), XMLNode::UNKNOWN_NODE);
+    EXPECT_EQ(doc.RootElement()->Kind(), XMLNode::ELEMENT_NODE);
+    EXPECT_EQ(doc.RootElement()->FirstChild()->Kind(), XMLNode::COMMENT_NODE);
+    EXPECT_EQ(doc.RootElement()->LastChildElement()->FirstChild()->Kind(), XMLNode::TEXT_NODE);
+
+    // Same calls, same results, for the document and for a subtree.
+    TraceVisitor virtualTrace;
+    StaticTraceVisitor staticTrace;
+    EXPECT_EQ(doc.Accept(&virtualTrace), staticTrace.Traverse(doc));
+    EXPECT_EQ(virtualTrace.trace, staticTrace.trace);
+    EXPECT_EQ(staticTrace.trace, "D(XUa1(Ctskip()c(stop())e(cd)))D");
+
+    const XMLElement* c = doc.RootElement()->FirstChildElement("c");
+    virtualTrace.trace.clear();
+    staticTrace.trace.clear();
+    EXPECT_EQ(c->Accept(&virtualTrace), Traverse(*c, staticTrace));
+    EXPECT_EQ(virtualTrace.trace, staticTrace.trace);
+    const XMLText* text = doc.RootElement()->FirstChild()->NextSibling()->ToText();
+    staticTrace.trace.clear();
+    EXPECT_TRUE(Traverse(*text, staticTrace));
+    EXPECT_EQ(staticTrace.trace, "t");
+
+    // --------- Static and virtual ----------- //
+    XMLPrinter big;
+    big.OpenElement("root");
+    for (int i = 0; i < 2000; ++i) {
+        big.OpenElement("group");
+        big.OpenElement("item");
+        big.PushText(i);
+        big.CloseElement();
+        big.CloseElement();
+    }
+    big.CloseElement();
+    doc.Parse(big.CStr());
+
+    ElementCounter virtualCounter;
+    doc.Accept(&virtualCounter);
+    StaticElementCounter staticCounter;
+    staticCounter.Traverse(doc);
+    EXPECT_EQ(virtualCounter.count, 4001);
+    EXPECT_EQ(staticCounter.count, 4001);
+}
+
+
+
+TEST(TEST_XMLBuilder, XMLBuilder)
+{
+    const int count = 1000;
+
+    XMLDocument api;
+    XMLElement* root = api.NewElement("root");
+    api.InsertEndChild(root);
+    for (int i = 0; i < count; ++i) {
+        XMLElement* item = api.NewElement("item");
+        root->InsertEndChild(item);
+        item->SetAttribute("id", i);
+        item->SetAttribute("name", "value");
+        item->SetAttribute("ok", true);
+        XMLElement* price = item->InsertNewChildElement("price");
+        price->SetText(1.5);
+    }
+
+    XMLDocument built;
+    XMLBuilder builder(&built, true);
+    builder.BeginElement("root");
+    for (int i = 0; i < count; ++i) {
+        builder.BeginElement("item");
+        builder.Attr("id", i);
+        builder.Attr("name", "value");
+        builder.Attr("ok", true);
+        builder.BeginElement("price");
+        builder.Text(1.5);
+        builder.EndElement();
+        builder.EndElement();
+    }
+    builder.EndElement();
+    EXPECT_EQ(0, builder.Depth());
+    EXPECT_EQ(&built, builder.Current());
+
+    XMLPrinter apiPrinter, builtPrinter;
+    api.Print(&apiPrinter);
+    built.Print(&builtPrinter);
+    EXPECT_STREQ(apiPrinter.CStr(), builtPrinter.CStr());
+
+    // Appending to an existing element, replacing attributes, and CDATA.
+    XMLDocument doc;
+    doc.Parse("<a x='1'><b/></a>");
+    XMLBuilder append(doc.RootElement());
+    append.Attr("x", "2");
+    append.Attr("y", "3");
+    append.BeginElement("c");
+    append.Text("<raw>", true);
+    append.EndElement();
+    append.Text("tail");
+    XMLPrinter printer(0, true);
+    doc.Print(&printer);
+    EXPECT_STREQ("<a x=\"2\" y=\"3\"><b/><c><![CDATA[<raw>]]></c>tail</a>", printer.CStr());
+    doc.Clear();
+
+    // Unique attributes go after those of a lazily parsed element.
+    XMLDocument lazy;
+    lazy.SetLazyParsing(true);
+    lazy.Parse("<a x='1' y='2'><b/></a>");
+    XMLBuilder unique(lazy.RootElement(), true);
+    unique.Attr("z", 3);
+    unique.BeginElement("c");
+    unique.EndElement();
+    unique.Attr("w", 4);
+    XMLPrinter lazyPrinter(0, true);
+    lazy.Print(&lazyPrinter);
+    EXPECT_STREQ("<a x=\"1\" y=\"2\" z=\"3\" w=\"4\"><b/><c/></a>", lazyPrinter.CStr());
+}
+
+
+
+TEST(TEST_XMLCompactDocument, XMLCompactDocument)
+{
+    const char* xml =
+        "<?xml version='1.0'?>\n"
+        "<!DOCTYPE root>\n"
+        "<root a='1 &amp; 2'>\n"
+        "  <!-- comment -->\n"
+        "  <item id='1'>one &lt; two</item>\n"
+        "  <item id='2'><![CDATA[ <raw> ]]></item>\n"
+        "  <other/>\n"
+        "</root>";
+    XMLCompactDocument compact;
+    EXPECT_EQ(compact.Parse(xml), XML_SUCCESS);
+    EXPECT_EQ(compact.NodeCount(), 9);
+    EXPECT_EQ(compact.AttributeCount(), 3);
+
+    XMLCompactNode root = compact.RootElement();
+    EXPECT_STREQ(root.Name(), "root");
+    EXPECT_EQ(root.GetLineNum(), 3);
+    EXPECT_STREQ(root.Attribute("a"), "1 & 2");
+    EXPECT_EQ(root.Attribute("a", "x"), (const char*)0);
+    EXPECT_TRUE(root.FirstChild().IsComment());
+    EXPECT_TRUE(root.Parent().IsDocument());
+    EXPECT_TRUE(root.Parent().Parent().IsNull());
+
+    XMLCompactNode item = root.FirstChildElement("item");
+    EXPECT_EQ(item.IntAttribute("id"), 1);
+    EXPECT_STREQ(item.GetText(), "one < two");
+    EXPECT_EQ(item.GetLineNum(), 5);
+    item = item.NextSiblingElement("item");
+    EXPECT_TRUE(item.FirstChild().CData());
+    EXPECT_STREQ(item.GetText(), " <raw> ");
+    EXPECT_TRUE(item.NextSiblingElement("item").IsNull());
+    EXPECT_TRUE(root.FirstChildElement("other").FirstChild().IsNull());
+    EXPECT_TRUE(compact.FirstChild().IsDeclaration());
+    EXPECT_TRUE(compact.FirstChild().NextSibling().IsUnknown());
+
+    // --------- CopyTo ----------- //
+    XMLDocument doc, copy;
+    doc.Parse(xml);
+    compact.CopyTo(&copy);
+    XMLPrinter printer, copyPrinter;
+    doc.Print(&printer);
+    copy.Print(&copyPrinter);
+    EXPECT_STREQ(printer.CStr(), copyPrinter.CStr());
+
+    // --------- Errors ----------- //
+    const char* bad[] = { "", "<a>", "<a></b>", "<a x='1' x='2'/>", "<a x=1/>", "<a><!-- </a>",
+                          "<a/><?xml?>", "<a>text", "<a>text<", "<a><![CDATA[</a>", "<a b>", "<1/>",
+                          "<a></a x>", "<a></a x='1' x='2'>", "<a></a x='1'", "<a></a/", "<a></a", "<a></ a>",
+                          "<a> ", "<a>\n\n", "<a><b>\n</b>", "<a></1>" };
+    for (size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); ++i) {
+        doc.Parse(bad[i]);
+        compact.Parse(bad[i]);
+        EXPECT_EQ(compact.ErrorID(), doc.ErrorID()) << bad[i];
+        EXPECT_EQ(compact.ErrorLineNum(), doc.ErrorLineNum()) << bad[i];
+        EXPECT_TRUE(compact.RootElement().IsNull());
+    }
+    // End tags are read as XMLDocument reads them: attributes are
+    // dropped, and one ended with "/>" is an element.
+    const char* odd[] = { "<a></a x='1'>", "<a></a\n>", "<r></a/></r>", "<r></a x='1'/></r>" };
+    for (size_t i = 0; i < sizeof(odd) / sizeof(odd[0]); ++i) {
+        ASSERT_EQ(doc.Parse(odd[i]), XML_SUCCESS) << odd[i];
+        ASSERT_EQ(compact.Parse(odd[i]), XML_SUCCESS) << odd[i];
+        XMLDocument oddCopy;
+        compact.CopyTo(&oddCopy);
+        XMLPrinter oddPrinter, oddCopyPrinter;
+        doc.Print(&oddPrinter);
+        oddCopy.Print(&oddCopyPrinter);
+        EXPECT_STREQ(oddPrinter.CStr(), oddCopyPrinter.CStr()) << odd[i];
+    }
+
+    // --------- BOM ----------- //
+    const char* withBOM = "\xEF\xBB\xBF<a>text</a>";
+    ASSERT_EQ(compact.Parse(withBOM), XML_SUCCESS);
+    EXPECT_TRUE(compact.HasBOM());
+    XMLDocument bomCopy;
+    compact.CopyTo(&bomCopy);
+    EXPECT_TRUE(bomCopy.HasBOM());
+    XMLPrinter bomPrinter(0, true);
+    bomCopy.Print(&bomPrinter);
+    EXPECT_STREQ(bomPrinter.CStr(), withBOM);
+    compact.Parse("<a/>");
+    EXPECT_FALSE(compact.HasBOM());
+    compact.CopyTo(&bomCopy);
+    EXPECT_FALSE(bomCopy.HasBOM());
+    EXPECT_EQ(compact.LoadFile("./testxml/nonexistent.xml"), XML_ERROR_FILE_NOT_FOUND);
+
+    // --------- Bytes per node ----------- //
+    XMLPrinter big;
+    big.OpenElement("root");
+    for (int i = 0; i < 10000; ++i) {
+        big.OpenElement("item");
+        big.PushAttribute("id", i);
+        big.PushText("text");
+        big.CloseElement();
+    }
+    big.CloseElement();
+    EXPECT_EQ(compact.Parse(big.CStr()), XML_SUCCESS);
+    EXPECT_EQ(compact.NodeCount(), 20001);
+    EXPECT_LT(compact.MemoryUsage(), compact.NodeCount() * sizeof(XMLElement));
+}
+
+
+
+class FrozenElementCounter : public XMLFrozenVisitor
+{
+public:
+    FrozenElementCounter() : count(0), texts(0) {}
+    virtual bool VisitEnter(const XMLFrozenDocument& doc, int node) {
+        if (node) ++count;
+        return !doc.Value(node) || strcmp(doc.Value(node), "skip") != 0;
+    }
+    virtual bool Visit(const XMLFrozenDocument&, int) { ++texts; return true; }
+    int count;
+    int texts;
+};
+
+TEST(TEST_XMLFrozenDocument, XMLFrozenDocument)
+{
+    const char* xml =
+        "<?xml version='1.0'?>"
+        "<root a='1'>"
+        "<!-- comment -->"
+        "<item id='1' kind='x'>one</item>"
+        "<skip><item id='2'>two</item></skip>"
+        "<item id='3'><![CDATA[three]]></item>"
+        "</root>";
+    XMLDocument doc;
+    doc.Parse(xml);
+    XMLFrozenDocument frozen;
+    doc.Freeze(&frozen);
+
+    EXPECT_EQ(frozen.NodeCount(), 11);
+    EXPECT_EQ(frozen.Kind(0), XMLFrozenDocument::DOCUMENT_NODE);
+    EXPECT_EQ(frozen.Kind(1), XMLFrozenDocument::DECLARATION_NODE);
+    const int root = frozen.NextSibling(1);
+    EXPECT_STREQ(frozen.Value(root), "root");
+    EXPECT_STREQ(frozen.Attribute(root, "a"), "1");
+    EXPECT_EQ(frozen.Kind(frozen.FirstChild(root)), XMLFrozenDocument::COMMENT_NODE);
+    EXPECT_EQ(frozen.CountElements(), 5);
+    EXPECT_EQ(frozen.CountElements("item"), 3);
+    EXPECT_EQ(frozen.CountElements("missing"), 0);
+    EXPECT_EQ(frozen.FindNameId("kind"), frozen.AttributeNameId(frozen.FindElement("item"), 1));
+
+    int item = frozen.FindElement("item");
+    EXPECT_STREQ(frozen.AttributeValue(item, 0), "1");
+    EXPECT_STREQ(frozen.Value(frozen.FirstChild(item)), "one");
+    item = frozen.FindElement("item", item);
+    EXPECT_STREQ(frozen.Value(frozen.Parent(item)), "skip");
+    item = frozen.FindElement("item", item);
+    EXPECT_EQ(frozen.Kind(frozen.FirstChild(item)), XMLFrozenDocument::CDATA_NODE);
+    EXPECT_EQ(frozen.FindElement("item", item), 0);
+    EXPECT_EQ(frozen.Parent(root), 0);
+
+    FrozenElementCounter counter;
+    EXPECT_TRUE(frozen.Accept(&counter));
+    EXPECT_EQ(counter.count, 4);     // the children of <skip> are skipped
+    EXPECT_EQ(counter.texts, 4);
+
+    // The view doesn't depend on the document.
+    doc.Clear();
+    EXPECT_STREQ(frozen.Value(root), "root");
+    frozen.Clear();
+    EXPECT_EQ(frozen.NodeCount(), 1);
+    EXPECT_EQ(frozen.FirstChild(0), 0);
+
+    // --------- Sweep and Accept ----------- //
+    XMLPrinter big;
+    big.OpenElement("root");
+    for (int i = 0; i < 2000; ++i) {
+        big.OpenElement("group");
+        big.OpenElement("item");
+        big.PushText(i);
+        big.CloseElement();
+        big.CloseElement();
+    }
+    big.CloseElement();
+    doc.Parse(big.CStr());
+    doc.Freeze(&frozen);
+
+    ElementCounter domCounter;
+    doc.Accept(&domCounter);
+    FrozenElementCounter frozenCounter;
+    frozen.Accept(&frozenCounter);
+    EXPECT_EQ(domCounter.count, 4001);
+    EXPECT_EQ(frozenCounter.count, 4001);
+    EXPECT_EQ(frozen.CountElements(), 4001);
+}
 
 int main(int argc, char **argv)
 {
@@ -122,6 +122,46 @@ distribution.
 	#define TIXML_FTELL ftell
 #endif
 
+// Parallel deep clones and prints, and compression on a thread of its
+// own, use std::thread where the compiler has it. Define
+// TINYXML2_NO_THREADS to always work on the calling thread.
+#if !defined(TINYXML2_NO_THREADS) && ( __cplusplus >= 201103L || ( defined(_MSC_VER) && _MSC_VER >= 1900 ) )
+	#define TIXML_THREADS 1
+	#include <thread>
+	#include <mutex>
+	#include <condition_variable>
+#else
+	#define TIXML_THREADS 0
+#endif
+
+// Compressed files are read and written with zlib (gzip) when tinyxml2
+// is built with TINYXML2_ZLIB defined, and with libzstd (zstd) when it
+// is built with TINYXML2_ZSTD.
+#if defined(TINYXML2_ZLIB)
+	#define TIXML_ZLIB 1
+	#include <zlib.h>
+#else
+	#define TIXML_ZLIB 0
+#endif
+#if defined(TINYXML2_ZSTD)
+	#define TIXML_ZSTD 1
+	#include <zstd.h>
+#else
+	#define TIXML_ZSTD 0
+#endif
+
+// XMLPrinter looks for characters to escape 16 at a time with SSE2 where
+// the compiler has it. Define TINYXML2_NO_SIMD to always look at each.
+#if !defined(TINYXML2_NO_SIMD) && ( defined(__SSE2__) || defined(_M_X64) || ( defined(_M_IX86_FP) && _M_IX86_FP >= 2 ) )
+	#define TIXML_SSE2 1
+	#include <emmintrin.h>
+	#if defined(_MSC_VER)
+		#include <intrin.h>
+	#endif
+#else
+	#define TIXML_SSE2 0
+#endif
+
 
 static const char LINE_FEED				= static_cast<char>(0x0a);			// all line endings are normalized to LF
 static const char LF = LINE_FEED;
@@ -199,11 +239,30 @@ void StrPair::Reset()
 }
 
 
-void StrPair::SetStr( const char* str, int flags )
+void StrPair::SetStr( const char* str, int flags, StrArena* arena )
 {
     TIXMLASSERT( str );
-    Reset();
     size_t len = strlen( str );
+    if ( arena ) {
+        // Overwrite the old string if it is in the arena and long enough,
+        // and no clone can be pointing at it.
+        char* mem = 0;
+        if ( ( _flags & IN_ARENA ) && !arena->Shared() && len <= static_cast<size_t>( _end - _start ) ) {
+            mem = _start;
+        }
+        else {
+            mem = arena->Alloc( len+1 );
+        }
+        flags |= EscapeFlags( str, len );
+        memmove( mem, str, len+1 );
+        Reset();
+        _start = mem;
+        _end = mem + len;
+        _flags = flags | IN_ARENA;
+        return;
+    }
+    flags |= EscapeFlags( str, len );
+    Reset();
     TIXMLASSERT( _start == 0 );
     _start = new char[ len+1 ];
     memcpy( _start, str, len+1 );
@@ -212,6 +271,255 @@ void StrPair::SetStr( const char* str, int flags )
 }
 
 
+// What XMLPrinter won't escape in 'str', of 'len' bytes: as TextFlags()
+// finds for parsed text.
+int StrPair::EscapeFlags( const char* str, size_t len )
+{
+    const size_t plain = strcspn( str, "&<>\"'" );
+    if ( plain == len ) {
+        return NO_MARKUP | NO_QUOTES;
+    }
+    return strcspn( str + plain, "&<>" ) == len - plain ? NO_MARKUP : 0;
+}
+
+
+void StrPair::SetShared( StrPair* other, StrArena* arena )
+{
+    TIXMLASSERT( other && other != this );
+    if ( other->_flags & NEEDS_FLUSH ) {
+        other->GetStr();
+    }
+    if ( other->_flags & NEEDS_DELETE ) {
+        SetStr( other->_start, 0, arena );
+        return;
+    }
+    Reset();
+    _start = other->_start;
+    _end = other->_end;
+    _flags = other->_flags & ( NO_MARKUP | NO_QUOTES );
+}
+
+
+// --------- XMLAllocator ----------- //
+
+class DefaultAllocator : public XMLAllocator
+{
+public:
+    virtual void* Allocate( size_t size ) {
+        return new char[size];
+    }
+    virtual void* TryAllocate( size_t size ) {
+        return new (std::nothrow) char[size];
+    }
+    virtual void Deallocate( void* mem, size_t /*size*/ ) {
+        delete [] static_cast<char*>( mem );
+    }
+};
+
+static DefaultAllocator defaultAllocator;
+
+
+/*static*/ XMLAllocator* XMLAllocator::Default()
+{
+    return &defaultAllocator;
+}
+
+
+// --------- StrArena ----------- //
+
+/*static*/ char* StrArena::NewBuffer( XMLAllocator* allocator, size_t size )
+{
+    TIXMLASSERT( allocator );
+    char* buffer = TryNewBuffer( allocator, size );
+    TIXMLASSERT( buffer );
+    return buffer;
+}
+
+
+/*static*/ char* StrArena::TryNewBuffer( XMLAllocator* allocator, size_t size )
+{
+    TIXMLASSERT( allocator );
+    if ( size > static_cast<size_t>(-1) - sizeof( BufferHeader ) ) {
+        return 0;
+    }
+    BufferHeader* header = static_cast<BufferHeader*>( allocator->TryAllocate( sizeof( BufferHeader ) + size ) );
+    if ( !header ) {
+        return 0;
+    }
+    header->allocator = allocator;
+    header->size = size;
+    header->refs = 1;
+    header->holder = 0;
+    return reinterpret_cast<char*>( header + 1 );
+}
+
+
+/*static*/ void StrArena::ReleaseBuffer( char* buffer )
+{
+    TIXMLASSERT( buffer );
+    BufferHeader* header = HeaderOf( buffer );
+    TIXMLASSERT( header->refs > 0 );
+    if ( --header->refs == 0 ) {
+        header->allocator->Deallocate( header, sizeof( BufferHeader ) + header->size );
+    }
+}
+
+
+// Adds 'buffer', which this arena has a reference to, to the chunks.
+void StrArena::Hold( char* buffer )
+{
+    HeaderOf( buffer )->holder = this;
+    _chunks.Push( buffer );
+    _bytes += HeaderOf( buffer )->size;
+}
+
+
+void StrArena::Release( char* buffer )
+{
+    BufferHeader* header = HeaderOf( buffer );
+    if ( header->holder == this ) {
+        header->holder = 0;
+    }
+    ReleaseBuffer( buffer );
+}
+
+
+// Whether 'buffer' is one of the chunks. Shared buffers were held last,
+// so the search starts at the end.
+bool StrArena::Holds( char* buffer ) const
+{
+    if ( HeaderOf( buffer )->holder == this ) {
+        return true;
+    }
+    for( int i = _chunks.Size() - 1; i >= 0; --i ) {
+        if ( _chunks[i] == buffer ) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+void StrArena::Reset()
+{
+    _shared = false;
+    // Keep the largest chunk nothing else refers to.
+    int largest = -1;
+    for( int i = 0; i < _chunks.Size(); ++i ) {
+        const BufferHeader* header = HeaderOf( _chunks[i] );
+        if ( header->refs == 1 && ( largest < 0 || header->size > HeaderOf( _chunks[largest] )->size ) ) {
+            largest = i;
+        }
+    }
+    char* keep = 0;
+    if ( largest >= 0 ) {
+        keep = _chunks[largest];
+        _chunks[largest] = _chunks.PeekTop();
+        _chunks.Pop();
+    }
+    while( !_chunks.Empty() ) {
+        Release( _chunks.Pop() );
+    }
+    _next = 0;
+    _end = 0;
+    _bytes = 0;
+    if ( keep ) {
+        Hold( keep );
+        _next = keep;
+        _end = keep + HeaderOf( keep )->size;
+    }
+}
+
+
+void StrArena::Clear()
+{
+    while( !_chunks.Empty() ) {
+        Release( _chunks.Pop() );
+    }
+    _next = 0;
+    _end = 0;
+    _nextChunkSize = MIN_CHUNK_SIZE;
+    _bytes = 0;
+    _shared = false;
+}
+
+
+void StrArena::Take( StrArena& other )
+{
+    TIXMLASSERT( &other != this );
+    for( int i = 0; i < other._chunks.Size(); ++i ) {
+        Hold( other._chunks[i] );
+    }
+    // Strings moved with the chunks may be pointed at from elsewhere.
+    _shared = _shared || other._shared;
+    other._chunks.Clear();
+    other._next = 0;
+    other._end = 0;
+    other._bytes = 0;
+    other._shared = false;
+}
+
+
+void StrArena::AddBuffer( char* buffer )
+{
+    TIXMLASSERT( buffer );
+    Hold( buffer );
+}
+
+
+void StrArena::Share( StrArena& other )
+{
+    other._shared = true;
+    if ( &other == this ) {
+        return;
+    }
+    for( int i = 0; i < other._chunks.Size(); ++i ) {
+        ShareBuffer( other._chunks[i] );
+    }
+}
+
+
+void StrArena::ShareBuffer( char* buffer )
+{
+    TIXMLASSERT( buffer );
+    if ( Holds( buffer ) ) {
+        // Sharing the same document again is cheap.
+        return;
+    }
+    ++HeaderOf( buffer )->refs;
+    Hold( buffer );
+}
+
+
+void StrArena::SetAllocator( XMLAllocator* allocator )
+{
+    TIXMLASSERT( allocator );
+    TIXMLASSERT( _chunks.Empty() );
+    _allocator = allocator;
+    _chunks.SetAllocator( allocator );
+}
+
+
+char* StrArena::NewChunk( size_t size )
+{
+    if ( size > _nextChunkSize / 4 ) {
+        // A big string gets a chunk of its own, and the current one
+        // stays in use for the small strings that follow.
+        char* mem = NewBuffer( _allocator, size );
+        Hold( mem );
+        return mem;
+    }
+    char* mem = NewBuffer( _allocator, _nextChunkSize );
+    Hold( mem );
+    if ( _nextChunkSize < MAX_CHUNK_SIZE ) {
+        _nextChunkSize *= 2;
+    }
+    _next = mem + size;
+    _end = mem + HeaderOf( mem )->size;
+    return mem;
+}
+
+
 char* StrPair::ParseText( char* p, const char* endTag, int strFlags, int* curLineNumPtr )
 {
     TIXMLASSERT( p );
@@ -221,14 +529,22 @@ char* StrPair::ParseText( char* p, const char* endTag, int strFlags, int* curLin
     char* start = p;
     const char  endChar = *endTag;
     size_t length = strlen( endTag );
+    // The characters below 64 seen, one bit each: the ones decoding
+    // and printing care about all are.
+    uint64_t seen = 0;
 
     // Inner loop of text parsing.
     while ( *p ) {
         if ( *p == endChar && strncmp( p, endTag, length ) == 0 ) {
-            Set( start, p, strFlags );
+            Set( start, p, TextFlags( strFlags, seen ) );
             return p + length;
-        } else if (*p == '\n') {
-            ++(*curLineNumPtr);
+        }
+        const unsigned char c = static_cast<unsigned char>( *p );
+        if ( c < 64 ) {
+            seen |= uint64_t(1) << c;
+            if ( c == '\n' ) {
+                ++(*curLineNumPtr);
+            }
         }
         ++p;
         TIXMLASSERT( p );
@@ -237,6 +553,29 @@ char* StrPair::ParseText( char* p, const char* endTag, int strFlags, int* curLin
 }
 
 
+// The flags of a string with the characters 'seen' (as ParseText() collects
+// them): what decoding is not needed, and what XMLPrinter won't escape.
+int StrPair::TextFlags( int flags, uint64_t seen )
+{
+    static const uint64_t amp = uint64_t(1) << '&';
+    static const uint64_t markup = amp | ( uint64_t(1) << '<' ) | ( uint64_t(1) << '>' );
+    static const uint64_t quotes = ( uint64_t(1) << '"' ) | ( uint64_t(1) << '\'' );
+    if ( !( seen & amp ) ) {
+        flags &= ~NEEDS_ENTITY_PROCESSING;
+    }
+    if ( !( seen & ( uint64_t(1) << CR ) ) ) {
+        flags &= ~NEEDS_NEWLINE_NORMALIZATION;
+    }
+    if ( !( seen & markup ) ) {
+        flags |= NO_MARKUP;
+        if ( !( seen & quotes ) ) {
+            flags |= NO_QUOTES;
+        }
+    }
+    return flags;
+}
+
+
 char* StrPair::ParseName( char* p )
 {
     if ( !p || !(*p) ) {
@@ -294,7 +633,7 @@ const char* StrPair::GetStr()
         *_end = 0;
         _flags ^= NEEDS_FLUSH;
 
-        if ( _flags ) {
+        if ( _flags & ~( NO_MARKUP | NO_QUOTES ) ) {
             const char* p = _start;	// the read pointer
             char* q = _start;	// the write pointer
 
@@ -380,7 +719,7 @@ const char* StrPair::GetStr()
         if ( _flags & NEEDS_WHITESPACE_COLLAPSING ) {
             CollapseWhitespace();
         }
-        _flags = (_flags & NEEDS_DELETE);
+        _flags = (_flags & ( NEEDS_DELETE | NO_MARKUP | NO_QUOTES ));
     }
     TIXMLASSERT( _start );
     return _start;
@@ -806,17 +1145,27 @@ XMLNode::XMLNode( XMLDocument* doc ) :
     _parent( 0 ),
     _value(),
     _parseLineNum( 0 ),
+    _lazy( 0 ),
+    _kind( DOCUMENT_NODE ),
+    _hashOptions( 0 ),
+    _modified( 0 ),
+    _hash( 0 ),
     _firstChild( 0 ), _lastChild( 0 ),
     _prev( 0 ), _next( 0 ),
 	_userData( 0 ),
-    _memPool( 0 )
+    _unlinkedIndex( -1 )
 {
 }
 
 
 XMLNode::~XMLNode()
 {
-    DeleteChildren();
+    // Not DeleteChildren(): a node going away has no hash to drop, and
+    // the document is already gone when its own XMLNode part goes.
+    _lazy &= ~LAZY_CHILDREN;
+    while( _firstChild ) {
+        DeleteChild( _firstChild );
+    }
     if ( _parent ) {
         _parent->Unlink( this );    // todo: 死代码，private无法测到
     }
@@ -836,30 +1185,238 @@ void XMLNode::SetValue( const char* str, bool staticMem )
         _value.SetInternedStr( str );
     }
     else {
-        _value.SetStr( str );
+        _value.SetStr( str, 0, &_document->_strArena );
     }
+    Changed();
 }
 
-XMLNode* XMLNode::DeepClone(XMLDocument* target) const
+// --------- Hash and DeepEqual ----------- //
+
+static const uint64_t FNV_OFFSET = 0xcbf29ce484222325ULL;
+static const uint64_t FNV_PRIME = 0x100000001b3ULL;
+
+// The 64 bit FNV-1a hash of 'str', with its null, continuing from 'h'.
+static uint64_t HashStr( uint64_t h, const char* str )
 {
-	XMLNode* clone = this->ShallowClone(target);
-	if (!clone) return 0;
+    for( const unsigned char* p = reinterpret_cast<const unsigned char*>( str ); ; ++p ) {
+        h = ( h ^ *p ) * FNV_PRIME;
+        if ( !*p ) {
+            break;
+        }
+    }
+    return h;
+}
+
+// As HashStr(), with whitespace trimmed, and runs of it as one space.
+static uint64_t HashCollapsed( uint64_t h, const char* str )
+{
+    const char* p = XMLUtil::SkipWhiteSpace( str, 0 );
+    while ( *p ) {
+        if ( XMLUtil::IsWhiteSpace( *p ) ) {
+            p = XMLUtil::SkipWhiteSpace( p, 0 );
+            if ( !*p ) {
+                break;
+            }
+            h = ( h ^ ' ' ) * FNV_PRIME;
+            continue;
+        }
+        h = ( h ^ static_cast<unsigned char>( *p ) ) * FNV_PRIME;
+        ++p;
+    }
+    return h * FNV_PRIME;   // the null
+}
+
+// Mixes 'v' into 'h' (the finalizer of splitmix64).
+static uint64_t HashCombine( uint64_t h, uint64_t v )
+{
+    uint64_t x = ( h ^ v ) + 0x9e3779b97f4a7c15ULL;
+    x = ( x ^ ( x >> 30 ) ) * 0xbf58476d1ce4e5b9ULL;
+    x = ( x ^ ( x >> 27 ) ) * 0x94d049bb133111ebULL;
+    return x ^ ( x >> 31 );
+}
+
+static bool IsAllWhiteSpace( const char* str )
+{
+    return *XMLUtil::SkipWhiteSpace( str, 0 ) == 0;
+}
+
+// True if 'node' is left out of the comparison of its parent.
+static bool CompareIgnores( const XMLNode* node, int options )
+{
+    if ( ( options & XMLNode::IGNORE_COMMENTS ) && node->ToComment() ) {
+        return true;
+    }
+    return ( options & XMLNode::IGNORE_WHITESPACE ) && node->ToText() && IsAllWhiteSpace( node->Value() );
+}
+
+static const XMLNode* NextCompared( const XMLNode* node, int options )
+{
+    while ( node && CompareIgnores( node, options ) ) {
+        node = node->NextSibling();
+    }
+    return node;
+}
+
+static bool CollapsedEqual( const char* a, const char* b )
+{
+    a = XMLUtil::SkipWhiteSpace( a, 0 );
+    b = XMLUtil::SkipWhiteSpace( b, 0 );
+    while ( *a && *b ) {
+        const bool spaceA = XMLUtil::IsWhiteSpace( *a );
+        const bool spaceB = XMLUtil::IsWhiteSpace( *b );
+        if ( spaceA != spaceB ) {
+            return false;
+        }
+        if ( spaceA ) {
+            a = XMLUtil::SkipWhiteSpace( a, 0 );
+            b = XMLUtil::SkipWhiteSpace( b, 0 );
+            if ( !*a || !*b ) {
+                break;
+            }
+            continue;
+        }
+        if ( *a != *b ) {
+            return false;
+        }
+        ++a;
+        ++b;
+    }
+    return !*XMLUtil::SkipWhiteSpace( a, 0 ) && !*XMLUtil::SkipWhiteSpace( b, 0 );
+}
+
+
+uint64_t XMLNode::Hash( int options ) const
+{
+    TIXMLASSERT( options >= 0 && options < HASH_VALID );
+    if ( _hashOptions == ( options | HASH_VALID ) ) {
+        return _hash;
+    }
+    uint64_t h = HashCombine( FNV_OFFSET, _kind );
+    if ( !ToDocument() ) {
+        h = ( ToText() && ( options & IGNORE_WHITESPACE ) ) ? HashCollapsed( h, Value() ) : HashStr( h, Value() );
+    }
+    if ( const XMLElement* element = ToElement() ) {
+        // Without the order, the hashes of the attributes are added up.
+        uint64_t sum = 0;
+        int count = 0;
+        for( const XMLAttribute* a = element->FirstAttribute(); a; a = a->Next() ) {
+            const uint64_t ah = HashStr( HashStr( FNV_OFFSET, a->Name() ), a->Value() );
+            if ( options & IGNORE_ATTRIBUTE_ORDER ) {
+                sum += HashCombine( 0, ah );
+            }
+            else {
+                h = HashCombine( h, ah );
+            }
+            ++count;
+        }
+        if ( options & IGNORE_ATTRIBUTE_ORDER ) {
+            h = HashCombine( h, sum );
+        }
+        h = HashCombine( h, count );
+    }
+    int count = 0;
+    for( const XMLNode* child = FirstChild(); child; child = child->NextSibling() ) {
+        // Every child is hashed, so that its changes reach this node
+        // even when it doesn't count.
+        const uint64_t ch = child->Hash( options );
+        if ( !CompareIgnores( child, options ) ) {
+            h = HashCombine( h, ch );
+            ++count;
+        }
+    }
+    h = HashCombine( h, count );
+    _hash = h;
+    _hashOptions = static_cast<unsigned char>( options | HASH_VALID );
+    return h;
+}
+
+
+bool XMLNode::DeepEqual( const XMLNode* compare, int options ) const
+{
+    TIXMLASSERT( compare );
+    if ( compare == this ) {
+        return true;
+    }
+    // Hashes already known settle a difference.
+    if ( _hashOptions == ( options | HASH_VALID ) && compare->_hashOptions == _hashOptions && _hash != compare->_hash ) {
+        return false;
+    }
+    if ( _kind != compare->_kind ) {
+        return false;
+    }
+    if ( !ToDocument() ) {
+        const bool equal = ( ToText() && ( options & IGNORE_WHITESPACE ) )
+                           ? CollapsedEqual( Value(), compare->Value() )
+                           : XMLUtil::StringEqual( Value(), compare->Value() );
+        if ( !equal ) {
+            return false;
+        }
+    }
+    if ( const XMLElement* element = ToElement() ) {
+        const XMLElement* other = compare->ToElement();
+        const XMLAttribute* a = element->FirstAttribute();
+        const XMLAttribute* b = other->FirstAttribute();
+        for( ; a && b; a = a->Next(), b = b->Next() ) {
+            const XMLAttribute* match = b;
+            if ( ( options & IGNORE_ATTRIBUTE_ORDER ) && !XMLUtil::StringEqual( a->Name(), b->Name() ) ) {
+                match = other->FindAttribute( a->Name() );
+            }
+            if ( !match || !XMLUtil::StringEqual( a->Name(), match->Name() ) || !XMLUtil::StringEqual( a->Value(), match->Value() ) ) {
+                return false;
+            }
+        }
+        if ( a || b ) {
+            // different count
+            return false;
+        }
+    }
+    const XMLNode* a = NextCompared( FirstChild(), options );
+    const XMLNode* b = NextCompared( compare->FirstChild(), options );
+    while ( a && b ) {
+        if ( !a->DeepEqual( b, options ) ) {
+            return false;
+        }
+        a = NextCompared( a->NextSibling(), options );
+        b = NextCompared( b->NextSibling(), options );
+    }
+    return !a && !b;
+}
+
+
+XMLNode* XMLNode::DeepClone(XMLDocument* target, int threads) const
+{
+	XMLDocument* doc = target ? target : _document;
+	if (threads != 1) {
+		return doc->ParallelClone(this, threads);
+	}
 
-	for (const XMLNode* child = this->FirstChild(); child; child = child->NextSibling()) {
-		XMLNode* childClone = child->DeepClone(target);
-		TIXMLASSERT(childClone);
-		clone->InsertEndChild(childClone);
+	// Share the strings of this document once, rather than for every node.
+	const XMLDocument* sharingFrom = doc->_sharingFrom;
+	doc->ShareStrings(_document);
+	doc->_sharingFrom = _document;
+
+	XMLNode* clone = this->ShallowClone(target);
+	if (clone) {
+		for (const XMLNode* child = this->FirstChild(); child; child = child->NextSibling()) {
+			XMLNode* childClone = child->DeepClone(target);
+			TIXMLASSERT(childClone);
+			clone->InsertEndChild(childClone);
+		}
 	}
+	doc->_sharingFrom = sharingFrom;
 	return clone;
 }
 
 void XMLNode::DeleteChildren()
 {
+    // Children that were never parsed are simply dropped.
+    _lazy &= ~LAZY_CHILDREN;
     while( _firstChild ) {
         TIXMLASSERT( _lastChild );
         DeleteChild( _firstChild );
     }
     _firstChild = _lastChild = 0;
+    Changed();
 }
 
 
@@ -884,6 +1441,7 @@ void XMLNode::Unlink( XMLNode* child )
 	child->_next = 0;
 	child->_prev = 0;
 	child->_parent = 0;
+    Changed();
 }
 
 
@@ -907,6 +1465,7 @@ XMLNode* XMLNode::InsertEndChild( XMLNode* addThis )
         TIXMLASSERT( false );
         return 0;
     }
+    MaterializeChildren();
     InsertChildPreamble( addThis );
 
     if ( _lastChild ) {
@@ -926,6 +1485,7 @@ XMLNode* XMLNode::InsertEndChild( XMLNode* addThis )
         addThis->_next = 0;
     }
     addThis->_parent = this;
+    Changed();
     return addThis;
 }
 
@@ -937,6 +1497,7 @@ XMLNode* XMLNode::InsertFirstChild( XMLNode* addThis )
         TIXMLASSERT( false );
         return 0;
     }
+    MaterializeChildren();
     InsertChildPreamble( addThis );
 
     if ( _firstChild ) {
@@ -957,6 +1518,7 @@ XMLNode* XMLNode::InsertFirstChild( XMLNode* addThis )
         addThis->_next = 0;
     }
     addThis->_parent = this;
+    Changed();
     return addThis;
 }
 
@@ -993,6 +1555,7 @@ XMLNode* XMLNode::InsertAfterChild( XMLNode* afterThis, XMLNode* addThis )
     afterThis->_next->_prev = addThis;
     afterThis->_next = addThis;
     addThis->_parent = this;
+    Changed();
     return addThis;
 }
 
@@ -1001,6 +1564,7 @@ XMLNode* XMLNode::InsertAfterChild( XMLNode* afterThis, XMLNode* addThis )
 
 const XMLElement* XMLNode::FirstChildElement( const char* name ) const
 {
+    MaterializeChildren();
     for( const XMLNode* node = _firstChild; node; node = node->_next ) {
         const XMLElement* element = node->ToElementWithName( name );
         if ( element ) {
@@ -1013,6 +1577,7 @@ const XMLElement* XMLNode::FirstChildElement( const char* name ) const
 
 const XMLElement* XMLNode::LastChildElement( const char* name ) const
 {
+    MaterializeChildren();
     for( const XMLNode* node = _lastChild; node; node = node->_prev ) {
         const XMLElement* element = node->ToElementWithName( name );
         if ( element ) {
@@ -1072,6 +1637,7 @@ char* XMLNode::ParseDeep( char* p, StrPair* parentEndTag, int* curLineNumPtr )
 
 	while( p && *p ) {                  // todo: p 不可能为 NULL
         XMLNode* node = 0;
+        char* const nodeStart = p;
 
         p = _document->Identify( p, &node );
         TIXMLASSERT( p );
@@ -1080,10 +1646,12 @@ char* XMLNode::ParseDeep( char* p, StrPair* parentEndTag, int* curLineNumPtr )
         }
 
        const int initialLineNum = node->_parseLineNum;
+        const int span = _document->_source ? _document->ReserveSpan() : -1;
 
         StrPair endTag;
         p = node->ParseDeep( p, &endTag, curLineNumPtr );
         if ( !p ) {
+            _document->DropSpans( span );
             DeleteNode( node );
             if ( !_document->Error() ) {
                 _document->SetError( XML_ERROR_PARSING, initialLineNum, 0);
@@ -1117,6 +1685,7 @@ char* XMLNode::ParseDeep( char* p, StrPair* parentEndTag, int* curLineNumPtr )
             }
             if ( !wellLocated ) {
                 _document->SetError( XML_ERROR_PARSING_DECLARATION, initialLineNum, "XMLDeclaration value=%s", decl->Value());
+                _document->DropSpans( span );
                 DeleteNode( node );
                 break;
             }
@@ -1129,7 +1698,8 @@ char* XMLNode::ParseDeep( char* p, StrPair* parentEndTag, int* curLineNumPtr )
                 if ( parentEndTag ) {
                     ele->_value.TransferTo( parentEndTag );
                 }
-                node->_memPool->SetTracked();   // created and then immediately deleted.
+                _document->PoolOf( node )->SetTracked();   // created and then immediately deleted.
+                _document->DropSpans( span );
                 DeleteNode( node );
                 return p;
             }
@@ -1152,10 +1722,22 @@ char* XMLNode::ParseDeep( char* p, StrPair* parentEndTag, int* curLineNumPtr )
             }
             if ( mismatch ) {
                 _document->SetError( XML_ERROR_MISMATCHED_ELEMENT, initialLineNum, "XMLElement name=%s", ele->Name());
+                _document->DropSpans( span );
                 DeleteNode( node );
                 break;
             }
         }
+        if ( _document->_source ) {
+            // Text starts where the markup before it ends; the rest
+            // after the whitespace, looked for in the unchanged copy.
+            const XMLText* text = node->ToText();
+            char* start = nodeStart;
+            if ( !text || text->CData() ) {
+                const char* source = _document->_source + ( nodeStart - _document->_charBuffer );
+                start += XMLUtil::SkipWhiteSpace( source, 0 ) - source;
+            }
+            _document->SetSpan( span, node->_value.RawStart(), start, p );
+        }
         InsertEndChild( node );
     }
     return 0;
@@ -1171,11 +1753,39 @@ char* XMLNode::ParseDeep( char* p, StrPair* parentEndTag, int* curLineNumPtr )
 		node->_document->MarkInUse(node);
 	}
 
-    MemPool* pool = node->_memPool;
+    MemPool* pool = node->_document->PoolOf( node );
     node->~XMLNode();
     pool->Free( node );
 }
 
+bool XMLNode::GetSourceSpan( size_t* offset, size_t* length ) const
+{
+    TIXMLASSERT( offset && length );
+    if ( ToDocument() ) {
+        return false;
+    }
+    return _document->FindSpan( _value.RawStart(), offset, length );
+}
+
+
+const char* XMLNode::OuterXML( size_t* length ) const
+{
+    TIXMLASSERT( length );
+    size_t offset = 0;
+    if ( !GetSourceSpan( &offset, length ) ) {
+        return 0;
+    }
+    return _document->_source + offset;
+}
+
+
+void XMLNode::ExpandChildren() const
+{
+    // Only elements are parsed lazily.
+    TIXMLASSERT( ToElement() );
+    static_cast<XMLElement*>( const_cast<XMLNode*>( this ) )->ExpandChildren();
+}
+
 void XMLNode::InsertChildPreamble( XMLNode* insertThis ) const
 {
     TIXMLASSERT( insertThis );
@@ -1186,16 +1796,18 @@ void XMLNode::InsertChildPreamble( XMLNode* insertThis ) const
 	}
 	else {
 		insertThis->_document->MarkInUse(insertThis);
-        insertThis->_memPool->SetTracked();
+        insertThis->_document->PoolOf( insertThis )->SetTracked();
 	}
 }
 
 const XMLElement* XMLNode::ToElementWithName( const char* name ) const
 {
-    const XMLElement* element = this->ToElement();
-    if ( element == 0 ) {
+    // Called for every sibling by the child and sibling element
+    // searches, so test the kind rather than call ToElement().
+    if ( _kind != ELEMENT_NODE ) {
         return 0;
     }
+    const XMLElement* element = static_cast<const XMLElement*>( this );
     if ( name == 0 ) {
         return element;
     }
@@ -1238,7 +1850,7 @@ XMLNode* XMLText::ShallowClone( XMLDocument* doc ) const
     if ( !doc ) {
         doc = _document;
     }
-    XMLText* text = doc->NewText( Value() );	// fixme: this will always allocate memory. Intern?
+    XMLText* text = doc->CreateSharedClone<XMLText>( doc->_textPool, this );
     text->SetCData( this->CData() );
     return text;
 }
@@ -1263,6 +1875,7 @@ bool XMLText::Accept( XMLVisitor* visitor ) const
 
 XMLComment::XMLComment( XMLDocument* doc ) : XMLNode( doc )
 {
+    _kind = COMMENT_NODE;
 }
 
 
@@ -1287,7 +1900,7 @@ XMLNode* XMLComment::ShallowClone( XMLDocument* doc ) const
     if ( !doc ) {
         doc = _document;
     }
-    XMLComment* comment = doc->NewComment( Value() );	// fixme: this will always allocate memory. Intern?
+    XMLComment* comment = doc->CreateSharedClone<XMLComment>( doc->_commentPool, this );
     return comment;
 }
 
@@ -1311,6 +1924,7 @@ bool XMLComment::Accept( XMLVisitor* visitor ) const
 
 XMLDeclaration::XMLDeclaration( XMLDocument* doc ) : XMLNode( doc )
 {
+    _kind = DECLARATION_NODE;
 }
 
 
@@ -1336,7 +1950,7 @@ XMLNode* XMLDeclaration::ShallowClone( XMLDocument* doc ) const
     if ( !doc ) {
         doc = _document;
     }
-    XMLDeclaration* dec = doc->NewDeclaration( Value() );	// fixme: this will always allocate memory. Intern?
+    XMLDeclaration* dec = doc->CreateSharedClone<XMLDeclaration>( doc->_commentPool, this );
     return dec;
 }
 
@@ -1360,6 +1974,7 @@ bool XMLDeclaration::Accept( XMLVisitor* visitor ) const
 
 XMLUnknown::XMLUnknown( XMLDocument* doc ) : XMLNode( doc )
 {
+    _kind = UNKNOWN_NODE;
 }
 
 
@@ -1384,7 +1999,7 @@ XMLNode* XMLUnknown::ShallowClone( XMLDocument* doc ) const
     if ( !doc ) {
         doc = _document;
     }
-    XMLUnknown* text = doc->NewUnknown( Value() );	// fixme: this will always allocate memory. Intern?
+    XMLUnknown* text = doc->CreateSharedClone<XMLUnknown>( doc->_commentPool, this );
     return text;
 }
 
@@ -1443,18 +2058,46 @@ char* XMLAttribute::ParseDeep( char* p, bool processEntities, int* curLineNumPtr
 }
 
 
-void XMLAttribute::SetName( const char* n )
+bool XMLAttribute::GetSourceSpan( size_t* offset, size_t* length ) const
 {
-    _name.SetStr( n );
+    TIXMLASSERT( offset && length );
+    const char* name = _name.RawStart();
+    if ( !_document->FindSpan( name, offset, length ) ) {
+        return false;
+    }
+    // A value that has been set is no longer in the span.
+    const char* value = _value.RawStart();
+    return value > name && value < name + *length;
 }
 
 
-XMLError XMLAttribute::QueryIntValue( int* value ) const
+bool XMLAttribute::GetValueSpan( size_t* offset, size_t* length ) const
 {
-    if ( XMLUtil::ToInt( Value(), value )) {
-        return XML_SUCCESS;
+    TIXMLASSERT( offset && length );
+    size_t start = 0;
+    size_t size = 0;
+    if ( !GetSourceSpan( &start, &size ) ) {
+        return false;
     }
-    return XML_WRONG_ATTRIBUTE_TYPE;
+    *offset = start + ( _value.RawStart() - _name.RawStart() );
+    // Up to the closing quote.
+    *length = start + size - 1 - *offset;
+    return true;
+}
+
+
+void XMLAttribute::SetName( const char* n )
+{
+    _name.SetStr( n, 0, &_document->_strArena );
+}
+
+
+XMLError XMLAttribute::QueryIntValue( int* value ) const
+{
+    if ( XMLUtil::ToInt( Value(), value )) {
+        return XML_SUCCESS;
+    }
+    return XML_WRONG_ATTRIBUTE_TYPE;
 }
 
 
@@ -1514,7 +2157,7 @@ XMLError XMLAttribute::QueryDoubleValue( double* value ) const
 
 void XMLAttribute::SetAttribute( const char* v )
 {
-    _value.SetStr( v );
+    _value.SetStr( v, 0, &_document->_strArena );
 }
 
 
@@ -1522,7 +2165,7 @@ void XMLAttribute::SetAttribute( int v )
 {
     char buf[BUF_SIZE];
     XMLUtil::ToStr( v, buf, BUF_SIZE );
-    _value.SetStr( buf );
+    _value.SetStr( buf, 0, &_document->_strArena );
 }
 
 
@@ -1530,7 +2173,7 @@ void XMLAttribute::SetAttribute( unsigned v )
 {
     char buf[BUF_SIZE];
     XMLUtil::ToStr( v, buf, BUF_SIZE );
-    _value.SetStr( buf );
+    _value.SetStr( buf, 0, &_document->_strArena );
 }
 
 
@@ -1538,14 +2181,14 @@ void XMLAttribute::SetAttribute(int64_t v)
 {
 	char buf[BUF_SIZE];
 	XMLUtil::ToStr(v, buf, BUF_SIZE);
-	_value.SetStr(buf);
+	_value.SetStr(buf, 0, &_document->_strArena);
 }
 
 void XMLAttribute::SetAttribute(uint64_t v)
 {
     char buf[BUF_SIZE];
     XMLUtil::ToStr(v, buf, BUF_SIZE);
-    _value.SetStr(buf);
+    _value.SetStr(buf, 0, &_document->_strArena);
 }
 
 
@@ -1553,29 +2196,32 @@ void XMLAttribute::SetAttribute( bool v )
 {
     char buf[BUF_SIZE];
     XMLUtil::ToStr( v, buf, BUF_SIZE );
-    _value.SetStr( buf );
+    _value.SetStr( buf, 0, &_document->_strArena );
 }
 
 void XMLAttribute::SetAttribute( double v )
 {
     char buf[BUF_SIZE];
     XMLUtil::ToStr( v, buf, BUF_SIZE );
-    _value.SetStr( buf );
+    _value.SetStr( buf, 0, &_document->_strArena );
 }
 
 void XMLAttribute::SetAttribute( float v )
 {
     char buf[BUF_SIZE];
     XMLUtil::ToStr( v, buf, BUF_SIZE );
-    _value.SetStr( buf );
+    _value.SetStr( buf, 0, &_document->_strArena );
 }
 
 
 // --------- XMLElement ---------- //
 XMLElement::XMLElement( XMLDocument* doc ) : XMLNode( doc ),
     _closingType( OPEN ),
+    _lazyLineNum( 0 ),
+    _lazySource( 0 ),
     _rootAttribute( 0 )
 {
+    _kind = ELEMENT_NODE;
 }
 
 
@@ -1591,6 +2237,7 @@ XMLElement::~XMLElement()
 
 const XMLAttribute* XMLElement::FindAttribute( const char* name ) const
 {
+    MaterializeAttributes();
     for( XMLAttribute* a = _rootAttribute; a; a = a->_next ) {
         if ( XMLUtil::StringEqual( a->Name(), name ) ) {
             return a;
@@ -1887,6 +2534,7 @@ float XMLElement::FloatText(float defaultValue) const
 
 XMLAttribute* XMLElement::FindOrCreateAttribute( const char* name )
 {
+    MaterializeAttributes();
     XMLAttribute* last = 0;
     XMLAttribute* attrib = 0;
     for( attrib = _rootAttribute;
@@ -1909,12 +2557,15 @@ XMLAttribute* XMLElement::FindOrCreateAttribute( const char* name )
         }
         attrib->SetName( name );
     }
+    // The caller is about to set the value.
+    Changed();
     return attrib;
 }
 
 
 void XMLElement::DeleteAttribute( const char* name )
 {
+    MaterializeAttributes();
     XMLAttribute* prev = 0;
     for( XMLAttribute* a=_rootAttribute; a; a=a->_next ) {
         if ( XMLUtil::StringEqual( name, a->Name() ) ) {
@@ -1925,6 +2576,7 @@ void XMLElement::DeleteAttribute( const char* name )
                 _rootAttribute = a->_next;
             }
             DeleteAttribute( a );
+            Changed();
             break;
         }
         prev = a;
@@ -1951,6 +2603,7 @@ char* XMLElement::ParseAttributes( char* p, int* curLineNumPtr )
             attrib->_parseLineNum = _document->_parseCurLineNum;
 
             const int attrLineNum = attrib->_parseLineNum;
+            char* const attrStart = p;
 
             p = attrib->ParseDeep( p, _document->ProcessEntities(), curLineNumPtr );
             if ( !p || Attribute( attrib->Name() ) ) {
@@ -1958,6 +2611,9 @@ char* XMLElement::ParseAttributes( char* p, int* curLineNumPtr )
                 _document->SetError( XML_ERROR_PARSING_ATTRIBUTE, attrLineNum, "XMLElement name=%s", Name() );
                 return 0;
             }
+            if ( _document->_source ) {
+                _document->AddSpan( attrStart, attrStart, p );
+            }
             // There is a minor bug here: if the attribute in the source xml
             // document is duplicated, it will not be detected and the
             // attribute will be doubly added. However, tracking the 'prevAttribute'
@@ -1996,9 +2652,9 @@ void XMLElement::DeleteAttribute( XMLAttribute* attribute )
     if ( attribute == 0 ) {
         return;         // todo: 不可达，所有调用DeleteAttribute的地方都保证了 attribute != 0
     }
-    MemPool* pool = attribute->_memPool;
+    XMLDocument* doc = attribute->_document;
     attribute->~XMLAttribute();
-    pool->Free( attribute );
+    doc->_attributePool.Free( attribute );
 }
 
 XMLAttribute* XMLElement::CreateAttribute()
@@ -2006,8 +2662,8 @@ XMLAttribute* XMLElement::CreateAttribute()
     TIXMLASSERT( sizeof( XMLAttribute ) == _document->_attributePool.ItemSize() );
     XMLAttribute* attrib = new (_document->_attributePool.Alloc() ) XMLAttribute();
     TIXMLASSERT( attrib );
-    attrib->_memPool = &_document->_attributePool;
-    attrib->_memPool->SetTracked();
+    attrib->_document = _document;
+    _document->_attributePool.SetTracked();
     return attrib;
 }
 
@@ -2061,11 +2717,16 @@ char* XMLElement::ParseDeep( char* p, StrPair* parentEndTag, int* curLineNumPtr
         ++p;
     }
 
+    char* const nameStart = p;
     p = _value.ParseName( p );
     if ( _value.Empty() ) {
         return 0;
     }
 
+    if ( _document->LazyParsing() && _closingType == OPEN ) {
+        return ParseLazy( p, nameStart, parentEndTag, curLineNumPtr );
+    }
+
     p = ParseAttributes( p, curLineNumPtr );
     if ( !p || !*p || _closingType != OPEN ) {
         return p;
@@ -2077,14 +2738,243 @@ char* XMLElement::ParseDeep( char* p, StrPair* parentEndTag, int* curLineNumPtr
 
 
 
+// Steps over the rest of a tag, honoring quoted attribute values.
+// Returns the closing '>' or null if the tag is not terminated.
+static char* SkipTag( char* p, int* curLineNumPtr )
+{
+    while ( *p && *p != '>' ) {
+        if ( *p == SINGLE_QUOTE || *p == DOUBLE_QUOTE ) {
+            const char quote = *p;
+            ++p;
+            while ( *p && *p != quote ) {
+                if ( *p == LF ) {
+                    ++(*curLineNumPtr);
+                }
+                ++p;
+            }
+            if ( !*p ) {
+                return 0;
+            }
+        }
+        else if ( *p == LF ) {
+            ++(*curLineNumPtr);
+        }
+        ++p;
+    }
+    return *p ? p : 0;
+}
+
+
+// Returns the character after 'endTag', or null if it is not found.
+static char* SkipPast( char* p, const char* endTag, int* curLineNumPtr )
+{
+    const size_t length = strlen( endTag );
+    while ( *p ) {
+        if ( *p == *endTag && strncmp( p, endTag, length ) == 0 ) {
+            return p + length;
+        }
+        if ( *p == LF ) {
+            ++(*curLineNumPtr);
+        }
+        ++p;
+    }
+    return 0;
+}
+
+
+// Finds the end tag of an element whose content starts at 'p' by
+// tracking the nesting depth; nothing is parsed or allocated. Returns the
+// '<' of the end tag, with the line number counted up to it, or null.
+static char* FindEndTag( char* p, int* curLineNumPtr )
+{
+    int depth = 1;
+    while ( p ) {
+        while ( *p && *p != '<' ) {
+            if ( *p == LF ) {
+                ++(*curLineNumPtr);
+            }
+            ++p;
+        }
+        if ( !*p ) {
+            return 0;
+        }
+        // Same order as XMLDocument::Identify()
+        if ( XMLUtil::StringEqual( p, "<?", 2 ) ) {
+            p = SkipPast( p + 2, "?>", curLineNumPtr );
+        }
+        else if ( XMLUtil::StringEqual( p, "<!--", 4 ) ) {
+            p = SkipPast( p + 4, "-->", curLineNumPtr );
+        }
+        else if ( XMLUtil::StringEqual( p, "<![CDATA[", 9 ) ) {
+            p = SkipPast( p + 9, "]]>", curLineNumPtr );
+        }
+        else if ( XMLUtil::StringEqual( p, "<!", 2 ) ) {
+            p = SkipPast( p + 2, ">", curLineNumPtr );
+        }
+        else {
+            char* const tagStart = p;
+            const int tagLineNum = *curLineNumPtr;
+            p = XMLUtil::SkipWhiteSpace( p + 1, curLineNumPtr );
+            const bool closing = ( *p == '/' );
+            p = SkipTag( p, curLineNumPtr );
+            if ( !p ) {
+                return 0;
+            }
+            if ( closing ) {
+                if ( --depth == 0 ) {
+                    *curLineNumPtr = tagLineNum;
+                    return tagStart;
+                }
+            }
+            else if ( *(p-1) != '/' ) {
+                ++depth;
+            }
+            ++p;
+        }
+    }
+    return 0;
+}
+
+
+// Lazy counterpart of the tail of ParseDeep(): 'p' is just past the
+// element name. The start tag and the content are located and recorded
+// but not parsed; see ExpandAttributes() and ExpandChildren().
+char* XMLElement::ParseLazy( char* p, const char* nameStart, StrPair* parentEndTag, int* curLineNumPtr )
+{
+    char* const nameEnd = p;
+    if ( XMLUtil::IsWhiteSpace( *p ) ) {
+        // Reading the name writes its terminator over this character,
+        // so the attributes are kept from the one after it.
+        if ( *p == LF ) {
+            ++(*curLineNumPtr);
+        }
+        ++p;
+        _lazySource = p;
+        _lazyLineNum = *curLineNumPtr;
+        char* const tagEnd = SkipTag( p, curLineNumPtr );
+        if ( !tagEnd ) {
+            _document->SetError( XML_ERROR_PARSING_ELEMENT, _parseLineNum, "XMLElement name=%s", Name() );
+            return 0;
+        }
+        if ( *(tagEnd-1) == '/' ) {
+            _closingType = CLOSED;
+        }
+        const char* const firstAttribute = XMLUtil::SkipWhiteSpace( p, 0 );
+        if ( firstAttribute < ( _closingType == CLOSED ? tagEnd - 1 : tagEnd ) ) {
+            _lazy |= LAZY_ATTRIBUTES;
+        }
+        p = tagEnd + 1;
+    }
+    else if ( *p == '>' ) {
+        ++p;
+    }
+    else if ( *p == '/' && *(p+1) == '>' ) {
+        _closingType = CLOSED;
+        return p+2;
+    }
+    else {
+        // Malformed; the attribute parser reports it.
+        return ParseAttributes( p, curLineNumPtr );
+    }
+    if ( _closingType == CLOSED ) {
+        return p;
+    }
+
+    char* const contentStart = p;
+    const int contentLineNum = *curLineNumPtr;
+    char* const endTag = FindEndTag( p, curLineNumPtr );
+    if ( !endTag ) {
+        _document->SetError( XML_ERROR_MISMATCHED_ELEMENT, _parseLineNum, "XMLElement name=%s", Name() );
+        return 0;
+    }
+    const char* q = XMLUtil::SkipWhiteSpace( endTag + 1, 0 );
+    TIXMLASSERT( *q == '/' );
+    ++q;
+    const size_t nameLength = nameEnd - nameStart;
+    if ( strncmp( q, nameStart, nameLength ) != 0 || XMLUtil::IsNameChar( static_cast<unsigned char>( q[nameLength] ) ) ) {
+        _document->SetError( XML_ERROR_MISMATCHED_ELEMENT, _parseLineNum, "XMLElement name=%s", Name() );
+        return 0;
+    }
+
+    if ( endTag != contentStart ) {
+        _lazy |= LAZY_CHILDREN;
+        if ( !( _lazy & LAZY_ATTRIBUTES ) ) {
+            _lazySource = contentStart;
+            _lazyLineNum = contentLineNum;
+        }
+    }
+    p = SkipTag( endTag, curLineNumPtr );
+    TIXMLASSERT( p );
+    // The end tag has been matched against the name above. Hand the name
+    // back as the end tag so the caller's check passes without re-reading.
+    parentEndTag->Set( const_cast<char*>( nameStart ), nameEnd, 0 );
+    return p + 1;
+}
+
+
+void XMLElement::ExpandAttributes()
+{
+    TIXMLASSERT( _lazy & LAZY_ATTRIBUTES );
+    _lazy &= ~LAZY_ATTRIBUTES;
+
+    const int savedLineNum = _document->_parseCurLineNum;
+    _document->_parseCurLineNum = _lazyLineNum;
+    char* const p = ParseAttributes( _lazySource, &_document->_parseCurLineNum );
+    if ( !p ) {
+        // The tag is damaged; there is no reliable way to its content.
+        _lazy &= ~LAZY_CHILDREN;
+    }
+    else if ( _lazy & LAZY_CHILDREN ) {
+        _lazySource = p;
+        _lazyLineNum = _document->_parseCurLineNum;
+    }
+    _document->_parseCurLineNum = savedLineNum;
+}
+
+
+void XMLElement::ExpandChildren()
+{
+    TIXMLASSERT( _lazy & LAZY_CHILDREN );
+    _lazy &= ~LAZY_CHILDREN;
+
+    const int savedLineNum = _document->_parseCurLineNum;
+    _document->_parseCurLineNum = _lazyLineNum;
+    char* p = _lazySource;
+    if ( _lazy & LAZY_ATTRIBUTES ) {
+        // Step over the unread attributes.
+        p = SkipTag( p, &_document->_parseCurLineNum );
+        TIXMLASSERT( p );
+        ++p;
+    }
+    StrPair endTag;
+    p = XMLNode::ParseDeep( p, &endTag, &_document->_parseCurLineNum );
+    if ( !p ) {
+        // Don't leave a partial subtree behind. The error has been set.
+        DeleteChildren();
+    }
+    _document->_parseCurLineNum = savedLineNum;
+}
+
+
 XMLNode* XMLElement::ShallowClone( XMLDocument* doc ) const
 {
     if ( !doc ) {
         doc = _document;
     }
-    XMLElement* element = doc->NewElement( Value() );					// fixme: this will always allocate memory. Intern?
+    XMLElement* element = doc->CreateSharedClone<XMLElement>( doc->_elementPool, this );
+    // The attributes are already unique, so they are appended in order.
+    XMLAttribute* last = 0;
     for( const XMLAttribute* a=FirstAttribute(); a; a=a->Next() ) {
-        element->SetAttribute( a->Name(), a->Value() );					// fixme: this will always allocate memory. Intern?
+        XMLAttribute* attrib = element->CreateAttribute();
+        attrib->_name.SetShared( &a->_name, &doc->_strArena );
+        attrib->_value.SetShared( &a->_value, &doc->_strArena );
+        if ( last ) {
+            last->_next = attrib;
+        }
+        else {
+            element->_rootAttribute = attrib;
+        }
+        last = attrib;
     }
     return element;
 }
@@ -2119,7 +3009,7 @@ bool XMLElement::ShallowEqual( const XMLNode* compare ) const
 bool XMLElement::Accept( XMLVisitor* visitor ) const
 {
     TIXMLASSERT( visitor );
-    if ( visitor->VisitEnter( *this, _rootAttribute ) ) {   // todo: false分支不可达，程序中没有能使 visitor->VisitEnter 为 false 的东西
+    if ( visitor->VisitEnter( *this, FirstAttribute() ) ) {   // todo: false分支不可达，程序中没有能使 visitor->VisitEnter 为 false 的东西
         for ( const XMLNode* node=FirstChild(); node; node=node->NextSibling() ) {
             if ( !node->Accept( visitor ) ) {           // todo: 不可达，程序中没有能使 visitor->Visit 为 false 的东西
                 break;
@@ -2152,7 +3042,10 @@ const char* XMLDocument::_errorNames[XML_ERROR_COUNT] = {
     "XML_ERROR_PARSING",
     "XML_CAN_NOT_CONVERT_TEXT",
     "XML_NO_TEXT_NODE",
-	"XML_ELEMENT_DEPTH_EXCEEDED"
+	"XML_ELEMENT_DEPTH_EXCEEDED",
+    "XML_ERROR_BAD_SNAPSHOT",
+    "XML_ERROR_BAD_PATCH",
+    "XML_ERROR_COMPRESSION"
 };
 
 
@@ -2160,18 +3053,27 @@ XMLDocument::XMLDocument( bool processEntities, Whitespace whitespaceMode ) :
     XMLNode( 0 ),
     _writeBOM( false ),
     _processEntities( processEntities ),
+    _lazyParsing( false ),
+    _trackSpans( false ),
     _errorID(XML_SUCCESS),
     _whitespaceMode( whitespaceMode ),
     _errorStr(),
     _errorLineNum( 0 ),
     _charBuffer( 0 ),
+    _charBufferSize( 0 ),
     _parseCurLineNum( 0 ),
 	_parsingDepth(0),
     _unlinked(),
     _elementPool(),
     _attributePool(),
     _textPool(),
-    _commentPool()
+    _commentPool(),
+    _strArena(),
+    _allocator( XMLAllocator::Default() ),
+    _sharingFrom( 0 ),
+    _source( 0 ),
+    _spans(),
+    _spansSorted( true )
 {
     // avoid VC++ C4355 warning about 'this' in initializer list (C4355 is off by default in VS2012+)
     _document = this;
@@ -2184,17 +3086,36 @@ XMLDocument::~XMLDocument()
 }
 
 
-void XMLDocument::MarkInUse(const XMLNode* const node)
+void XMLDocument::MarkInUse(XMLNode* node)
 {
 	TIXMLASSERT(node);
 	TIXMLASSERT(node->_parent == 0);
 
-	for (int i = 0; i < _unlinked.Size(); ++i) {
-		if (node == _unlinked[i]) {
-			_unlinked.SwapRemove(i);
-			break;
-		}
+	// The node knows where it is in _unlinked, so there is no search.
+	const int i = node->_unlinkedIndex;
+	if (i < 0) {
+		return;
 	}
+	TIXMLASSERT(_unlinked[i] == node);
+	_unlinked.SwapRemove(i);
+	if (i < _unlinked.Size()) {
+		_unlinked[i]->_unlinkedIndex = i;
+	}
+	node->_unlinkedIndex = -1;
+}
+
+
+MemPool* XMLDocument::PoolOf( const XMLNode* node )
+{
+    TIXMLASSERT( node && node->_document == this );
+    switch ( node->_kind ) {
+        case ELEMENT_NODE:  return &_elementPool;
+        case TEXT_NODE:     return &_textPool;
+        default:            break;
+    }
+    // Comments, declarations and unknowns share a pool.
+    TIXMLASSERT( node->_kind != DOCUMENT_NODE );
+    return &_commentPool;
 }
 
 void XMLDocument::Clear()
@@ -2209,9 +3130,20 @@ void XMLDocument::Clear()
 #endif
     ClearError();
 
-    delete [] _charBuffer;
+    if ( _charBuffer ) {
+        StrArena::ReleaseBuffer( _charBuffer );
+    }
     _charBuffer = 0;
+    _charBufferSize = 0;
 	_parsingDepth = 0;
+    if ( _source ) {
+        StrArena::ReleaseBuffer( _source );
+        _source = 0;
+    }
+    _spans.Clear();
+    _spansSorted = true;
+    // Emptying it is not a change to what the next load brings.
+    _modified = 0;
 
 #if 0
     _textPool.Trace( "text" );
@@ -2228,10 +3160,73 @@ void XMLDocument::Clear()
         TIXMLASSERT( _commentPool.CurrentAllocs()   == _commentPool.Untracked() );
     }
 #endif
+    // Every node is gone, so the pools can drop them all at once.
+    _elementPool.Reset();
+    _attributePool.Reset();
+    _textPool.Reset();
+    _commentPool.Reset();
+    _strArena.Reset();
+}
+
+
+// Number of pool items that fit in 'bytes', at least one.
+static int PoolItems( int bytes, int itemSize )
+{
+    const int items = bytes / itemSize;
+    return items > 0 ? items : 1;
+}
+
+
+void XMLDocument::SetAllocator( XMLAllocator* allocator )
+{
+    if ( !allocator ) {
+        allocator = XMLAllocator::Default();
+    }
+    Clear();
+    _elementPool.Clear();
+    _attributePool.Clear();
+    _textPool.Clear();
+    _commentPool.Clear();
+    _strArena.Clear();
+
+    _allocator = allocator;
+    _elementPool.SetAllocator( allocator );
+    _attributePool.SetAllocator( allocator );
+    _textPool.SetAllocator( allocator );
+    _commentPool.SetAllocator( allocator );
+    _strArena.SetAllocator( allocator );
+    _unlinked.SetAllocator( allocator );
+}
+
+
+void XMLDocument::GetPoolStats( MemPoolStats* elements, MemPoolStats* attributes, MemPoolStats* texts, MemPoolStats* comments ) const
+{
+    if ( elements ) {
+        _elementPool.GetStats( elements );
+    }
+    if ( attributes ) {
+        _attributePool.GetStats( attributes );
+    }
+    if ( texts ) {
+        _textPool.GetStats( texts );
+    }
+    if ( comments ) {
+        _commentPool.GetStats( comments );
+    }
+}
+
+
+void XMLDocument::SetPoolBlockSize( int bytes, int maxBytes )
+{
+    TIXMLASSERT( bytes > 0 && bytes <= maxBytes );
+    _elementPool.SetBlockSize( PoolItems( bytes, _elementPool.ItemSize() ), PoolItems( maxBytes, _elementPool.ItemSize() ) );
+    _attributePool.SetBlockSize( PoolItems( bytes, _attributePool.ItemSize() ), PoolItems( maxBytes, _attributePool.ItemSize() ) );
+    _textPool.SetBlockSize( PoolItems( bytes, _textPool.ItemSize() ), PoolItems( maxBytes, _textPool.ItemSize() ) );
+    _commentPool.SetBlockSize( PoolItems( bytes, _commentPool.ItemSize() ), PoolItems( maxBytes, _commentPool.ItemSize() ) );
 }
 
 
-void XMLDocument::DeepCopy(XMLDocument* target) const
+void XMLDocument::DeepCopy(XMLDocument* target, int threads) const
 {
 	TIXMLASSERT(target);
     if (target == this) {
@@ -2240,157 +3235,626 @@ void XMLDocument::DeepCopy(XMLDocument* target) const
 
 	target->Clear();
 	for (const XMLNode* node = this->FirstChild(); node; node = node->NextSibling()) {
-		target->InsertEndChild(node->DeepClone(target));
+		target->InsertEndChild(node->DeepClone(target, threads));
 	}
 }
 
-XMLElement* XMLDocument::NewElement( const char* name )
-{
-    XMLElement* ele = CreateUnlinkedNode<XMLElement>( _elementPool );
-    ele->SetName( name );
-    return ele;
-}
 
+// --------- Parallel clone ----------- //
+//
+// ParallelClone() first reads the whole source on the calling thread, so
+// that lazily parsed content is expanded and the strings are decoded;
+// after that the source is only read. The top of the tree is cloned on
+// the calling thread, down to runs of siblings small enough to be work
+// units. The units are shared out between the threads, which clone them
+// with pools of their own into chains of siblings. Then the calling
+// thread links the chains in, in document order, and the document takes
+// over the pools.
+
+namespace {
+
+// Siblings cloned together on one thread.
+struct CloneUnit
+{
+    const XMLNode*  source;     // the first of them
+    int             count;
+    int             size;       // in nodes
+    XMLNode*        parent;     // the clone they go under
+    XMLNode*        first;      // the clones
+    XMLNode*        last;
+};
 
-XMLComment* XMLDocument::NewComment( const char* str )
+// A child at the top of the tree: 'child' is a clone made on the
+// calling thread, or null for units[unit].
+struct CloneLink
 {
-    XMLComment* comment = CreateUnlinkedNode<XMLComment>( _commentPool );
-    comment->SetValue( str );
-    return comment;
-}
+    XMLNode*    parent;
+    XMLNode*    child;
+    int         unit;
+};
 
+} // namespace
 
-XMLText* XMLDocument::NewText( const char* str )
+struct XMLDocument::CloneJob
 {
-    XMLText* text = CreateUnlinkedNode<XMLText>( _textPool );
-    text->SetValue( str );
-    return text;
-}
-
+    DynArray<int, 64>       sizes;      // subtree sizes, in document order
+    DynArray<CloneUnit, 64> units;
+    DynArray<CloneLink, 64> links;
+    int                     grain;
+};
 
-XMLDeclaration* XMLDocument::NewDeclaration( const char* str )
+struct XMLDocument::CloneWorker
 {
-    XMLDeclaration* dec = CreateUnlinkedNode<XMLDeclaration>( _commentPool );
-    dec->SetValue( str ? str : "xml version=\"1.0\" encoding=\"UTF-8\"" );
-    return dec;
-}
+    MemPoolT< sizeof(XMLElement) >	 elements;
+    MemPoolT< sizeof(XMLAttribute) > attributes;
+    MemPoolT< sizeof(XMLText) >		 texts;
+    MemPoolT< sizeof(XMLComment) >	 comments;
+    StrArena    strings;        // for strings that can't be shared
+    CloneUnit*  units;
+    int         count;
+};
 
+// Trees of fewer nodes than this are cloned on one thread.
+static const int MIN_PARALLEL_CLONE = 4096;
 
-XMLUnknown* XMLDocument::NewUnknown( const char* str )
+// Reads 'node' and its subtree, and pushes the number of nodes in each
+// subtree in document order. Returns the number for 'node'.
+static int PrepareClone( const XMLNode* node, DynArray<int, 64>* sizes )
 {
-    XMLUnknown* unk = CreateUnlinkedNode<XMLUnknown>( _commentPool );
-    unk->SetValue( str );
-    return unk;
+    const int index = sizes->Size();
+    sizes->Push( 0 );
+    node->Value();
+    if ( const XMLElement* element = node->ToElement() ) {
+        for( const XMLAttribute* a = element->FirstAttribute(); a; a = a->Next() ) {
+            a->Name();
+            a->Value();
+        }
+    }
+    int size = 1;
+    for( const XMLNode* child = node->FirstChild(); child; child = child->NextSibling() ) {
+        size += PrepareClone( child, sizes );
+    }
+    (*sizes)[index] = size;
+    return size;
 }
 
-static FILE* callfopen( const char* filepath, const char* mode )
+
+XMLNode* XMLDocument::ParallelClone( const XMLNode* node, int threads )
 {
-    TIXMLASSERT( filepath );
-    TIXMLASSERT( mode );
-#if defined(_MSC_VER) && (_MSC_VER >= 1400 ) && (!defined WINCE)
-    FILE* fp = 0;
-    const errno_t err = fopen_s( &fp, filepath, mode );
-    if ( err ) {
-        return 0;
+    TIXMLASSERT( node );
+#if TIXML_THREADS
+    if ( threads <= 0 ) {
+        threads = static_cast<int>( std::thread::hardware_concurrency() );
     }
 #else
-    FILE* fp = fopen( filepath, mode );
+    threads = 1;
 #endif
-    return fp;
+    // Other allocators aren't known to be safe to call from other threads.
+    if ( threads <= 1 || _allocator != XMLAllocator::Default() || node->ToDocument() ) {
+        return node->DeepClone( this, 1 );
+    }
+    CloneJob job;
+    const int total = PrepareClone( node, &job.sizes );
+    if ( total < MIN_PARALLEL_CLONE ) {
+        return node->DeepClone( this, 1 );
+    }
+
+    XMLDocument* source = node->_document;
+    const XMLDocument* sharingFrom = _sharingFrom;
+    ShareStrings( source );
+    _sharingFrom = source;
+
+    // A few units per thread even out their sizes.
+    job.grain = total / ( threads * 8 ) + 1;
+    XMLNode* clone = node->ShallowClone( this );
+    const int end = CloneTop( node, clone, 0, &job );
+    TIXMLASSERT( end == job.sizes.Size() );
+    (void)end;
+
+    // Give each thread a run of units of about the same total size.
+    const int units = job.units.Size();
+    TIXMLASSERT( units > 0 );
+    if ( threads > units ) {
+        threads = units;
+    }
+    CloneWorker* workers = new CloneWorker[threads];
+    int unit = 0;
+    int done = 0;
+    for( int i = 0; i < threads; ++i ) {
+        CloneWorker& worker = workers[i];
+        worker.elements.SetAllocator( _allocator );
+        worker.attributes.SetAllocator( _allocator );
+        worker.texts.SetAllocator( _allocator );
+        worker.comments.SetAllocator( _allocator );
+        worker.strings.SetAllocator( _allocator );
+        worker.units = unit < units ? &job.units[unit] : 0;
+        worker.count = 0;
+        const int64_t share = static_cast<int64_t>( total ) * ( i + 1 ) / threads;
+        while( unit < units && ( done < share || i == threads - 1 ) ) {
+            done += job.units[unit].size;
+            ++unit;
+            ++worker.count;
+        }
+    }
+    TIXMLASSERT( unit == units );
+
+#if TIXML_THREADS
+    std::thread* running = new std::thread[threads];
+    for( int i = 1; i < threads; ++i ) {
+        running[i] = std::thread( &XMLDocument::CloneUnits, this, &workers[i] );
+    }
+    CloneUnits( &workers[0] );
+    for( int i = 1; i < threads; ++i ) {
+        running[i].join();
+    }
+    delete [] running;
+#else
+    CloneUnits( &workers[0] );
+#endif
+
+    for( int i = 0; i < job.links.Size(); ++i ) {
+        const CloneLink& link = job.links[i];
+        XMLNode* parent = link.parent;
+        if ( link.child ) {
+            parent->InsertEndChild( link.child );
+            continue;
+        }
+        // Append the chain of siblings.
+        const CloneUnit& chain = job.units[link.unit];
+        chain.first->_prev = parent->_lastChild;
+        if ( parent->_lastChild ) {
+            parent->_lastChild->_next = chain.first;
+        }
+        else {
+            parent->_firstChild = chain.first;
+        }
+        parent->_lastChild = chain.last;
+    }
+    for( int i = 0; i < threads; ++i ) {
+        _elementPool.Take( workers[i].elements );
+        _attributePool.Take( workers[i].attributes );
+        _textPool.Take( workers[i].texts );
+        _commentPool.Take( workers[i].comments );
+        _strArena.Take( workers[i].strings );
+    }
+    delete [] workers;
+    _sharingFrom = sharingFrom;
+    return clone;
+}
+
+
+// Clones the children of 'node', which is job->sizes[index], under its
+// clone: on this thread if they are bigger than a unit, or else in runs
+// of siblings as units. Returns the index of the node after its subtree.
+int XMLDocument::CloneTop( const XMLNode* node, XMLNode* clone, int index, CloneJob* job )
+{
+    ++index;
+    int run = -1;
+    for( const XMLNode* child = node->_firstChild; child; child = child->_next ) {
+        const int size = job->sizes[index];
+        CloneLink link;
+        link.parent = clone;
+        link.child = 0;
+        link.unit = -1;
+        if ( size > job->grain ) {
+            run = -1;
+            link.child = child->ShallowClone( this );
+            job->links.Push( link );
+            index = CloneTop( child, link.child, index, job );
+            continue;
+        }
+        if ( run < 0 || job->units[run].size + size > job->grain ) {
+            CloneUnit unit;
+            unit.source = child;
+            unit.count = 0;
+            unit.size = 0;
+            unit.parent = clone;
+            unit.first = unit.last = 0;
+            run = job->units.Size();
+            job->units.Push( unit );
+            link.unit = run;
+            job->links.Push( link );
+        }
+        ++job->units[run].count;
+        job->units[run].size += size;
+        index += size;
+    }
+    return index;
 }
 
-void XMLDocument::DeleteNode( XMLNode* node )	{
-    TIXMLASSERT( node );
-    TIXMLASSERT(node->_document == this );
-    if (node->_parent) {
-        node->_parent->DeleteChild( node );
+
+void XMLDocument::CloneUnits( CloneWorker* worker )
+{
+    for( int i = 0; i < worker->count; ++i ) {
+        CloneUnit& unit = worker->units[i];
+        const XMLNode* source = unit.source;
+        XMLNode* prev = 0;
+        for( int n = 0; n < unit.count; ++n, source = source->_next ) {
+            XMLNode* clone = CloneSubtree( source, 0, worker );
+            clone->_parent = unit.parent;
+            clone->_prev = prev;
+            if ( prev ) {
+                prev->_next = clone;
+            }
+            else {
+                unit.first = clone;
+            }
+            prev = clone;
+        }
+        unit.last = prev;
+    }
+}
+
+
+// Clones 'node' and its subtree, as the last child of 'parent', or for
+// the caller to link, with the pools of 'worker'. Nothing of the document
+// is changed, so this can run on any thread.
+XMLNode* XMLDocument::CloneSubtree( const XMLNode* node, XMLNode* parent, CloneWorker* worker )
+{
+    XMLNode* clone = 0;
+    switch ( node->_kind ) {
+        case ELEMENT_NODE:
+        {
+            XMLElement* element = parent ? CreateLastChild<XMLElement>( worker->elements, parent ) : CreateLinkedNode<XMLElement>( worker->elements );
+            XMLAttribute* last = 0;
+            for( const XMLAttribute* a = static_cast<const XMLElement*>( node )->_rootAttribute; a; a = a->_next ) {
+                XMLAttribute* attrib = new (worker->attributes.Alloc()) XMLAttribute();
+                worker->attributes.SetTracked();
+                attrib->_document = this;
+                attrib->_name.SetShared( &a->_name, &worker->strings );
+                attrib->_value.SetShared( &a->_value, &worker->strings );
+                if ( last ) {
+                    last->_next = attrib;
+                }
+                else {
+                    element->_rootAttribute = attrib;
+                }
+                last = attrib;
+            }
+            clone = element;
+            break;
+        }
+        case TEXT_NODE:
+        {
+            XMLText* text = parent ? CreateLastChild<XMLText>( worker->texts, parent ) : CreateLinkedNode<XMLText>( worker->texts );
+            text->SetCData( static_cast<const XMLText*>( node )->CData() );
+            clone = text;
+            break;
+        }
+        case COMMENT_NODE:
+            clone = parent ? CreateLastChild<XMLComment>( worker->comments, parent ) : CreateLinkedNode<XMLComment>( worker->comments );
+            break;
+        case DECLARATION_NODE:
+            clone = parent ? CreateLastChild<XMLDeclaration>( worker->comments, parent ) : CreateLinkedNode<XMLDeclaration>( worker->comments );
+            break;
+        default:
+            TIXMLASSERT( node->_kind == UNKNOWN_NODE );
+            clone = parent ? CreateLastChild<XMLUnknown>( worker->comments, parent ) : CreateLinkedNode<XMLUnknown>( worker->comments );
+            break;
     }
-    else {
-        // Isn't in the tree.
-        // Use the parent delete.
-        // Also, we need to mark it tracked: we 'know'
-        // it was never used.
-        node->_memPool->SetTracked();
-        // Call the static XMLNode version:
-        XMLNode::DeleteNode(node);
+    clone->_value.SetShared( &node->_value, &worker->strings );
+    for( const XMLNode* child = node->_firstChild; child; child = child->_next ) {
+        CloneSubtree( child, clone, worker );
     }
+    return clone;
 }
 
 
-XMLError XMLDocument::LoadFile( const char* filename )
+// Keeps the strings of 'source' alive as long as the nodes of this
+// document may point at them.
+void XMLDocument::ShareStrings( XMLDocument* source )
 {
-    if ( !filename ) {
-        TIXMLASSERT( false );
-        SetError( XML_ERROR_FILE_COULD_NOT_BE_OPENED, 0, "filename=<null>" );
-        return _errorID;
+    TIXMLASSERT( source );
+    if ( source == _sharingFrom ) {
+        return;
+    }
+    _strArena.Share( source->_strArena );
+    if ( source != this && source->_charBuffer ) {
+        _strArena.ShareBuffer( source->_charBuffer );
     }
+}
 
-    Clear();
-    FILE* fp = callfopen( filename, "rb" );
-    if ( !fp ) {
-        SetError( XML_ERROR_FILE_NOT_FOUND, 0, "filename=%s", filename );
-        return _errorID;
+
+XMLNode* XMLDocument::Adopt( XMLNode* node )
+{
+    TIXMLASSERT( node );
+    XMLDocument* source = node->_document;
+    if ( source == this ) {
+        return node;
     }
-    LoadFile( fp );
-    fclose( fp );
-    return _errorID;
+    TIXMLASSERT( !node->ToDocument() );
+
+    // Find the part of the source's character buffer the strings are
+    // in, and copy it in one piece.
+    const char* lo = 0;
+    const char* hi = 0;
+    source->AdoptRange( node, &lo, &hi );
+    char* copy = 0;
+    if ( lo ) {
+        copy = _strArena.Alloc( hi - lo );
+        memcpy( copy, lo, hi - lo );
+    }
+    XMLNode* adopted = AdoptCopy( node, 0, lo, hi, copy );
+    source->DeleteNode( node );
+    return adopted;
 }
 
-XMLError XMLDocument::LoadFile( FILE* fp )
+
+XMLNode* XMLDocument::Splice( XMLDocument* source, XMLNode* parent )
 {
-    Clear();
+    TIXMLASSERT( source );
+    if ( !parent ) {
+        parent = this;
+    }
+    TIXMLASSERT( parent->_document == this );
+    TIXMLASSERT( parent->ToDocument() || parent->ToElement() );
+    if ( source == this ) {
+        return 0;
+    }
+    parent->MaterializeChildren();
+    XMLNode* first = 0;
 
-    TIXML_FSEEK( fp, 0, SEEK_SET );
-    if ( fgetc( fp ) == EOF && ferror( fp ) != 0 ) {
-        SetError( XML_ERROR_FILE_READ_ERROR, 0, 0 );
-        return _errorID;
+    if ( source->_allocator != _allocator ) {
+        // The memory can't change hands; move the nodes one by one.
+        while( XMLNode* node = source->FirstChild() ) {
+            XMLNode* adopted = Adopt( node );
+            parent->InsertEndChild( adopted );
+            if ( !first ) {
+                first = adopted;
+            }
+        }
+        while( source->_unlinked.Size() ) {
+            Adopt( source->_unlinked[0] );
+        }
+        source->Clear();
+        return first;
     }
 
-    TIXML_FSEEK( fp, 0, SEEK_END );
+    for( XMLNode* node = source->FirstChild(); node; node = node->_next ) {
+        SetDocument( node );
+    }
+    for( int i = 0; i < source->_unlinked.Size(); ++i ) {
+        XMLNode* node = source->_unlinked[i];
+        SetDocument( node );
+        node->_unlinkedIndex = _unlinked.Size();
+        _unlinked.Push( node );
+    }
+    source->_unlinked.Clear();
 
-    unsigned long long filelength;
-    {
-        const long long fileLengthSigned = TIXML_FTELL( fp );
-        TIXML_FSEEK( fp, 0, SEEK_SET );
-        if ( fileLengthSigned == -1L ) {        // todo: 文件长度出错，需要文件超级大（文件大小 > 2G），做不到。
-            SetError( XML_ERROR_FILE_READ_ERROR, 0, 0 );
-            return _errorID;
+    // Move the chain of top level nodes.
+    first = source->_firstChild;
+    if ( first ) {
+        for( XMLNode* node = first; node; node = node->_next ) {
+            node->_parent = parent;
         }
-        TIXMLASSERT( fileLengthSigned >= 0 );
-        filelength = static_cast<unsigned long long>(fileLengthSigned);
+        first->_prev = parent->_lastChild;
+        if ( parent->_lastChild ) {
+            parent->_lastChild->_next = first;
+        }
+        else {
+            parent->_firstChild = first;
+        }
+        parent->_lastChild = source->_lastChild;
+        source->_firstChild = source->_lastChild = 0;
+        parent->Changed();
     }
 
-    const size_t maxSizeT = static_cast<size_t>(-1);
-    // We'll do the comparison as an unsigned long long, because that's guaranteed to be at
-    // least 8 bytes, even on a 32-bit platform.
-    if ( filelength >= static_cast<unsigned long long>(maxSizeT) ) {    // todo: 文件长度出错，需要文件超级大，做不到。
-        // Cannot handle files which won't fit in buffer together with null terminator
-        SetError( XML_ERROR_FILE_READ_ERROR, 0, 0 );
-        return _errorID;
+    _elementPool.Take( source->_elementPool );
+    _attributePool.Take( source->_attributePool );
+    _textPool.Take( source->_textPool );
+    _commentPool.Take( source->_commentPool );
+    _strArena.Take( source->_strArena );
+    if ( source->_charBuffer ) {
+        _strArena.AddBuffer( source->_charBuffer );
+        source->_charBuffer = 0;
+        source->_charBufferSize = 0;
     }
+    source->Clear();
+    return first;
+}
 
-    if ( filelength == 0 ) {
-        SetError( XML_ERROR_EMPTY_DOCUMENT, 0, 0 );
-        return _errorID;
+
+// Makes 'node' and its subtree belong to this document. Lazily parsed
+// content is read first, while the node still belongs to its own.
+void XMLDocument::SetDocument( XMLNode* node )
+{
+    for( XMLNode* child = node->FirstChild(); child; child = child->_next ) {
+        SetDocument( child );
+    }
+    if ( XMLElement* element = node->ToElement() ) {
+        element->MaterializeAttributes();
+        for( XMLAttribute* a = element->_rootAttribute; a; a = a->_next ) {
+            a->_document = this;
+        }
     }
+    node->_document = this;
+}
 
-    const size_t size = static_cast<size_t>(filelength);
-    TIXMLASSERT( _charBuffer == 0 );
-    _charBuffer = new char[size+1];
-    const size_t read = fread( _charBuffer, 1, size, fp );
-    if ( read != size ) {   // todo: 因为size=filelength，不会因为读到末尾而不一致，只有文件中途出错，无法通过程序实现
-        SetError( XML_ERROR_FILE_READ_ERROR, 0, 0 );
-        return _errorID;
+
+// Widens [lo, hi) to cover 'str' if it is in [start, end).
+static void WidenRange( const char* str, const char* start, const char* end, const char** lo, const char** hi )
+{
+    if ( !str || str < start || str >= end ) {
+        return;
+    }
+    const char* strEnd = str + strlen( str ) + 1;
+    if ( !*lo || str < *lo ) {
+        *lo = str;
     }
+    if ( !*hi || strEnd > *hi ) {
+        *hi = strEnd;
+    }
+}
 
-    _charBuffer[size] = 0;
 
-    Parse();
-    return _errorID;
+// Widens [lo, hi) to cover the strings of 'node' and its subtree that
+// are in this document's character buffer. Reading them expands any
+// lazily parsed content and decodes the strings in place.
+void XMLDocument::AdoptRange( const XMLNode* node, const char** lo, const char** hi ) const
+{
+    if ( !_charBuffer ) {
+        return;
+    }
+    const char* end = _charBuffer + _charBufferSize + 1;
+    WidenRange( node->Value(), _charBuffer, end, lo, hi );
+    if ( const XMLElement* element = node->ToElement() ) {
+        for( const XMLAttribute* a = element->FirstAttribute(); a; a = a->Next() ) {
+            WidenRange( a->Name(), _charBuffer, end, lo, hi );
+            WidenRange( a->Value(), _charBuffer, end, lo, hi );
+        }
+    }
+    for( const XMLNode* child = node->FirstChild(); child; child = child->NextSibling() ) {
+        AdoptRange( child, lo, hi );
+    }
 }
 
 
-XMLError XMLDocument::SaveFile( const char* filename, bool compact )
+// Sets 'to' to 'str', which is either in [lo, hi) of the source buffer,
+// and so at the same place in 'copy', or has to be copied.
+static void AdoptStr( StrPair* to, const char* str, const char* lo, const char* hi, char* copy, StrArena* arena )
+{
+    if ( copy && str >= lo && str < hi ) {
+        // Already decoded and null terminated; there is nothing to flush.
+        char* start = copy + ( str - lo );
+        to->Set( start, start + strlen( str ), 0 );
+    }
+    else {
+        to->SetStr( str, 0, arena );
+    }
+}
+
+
+// Makes a node of this document like 'node' (which AdoptRange() has
+// been called on), as the last child of 'parent' or unlinked.
+XMLNode* XMLDocument::AdoptCopy( const XMLNode* node, XMLNode* parent, const char* lo, const char* hi, char* copy )
+{
+    XMLNode* result = 0;
+    switch ( node->Kind() ) {
+        case ELEMENT_NODE:
+        {
+            XMLElement* element = parent ? CreateLastChild<XMLElement>( _elementPool, parent ) : CreateUnlinkedNode<XMLElement>( _elementPool );
+            const XMLElement* from = node->ToElement();
+            element->_closingType = from->_closingType;
+            XMLAttribute* last = 0;
+            for( const XMLAttribute* a = from->FirstAttribute(); a; a = a->Next() ) {
+                XMLAttribute* attrib = element->CreateAttribute();
+                AdoptStr( &attrib->_name, a->Name(), lo, hi, copy, &_strArena );
+                AdoptStr( &attrib->_value, a->Value(), lo, hi, copy, &_strArena );
+                attrib->_parseLineNum = a->_parseLineNum;
+                if ( last ) {
+                    last->_next = attrib;
+                }
+                else {
+                    element->_rootAttribute = attrib;
+                }
+                last = attrib;
+            }
+            result = element;
+            break;
+        }
+        case TEXT_NODE:
+        {
+            XMLText* text = parent ? CreateLastChild<XMLText>( _textPool, parent ) : CreateUnlinkedNode<XMLText>( _textPool );
+            text->SetCData( node->ToText()->CData() );
+            result = text;
+            break;
+        }
+        case COMMENT_NODE:
+            result = parent ? CreateLastChild<XMLComment>( _commentPool, parent ) : CreateUnlinkedNode<XMLComment>( _commentPool );
+            break;
+        case DECLARATION_NODE:
+            result = parent ? CreateLastChild<XMLDeclaration>( _commentPool, parent ) : CreateUnlinkedNode<XMLDeclaration>( _commentPool );
+            break;
+        default:
+            TIXMLASSERT( node->Kind() == UNKNOWN_NODE );
+            result = parent ? CreateLastChild<XMLUnknown>( _commentPool, parent ) : CreateUnlinkedNode<XMLUnknown>( _commentPool );
+            break;
+    }
+    AdoptStr( &result->_value, node->Value(), lo, hi, copy, &_strArena );
+    result->_parseLineNum = node->_parseLineNum;
+    result->_userData = node->_userData;
+
+    for( const XMLNode* child = node->FirstChild(); child; child = child->NextSibling() ) {
+        AdoptCopy( child, result, lo, hi, copy );
+    }
+    return result;
+}
+
+
+XMLElement* XMLDocument::NewElement( const char* name )
+{
+    XMLElement* ele = CreateUnlinkedNode<XMLElement>( _elementPool );
+    ele->SetName( name );
+    return ele;
+}
+
+
+XMLComment* XMLDocument::NewComment( const char* str )
+{
+    XMLComment* comment = CreateUnlinkedNode<XMLComment>( _commentPool );
+    comment->SetValue( str );
+    return comment;
+}
+
+
+XMLText* XMLDocument::NewText( const char* str )
+{
+    XMLText* text = CreateUnlinkedNode<XMLText>( _textPool );
+    text->SetValue( str );
+    return text;
+}
+
+
+XMLDeclaration* XMLDocument::NewDeclaration( const char* str )
+{
+    XMLDeclaration* dec = CreateUnlinkedNode<XMLDeclaration>( _commentPool );
+    dec->SetValue( str ? str : "xml version=\"1.0\" encoding=\"UTF-8\"" );
+    return dec;
+}
+
+
+XMLUnknown* XMLDocument::NewUnknown( const char* str )
+{
+    XMLUnknown* unk = CreateUnlinkedNode<XMLUnknown>( _commentPool );
+    unk->SetValue( str );
+    return unk;
+}
+
+static FILE* callfopen( const char* filepath, const char* mode )
+{
+    TIXMLASSERT( filepath );
+    TIXMLASSERT( mode );
+#if defined(_MSC_VER) && (_MSC_VER >= 1400 ) && (!defined WINCE)
+    FILE* fp = 0;
+    const errno_t err = fopen_s( &fp, filepath, mode );
+    if ( err ) {
+        return 0;
+    }
+#else
+    FILE* fp = fopen( filepath, mode );
+#endif
+    return fp;
+}
+
+void XMLDocument::DeleteNode( XMLNode* node )	{
+    TIXMLASSERT( node );
+    TIXMLASSERT(node->_document == this );
+    if (node->_parent) {
+        node->_parent->DeleteChild( node );
+    }
+    else {
+        // Isn't in the tree.
+        // Use the parent delete.
+        // Also, we need to mark it tracked: we 'know'
+        // it was never used.
+        PoolOf( node )->SetTracked();
+        // Call the static XMLNode version:
+        XMLNode::DeleteNode(node);
+    }
+}
+
+
+XMLError XMLDocument::LoadFile( const char* filename )
 {
     if ( !filename ) {
         TIXMLASSERT( false );
@@ -2398,185 +3862,3849 @@ XMLError XMLDocument::SaveFile( const char* filename, bool compact )
         return _errorID;
     }
 
-    FILE* fp = callfopen( filename, "w" );
+    Clear();
+    FILE* fp = callfopen( filename, "rb" );
     if ( !fp ) {
-        SetError( XML_ERROR_FILE_COULD_NOT_BE_OPENED, 0, "filename=%s", filename );
+        SetError( XML_ERROR_FILE_NOT_FOUND, 0, "filename=%s", filename );
         return _errorID;
     }
-    SaveFile(fp, compact);
+    LoadFile( fp );
     fclose( fp );
     return _errorID;
 }
 
-
-XMLError XMLDocument::SaveFile( FILE* fp, bool compact )
+XMLError XMLDocument::LoadFile( FILE* fp )
 {
-    // Clear any error from the last save, otherwise it will get reported
-    // for *this* call.
-    ClearError();
-    XMLPrinter stream( fp, compact );
-    Print( &stream );
+    Clear();
+    if ( ReadFile( fp ) ) {
+        Parse();
+    }
     return _errorID;
 }
 
 
-XMLError XMLDocument::Parse( const char* xml, size_t nBytes )
+// --------- Compressed files ----------- //
+
+namespace {
+
+// Compressed data is read and written in pieces this big.
+const size_t COMPRESSED_CHUNK = 64 * 1024;
+
+// Decompresses gzip or zstd, a piece at a time. The data may be several
+// gzip members or zstd frames, one after the other.
+class Decompressor
 {
-    Clear();
+public:
+    Decompressor();
+    ~Decompressor();
+    // False if tinyxml2 was built without the codec for 'format'.
+    bool Init( int format );
+    // Decompresses from in[*inPos, inSize) to out[*outPos, outSize), and
+    // moves the positions on. Returns false if the data is corrupt.
+    bool Run( const char* in, size_t* inPos, size_t inSize, char* out, size_t* outPos, size_t outSize );
+    // Whether the data so far ends at the end of a member or frame.
+    bool Ended() const {
+        return _ended;
+    }
 
-    if ( nBytes == 0 || !xml || !*xml ) {
-        SetError( XML_ERROR_EMPTY_DOCUMENT, 0, 0 );
-        return _errorID;
+private:
+    int     _format;
+    bool    _ended;
+#if TIXML_ZLIB
+    z_stream    _gzip;
+#endif
+#if TIXML_ZSTD
+    ZSTD_DCtx*  _zstd;
+#endif
+};
+
+// Compresses to gzip or zstd, and writes what comes out to a FILE.
+class Compressor
+{
+public:
+    Compressor();
+    ~Compressor();
+    // False if tinyxml2 was built without the codec for 'format'.
+    bool Init( int format, int level );
+    // Compresses 'size' bytes at 'data', ending the data if 'finish'.
+    // Returns false if the codec fails or 'fp' can't be written.
+    bool Write( const char* data, size_t size, bool finish, FILE* fp );
+
+private:
+    int     _format;
+    char    _out[COMPRESSED_CHUNK];
+#if TIXML_ZLIB
+    z_stream    _gzip;
+#endif
+#if TIXML_ZSTD
+    ZSTD_CCtx*  _zstd;
+#endif
+};
+
+} // namespace
+
+
+Decompressor::Decompressor() :
+    _format( -1 ),
+    _ended( false )
+{
+#if TIXML_ZSTD
+    _zstd = 0;
+#endif
+}
+
+
+Decompressor::~Decompressor()
+{
+#if TIXML_ZLIB
+    if ( _format == XMLCompressor::GZIP ) {
+        inflateEnd( &_gzip );
     }
-    if ( nBytes == static_cast<size_t>(-1) ) {
-        nBytes = strlen( xml );
+#endif
+#if TIXML_ZSTD
+    if ( _zstd ) {
+        ZSTD_freeDCtx( _zstd );
     }
-    TIXMLASSERT( _charBuffer == 0 );
-    _charBuffer = new char[ nBytes+1 ];
-    memcpy( _charBuffer, xml, nBytes );
-    _charBuffer[nBytes] = 0;
+#endif
+}
 
-    Parse();
-    if ( Error() ) {
-        // clean up now essentially dangling memory.
-        // and the parse fail can put objects in the
-        // pools that are dead and inaccessible.
-        DeleteChildren();
-        _elementPool.Clear();
-        _attributePool.Clear();
-        _textPool.Clear();
-        _commentPool.Clear();
+
+bool Decompressor::Init( int format )
+{
+    TIXMLASSERT( _format < 0 );
+#if TIXML_ZLIB
+    if ( format == XMLCompressor::GZIP ) {
+        memset( &_gzip, 0, sizeof( _gzip ) );
+        // A gzip header (32), and the largest window.
+        if ( inflateInit2( &_gzip, 15 + 32 ) != Z_OK ) {
+            return false;
+        }
+        _format = format;
+        return true;
     }
-    return _errorID;
+#endif
+#if TIXML_ZSTD
+    if ( format == XMLCompressor::ZSTD ) {
+        _zstd = ZSTD_createDCtx();
+        if ( !_zstd ) {
+            return false;
+        }
+        _format = format;
+        return true;
+    }
+#endif
+    (void)format;
+    return false;
+}
+
+
+bool Decompressor::Run( const char* in, size_t* inPos, size_t inSize, char* out, size_t* outPos, size_t outSize )
+{
+#if TIXML_ZLIB
+    if ( _format == XMLCompressor::GZIP ) {
+        if ( _ended ) {
+            if ( *inPos == inSize ) {
+                return true;
+            }
+            // Another member.
+            inflateReset( &_gzip );
+            _ended = false;
+        }
+        const size_t inLeft = inSize - *inPos;
+        const size_t outLeft = outSize - *outPos;
+        _gzip.next_in = reinterpret_cast<Bytef*>( const_cast<char*>( in + *inPos ) );
+        _gzip.avail_in = static_cast<uInt>( inLeft < UINT_MAX ? inLeft : UINT_MAX );
+        _gzip.next_out = reinterpret_cast<Bytef*>( out + *outPos );
+        _gzip.avail_out = static_cast<uInt>( outLeft < UINT_MAX ? outLeft : UINT_MAX );
+        const int result = inflate( &_gzip, Z_NO_FLUSH );
+        *inPos = reinterpret_cast<const char*>( _gzip.next_in ) - in;
+        *outPos = reinterpret_cast<char*>( _gzip.next_out ) - out;
+        if ( result == Z_STREAM_END ) {
+            _ended = true;
+        }
+        return result == Z_OK || result == Z_STREAM_END || result == Z_BUF_ERROR;
+    }
+#endif
+#if TIXML_ZSTD
+    if ( _format == XMLCompressor::ZSTD ) {
+        ZSTD_inBuffer input = { in, inSize, *inPos };
+        ZSTD_outBuffer output = { out, outSize, *outPos };
+        const size_t result = ZSTD_decompressStream( _zstd, &output, &input );
+        if ( ZSTD_isError( result ) ) {
+            return false;
+        }
+        *inPos = input.pos;
+        *outPos = output.pos;
+        // 0 once a frame is decoded and all of it written out.
+        _ended = ( result == 0 );
+        return true;
+    }
+#endif
+    (void)in;
+    (void)inPos;
+    (void)inSize;
+    (void)out;
+    (void)outPos;
+    (void)outSize;
+    return false;
+}
+
+
+Compressor::Compressor() :
+    _format( -1 )
+{
+#if TIXML_ZSTD
+    _zstd = 0;
+#endif
+}
+
+
+Compressor::~Compressor()
+{
+#if TIXML_ZLIB
+    if ( _format == XMLCompressor::GZIP ) {
+        deflateEnd( &_gzip );
+    }
+#endif
+#if TIXML_ZSTD
+    if ( _zstd ) {
+        ZSTD_freeCCtx( _zstd );
+    }
+#endif
+}
+
+
+bool Compressor::Init( int format, int level )
+{
+    TIXMLASSERT( _format < 0 );
+#if TIXML_ZLIB
+    if ( format == XMLCompressor::GZIP ) {
+        memset( &_gzip, 0, sizeof( _gzip ) );
+        // A gzip header (16), and the largest window.
+        if ( deflateInit2( &_gzip, level ? level : Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY ) != Z_OK ) {
+            return false;
+        }
+        _format = format;
+        return true;
+    }
+#endif
+#if TIXML_ZSTD
+    if ( format == XMLCompressor::ZSTD ) {
+        _zstd = ZSTD_createCCtx();
+        if ( !_zstd || ZSTD_isError( ZSTD_CCtx_setParameter( _zstd, ZSTD_c_compressionLevel, level ) ) ) {
+            return false;
+        }
+        _format = format;
+        return true;
+    }
+#endif
+    (void)format;
+    (void)level;
+    return false;
+}
+
+
+bool Compressor::Write( const char* data, size_t size, bool finish, FILE* fp )
+{
+#if TIXML_ZLIB
+    if ( _format == XMLCompressor::GZIP ) {
+        // zlib counts in uInt.
+        do {
+            const size_t piece = size < UINT_MAX ? size : UINT_MAX;
+            const int flush = ( finish && piece == size ) ? Z_FINISH : Z_NO_FLUSH;
+            _gzip.next_in = reinterpret_cast<Bytef*>( const_cast<char*>( data ) );
+            _gzip.avail_in = static_cast<uInt>( piece );
+            do {
+                _gzip.next_out = reinterpret_cast<Bytef*>( _out );
+                _gzip.avail_out = static_cast<uInt>( COMPRESSED_CHUNK );
+                if ( deflate( &_gzip, flush ) == Z_STREAM_ERROR ) {
+                    return false;
+                }
+                const size_t out = COMPRESSED_CHUNK - _gzip.avail_out;
+                if ( fwrite( _out, 1, out, fp ) != out ) {
+                    return false;
+                }
+            } while ( _gzip.avail_out == 0 );
+            data += piece;
+            size -= piece;
+        } while ( size > 0 );
+        return true;
+    }
+#endif
+#if TIXML_ZSTD
+    if ( _format == XMLCompressor::ZSTD ) {
+        ZSTD_inBuffer input = { data, size, 0 };
+        for ( ;; ) {
+            ZSTD_outBuffer output = { _out, COMPRESSED_CHUNK, 0 };
+            const size_t left = ZSTD_compressStream2( _zstd, &output, &input, finish ? ZSTD_e_end : ZSTD_e_continue );
+            if ( ZSTD_isError( left ) || fwrite( _out, 1, output.pos, fp ) != output.pos ) {
+                return false;
+            }
+            // With ZSTD_e_end, 'left' is what is still to be written out.
+            if ( finish ? left == 0 : input.pos == input.size ) {
+                return true;
+            }
+        }
+    }
+#endif
+    (void)data;
+    (void)size;
+    (void)finish;
+    (void)fp;
+    return false;
+}
+
+
+// The format of compressed data starting with 'magic', or -1.
+static int CompressedFormat( const unsigned char* magic )
+{
+    if ( magic[0] == 0x1f && magic[1] == 0x8b ) {
+        return XMLCompressor::GZIP;
+    }
+    if ( magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f && magic[3] == 0xfd ) {
+        return XMLCompressor::ZSTD;
+    }
+    return -1;
+}
+
+
+// Deflate shrinks data at most 1032 times.
+static const unsigned long long MAX_DEFLATE_RATIO = 1032;
+
+// A hint at the size 'fp', 'length' bytes of 'format', decompresses to:
+// the size at the end of a gzip member, or the one in the header of a
+// zstd frame, or a guess if it doesn't say. The file says what it likes,
+// so the hint is at most what so much deflate could decompress to; a
+// zstd file that goes further grows the buffer. Leaves 'fp' at the start.
+static unsigned long long DecompressedSize( FILE* fp, int format, unsigned long long length )
+{
+    unsigned long long size = length * 4;
+    if ( format == XMLCompressor::GZIP && length >= 18 ) {
+        unsigned char tail[4];
+        TIXML_FSEEK( fp, -4, SEEK_END );
+        if ( fread( tail, 1, 4, fp ) == 4 ) {
+            size = tail[0] | ( tail[1] << 8 ) | ( tail[2] << 16 ) | ( static_cast<unsigned long long>( tail[3] ) << 24 );
+            // It is modulo 4G, so it is only off for a large file.
+            const unsigned long long wrap = 1ULL << 32;
+            if ( length * MAX_DEFLATE_RATIO >= wrap ) {
+                while ( size < length ) {
+                    size += wrap;
+                }
+            }
+        }
+    }
+#if TIXML_ZSTD
+    if ( format == XMLCompressor::ZSTD ) {
+        // The longest frame header.
+        unsigned char header[18];
+        const size_t read = fread( header, 1, sizeof( header ), fp );
+        const unsigned long long content = ZSTD_getFrameContentSize( header, read );
+        if ( content != ZSTD_CONTENTSIZE_UNKNOWN && content != ZSTD_CONTENTSIZE_ERROR ) {
+            size = content;
+        }
+    }
+#endif
+    TIXML_FSEEK( fp, 0, SEEK_SET );
+    return size < length * MAX_DEFLATE_RATIO ? size : length * MAX_DEFLATE_RATIO;
+}
+
+
+// Decompresses 'fp', 'length' bytes of 'format', into a new, null
+// terminated buffer. The file is read a piece at a time, and goes
+// straight into a buffer the size it says it decompresses to, so the
+// text is in memory once; the buffer only grows (and is copied) if the
+// file said too little. XML_ERROR_FILE_READ_ERROR if there isn't the
+// memory.
+static XMLError ReadCompressed( FILE* fp, int format, unsigned long long length, XMLAllocator* allocator, char** buffer, size_t* size )
+{
+    Decompressor codec;
+    if ( !codec.Init( format ) ) {
+        return XML_ERROR_COMPRESSION;
+    }
+    const size_t maxSizeT = static_cast<size_t>(-1);
+    const unsigned long long expected = DecompressedSize( fp, format, length );
+    // A byte more than expected, so the decompressor sees the end of the
+    // data without running out of room.
+    size_t capacity = expected < maxSizeT / 2 ? static_cast<size_t>( expected ) + 1 : maxSizeT / 2;
+    char* mem = StrArena::TryNewBuffer( allocator, capacity + 1 );
+    if ( !mem ) {
+        return XML_ERROR_FILE_READ_ERROR;
+    }
+    char* in = static_cast<char*>( allocator->Allocate( COMPRESSED_CHUNK ) );
+    size_t used = 0;
+    size_t inPos = 0;
+    size_t inSize = 0;
+    bool eof = false;
+    XMLError error = XML_SUCCESS;
+    for ( ;; ) {
+        if ( inPos == inSize && !eof ) {
+            inSize = fread( in, 1, COMPRESSED_CHUNK, fp );
+            inPos = 0;
+            if ( inSize < COMPRESSED_CHUNK ) {
+                if ( ferror( fp ) ) {
+                    error = XML_ERROR_FILE_READ_ERROR;
+                    break;
+                }
+                eof = true;
+            }
+        }
+        if ( eof && inPos == inSize && codec.Ended() ) {
+            break;
+        }
+        if ( used == capacity ) {
+            if ( capacity >= maxSizeT / 4 ) {
+                error = XML_ERROR_FILE_READ_ERROR;
+                break;
+            }
+            char* bigger = StrArena::TryNewBuffer( allocator, capacity * 2 + 1 );
+            if ( !bigger ) {
+                error = XML_ERROR_FILE_READ_ERROR;
+                break;
+            }
+            memcpy( bigger, mem, used );
+            StrArena::ReleaseBuffer( mem );
+            mem = bigger;
+            capacity *= 2;
+        }
+        const size_t was = used;
+        if ( !codec.Run( in, &inPos, inSize, mem, &used, capacity ) ) {
+            error = XML_ERROR_COMPRESSION;
+            break;
+        }
+        if ( eof && inPos == inSize && used == was && !codec.Ended() ) {
+            // Cut short.
+            error = XML_ERROR_COMPRESSION;
+            break;
+        }
+    }
+    allocator->Deallocate( in, COMPRESSED_CHUNK );
+
+    if ( error == XML_SUCCESS && used == 0 ) {
+        error = XML_ERROR_EMPTY_DOCUMENT;
+    }
+    if ( error != XML_SUCCESS ) {
+        StrArena::ReleaseBuffer( mem );
+        return error;
+    }
+    mem[used] = 0;
+    *buffer = mem;
+    *size = used;
+    return XML_SUCCESS;
+}
+
+
+// Reads the whole file into a new, null terminated buffer (see
+// StrArena::NewBuffer()). A compressed file is decompressed.
+static XMLError ReadFileToBuffer( FILE* fp, XMLAllocator* allocator, char** buffer, size_t* size )
+{
+    TIXML_FSEEK( fp, 0, SEEK_SET );
+    if ( fgetc( fp ) == EOF && ferror( fp ) != 0 ) {
+        return XML_ERROR_FILE_READ_ERROR;
+    }
+
+    TIXML_FSEEK( fp, 0, SEEK_END );
+
+    unsigned long long filelength;
+    {
+        const long long fileLengthSigned = TIXML_FTELL( fp );
+        TIXML_FSEEK( fp, 0, SEEK_SET );
+        if ( fileLengthSigned == -1L ) {        // todo: 文件长度出错，需要文件超级大（文件大小 > 2G），做不到。
+            return XML_ERROR_FILE_READ_ERROR;
+        }
+        TIXMLASSERT( fileLengthSigned >= 0 );
+        filelength = static_cast<unsigned long long>(fileLengthSigned);
+    }
+
+    const size_t maxSizeT = static_cast<size_t>(-1);
+    // We'll do the comparison as an unsigned long long, because that's guaranteed to be at
+    // least 8 bytes, even on a 32-bit platform.
+    if ( filelength >= static_cast<unsigned long long>(maxSizeT) ) {    // todo: 文件长度出错，需要文件超级大，做不到。
+        // Cannot handle files which won't fit in buffer together with null terminator
+        return XML_ERROR_FILE_READ_ERROR;
+    }
+
+    if ( filelength == 0 ) {
+        return XML_ERROR_EMPTY_DOCUMENT;
+    }
+
+    unsigned char magic[4] = { 0, 0, 0, 0 };
+    if ( filelength >= sizeof( magic ) ) {
+        const size_t read = fread( magic, 1, sizeof( magic ), fp );
+        TIXML_FSEEK( fp, 0, SEEK_SET );
+        if ( read != sizeof( magic ) ) {
+            return XML_ERROR_FILE_READ_ERROR;
+        }
+    }
+    const int format = CompressedFormat( magic );
+    if ( format >= 0 ) {
+        return ReadCompressed( fp, format, filelength, allocator, buffer, size );
+    }
+
+    *size = static_cast<size_t>(filelength);
+    char* mem = StrArena::TryNewBuffer( allocator, *size+1 );
+    if ( !mem ) {
+        return XML_ERROR_FILE_READ_ERROR;
+    }
+    const size_t read = fread( mem, 1, *size, fp );
+    if ( read != *size ) {   // todo: 因为size=filelength，不会因为读到末尾而不一致，只有文件中途出错，无法通过程序实现
+        StrArena::ReleaseBuffer( mem );
+        return XML_ERROR_FILE_READ_ERROR;
+    }
+
+    mem[*size] = 0;
+    *buffer = mem;
+    return XML_SUCCESS;
+}
+
+
+// Reads the whole file into a null terminated _charBuffer.
+// Returns the file size, or 0 with the error set.
+size_t XMLDocument::ReadFile( FILE* fp )
+{
+    TIXMLASSERT( _charBuffer == 0 );
+    size_t size = 0;
+    const XMLError error = ReadFileToBuffer( fp, _allocator, &_charBuffer, &size );
+    if ( error != XML_SUCCESS ) {
+        SetError( error, 0, 0 );
+        return 0;
+    }
+    _charBufferSize = size;
+    return size;
+}
+
+
+XMLError XMLDocument::SaveFile( const char* filename, bool compact )
+{
+    if ( !filename ) {
+        TIXMLASSERT( false );
+        SetError( XML_ERROR_FILE_COULD_NOT_BE_OPENED, 0, "filename=<null>" );
+        return _errorID;
+    }
+
+    // Compressed, going by the extension.
+    const size_t length = strlen( filename );
+    int format = -1;
+    if ( length > 3 && strcmp( filename + length - 3, ".gz" ) == 0 ) {
+        format = XMLCompressor::GZIP;
+    }
+    else if ( length > 4 && strcmp( filename + length - 4, ".zst" ) == 0 ) {
+        format = XMLCompressor::ZSTD;
+    }
+    if ( format >= 0 && !XMLCompressor::Supported( static_cast<XMLCompressor::Format>( format ) ) ) {
+        SetError( XML_ERROR_COMPRESSION, 0, "filename=%s", filename );
+        return _errorID;
+    }
+
+    FILE* fp = callfopen( filename, format < 0 ? "w" : "wb" );
+    if ( !fp ) {
+        SetError( XML_ERROR_FILE_COULD_NOT_BE_OPENED, 0, "filename=%s", filename );
+        return _errorID;
+    }
+    if ( format < 0 ) {
+        SaveFile(fp, compact);
+    }
+    else {
+        ClearError();
+        XMLCompressor compressor( fp, static_cast<XMLCompressor::Format>( format ) );
+        XMLPrinter stream( 0, compact );
+        stream.SetOutput( XMLCompressor::Output, &compressor );
+        Print( &stream );
+        stream.Flush();
+        if ( compressor.Finish() != XML_SUCCESS ) {
+            SetError( XML_ERROR_COMPRESSION, 0, "filename=%s", filename );
+        }
+    }
+    fclose( fp );
+    return _errorID;
+}
+
+
+XMLError XMLDocument::SaveFile( FILE* fp, bool compact )
+{
+    // Clear any error from the last save, otherwise it will get reported
+    // for *this* call.
+    ClearError();
+    XMLPrinter stream( fp, compact );
+    Print( &stream );
+    return _errorID;
+}
+
+
+// --------- XMLCompressor ----------- //
+
+// The output waiting to be compressed: blocks, which a thread of their
+// own compresses in turn while the next one is filled.
+struct XMLCompressor::Pipeline
+{
+    enum {
+        BLOCK_SIZE = 256 * 1024,
+        BLOCKS = TIXML_THREADS ? 4 : 1
+    };
+
+    explicit Pipeline( FILE* file );
+    ~Pipeline();
+    void Pass();
+    void Compress();
+
+    Compressor  codec;
+    FILE*       fp;
+    bool        failed;
+    char*       blocks[BLOCKS];
+    size_t      sizes[BLOCKS];
+    int         next;       // the block being filled
+#if TIXML_THREADS
+    int         queued;     // the blocks before 'next' still to compress
+    bool        done;
+    std::mutex  lock;
+    std::condition_variable changed;
+    std::thread thread;
+#endif
+};
+
+
+XMLCompressor::Pipeline::Pipeline( FILE* file ) :
+    fp( file ),
+    failed( false ),
+    next( 0 )
+{
+    for( int i = 0; i < BLOCKS; ++i ) {
+        blocks[i] = new char[BLOCK_SIZE];
+        sizes[i] = 0;
+    }
+#if TIXML_THREADS
+    queued = 0;
+    done = false;
+#endif
+}
+
+
+XMLCompressor::Pipeline::~Pipeline()
+{
+    for( int i = 0; i < BLOCKS; ++i ) {
+        delete [] blocks[i];
+    }
+}
+
+
+// Passes the full block on, and starts on the next one.
+void XMLCompressor::Pipeline::Pass()
+{
+#if TIXML_THREADS
+    std::unique_lock<std::mutex> hold( lock );
+    while ( queued == BLOCKS - 1 ) {
+        changed.wait( hold );
+    }
+    ++queued;
+    next = ( next + 1 ) % BLOCKS;
+    sizes[next] = 0;
+    changed.notify_all();
+#else
+    if ( !codec.Write( blocks[next], sizes[next], false, fp ) ) {
+        failed = true;
+    }
+    sizes[next] = 0;
+#endif
+}
+
+
+// Compresses the blocks passed on, until there are no more.
+void XMLCompressor::Pipeline::Compress()
+{
+#if TIXML_THREADS
+    std::unique_lock<std::mutex> hold( lock );
+    for ( ;; ) {
+        while ( queued == 0 && !done ) {
+            changed.wait( hold );
+        }
+        if ( queued == 0 ) {
+            break;
+        }
+        const int block = ( next - queued + BLOCKS ) % BLOCKS;
+        hold.unlock();
+        if ( !failed && !codec.Write( blocks[block], sizes[block], false, fp ) ) {
+            failed = true;
+        }
+        hold.lock();
+        --queued;
+        changed.notify_all();
+    }
+#endif
+}
+
+
+XMLCompressor::XMLCompressor( FILE* fp, Format format, int level ) :
+    _pipeline( 0 ),
+    _error( XML_SUCCESS )
+{
+    TIXMLASSERT( fp );
+    Pipeline* pipeline = new Pipeline( fp );
+    if ( !pipeline->codec.Init( format, level ) ) {
+        delete pipeline;
+        _error = XML_ERROR_COMPRESSION;
+        return;
+    }
+#if TIXML_THREADS
+    pipeline->thread = std::thread( &Pipeline::Compress, pipeline );
+#endif
+    _pipeline = pipeline;
+}
+
+
+XMLCompressor::~XMLCompressor()
+{
+    Finish();
+}
+
+
+/*static*/ bool XMLCompressor::Supported( Format format )
+{
+    return ( format == GZIP && TIXML_ZLIB ) || ( format == ZSTD && TIXML_ZSTD );
+}
+
+
+/*static*/ void XMLCompressor::Output( const char* data, size_t size, void* compressor )
+{
+    Pipeline* pipeline = static_cast<XMLCompressor*>( compressor )->_pipeline;
+    if ( !pipeline ) {
+        return;
+    }
+    while ( size > 0 ) {
+        size_t& filled = pipeline->sizes[pipeline->next];
+        const size_t room = Pipeline::BLOCK_SIZE - filled;
+        const size_t piece = size < room ? size : room;
+        memcpy( pipeline->blocks[pipeline->next] + filled, data, piece );
+        filled += piece;
+        data += piece;
+        size -= piece;
+        if ( filled == Pipeline::BLOCK_SIZE ) {
+            pipeline->Pass();
+        }
+    }
+}
+
+
+XMLError XMLCompressor::Finish()
+{
+    Pipeline* pipeline = _pipeline;
+    if ( !pipeline ) {
+        return _error;
+    }
+#if TIXML_THREADS
+    {
+        std::lock_guard<std::mutex> hold( pipeline->lock );
+        pipeline->done = true;
+        pipeline->changed.notify_all();
+    }
+    pipeline->thread.join();
+#endif
+    // The last block ends the data.
+    const int last = pipeline->next;
+    if ( !pipeline->codec.Write( pipeline->blocks[last], pipeline->sizes[last], true, pipeline->fp ) || pipeline->failed ) {
+        _error = XML_ERROR_COMPRESSION;
+    }
+    delete pipeline;
+    _pipeline = 0;
+    return _error;
+}
+
+
+// --------- XMLLoad ----------- //
+
+// A file being loaded into a document.
+struct XMLLoad::Task
+{
+    Task( XMLDocument* doc, const char* name );
+    ~Task();
+    void Run();
+
+    XMLDocument*    document;
+    char*           filename;
+    XMLError        error;
+#if TIXML_THREADS
+    bool            done;
+    mutable std::mutex  lock;
+    std::thread     thread;
+#endif
+};
+
+
+XMLLoad::Task::Task( XMLDocument* doc, const char* name ) :
+    document( doc ),
+    filename( 0 ),
+    error( XML_SUCCESS )
+{
+    // The caller's string may be gone before the load starts.
+    if ( name ) {
+        const size_t length = strlen( name ) + 1;
+        filename = new char[length];
+        memcpy( filename, name, length );
+    }
+#if TIXML_THREADS
+    done = false;
+#endif
+}
+
+
+XMLLoad::Task::~Task()
+{
+    delete [] filename;
+}
+
+
+void XMLLoad::Task::Run()
+{
+    const XMLError result = document->LoadFile( filename );
+#if TIXML_THREADS
+    std::lock_guard<std::mutex> hold( lock );
+    done = true;
+#endif
+    error = result;
+}
+
+
+XMLLoad::XMLLoad() :
+    _task( 0 ),
+    _error( XML_SUCCESS )
+{
+}
+
+
+XMLLoad::~XMLLoad()
+{
+    Wait();
+}
+
+
+bool XMLLoad::Ready() const
+{
+#if TIXML_THREADS
+    if ( _task ) {
+        std::lock_guard<std::mutex> hold( _task->lock );
+        return _task->done;
+    }
+#endif
+    return true;
+}
+
+
+XMLError XMLLoad::Wait()
+{
+    Task* task = _task;
+    if ( !task ) {
+        return _error;
+    }
+#if TIXML_THREADS
+    task->thread.join();
+#endif
+    _error = task->error;
+    delete task;
+    _task = 0;
+    return _error;
+}
+
+
+void XMLDocument::LoadFileAsync( const char* filename, XMLLoad* load )
+{
+    TIXMLASSERT( load );
+    load->Wait();
+    XMLLoad::Task* task = new XMLLoad::Task( this, filename );
+#if TIXML_THREADS
+    task->thread = std::thread( &XMLLoad::Task::Run, task );
+    load->_task = task;
+#else
+    task->Run();
+    load->_error = task->error;
+    delete task;
+#endif
+}
+
+
+// --------- Snapshots ----------- //
+// A snapshot is a header, followed by the node table (in document order,
+// without the document itself), the attribute table, and the string
+// table. Integers are in the byte order of the writer. Strings are
+// referenced by their offset in the string table and are null terminated
+// there, so they can be used in place once the file is read.
+
+static const char SNAPSHOT_MAGIC[8] = { 'T', 'X', 'M', 'L', '2', 'S', 'N', 'P' };
+static const uint32_t SNAPSHOT_VERSION = 1;
+static const uint32_t SNAPSHOT_BYTE_ORDER = 0x01020304;
+static const uint32_t SNAPSHOT_HAS_BOM = 0x01;
+
+enum {
+    SNAPSHOT_ELEMENT = 1,
+    SNAPSHOT_TEXT,
+    SNAPSHOT_CDATA,
+    SNAPSHOT_COMMENT,
+    SNAPSHOT_DECLARATION,
+    SNAPSHOT_UNKNOWN
+};
+
+struct SnapshotHeader {
+    char        magic[8];
+    uint32_t    version;
+    uint32_t    byteOrder;
+    uint32_t    flags;
+    uint32_t    nodeCount;
+    uint32_t    attributeCount;
+    uint32_t    stringBytes;
+};
+
+struct SnapshotNode {
+    uint32_t    kind;
+    uint32_t    parent;             // index in the node table plus one; 0 is the document
+    uint32_t    value;              // offset in the string table
+    uint32_t    valueLength;
+    int32_t     lineNum;
+    uint32_t    attributeCount;     // taken, in order, from the attribute table
+};
+
+struct SnapshotAttribute {
+    uint32_t    name;
+    uint32_t    nameLength;
+    uint32_t    value;
+    uint32_t    valueLength;
+    int32_t     lineNum;
+};
+
+
+// A table of null terminated strings in one block of memory, in which
+// equal strings are stored once. Used to write snapshots and to build
+// frozen documents.
+class StringTable
+{
+public:
+    StringTable() : _slots( 0 ), _slotCount( 0 ) {}
+    ~StringTable() {
+        delete [] _slots;
+    }
+
+    // Returns the index of the string, in order of first addition.
+    int Add( const char* str ) {
+        const size_t len = strlen( str );
+        if ( 2 * ( static_cast<uint32_t>( _offsets.Size() ) + 1 ) > _slotCount ) {
+            Grow();
+        }
+        const uint32_t mask = _slotCount - 1;
+        uint32_t i = Slot( str ) & mask;
+        while ( _slots[i] ) {
+            const int index = _slots[i] - 1;
+            const uint32_t offset = _offsets[index];
+            if ( memcmp( _blob.Mem() + offset, str, len ) == 0 && _blob[static_cast<int>( offset + len )] == 0 ) {
+                return index;
+            }
+            i = ( i + 1 ) & mask;
+        }
+        TIXMLASSERT( len < static_cast<size_t>( INT_MAX - _blob.Size() ) );
+        _offsets.Push( static_cast<uint32_t>( _blob.Size() ) );
+        memcpy( _blob.PushArr( static_cast<int>( len ) + 1 ), str, len + 1 );
+        _slots[i] = _offsets.Size();
+        return _offsets.Size() - 1;
+    }
+
+    // Where string 'index' is in Mem().
+    uint32_t Offset( int index ) const {
+        return _offsets[index];
+    }
+    int Count() const {
+        return _offsets.Size();
+    }
+    const char* Mem() const {
+        return _blob.Mem();
+    }
+    int Size() const {
+        return _blob.Size();
+    }
+
+private:
+    StringTable( const StringTable& );      // not supported
+    void operator=( const StringTable& );   // not supported
+
+    static uint32_t Slot( const char* str ) {
+        return static_cast<uint32_t>( HashStr( FNV_OFFSET, str ) );
+    }
+
+    void Grow() {
+        delete [] _slots;
+        _slotCount = _slotCount ? _slotCount * 2 : 256;
+        _slots = new int[_slotCount];
+        memset( _slots, 0, _slotCount * sizeof( int ) );
+        const uint32_t mask = _slotCount - 1;
+        for ( int index = 0; index < _offsets.Size(); ++index ) {
+            const char* str = _blob.Mem() + _offsets[index];
+            uint32_t i = Slot( str ) & mask;
+            while ( _slots[i] ) {
+                i = ( i + 1 ) & mask;
+            }
+            _slots[i] = index + 1;
+        }
+    }
+
+    DynArray< char, 1024 >      _blob;
+    DynArray< uint32_t, 64 >    _offsets;   // by index
+    int*        _slots;         // index plus one; 0 is empty
+    uint32_t    _slotCount;     // a power of 2
+};
+
+
+XMLError XMLDocument::SaveSnapshot( const char* filename )
+{
+    if ( !filename ) {
+        TIXMLASSERT( false );
+        SetError( XML_ERROR_FILE_COULD_NOT_BE_OPENED, 0, "filename=<null>" );
+        return _errorID;
+    }
+
+    FILE* fp = callfopen( filename, "wb" );
+    if ( !fp ) {
+        SetError( XML_ERROR_FILE_COULD_NOT_BE_OPENED, 0, "filename=%s", filename );
+        return _errorID;
+    }
+    SaveSnapshot( fp );
+    fclose( fp );
+    return _errorID;
+}
+
+
+XMLError XMLDocument::SaveSnapshot( FILE* fp )
+{
+    ClearError();
+
+    DynArray< SnapshotNode, 64 > nodes;
+    DynArray< SnapshotAttribute, 64 > attributes;
+    StringTable strings;
+    // Table index (plus one) of each open ancestor; the document is 0.
+    DynArray< uint32_t, 32 > parents;
+    parents.Push( 0 );
+
+    const XMLNode* node = FirstChild();
+    while ( node ) {
+        SnapshotNode& entry = *nodes.PushArr( 1 );
+        entry.parent = parents.PeekTop();
+        entry.lineNum = node->GetLineNum();
+        entry.attributeCount = 0;
+        const char* value = node->Value();
+        if ( const XMLElement* element = node->ToElement() ) {
+            entry.kind = SNAPSHOT_ELEMENT;
+            for ( const XMLAttribute* a = element->FirstAttribute(); a; a = a->Next() ) {
+                SnapshotAttribute& attribute = *attributes.PushArr( 1 );
+                attribute.name = strings.Offset( strings.Add( a->Name() ) );
+                attribute.nameLength = static_cast<uint32_t>( strlen( a->Name() ) );
+                attribute.value = strings.Offset( strings.Add( a->Value() ) );
+                attribute.valueLength = static_cast<uint32_t>( strlen( a->Value() ) );
+                attribute.lineNum = a->GetLineNum();
+                ++entry.attributeCount;
+            }
+        }
+        else if ( const XMLText* text = node->ToText() ) {
+            entry.kind = text->CData() ? SNAPSHOT_CDATA : SNAPSHOT_TEXT;
+        }
+        else if ( node->ToComment() ) {
+            entry.kind = SNAPSHOT_COMMENT;
+        }
+        else if ( node->ToDeclaration() ) {
+            entry.kind = SNAPSHOT_DECLARATION;
+        }
+        else {
+            TIXMLASSERT( node->ToUnknown() );
+            entry.kind = SNAPSHOT_UNKNOWN;
+        }
+        entry.value = strings.Offset( strings.Add( value ) );
+        entry.valueLength = static_cast<uint32_t>( strlen( value ) );
+
+        // Next in document order.
+        if ( node->FirstChild() ) {
+            parents.Push( static_cast<uint32_t>( nodes.Size() ) );
+            node = node->FirstChild();
+            continue;
+        }
+        while ( node && !node->NextSibling() ) {
+            node = node->Parent();
+            if ( node == this ) {
+                node = 0;
+            }
+            else {
+                parents.Pop();
+            }
+        }
+        if ( node ) {
+            node = node->NextSibling();
+        }
+    }
+
+    SnapshotHeader header;
+    memcpy( header.magic, SNAPSHOT_MAGIC, sizeof( header.magic ) );
+    header.version = SNAPSHOT_VERSION;
+    header.byteOrder = SNAPSHOT_BYTE_ORDER;
+    header.flags = _writeBOM ? SNAPSHOT_HAS_BOM : 0;
+    header.nodeCount = static_cast<uint32_t>( nodes.Size() );
+    header.attributeCount = static_cast<uint32_t>( attributes.Size() );
+    header.stringBytes = static_cast<uint32_t>( strings.Size() );
+
+    const size_t nodeBytes = nodes.Size() * sizeof( SnapshotNode );
+    const size_t attributeBytes = attributes.Size() * sizeof( SnapshotAttribute );
+    const size_t stringBytes = strings.Size();
+    if ( fwrite( &header, sizeof( header ), 1, fp ) != 1
+            || ( nodeBytes && fwrite( nodes.Mem(), 1, nodeBytes, fp ) != nodeBytes )
+            || ( attributeBytes && fwrite( attributes.Mem(), 1, attributeBytes, fp ) != attributeBytes )
+            || ( stringBytes && fwrite( strings.Mem(), 1, stringBytes, fp ) != stringBytes ) ) {
+        SetError( XML_ERROR_FILE_COULD_NOT_BE_OPENED, 0, 0 );
+    }
+    return _errorID;
+}
+
+
+void XMLDocument::Freeze( XMLFrozenDocument* target ) const
+{
+    TIXMLASSERT( target );
+    target->Clear();
+
+    StringTable strings;
+    StringTable names;
+    // The index and the last child of each open ancestor; the document first.
+    DynArray< int, 32 > parents;
+    DynArray< int, 32 > lastChildren;
+    parents.Push( 0 );
+    lastChildren.Push( 0 );
+
+    const XMLNode* node = FirstChild();
+    while ( node ) {
+        const int index = target->_kinds.Size();
+        const int parent = parents.PeekTop();
+        XMLFrozenDocument::NodeKind kind = XMLFrozenDocument::UNKNOWN_NODE;
+        int nameId = -1;
+        if ( const XMLElement* element = node->ToElement() ) {
+            kind = XMLFrozenDocument::ELEMENT_NODE;
+            nameId = names.Add( element->Name() );
+            for ( const XMLAttribute* a = element->FirstAttribute(); a; a = a->Next() ) {
+                target->_attributeNameIds.Push( names.Add( a->Name() ) );
+                target->_attributeValues.Push( strings.Offset( strings.Add( a->Value() ) ) );
+            }
+        }
+        else if ( const XMLText* text = node->ToText() ) {
+            kind = text->CData() ? XMLFrozenDocument::CDATA_NODE : XMLFrozenDocument::TEXT_NODE;
+        }
+        else if ( node->ToComment() ) {
+            kind = XMLFrozenDocument::COMMENT_NODE;
+        }
+        else if ( node->ToDeclaration() ) {
+            kind = XMLFrozenDocument::DECLARATION_NODE;
+        }
+        TIXMLASSERT( kind != XMLFrozenDocument::UNKNOWN_NODE || node->ToUnknown() );
+        target->_kinds.Push( static_cast<unsigned char>( kind ) );
+        target->_nameIds.Push( nameId );
+        target->_parents.Push( parent );
+        target->_firstChildren.Push( 0 );
+        target->_nextSiblings.Push( 0 );
+        target->_values.Push( strings.Offset( strings.Add( node->Value() ) ) );
+        target->_attributeStarts.Push( target->_attributeNameIds.Size() );
+
+        int& last = lastChildren[lastChildren.Size() - 1];
+        if ( last ) {
+            target->_nextSiblings[last] = index;
+        }
+        else {
+            target->_firstChildren[parent] = index;
+        }
+        last = index;
+
+        // Next in document order.
+        if ( node->FirstChild() ) {
+            parents.Push( index );
+            lastChildren.Push( 0 );
+            node = node->FirstChild();
+            continue;
+        }
+        while ( node && !node->NextSibling() ) {
+            node = node->Parent();
+            if ( node == this ) {
+                node = 0;
+            }
+            else {
+                parents.Pop();
+                lastChildren.Pop();
+            }
+        }
+        if ( node ) {
+            node = node->NextSibling();
+        }
+    }
+
+    for ( int i = 0; i < names.Count(); ++i ) {
+        target->_names.Push( strings.Offset( strings.Add( names.Mem() + names.Offset( i ) ) ) );
+    }
+    if ( strings.Size() ) {
+        memcpy( target->_strings.PushArr( strings.Size() ), strings.Mem(), strings.Size() );
+    }
+}
+
+
+XMLError XMLDocument::LoadSnapshot( const char* filename )
+{
+    if ( !filename ) {
+        TIXMLASSERT( false );
+        SetError( XML_ERROR_FILE_COULD_NOT_BE_OPENED, 0, "filename=<null>" );
+        return _errorID;
+    }
+
+    Clear();
+    FILE* fp = callfopen( filename, "rb" );
+    if ( !fp ) {
+        SetError( XML_ERROR_FILE_NOT_FOUND, 0, "filename=%s", filename );
+        return _errorID;
+    }
+    LoadSnapshot( fp );
+    fclose( fp );
+    return _errorID;
+}
+
+
+XMLError XMLDocument::LoadSnapshot( FILE* fp )
+{
+    Clear();
+    const size_t size = ReadFile( fp );
+    if ( size ) {
+        ParseSnapshot( size );
+        if ( Error() ) {
+            DeleteChildren();
+        }
+    }
+    return _errorID;
+}
+
+
+// Checks that a string reference of a snapshot is in the string table.
+static bool SnapshotStringValid( const char* strings, uint32_t stringBytes, uint32_t offset, uint32_t length )
+{
+    return offset < stringBytes && length < stringBytes - offset && strings[offset + length] == 0;
+}
+
+
+void XMLDocument::ParseSnapshot( size_t size )
+{
+    TIXMLASSERT( NoChildren() );
+    TIXMLASSERT( _charBuffer );
+
+    SnapshotHeader header;
+    if ( size < sizeof( header ) ) {
+        SetError( XML_ERROR_BAD_SNAPSHOT, 0, "file too small" );
+        return;
+    }
+    memcpy( &header, _charBuffer, sizeof( header ) );
+    if ( memcmp( header.magic, SNAPSHOT_MAGIC, sizeof( header.magic ) ) != 0 ) {
+        SetError( XML_ERROR_BAD_SNAPSHOT, 0, "not a snapshot" );
+        return;
+    }
+    if ( header.version != SNAPSHOT_VERSION ) {
+        SetError( XML_ERROR_BAD_SNAPSHOT, 0, "version=%u", static_cast<unsigned>( header.version ) );
+        return;
+    }
+    if ( header.byteOrder != SNAPSHOT_BYTE_ORDER ) {
+        SetError( XML_ERROR_BAD_SNAPSHOT, 0, "written with a different byte order" );
+        return;
+    }
+    // The counts are 32 bit, so the sums can't overflow 64 bits.
+    const unsigned long long expected = sizeof( header )
+        + static_cast<unsigned long long>( header.nodeCount ) * sizeof( SnapshotNode )
+        + static_cast<unsigned long long>( header.attributeCount ) * sizeof( SnapshotAttribute )
+        + header.stringBytes;
+    if ( expected != size ) {
+        SetError( XML_ERROR_BAD_SNAPSHOT, 0, "size=%llu expected=%llu", static_cast<unsigned long long>( size ), expected );
+        return;
+    }
+    _writeBOM = ( header.flags & SNAPSHOT_HAS_BOM ) != 0;
+
+    // The tables are 4 byte aligned in the file, and new[] aligns the buffer.
+    const SnapshotNode* nodeTable = reinterpret_cast<const SnapshotNode*>( _charBuffer + sizeof( header ) );
+    const SnapshotAttribute* attributeTable = reinterpret_cast<const SnapshotAttribute*>( nodeTable + header.nodeCount );
+    char* strings = reinterpret_cast<char*>( const_cast<SnapshotAttribute*>( attributeTable + header.attributeCount ) );
+
+    // Rebuilt nodes by table index plus one; the document is 0.
+    XMLNode** nodes = new XMLNode*[header.nodeCount + 1];
+    nodes[0] = this;
+    uint32_t nextAttribute = 0;
+    for ( uint32_t i = 0; i < header.nodeCount; ++i ) {
+        const SnapshotNode& entry = nodeTable[i];
+        if ( entry.parent > i
+                || ( entry.parent && !nodes[entry.parent]->ToElement() )
+                || !SnapshotStringValid( strings, header.stringBytes, entry.value, entry.valueLength )
+                || ( entry.attributeCount && entry.kind != SNAPSHOT_ELEMENT )
+                || entry.attributeCount > header.attributeCount - nextAttribute ) {
+            SetError( XML_ERROR_BAD_SNAPSHOT, entry.lineNum, "node=%u", static_cast<unsigned>( i ) );
+            break;
+        }
+
+        XMLNode* node = 0;
+        switch ( entry.kind ) {
+            case SNAPSHOT_ELEMENT:
+            {
+                XMLElement* element = CreateUnlinkedNode<XMLElement>( _elementPool );
+                XMLAttribute* last = 0;
+                for ( uint32_t j = 0; j < entry.attributeCount; ++j ) {
+                    const SnapshotAttribute& a = attributeTable[nextAttribute++];
+                    if ( !SnapshotStringValid( strings, header.stringBytes, a.name, a.nameLength )
+                            || !SnapshotStringValid( strings, header.stringBytes, a.value, a.valueLength ) ) {
+                        SetError( XML_ERROR_BAD_SNAPSHOT, a.lineNum, "node=%u", static_cast<unsigned>( i ) );
+                        break;
+                    }
+                    XMLAttribute* attrib = element->CreateAttribute();
+                    attrib->_name.Set( strings + a.name, strings + a.name + a.nameLength, 0 );
+                    attrib->_value.Set( strings + a.value, strings + a.value + a.valueLength, 0 );
+                    attrib->_parseLineNum = a.lineNum;
+                    if ( last ) {
+                        last->_next = attrib;
+                    }
+                    else {
+                        element->_rootAttribute = attrib;
+                    }
+                    last = attrib;
+                }
+                node = element;
+                break;
+            }
+            case SNAPSHOT_TEXT:
+            case SNAPSHOT_CDATA:
+            {
+                XMLText* text = CreateUnlinkedNode<XMLText>( _textPool );
+                text->SetCData( entry.kind == SNAPSHOT_CDATA );
+                node = text;
+                break;
+            }
+            case SNAPSHOT_COMMENT:
+                node = CreateUnlinkedNode<XMLComment>( _commentPool );
+                break;
+            case SNAPSHOT_DECLARATION:
+                node = CreateUnlinkedNode<XMLDeclaration>( _commentPool );
+                break;
+            case SNAPSHOT_UNKNOWN:
+                node = CreateUnlinkedNode<XMLUnknown>( _commentPool );
+                break;
+            default:
+                SetError( XML_ERROR_BAD_SNAPSHOT, entry.lineNum, "node=%u kind=%u", static_cast<unsigned>( i ), static_cast<unsigned>( entry.kind ) );
+                break;
+        }
+        if ( !node ) {
+            break;
+        }
+        node->_value.Set( strings + entry.value, strings + entry.value + entry.valueLength, 0 );
+        node->_parseLineNum = entry.lineNum;
+        nodes[entry.parent]->InsertEndChild( node );
+        nodes[i + 1] = node;
+        if ( Error() ) {
+            break;
+        }
+    }
+    delete [] nodes;
+}
+
+
+XMLError XMLDocument::Parse( const char* xml, size_t nBytes )
+{
+    Clear();
+
+    if ( nBytes == 0 || !xml || !*xml ) {
+        SetError( XML_ERROR_EMPTY_DOCUMENT, 0, 0 );
+        return _errorID;
+    }
+    if ( nBytes == static_cast<size_t>(-1) ) {
+        nBytes = strlen( xml );
+    }
+    TIXMLASSERT( _charBuffer == 0 );
+    _charBuffer = StrArena::NewBuffer( _allocator, nBytes+1 );
+    _charBufferSize = nBytes;
+    memcpy( _charBuffer, xml, nBytes );
+    _charBuffer[nBytes] = 0;
+
+    Parse();
+    if ( Error() ) {
+        // clean up now essentially dangling memory.
+        // and the parse fail can put objects in the
+        // pools that are dead and inaccessible.
+        DeleteChildren();
+        _elementPool.Clear();
+        _attributePool.Clear();
+        _textPool.Clear();
+        _commentPool.Clear();
+    }
+    return _errorID;
+}
+
+
+void XMLDocument::Print( XMLPrinter* streamer, int threads ) const
+{
+    if ( !streamer ) {
+        XMLPrinter stdoutStreamer( stdout );
+        Print( &stdoutStreamer, threads );
+    }
+    else if ( threads != 1 ) {
+        streamer->PrintParallel( *this, threads );
+    }
+    else {
+        Accept( streamer );
+    }
+}
+
+
+void XMLDocument::ClearError() {
+    _errorID = XML_SUCCESS;
+    _errorLineNum = 0;
+    _errorStr.Reset();
+}
+
+
+void XMLDocument::SetError( XMLError error, int lineNum, const char* format, ... )
+{
+    TIXMLASSERT( error >= 0 && error < XML_ERROR_COUNT );
+    _errorID = error;
+    _errorLineNum = lineNum;
+	_errorStr.Reset();
+
+    const size_t BUFFER_SIZE = 1000;
+    char* buffer = new char[BUFFER_SIZE];
+
+    TIXMLASSERT(sizeof(error) <= sizeof(int));
+    TIXML_SNPRINTF(buffer, BUFFER_SIZE, "Error=%s ErrorID=%d (0x%x) Line number=%d", ErrorIDToName(error), int(error), int(error), lineNum);
+
+	if (format) {
+		size_t len = strlen(buffer);
+		TIXML_SNPRINTF(buffer + len, BUFFER_SIZE - len, ": ");
+		len = strlen(buffer);
+
+		va_list va;
+		va_start(va, format);
+		TIXML_VSNPRINTF(buffer + len, BUFFER_SIZE - len, format, va);
+		va_end(va);
+	}
+	_errorStr.SetStr(buffer);
+	delete[] buffer;
+}
+
+
+/*static*/ const char* XMLDocument::ErrorIDToName(XMLError errorID)
+{
+	TIXMLASSERT( errorID >= 0 && errorID < XML_ERROR_COUNT );
+    const char* errorName = _errorNames[errorID];
+    TIXMLASSERT( errorName && errorName[0] );
+    return errorName;
+}
+
+const char* XMLDocument::ErrorStr() const
+{
+	return _errorStr.Empty() ? "" : _errorStr.GetStr();
+}
+
+
+void XMLDocument::PrintError() const
+{
+    printf("%s\n", ErrorStr());
+}
+
+const char* XMLDocument::ErrorName() const
+{
+    return ErrorIDToName(_errorID);
+}
+
+// Reserves room in 'pool' for 'bytes' of input, at an item per
+// 'bytesPerItem' bytes, but not more than the pool's largest block.
+template<int ITEM_SIZE>
+static void ReserveForInput( MemPoolT<ITEM_SIZE>* pool, size_t bytes, size_t bytesPerItem )
+{
+    const size_t items = bytes / bytesPerItem;
+    const size_t most = static_cast<size_t>( pool->MaxBlockItems() );
+    pool->Reserve( static_cast<int>( items < most ? items : most ) );
+}
+
+
+void XMLDocument::Parse()
+{
+    TIXMLASSERT( NoChildren() ); // Clear() must have been called previously
+    TIXMLASSERT( _charBuffer );
+    if ( _trackSpans ) {
+        TIXMLASSERT( !_source );
+        _source = StrArena::NewBuffer( _allocator, _charBufferSize + 1 );
+        memcpy( _source, _charBuffer, _charBufferSize + 1 );
+    }
+    _parseCurLineNum = 1;
+    _parseLineNum = 1;
+    char* p = _charBuffer;
+    p = XMLUtil::SkipWhiteSpace( p, &_parseCurLineNum );
+    p = const_cast<char*>( XMLUtil::ReadBOM( p, &_writeBOM ) );
+    if ( !*p ) {
+        SetError( XML_ERROR_EMPTY_DOCUMENT, 0, 0 );
+        return;
+    }
+    if ( !_lazyParsing ) {
+        // Estimated from the size, without a pass over the input: an
+        // element takes some dozens of bytes with its tags and the
+        // whitespace around them, and fewer of them hold text.
+        ReserveForInput( &_elementPool, _charBufferSize, 64 );
+        ReserveForInput( &_textPool, _charBufferSize, 128 );
+    }
+    ParseDeep(p, 0, &_parseCurLineNum );
+}
+
+// Records the span [start, end) of _charBuffer. Spans are recorded in
+// document order, except for what lazy parsing expands later.
+void XMLDocument::AddSpan( const char* key, const char* start, const char* end )
+{
+    SetSpan( ReserveSpan(), key, start, end );
+}
+
+
+// A place for the span of a node whose end isn't known yet, before the
+// spans of its attributes and children, so that they stay in key order.
+int XMLDocument::ReserveSpan()
+{
+    TIXMLASSERT( _source );
+    SourceSpan span = { 0, 0, 0 };
+    _spans.Push( span );
+    return _spans.Size() - 1;
+}
+
+
+void XMLDocument::SetSpan( int index, const char* key, const char* start, const char* end )
+{
+    TIXMLASSERT( start >= _charBuffer && end <= _charBuffer + _charBufferSize );
+    SourceSpan& span = _spans[index];
+    span.key = reinterpret_cast<uintptr_t>( key );
+    span.offset = start - _charBuffer;
+    span.length = end - start;
+    if ( index > 0 && _spans[index - 1].key > span.key ) {
+        _spansSorted = false;
+    }
+}
+
+
+// Drops the spans from 'index' on, of a node that was deleted.
+void XMLDocument::DropSpans( int index )
+{
+    if ( index >= 0 && index < _spans.Size() ) {
+        _spans.PopArr( _spans.Size() - index );
+    }
+}
+
+
+static int CompareSpanKeys( const void* a, const void* b )
+{
+    const uintptr_t x = *static_cast<const uintptr_t*>( a );
+    const uintptr_t y = *static_cast<const uintptr_t*>( b );
+    return x < y ? -1 : ( x > y ? 1 : 0 );
+}
+
+
+bool XMLDocument::FindSpan( const char* key, size_t* offset, size_t* length ) const
+{
+    if ( !_source || !key ) {
+        return false;
+    }
+    if ( !_spansSorted ) {
+        qsort( _spans.Mem(), _spans.Size(), sizeof( SourceSpan ), CompareSpanKeys );
+        _spansSorted = true;
+    }
+    const uintptr_t k = reinterpret_cast<uintptr_t>( key );
+    int lo = 0;
+    int hi = _spans.Size();
+    while ( lo < hi ) {
+        const int mid = lo + ( hi - lo ) / 2;
+        if ( _spans[mid].key < k ) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+    if ( lo == _spans.Size() || _spans[lo].key != k ) {
+        return false;
+    }
+    *offset = _spans[lo].offset;
+    *length = _spans[lo].length;
+    return true;
+}
+
+
+// The content of the element whose span is [offset, offset + length) of
+// 'source': from after its start tag to its end tag. False if the start
+// tag closes the element.
+static bool ElementContent( const char* source, size_t offset, size_t length, size_t* start, size_t* end )
+{
+    // A '>' in a quoted attribute value doesn't end the tag.
+    const char* p = source + offset;
+    char quote = 0;
+    while ( quote || *p != '>' ) {
+        if ( *p == quote ) {
+            quote = 0;
+        }
+        else if ( !quote && ( *p == '"' || *p == '\'' ) ) {
+            quote = *p;
+        }
+        ++p;
+    }
+    if ( *(p-1) == '/' ) {
+        return false;
+    }
+    *start = p + 1 - source;
+    size_t last = offset + length - 1;
+    while ( source[last] != '<' ) {
+        --last;
+    }
+    *end = last;
+    return true;
+}
+
+
+// The innermost element whose content holds [start, end) of _source, or
+// null. Lazily parsed content isn't expanded to look further.
+XMLElement* XMLDocument::ReparseTarget( size_t start, size_t end, size_t* contentStart, size_t* contentEnd ) const
+{
+    XMLElement* target = 0;
+    const XMLNode* parent = this;
+    while ( !( parent->_lazy & LAZY_CHILDREN ) ) {
+        // The first child that ends after the start of the edit.
+        const XMLNode* child = parent->_firstChild;
+        size_t offset = 0;
+        size_t length = 0;
+        for( ; child; child = child->_next ) {
+            if ( child->GetSourceSpan( &offset, &length ) && offset + length > start ) {
+                break;
+            }
+        }
+        size_t first = 0;
+        size_t last = 0;
+        if ( !child || !child->ToElement() || !ElementContent( _source, offset, length, &first, &last ) || start < first || end > last ) {
+            break;
+        }
+        target = const_cast<XMLElement*>( child->ToElement() );
+        *contentStart = first;
+        *contentEnd = last;
+        parent = target;
+    }
+    return target;
+}
+
+
+// Moves what lazy parsing has still to read of 'node' and its subtree
+// from 'oldBuffer' to _charBuffer, where the text from 'editEnd' on
+// is at 'newEditEnd', and adds 'lines' to their line numbers.
+void XMLDocument::ReparseMove( XMLNode* node, const char* oldBuffer, size_t editEnd, size_t newEditEnd, int lines )
+{
+    node->_parseLineNum += lines;
+    if ( XMLElement* element = node->ToElement() ) {
+        for( XMLAttribute* a = element->_rootAttribute; a; a = a->_next ) {
+            a->_parseLineNum += lines;
+        }
+        if ( element->_lazy ) {
+            size_t at = element->_lazySource - oldBuffer;
+            if ( at >= editEnd ) {
+                at = at - editEnd + newEditEnd;
+            }
+            element->_lazySource = _charBuffer + at;
+            element->_lazyLineNum += lines;
+        }
+    }
+    for( XMLNode* child = node->_firstChild; child; child = child->_next ) {
+        ReparseMove( child, oldBuffer, editEnd, newEditEnd, lines );
+    }
+}
+
+
+XMLError XMLDocument::Reparse( const char* xml, size_t nBytes, size_t offset, size_t replaced )
+{
+    if ( xml && nBytes == static_cast<size_t>(-1) ) {
+        nBytes = strlen( xml );
+    }
+    const size_t oldSize = SourceSize();
+    XMLElement* target = 0;
+    size_t contentStart = 0;
+    size_t contentEnd = 0;
+    if ( xml && _source && !Error() && offset <= oldSize && replaced <= oldSize - offset && nBytes + replaced >= oldSize ) {
+        target = ReparseTarget( offset, offset + replaced, &contentStart, &contentEnd );
+    }
+    if ( !target || target->Modified() ) {
+        return Parse( xml, nBytes );
+    }
+
+    size_t targetOffset = 0;
+    size_t targetLength = 0;
+    target->GetSourceSpan( &targetOffset, &targetLength );
+    const size_t editEnd = offset + replaced;
+    const size_t inserted = nBytes + replaced - oldSize;
+    const ptrdiff_t shift = static_cast<ptrdiff_t>( inserted ) - static_cast<ptrdiff_t>( replaced );
+    int lines = 0;
+    for( size_t i = offset; i < editEnd; ++i ) {
+        lines -= ( _source[i] == LF );
+    }
+    for( size_t i = offset; i < offset + inserted; ++i ) {
+        lines += ( xml[i] == LF );
+    }
+    int contentLineNum = target->_parseLineNum;
+    for( size_t i = targetOffset; i < contentStart; ++i ) {
+        contentLineNum += ( _source[i] == LF );
+    }
+
+    // The old buffer stays, for the strings of the nodes that are kept.
+    char* const oldBuffer = _charBuffer;
+    _strArena.AddBuffer( oldBuffer );
+    _charBuffer = StrArena::NewBuffer( _allocator, nBytes + 1 );
+    _charBufferSize = nBytes;
+    memcpy( _charBuffer, xml, nBytes );
+    _charBuffer[nBytes] = 0;
+    StrArena::ReleaseBuffer( _source );
+    _source = StrArena::NewBuffer( _allocator, nBytes + 1 );
+    memcpy( _source, _charBuffer, nBytes + 1 );
+
+    // Drop the spans of the old content and move the ones after it.
+    // Keys don't change, so the order does not either.
+    const bool sorted = _spansSorted;
+    int kept = 0;
+    for( int i = 0; i < _spans.Size(); ++i ) {
+        SourceSpan span = _spans[i];
+        if ( span.offset >= contentStart && span.offset < contentEnd ) {
+            continue;
+        }
+        if ( span.offset >= contentEnd ) {
+            span.offset += shift;
+        }
+        else if ( span.offset + span.length > contentStart ) {
+            span.length += shift;
+        }
+        _spans[kept++] = span;
+    }
+    _spans.PopArr( _spans.Size() - kept );
+
+    // Deleting the old content drops the hashes above it, but the
+    // nodes are no more Modified() than they were.
+    ++_parsingDepth;
+    target->DeleteChildren();
+    --_parsingDepth;
+    for( XMLNode* node = target; node; node = node->_parent ) {
+        node->_hashOptions = 0;
+    }
+
+    for( XMLNode* node = target; node != this; node = node->_parent ) {
+        for( XMLNode* next = node->_next; next; next = next->_next ) {
+            ReparseMove( next, oldBuffer, editEnd, offset + inserted, lines );
+        }
+        if ( _lazyParsing ) {
+            // Lazy content before the edit has to move too.
+            for( XMLNode* prev = node->_prev; prev; prev = prev->_prev ) {
+                ReparseMove( prev, oldBuffer, editEnd, offset + inserted, 0 );
+            }
+            XMLElement* element = node->ToElement();
+            if ( element->_lazy ) {
+                element->_lazySource = _charBuffer + ( element->_lazySource - oldBuffer );
+            }
+        }
+    }
+
+    _parseCurLineNum = contentLineNum;
+    StrPair endTag;
+    char* const p = target->XMLNode::ParseDeep( _charBuffer + contentStart, &endTag, &_parseCurLineNum );
+    if ( !p || Error() || p != _charBuffer + targetOffset + targetLength + shift || !XMLUtil::StringEqual( endTag.GetStr(), target->Name() ) ) {
+        // The edit reaches out of the element. 'xml' may be gone with
+        // the old text, so parse the copy.
+        char* const text = _source;
+        _source = 0;
+        Parse( text, nBytes );
+        StrArena::ReleaseBuffer( text );
+        return _errorID;
+    }
+
+    // The new spans are in document order: merge them in.
+    const int added = _spans.Size() - kept;
+    if ( sorted && added ) {
+        SourceSpan* const spans = _spans.Mem();
+        DynArray<SourceSpan, 16> run;
+        memcpy( run.PushArr( added ), spans + kept, added * sizeof( SourceSpan ) );
+        int i = kept - 1;
+        int j = added - 1;
+        for( int k = _spans.Size() - 1; j >= 0; --k ) {
+            if ( i >= 0 && spans[i].key > run[j].key ) {
+                spans[k] = spans[i--];
+            }
+            else {
+                spans[k] = run[j--];
+            }
+        }
+        _spansSorted = true;
+    }
+    return _errorID;
+}
+
+
+void XMLDocument::PushDepth()
+{
+	_parsingDepth++;
+	if (_parsingDepth == TINYXML2_MAX_ELEMENT_DEPTH) {
+		SetError(XML_ELEMENT_DEPTH_EXCEEDED, _parseCurLineNum, "Element nesting is too deep." );
+	}
+}
+
+void XMLDocument::PopDepth()
+{
+	TIXMLASSERT(_parsingDepth > 0);
+	--_parsingDepth;
+}
+
+// --------- Diff and Patch ----------- //
+//
+// A patch script is a <patch> element with the edits, in the order they
+// are applied:
+//   <delete path="P" index="i"/>           deletes child i of P
+//   <insert path="P" index="i">N</insert>  inserts a copy of N as child i of P
+//   <insert path="P" index="i" text="T"/>  ... a text node (cdata="true" for CDATA)
+//   <insert path="P" index="i" declaration="D"/>  ... a declaration
+//   <move path="P" from="i" index="j"/>    moves child i of P to be child j
+//   <set path="E" name="A" value="V"/>     sets attribute A of element E
+//   <remove path="E" name="A"/>            removes attribute A of element E
+//   <value path="N" value="V"/>            sets the value of N
+//   <value path="T" value="V" cdata="C"/>  ... and whether text T is CDATA
+// A path is child indices, from the document, separated by '/': the
+// document itself is "". Indices are those when the edit is applied.
+//
+// Diff() makes the children of a node like those of the node it is
+// compared with before it goes down into them, so the paths of the nodes
+// it goes down into are their paths in the new document.
+
+namespace {
+
+// A child, for sorting children by a key.
+struct DiffKey
+{
+    uint64_t    key;
+    int         index;
+};
+
+} // namespace
+
+static int CompareDiffKeys( const void* a, const void* b )
+{
+    const DiffKey* x = static_cast<const DiffKey*>( a );
+    const DiffKey* y = static_cast<const DiffKey*>( b );
+    if ( x->key != y->key ) {
+        return x->key < y->key ? -1 : 1;
+    }
+    return x->index - y->index;
+}
+
+// The first of 'keys' (sorted) with 'key', or keys.Size().
+static int LowerBound( const DynArray<DiffKey, 16>& keys, uint64_t key )
+{
+    int lo = 0;
+    int hi = keys.Size();
+    while ( lo < hi ) {
+        const int mid = lo + ( hi - lo ) / 2;
+        if ( keys[mid].key < key ) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// True if the text under 'a' and 'b', which are DeepEqual(), is CDATA in
+// the same places. DeepEqual() and Hash() don't compare it.
+static bool SameCData( const XMLNode* a, const XMLNode* b )
+{
+    if ( const XMLText* text = a->ToText() ) {
+        return text->CData() == b->ToText()->CData();
+    }
+    for( a = a->FirstChild(), b = b->FirstChild(); a && b; a = a->NextSibling(), b = b->NextSibling() ) {
+        if ( !SameCData( a, b ) ) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// What children have to share to be compared rather than replaced.
+static uint64_t PairKey( const XMLNode* node )
+{
+    return HashStr( HashCombine( FNV_OFFSET, node->Kind() ), node->ToElement() ? node->Value() : "" );
+}
+
+// A Fenwick tree of counts at positions 0 to tree.Size() - 1.
+static void FenwickAdd( DynArray<int, 16>* tree, int pos, int delta )
+{
+    for( ++pos; pos <= tree->Size(); pos += pos & -pos ) {
+        (*tree)[pos - 1] += delta;
+    }
+}
+
+// The sum of the counts at positions 0 to 'pos'.
+static int FenwickSum( const DynArray<int, 16>& tree, int pos )
+{
+    int sum = 0;
+    for( ++pos; pos > 0; pos -= pos & -pos ) {
+        sum += tree[pos - 1];
+    }
+    return sum;
+}
+
+namespace {
+
+class DiffWriter
+{
+public:
+    DiffWriter( XMLDocument* script ) : _builder( script, true ), _edits( 0 ) {
+        _builder.BeginElement( "patch" );
+    }
+
+    void Node( const XMLNode* from, const XMLNode* to );
+
+    int Edits() const {
+        return _edits;
+    }
+
+private:
+    void Attributes( const XMLElement* from, const XMLElement* to );
+    void Children( const XMLNode* from, const XMLNode* to );
+    void Begin( const char* edit );
+    void Insert( int index, const XMLNode* node );
+    void PushIndex( int index );
+
+    XMLBuilder          _builder;
+    DynArray<char, 64>  _path;
+    int                 _edits;
+};
+
+
+// Begins an edit of the node at _path; the caller ends it.
+void DiffWriter::Begin( const char* edit )
+{
+    _builder.BeginElement( edit );
+    _path.Push( 0 );
+    _builder.Attr( "path", _path.Mem() );
+    _path.Pop();
+    ++_edits;
+}
+
+
+void DiffWriter::PushIndex( int index )
+{
+    char buf[16];
+    TIXML_SNPRINTF( buf, sizeof( buf ), _path.Empty() ? "%d" : "/%d", index );
+    const int length = static_cast<int>( strlen( buf ) );
+    memcpy( _path.PushArr( length ), buf, length );
+}
+
+
+void DiffWriter::Node( const XMLNode* from, const XMLNode* to )
+{
+    TIXMLASSERT( from->Kind() == to->Kind() );
+    if ( const XMLElement* element = from->ToElement() ) {
+        TIXMLASSERT( XMLUtil::StringEqual( element->Name(), to->Value() ) );
+        Attributes( element, to->ToElement() );
+    }
+    else if ( !from->ToDocument() ) {
+        const XMLText* text = to->ToText();
+        const bool cdata = text && text->CData() != from->ToText()->CData();
+        if ( cdata || !XMLUtil::StringEqual( from->Value(), to->Value() ) ) {
+            Begin( "value" );
+            _builder.Attr( "value", to->Value() );
+            if ( cdata ) {
+                _builder.Attr( "cdata", text->CData() );
+            }
+            _builder.EndElement();
+        }
+    }
+    Children( from, to );
+}
+
+
+void DiffWriter::Attributes( const XMLElement* from, const XMLElement* to )
+{
+    for( const XMLAttribute* a = from->FirstAttribute(); a; a = a->Next() ) {
+        if ( !to->FindAttribute( a->Name() ) ) {
+            Begin( "remove" );
+            _builder.Attr( "name", a->Name() );
+            _builder.EndElement();
+        }
+    }
+    // The attributes in the same order in both are set in place. From the
+    // first one out of order on, they are removed and set again at the end.
+    const XMLAttribute* a = from->FirstAttribute();
+    const XMLAttribute* b = to->FirstAttribute();
+    for( ; b; a = a->Next(), b = b->Next() ) {
+        while ( a && !to->FindAttribute( a->Name() ) ) {
+            a = a->Next();
+        }
+        if ( !a || !XMLUtil::StringEqual( a->Name(), b->Name() ) ) {
+            break;
+        }
+        if ( !XMLUtil::StringEqual( a->Value(), b->Value() ) ) {
+            Begin( "set" );
+            _builder.Attr( "name", b->Name() );
+            _builder.Attr( "value", b->Value() );
+            _builder.EndElement();
+        }
+    }
+    if ( !b ) {
+        return;
+    }
+    for( ; a; a = a->Next() ) {
+        if ( to->FindAttribute( a->Name() ) ) {
+            Begin( "remove" );
+            _builder.Attr( "name", a->Name() );
+            _builder.EndElement();
+        }
+    }
+    for( ; b; b = b->Next() ) {
+        Begin( "set" );
+        _builder.Attr( "name", b->Name() );
+        _builder.Attr( "value", b->Value() );
+        _builder.EndElement();
+    }
+}
+
+
+void DiffWriter::Insert( int index, const XMLNode* node )
+{
+    Begin( "insert" );
+    _builder.Attr( "index", index );
+    if ( const XMLText* text = node->ToText() ) {
+        // As an attribute, so that whitespace survives.
+        _builder.Attr( "text", text->Value() );
+        if ( text->CData() ) {
+            _builder.Attr( "cdata", true );
+        }
+    }
+    else if ( node->ToDeclaration() ) {
+        _builder.Attr( "declaration", node->Value() );
+    }
+    else {
+        XMLNode* insert = _builder.Current();
+        insert->InsertEndChild( node->DeepClone( insert->GetDocument() ) );
+    }
+    _builder.EndElement();
+}
+
+
+void DiffWriter::Children( const XMLNode* from, const XMLNode* to )
+{
+    DynArray<const XMLNode*, 16> f;
+    DynArray<const XMLNode*, 16> t;
+    for( const XMLNode* child = from->FirstChild(); child; child = child->NextSibling() ) {
+        f.Push( child );
+    }
+    for( const XMLNode* child = to->FirstChild(); child; child = child->NextSibling() ) {
+        t.Push( child );
+    }
+    const int n = f.Size();
+    const int m = t.Size();
+    if ( n == 0 && m == 0 ) {
+        return;
+    }
+    DynArray<int, 16> matchF;
+    DynArray<int, 16> matchT;
+    DynArray<char, 16> equal;       // of t: the match is equal
+    for( int i = 0; i < n; ++i ) {
+        matchF.Push( -1 );
+    }
+    for( int j = 0; j < m; ++j ) {
+        matchT.Push( -1 );
+        equal.Push( 0 );
+    }
+
+    // Equal subtrees are matched first, by hash, in order. 'next' is the
+    // next one to take from each run of equal keys.
+    DynArray<DiffKey, 16> keys;
+    DynArray<int, 16> next;
+    for( int i = 0; i < n; ++i ) {
+        DiffKey key = { f[i]->Hash(), i };
+        keys.Push( key );
+        next.Push( i );
+    }
+    qsort( keys.Mem(), n, sizeof( DiffKey ), CompareDiffKeys );
+    for( int j = 0; j < m; ++j ) {
+        const uint64_t hash = t[j]->Hash();
+        const int run = LowerBound( keys, hash );
+        if ( run == n || keys[run].key != hash ) {
+            continue;
+        }
+        const int k = next[run];
+        if ( k < n && keys[k].key == hash && f[keys[k].index]->DeepEqual( t[j] ) ) {
+            matchF[keys[k].index] = j;
+            matchT[j] = keys[k].index;
+            // Otherwise it is gone into for the text that is CDATA.
+            equal[j] = SameCData( f[keys[k].index], t[j] );
+            next[run] = k + 1;
+        }
+    }
+
+    // The rest are paired by kind and element name, in order.
+    keys.Clear();
+    next.Clear();
+    for( int i = 0; i < n; ++i ) {
+        if ( matchF[i] < 0 ) {
+            DiffKey key = { PairKey( f[i] ), i };
+            keys.Push( key );
+            next.Push( keys.Size() - 1 );
+        }
+    }
+    qsort( keys.Mem(), keys.Size(), sizeof( DiffKey ), CompareDiffKeys );
+    for( int j = 0; j < m; ++j ) {
+        if ( matchT[j] >= 0 ) {
+            continue;
+        }
+        const uint64_t key = PairKey( t[j] );
+        const int run = LowerBound( keys, key );
+        if ( run == keys.Size() || keys[run].key != key ) {
+            continue;
+        }
+        const int k = next[run];
+        if ( k < keys.Size() && keys[k].key == key ) {
+            const XMLNode* node = f[keys[k].index];
+            if ( node->Kind() == t[j]->Kind() && ( !node->ToElement() || XMLUtil::StringEqual( node->Value(), t[j]->Value() ) ) ) {
+                matchF[keys[k].index] = j;
+                matchT[j] = keys[k].index;
+                next[run] = k + 1;
+            }
+        }
+    }
+
+    // The matched children that stay are a longest increasing run of
+    // their old indices, in their new order.
+    DynArray<int, 16> seq;          // new indices of the matched
+    DynArray<int, 16> prev;         // of seq: the one before in the run
+    DynArray<int, 16> tails;        // the last of the best run of each length
+    for( int j = 0; j < m; ++j ) {
+        if ( matchT[j] < 0 ) {
+            continue;
+        }
+        const int old = matchT[j];
+        int lo = 0;
+        int hi = tails.Size();
+        while ( lo < hi ) {
+            const int mid = lo + ( hi - lo ) / 2;
+            if ( matchT[seq[tails[mid]]] < old ) {
+                lo = mid + 1;
+            }
+            else {
+                hi = mid;
+            }
+        }
+        prev.Push( lo > 0 ? tails[lo - 1] : -1 );
+        if ( lo == tails.Size() ) {
+            tails.Push( seq.Size() );
+        }
+        else {
+            tails[lo] = seq.Size();
+        }
+        seq.Push( j );
+    }
+    DynArray<char, 16> stays;       // of t
+    for( int j = 0; j < m; ++j ) {
+        stays.Push( 0 );
+    }
+    for( int q = tails.Empty() ? -1 : tails.PeekTop(); q >= 0; q = prev[q] ) {
+        stays[seq[q]] = 1;
+    }
+
+    for( int i = n - 1; i >= 0; --i ) {
+        if ( matchF[i] < 0 ) {
+            Begin( "delete" );
+            _builder.Attr( "index", i );
+            _builder.EndElement();
+        }
+    }
+
+    // Each child that doesn't stay is moved or inserted right after the
+    // one before it in the new order. Children are counted in groups: a
+    // staying child (at 1 + its rank among the matched in old order) with
+    // those put after it, the ones put first (at 0), and each child not
+    // yet moved (at 1 + its rank).
+    DynArray<int, 16> rank;         // of f
+    DynArray<int, 16> counts;
+    counts.Push( 0 );
+    for( int i = 0; i < n; ++i ) {
+        rank.Push( counts.Size() - 1 );
+        if ( matchF[i] >= 0 ) {
+            counts.Push( 0 );
+        }
+    }
+    for( int r = 1; r < counts.Size(); ++r ) {
+        FenwickAdd( &counts, r, 1 );
+    }
+    int group = 0;
+    for( int j = 0; j < m; ++j ) {
+        if ( stays[j] ) {
+            group = rank[matchT[j]] + 1;
+            continue;
+        }
+        if ( matchT[j] >= 0 ) {
+            const int pos = rank[matchT[j]] + 1;
+            const int index = FenwickSum( counts, pos - 1 );
+            FenwickAdd( &counts, pos, -1 );
+            const int toIndex = FenwickSum( counts, group );
+            if ( toIndex != index ) {
+                Begin( "move" );
+                _builder.Attr( "from", index );
+                _builder.Attr( "index", toIndex );
+                _builder.EndElement();
+            }
+        }
+        else {
+            Insert( FenwickSum( counts, group ), t[j] );
+        }
+        FenwickAdd( &counts, group, 1 );
+    }
+
+    for( int j = 0; j < m; ++j ) {
+        if ( matchT[j] >= 0 && !equal[j] ) {
+            const int length = _path.Size();
+            PushIndex( j );
+            Node( f[matchT[j]], t[j] );
+            _path.PopArr( _path.Size() - length );
+        }
+    }
+}
+
+// The child found last at one depth of the paths of a patch.
+struct PatchCursor
+{
+    XMLNode*    parent;
+    XMLNode*    child;
+    int         index;
+};
+
+} // namespace
+
+
+// Child 'index' of 'parent', found from the cursor when it is nearer
+// than the first child.
+static XMLNode* PatchChild( XMLNode* parent, int index, PatchCursor* cursor )
+{
+    XMLNode* child = parent->FirstChild();
+    int at = 0;
+    if ( cursor->parent == parent && cursor->index - index < index ) {
+        child = cursor->child;
+        at = cursor->index;
+    }
+    while ( child && at < index ) {
+        child = child->NextSibling();
+        ++at;
+    }
+    while ( child && at > index ) {
+        child = child->PreviousSibling();
+        --at;
+    }
+    if ( child ) {
+        cursor->parent = parent;
+        cursor->child = child;
+        cursor->index = index;
+    }
+    return child;
+}
+
+
+// The node at 'path', at depth 'depth', or null if there is none.
+static XMLNode* PatchNode( XMLDocument* doc, const char* path, DynArray<PatchCursor, 16>* cursors, int* depth )
+{
+    XMLNode* node = doc;
+    int d = 0;
+    for( const char* p = path; *p; ++d ) {
+        if ( d > 0 && *p++ != '/' ) {
+            return 0;
+        }
+        if ( *p < '0' || *p > '9' ) {
+            return 0;
+        }
+        int index = 0;
+        for( ; *p >= '0' && *p <= '9'; ++p ) {
+            if ( index > ( INT_MAX - 9 ) / 10 ) {
+                return 0;
+            }
+            index = index * 10 + ( *p - '0' );
+        }
+        if ( d == cursors->Size() ) {
+            PatchCursor cursor = { 0, 0, 0 };
+            cursors->Push( cursor );
+        }
+        node = PatchChild( node, index, &(*cursors)[d] );
+        if ( !node ) {
+            return 0;
+        }
+    }
+    *depth = d;
+    return node;
+}
+
+
+// Applies one edit of a patch; false if it doesn't fit the document.
+static bool PatchEdit( XMLDocument* doc, const XMLElement* edit, DynArray<PatchCursor, 16>* cursors )
+{
+    const char* path = edit->Attribute( "path" );
+    int depth = 0;
+    XMLNode* node = path ? PatchNode( doc, path, cursors, &depth ) : 0;
+    if ( !node ) {
+        return false;
+    }
+    const char* name = edit->Name();
+    if ( XMLUtil::StringEqual( name, "value" ) ) {
+        const char* value = edit->Attribute( "value" );
+        const char* cdata = edit->Attribute( "cdata" );
+        if ( !value || node->ToDocument() || node->ToElement() || ( cdata && !node->ToText() ) ) {
+            return false;
+        }
+        node->SetValue( value );
+        if ( cdata ) {
+            node->ToText()->SetCData( edit->BoolAttribute( "cdata" ) );
+        }
+        return true;
+    }
+    if ( XMLUtil::StringEqual( name, "set" ) || XMLUtil::StringEqual( name, "remove" ) ) {
+        XMLElement* element = node->ToElement();
+        const char* attribute = edit->Attribute( "name" );
+        if ( !element || !attribute ) {
+            return false;
+        }
+        if ( name[0] == 's' ) {
+            const char* value = edit->Attribute( "value" );
+            if ( !value ) {
+                return false;
+            }
+            element->SetAttribute( attribute, value );
+        }
+        else {
+            if ( !element->FindAttribute( attribute ) ) {
+                return false;
+            }
+            element->DeleteAttribute( attribute );
+        }
+        return true;
+    }
+
+    // The rest change the children of 'node', so the cursors below it
+    // may not be valid any more.
+    int index = 0;
+    if ( ( !node->ToDocument() && !node->ToElement() ) || edit->QueryIntAttribute( "index", &index ) != XML_SUCCESS || index < 0 ) {
+        return false;
+    }
+    if ( depth == cursors->Size() ) {
+        PatchCursor empty = { 0, 0, 0 };
+        cursors->Push( empty );
+    }
+    cursors->PopArr( cursors->Size() - depth - 1 );
+    PatchCursor* cursor = &(*cursors)[depth];
+
+    if ( XMLUtil::StringEqual( name, "delete" ) ) {
+        XMLNode* child = PatchChild( node, index, cursor );
+        if ( !child ) {
+            return false;
+        }
+        cursor->parent = 0;
+        node->DeleteChild( child );
+        return true;
+    }
+
+    XMLNode* child = 0;
+    int from = -1;
+    if ( XMLUtil::StringEqual( name, "move" ) ) {
+        if ( edit->QueryIntAttribute( "from", &from ) != XML_SUCCESS || from < 0 ) {
+            return false;
+        }
+        child = PatchChild( node, from, cursor );
+    }
+    else if ( XMLUtil::StringEqual( name, "insert" ) ) {
+        const XMLNode* content = edit->FirstChild();
+        if ( const char* text = edit->Attribute( "text" ) ) {
+            XMLText* textNode = doc->NewText( text );
+            textNode->SetCData( edit->BoolAttribute( "cdata" ) );
+            child = textNode;
+        }
+        else if ( const char* declaration = edit->Attribute( "declaration" ) ) {
+            child = doc->NewDeclaration( declaration );
+        }
+        else if ( content && !content->NextSibling() && !content->ToText() ) {
+            child = content->DeepClone( doc );
+        }
+    }
+    if ( !child ) {
+        return false;
+    }
+
+    // Insert after child index - 1, counting without 'child' if it is
+    // moved from before there.
+    bool inserted = false;
+    if ( index == 0 ) {
+        inserted = node->InsertFirstChild( child ) != 0;
+    }
+    else if ( XMLNode* after = PatchChild( node, ( from >= 0 && from < index ) ? index : index - 1, cursor ) ) {
+        inserted = node->InsertAfterChild( after, child ) != 0;
+    }
+    if ( !inserted ) {
+        if ( from < 0 ) {
+            doc->DeleteNode( child );
+        }
+        return false;
+    }
+    cursor->parent = node;
+    cursor->child = child;
+    cursor->index = index;
+    return true;
+}
+
+
+int XMLDocument::Diff( const XMLDocument* to, XMLDocument* script ) const
+{
+    TIXMLASSERT( to && script );
+    TIXMLASSERT( script != this && script != to );
+    script->Clear();
+    DiffWriter writer( script );
+    writer.Node( this, to );
+    return writer.Edits();
+}
+
+
+XMLError XMLDocument::Patch( const XMLDocument* script )
+{
+    TIXMLASSERT( script );
+    ClearError();
+    const XMLElement* root = script->RootElement();
+    if ( !root || !XMLUtil::StringEqual( root->Name(), "patch" ) ) {
+        SetError( XML_ERROR_BAD_PATCH, 0, "not a patch" );
+        return _errorID;
+    }
+    DynArray<PatchCursor, 16> cursors;
+    for( const XMLElement* edit = root->FirstChildElement(); edit; edit = edit->NextSiblingElement() ) {
+        if ( !PatchEdit( this, edit, &cursors ) ) {
+            SetError( XML_ERROR_BAD_PATCH, edit->GetLineNum(), "edit=%s", edit->Name() );
+            break;
+        }
+    }
+    return _errorID;
+}
+
+
+// --------- XMLBuilder ----------- //
+
+XMLBuilder::XMLBuilder( XMLNode* parent, bool uniqueAttributes ) :
+    _document( 0 ),
+    _current( parent ),
+    _lastAttribute( 0 ),
+    _depth( 0 ),
+    _uniqueAttributes( uniqueAttributes )
+{
+    TIXMLASSERT( parent );
+    TIXMLASSERT( parent->ToDocument() || parent->ToElement() );
+    _document = parent->GetDocument();
+    // Expand a lazily parsed parent before appending to it; its
+    // attributes are read by Attr().
+    parent->LastChild();
+}
+
+
+void XMLBuilder::BeginElement( const char* name )
+{
+    TIXMLASSERT( name );
+    XMLElement* element = _document->CreateLastChild<XMLElement>( _document->_elementPool, _current );
+    element->SetValue( name, false );
+    _current = element;
+    _lastAttribute = 0;
+    ++_depth;
+}
+
+
+void XMLBuilder::Attr( const char* name, const char* value )
+{
+    TIXMLASSERT( name && value );
+    XMLElement* element = _current->ToElement();
+    TIXMLASSERT( element );
+    if ( !_uniqueAttributes ) {
+        element->SetAttribute( name, value );
+        return;
+    }
+    if ( !_lastAttribute ) {
+        element->MaterializeAttributes();
+        for( XMLAttribute* a = element->_rootAttribute; a; a = a->_next ) {
+            _lastAttribute = a;
+        }
+    }
+    XMLAttribute* attrib = element->CreateAttribute();
+    if ( _lastAttribute ) {
+        _lastAttribute->_next = attrib;
+    }
+    else {
+        element->_rootAttribute = attrib;
+    }
+    _lastAttribute = attrib;
+    attrib->SetName( name );
+    attrib->SetAttribute( value );
+    element->Changed();
+}
+
+
+void XMLBuilder::Attr( const char* name, int v )
+{
+    char buf[BUF_SIZE];
+    XMLUtil::ToStr( v, buf, BUF_SIZE );
+    Attr( name, buf );
+}
+
+
+void XMLBuilder::Attr( const char* name, unsigned v )
+{
+    char buf[BUF_SIZE];
+    XMLUtil::ToStr( v, buf, BUF_SIZE );
+    Attr( name, buf );
+}
+
+
+void XMLBuilder::Attr( const char* name, int64_t v )
+{
+    char buf[BUF_SIZE];
+    XMLUtil::ToStr( v, buf, BUF_SIZE );
+    Attr( name, buf );
+}
+
+
+void XMLBuilder::Attr( const char* name, uint64_t v )
+{
+    char buf[BUF_SIZE];
+    XMLUtil::ToStr( v, buf, BUF_SIZE );
+    Attr( name, buf );
+}
+
+
+void XMLBuilder::Attr( const char* name, bool v )
+{
+    char buf[BUF_SIZE];
+    XMLUtil::ToStr( v, buf, BUF_SIZE );
+    Attr( name, buf );
+}
+
+
+void XMLBuilder::Attr( const char* name, double v )
+{
+    char buf[BUF_SIZE];
+    XMLUtil::ToStr( v, buf, BUF_SIZE );
+    Attr( name, buf );
+}
+
+
+void XMLBuilder::Text( const char* text, bool cdata )
+{
+    TIXMLASSERT( text );
+    XMLText* node = _document->CreateLastChild<XMLText>( _document->_textPool, _current );
+    node->SetValue( text, false );
+    node->SetCData( cdata );
+}
+
+
+void XMLBuilder::Text( int v )
+{
+    char buf[BUF_SIZE];
+    XMLUtil::ToStr( v, buf, BUF_SIZE );
+    Text( buf );
+}
+
+
+void XMLBuilder::Text( unsigned v )
+{
+    char buf[BUF_SIZE];
+    XMLUtil::ToStr( v, buf, BUF_SIZE );
+    Text( buf );
+}
+
+
+void XMLBuilder::Text( int64_t v )
+{
+    char buf[BUF_SIZE];
+    XMLUtil::ToStr( v, buf, BUF_SIZE );
+    Text( buf );
+}
+
+
+void XMLBuilder::Text( uint64_t v )
+{
+    char buf[BUF_SIZE];
+    XMLUtil::ToStr( v, buf, BUF_SIZE );
+    Text( buf );
+}
+
+
+void XMLBuilder::Text( bool v )
+{
+    char buf[BUF_SIZE];
+    XMLUtil::ToStr( v, buf, BUF_SIZE );
+    Text( buf );
+}
+
+
+void XMLBuilder::Text( double v )
+{
+    char buf[BUF_SIZE];
+    XMLUtil::ToStr( v, buf, BUF_SIZE );
+    Text( buf );
+}
+
+
+void XMLBuilder::EndElement()
+{
+    TIXMLASSERT( _depth > 0 );
+    _current = _current->Parent();
+    _lastAttribute = 0;
+    --_depth;
+}
+
+
+// --------- XMLCompactNode ----------- //
+
+bool XMLCompactNode::IsDocument() const
+{
+    return _document && _index == 0;
+}
+
+
+bool XMLCompactNode::IsElement() const
+{
+    return _document && XMLCompactDocument::Kind( _document->NodeAt( _index ) ) == XMLCompactDocument::KIND_ELEMENT;
+}
+
+
+bool XMLCompactNode::IsText() const
+{
+    if ( !_document ) {
+        return false;
+    }
+    const int kind = XMLCompactDocument::Kind( _document->NodeAt( _index ) );
+    return kind == XMLCompactDocument::KIND_TEXT || kind == XMLCompactDocument::KIND_CDATA;
+}
+
+
+bool XMLCompactNode::IsComment() const
+{
+    return _document && XMLCompactDocument::Kind( _document->NodeAt( _index ) ) == XMLCompactDocument::KIND_COMMENT;
+}
+
+
+bool XMLCompactNode::IsDeclaration() const
+{
+    return _document && XMLCompactDocument::Kind( _document->NodeAt( _index ) ) == XMLCompactDocument::KIND_DECLARATION;
+}
+
+
+bool XMLCompactNode::IsUnknown() const
+{
+    return _document && XMLCompactDocument::Kind( _document->NodeAt( _index ) ) == XMLCompactDocument::KIND_UNKNOWN;
+}
+
+
+bool XMLCompactNode::CData() const
+{
+    return _document && XMLCompactDocument::Kind( _document->NodeAt( _index ) ) == XMLCompactDocument::KIND_CDATA;
+}
+
+
+const char* XMLCompactNode::Value() const
+{
+    if ( !_document || _index == 0 ) {
+        return 0;
+    }
+    return _document->_charBuffer + _document->NodeAt( _index ).value;
+}
+
+
+size_t XMLCompactNode::ValueLength() const
+{
+    if ( !_document ) {
+        return 0;
+    }
+    return _document->NodeAt( _index ).valueLength;
+}
+
+
+const char* XMLCompactNode::Name() const
+{
+    return IsElement() ? Value() : 0;
+}
+
+
+int XMLCompactNode::GetLineNum() const
+{
+    if ( !_document ) {
+        return 0;
+    }
+    return _document->NodeAt( _index ).lineNum;
+}
+
+
+XMLCompactNode XMLCompactNode::Parent() const
+{
+    if ( !_document || _index == 0 ) {
+        return XMLCompactNode();
+    }
+    return XMLCompactNode( _document, _document->NodeAt( _index ).parent );
+}
+
+
+XMLCompactNode XMLCompactNode::FirstChild() const
+{
+    if ( !_document ) {
+        return XMLCompactNode();
+    }
+    const uint32_t child = _document->NodeAt( _index ).firstChild;
+    return child ? XMLCompactNode( _document, child ) : XMLCompactNode();
+}
+
+
+XMLCompactNode XMLCompactNode::NextSibling() const
+{
+    if ( !_document ) {
+        return XMLCompactNode();
+    }
+    const uint32_t sibling = _document->NodeAt( _index ).nextSibling;
+    return sibling ? XMLCompactNode( _document, sibling ) : XMLCompactNode();
+}
+
+
+XMLCompactNode XMLCompactNode::FirstChildElement( const char* name ) const
+{
+    for( XMLCompactNode node = FirstChild(); !node.IsNull(); node = node.NextSibling() ) {
+        if ( node.IsElement() && ( !name || XMLUtil::StringEqual( node.Value(), name ) ) ) {
+            return node;
+        }
+    }
+    return XMLCompactNode();
+}
+
+
+XMLCompactNode XMLCompactNode::NextSiblingElement( const char* name ) const
+{
+    for( XMLCompactNode node = NextSibling(); !node.IsNull(); node = node.NextSibling() ) {
+        if ( node.IsElement() && ( !name || XMLUtil::StringEqual( node.Value(), name ) ) ) {
+            return node;
+        }
+    }
+    return XMLCompactNode();
+}
+
+
+int XMLCompactNode::AttributeCount() const
+{
+    if ( !IsElement() ) {
+        return 0;
+    }
+    return static_cast<int>( _document->NodeAt( _index ).kindAndAttributes >> XMLCompactDocument::KIND_BITS );
+}
+
+
+const char* XMLCompactNode::AttributeName( int i ) const
+{
+    if ( i < 0 || i >= AttributeCount() ) {
+        return 0;
+    }
+    const uint32_t attribute = _document->NodeAt( _index ).firstAttribute + static_cast<uint32_t>( i );
+    return _document->_charBuffer + _document->AttributeAt( attribute ).name;
+}
+
+
+const char* XMLCompactNode::AttributeValue( int i ) const
+{
+    if ( i < 0 || i >= AttributeCount() ) {
+        return 0;
+    }
+    const uint32_t attribute = _document->NodeAt( _index ).firstAttribute + static_cast<uint32_t>( i );
+    return _document->_charBuffer + _document->AttributeAt( attribute ).value;
+}
+
+
+const char* XMLCompactNode::Attribute( const char* name, const char* value ) const
+{
+    const int count = AttributeCount();
+    for( int i = 0; i < count; ++i ) {
+        if ( XMLUtil::StringEqual( AttributeName( i ), name ) ) {
+            const char* attributeValue = AttributeValue( i );
+            if ( !value || XMLUtil::StringEqual( attributeValue, value ) ) {
+                return attributeValue;
+            }
+            return 0;
+        }
+    }
+    return 0;
+}
+
+
+int XMLCompactNode::IntAttribute( const char* name, int defaultValue ) const
+{
+    const char* str = Attribute( name );
+    int i = defaultValue;
+    if ( !str || !XMLUtil::ToInt( str, &i ) ) {
+        return defaultValue;
+    }
+    return i;
+}
+
+
+const char* XMLCompactNode::GetText() const
+{
+    /* skip comment node */
+    XMLCompactNode node = FirstChild();
+    while ( node.IsComment() ) {
+        node = node.NextSibling();
+    }
+    return node.IsText() ? node.Value() : 0;
+}
+
+
+// --------- XMLCompactDocument ----------- //
+
+XMLCompactDocument::XMLCompactDocument( bool processEntities, Whitespace whitespaceMode ) :
+    _processEntities( processEntities ),
+    _whitespaceMode( whitespaceMode ),
+    _errorID( XML_SUCCESS ),
+    _errorLineNum( 0 ),
+    _charBuffer( 0 ),
+    _charBufferSize( 0 ),
+    _parseCurLineNum( 0 ),
+    _writeBOM( false ),
+    _nodes(),
+    _attributes(),
+    _lastChild()
+{
+    Clear();
+}
+
+
+XMLCompactDocument::~XMLCompactDocument()
+{
+    if ( _charBuffer ) {
+        StrArena::ReleaseBuffer( _charBuffer );
+    }
+}
+
+
+void XMLCompactDocument::Clear()
+{
+    _nodes.Clear();
+    _attributes.Clear();
+    _lastChild.Clear();
+    AddNode( KIND_DOCUMENT, 0, 0, 0, 0 );
+
+    _errorID = XML_SUCCESS;
+    _errorLineNum = 0;
+    _writeBOM = false;
+    if ( _charBuffer ) {
+        StrArena::ReleaseBuffer( _charBuffer );
+    }
+    _charBuffer = 0;
+    _charBufferSize = 0;
+}
+
+
+XMLError XMLCompactDocument::Parse( const char* xml, size_t nBytes )
+{
+    Clear();
+
+    if ( nBytes == 0 || !xml || !*xml ) {
+        SetError( XML_ERROR_EMPTY_DOCUMENT, 0 );
+        return _errorID;
+    }
+    if ( nBytes == static_cast<size_t>(-1) ) {
+        nBytes = strlen( xml );
+    }
+    _charBuffer = StrArena::NewBuffer( XMLAllocator::Default(), nBytes+1 );
+    _charBufferSize = nBytes;
+    memcpy( _charBuffer, xml, nBytes );
+    _charBuffer[nBytes] = 0;
+
+    Parse();
+    return _errorID;
+}
+
+
+XMLError XMLCompactDocument::LoadFile( const char* filename )
+{
+    if ( !filename ) {
+        TIXMLASSERT( false );
+        SetError( XML_ERROR_FILE_COULD_NOT_BE_OPENED, 0 );
+        return _errorID;
+    }
+
+    Clear();
+    FILE* fp = callfopen( filename, "rb" );
+    if ( !fp ) {
+        SetError( XML_ERROR_FILE_NOT_FOUND, 0 );
+        return _errorID;
+    }
+    LoadFile( fp );
+    fclose( fp );
+    return _errorID;
+}
+
+
+XMLError XMLCompactDocument::LoadFile( FILE* fp )
+{
+    Clear();
+    const XMLError error = ReadFileToBuffer( fp, XMLAllocator::Default(), &_charBuffer, &_charBufferSize );
+    if ( error != XML_SUCCESS ) {
+        SetError( error, 0 );
+        return _errorID;
+    }
+    Parse();
+    return _errorID;
+}
+
+
+size_t XMLCompactDocument::MemoryUsage() const
+{
+    return static_cast<size_t>( _nodes.Capacity() ) * sizeof( Node )
+        + static_cast<size_t>( _attributes.Capacity() ) * sizeof( Attribute )
+        + static_cast<size_t>( _lastChild.Capacity() ) * sizeof( uint32_t )
+        + ( _charBuffer ? _charBufferSize + 1 : 0 );
+}
+
+
+void XMLCompactDocument::SetError( XMLError error, int lineNum )
+{
+    _errorID = error;
+    _errorLineNum = lineNum;
+}
+
+
+uint32_t XMLCompactDocument::AddNode( int kind, uint32_t parent, const char* start, const char* end, int lineNum )
+{
+    const uint32_t index = static_cast<uint32_t>( _nodes.Size() );
+    Node* node = _nodes.PushArr( 1 );
+    node->kindAndAttributes = static_cast<uint32_t>( kind );
+    node->parent = parent;
+    node->firstChild = 0;
+    node->nextSibling = 0;
+    node->value = start ? static_cast<uint32_t>( start - _charBuffer ) : 0;
+    node->valueLength = static_cast<uint32_t>( end - start );
+    node->firstAttribute = static_cast<uint32_t>( _attributes.Size() );
+    node->lineNum = lineNum;
+
+    if ( kind == KIND_DOCUMENT ) {
+        _lastChild.Push( 0 );
+    }
+    else {
+        uint32_t& last = _lastChild[_lastChild.Size() - 1];
+        if ( last ) {
+            _nodes[static_cast<int>( last )].nextSibling = index;
+        }
+        else {
+            _nodes[static_cast<int>( parent )].firstChild = index;
+        }
+        last = index;
+    }
+    return index;
+}
+
+
+// Decodes a string in place, as StrPair does for the other document.
+void XMLCompactDocument::Decode( uint32_t* offset, uint32_t* length, int flags )
+{
+    StrPair str;
+    str.Set( _charBuffer + *offset, _charBuffer + *offset + *length, flags );
+    const char* decoded = str.GetStr();
+    *offset = static_cast<uint32_t>( decoded - _charBuffer );
+    *length = static_cast<uint32_t>( strlen( decoded ) );
+}
+
+
+void XMLCompactDocument::Parse()
+{
+    TIXMLASSERT( _charBuffer );
+    if ( _charBufferSize >= 0xffffffffU ) {
+        // Strings are referenced by 32 bit offsets.
+        SetError( XML_ERROR_FILE_READ_ERROR, 0 );
+        return;
+    }
+
+    _parseCurLineNum = 1;
+    char* p = XMLUtil::SkipWhiteSpace( _charBuffer, &_parseCurLineNum );
+    p = const_cast<char*>( XMLUtil::ReadBOM( p, &_writeBOM ) );
+    if ( !*p ) {
+        SetError( XML_ERROR_EMPTY_DOCUMENT, 0 );
+        return;
+    }
+
+    // The strings can't be decoded (and null terminated) while parsing,
+    // since that would overwrite the markup that follows them. The nodes
+    // record where the raw strings are, and they are decoded at the end.
+    uint32_t parent = 0;    // the innermost open element, or the document
+    const char* content = 0;    // where the content of 'parent' starts
+    bool onlyDeclarations = true;
+    while ( !Error() ) {
+        char* const start = p;
+        const int startLine = _parseCurLineNum;
+        p = XMLUtil::SkipWhiteSpace( p, &_parseCurLineNum );
+        if ( !*p ) {
+            if ( parent ) {
+                // XMLDocument reports an element cut off right after its
+                // start tag as mismatched, and one cut off later as not parsed.
+                SetError( p == content ? XML_ERROR_MISMATCHED_ELEMENT : XML_ERROR_PARSING, NodeAt( parent ).lineNum );
+            }
+            break;
+        }
+        const int lineNum = _parseCurLineNum;
+        const bool topLevel = ( parent == 0 );
+
+        // Same order as XMLDocument::Identify()
+        if ( XMLUtil::StringEqual( p, "<?", 2 ) ) {
+            char* const value = p + 2;
+            p = SkipPast( value, "?>", &_parseCurLineNum );
+            if ( !p || parent || !onlyDeclarations ) {
+                // Declarations are only allowed at document level, before anything else.
+                SetError( XML_ERROR_PARSING_DECLARATION, lineNum );
+                break;
+            }
+            AddNode( KIND_DECLARATION, parent, value, p - 2, lineNum );
+            continue;
+        }
+        else if ( XMLUtil::StringEqual( p, "<!--", 4 ) ) {
+            char* const value = p + 4;
+            p = SkipPast( value, "-->", &_parseCurLineNum );
+            if ( !p ) {
+                SetError( XML_ERROR_PARSING_COMMENT, lineNum );
+                break;
+            }
+            AddNode( KIND_COMMENT, parent, value, p - 3, lineNum );
+        }
+        else if ( XMLUtil::StringEqual( p, "<![CDATA[", 9 ) ) {
+            char* const value = p + 9;
+            p = SkipPast( value, "]]>", &_parseCurLineNum );
+            if ( !p ) {
+                SetError( XML_ERROR_PARSING_CDATA, lineNum );
+                break;
+            }
+            AddNode( KIND_CDATA, parent, value, p - 3, lineNum );
+        }
+        else if ( XMLUtil::StringEqual( p, "<!", 2 ) ) {
+            char* const value = p + 2;
+            p = SkipPast( value, ">", &_parseCurLineNum );
+            if ( !p ) {
+                SetError( XML_ERROR_PARSING_UNKNOWN, lineNum );
+                break;
+            }
+            AddNode( KIND_UNKNOWN, parent, value, p - 1, lineNum );
+        }
+        else if ( *p == '<' ) {
+            p = XMLUtil::SkipWhiteSpace( p + 1, &_parseCurLineNum );
+            if ( *p == '/' ) {
+                // An end tag closes the innermost open element.
+                char* const name = p + 1;
+                p = name;
+                if ( !XMLUtil::IsNameStartChar( static_cast<unsigned char>( *p ) ) ) {
+                    SetError( XML_ERROR_PARSING, lineNum );
+                    break;
+                }
+                while ( *p && XMLUtil::IsNameChar( static_cast<unsigned char>( *p ) ) ) {
+                    ++p;
+                }
+                char* const nameEnd = p;
+                // XMLDocument reads an end tag as it does a start tag, and
+                // drops its attributes; ended with "/>", it is an element.
+                const int firstAttribute = _attributes.Size();
+                bool closed = false;
+                p = ParseTag( p, lineNum, firstAttribute, &closed );
+                if ( !p ) {
+                    break;
+                }
+                if ( closed ) {
+                    const uint32_t element = AddNode( KIND_ELEMENT, parent, name, nameEnd, lineNum );
+                    Node& node = _nodes[static_cast<int>( element )];
+                    node.firstAttribute = static_cast<uint32_t>( firstAttribute );
+                    node.kindAndAttributes += static_cast<uint32_t>( _attributes.Size() - firstAttribute ) << KIND_BITS;
+                    if ( topLevel ) {
+                        onlyDeclarations = false;
+                    }
+                    continue;
+                }
+                _attributes.PopArr( _attributes.Size() - firstAttribute );
+                const size_t nameLength = nameEnd - name;
+                if ( !parent ) {
+                    // An end tag at document level ends the document.
+                    break;
+                }
+                const Node& open = NodeAt( parent );
+                if ( open.valueLength != nameLength || memcmp( _charBuffer + open.value, name, nameLength ) != 0 ) {
+                    SetError( XML_ERROR_MISMATCHED_ELEMENT, open.lineNum );
+                    break;
+                }
+                _lastChild.Pop();
+                parent = open.parent;
+                continue;
+            }
+
+            char* const name = p;
+            if ( !XMLUtil::IsNameStartChar( static_cast<unsigned char>( *p ) ) ) {
+                SetError( XML_ERROR_PARSING, lineNum );
+                break;
+            }
+            ++p;
+            while ( *p && XMLUtil::IsNameChar( static_cast<unsigned char>( *p ) ) ) {
+                ++p;
+            }
+            const uint32_t element = AddNode( KIND_ELEMENT, parent, name, p, lineNum );
+            const int firstAttribute = _attributes.Size();
+            bool closed = false;
+            p = ParseTag( p, lineNum, firstAttribute, &closed );
+            if ( !p ) {
+                break;
+            }
+            _nodes[static_cast<int>( element )].kindAndAttributes += static_cast<uint32_t>( _attributes.Size() - firstAttribute ) << KIND_BITS;
+            if ( !closed ) {
+                parent = element;
+                content = p;
+                _lastChild.Push( 0 );
+            }
+        }
+        else {
+            // Text; all of it counts, including leading white space.
+            p = start;
+            _parseCurLineNum = startLine;
+            p = SkipPast( p, "<", &_parseCurLineNum );
+            if ( !p ) {
+                SetError( XML_ERROR_PARSING_TEXT, lineNum );
+                break;
+            }
+            --p;
+            AddNode( KIND_TEXT, parent, start, p, lineNum );
+            if ( !*( p + 1 ) ) {
+                SetError( XML_ERROR_PARSING, lineNum );
+                break;
+            }
+        }
+        if ( topLevel ) {
+            onlyDeclarations = false;
+        }
+    }
+
+    if ( Error() ) {
+        _nodes.PopArr( _nodes.Size() - 1 );
+        _nodes[0].firstChild = 0;
+        _attributes.Clear();
+        _lastChild.Clear();
+        _lastChild.Push( 0 );
+        return;
+    }
+
+    int textFlags = _processEntities ? StrPair::TEXT_ELEMENT : StrPair::TEXT_ELEMENT_LEAVE_ENTITIES;
+    if ( _whitespaceMode == COLLAPSE_WHITESPACE ) {
+        textFlags |= StrPair::NEEDS_WHITESPACE_COLLAPSING;
+    }
+    for ( int i = 1; i < _nodes.Size(); ++i ) {
+        Node& node = _nodes[i];
+        int flags = StrPair::NEEDS_NEWLINE_NORMALIZATION;
+        switch ( Kind( node ) ) {
+            case KIND_ELEMENT:  flags = 0;                          break;
+            case KIND_TEXT:     flags = textFlags;                  break;
+            case KIND_COMMENT:  flags = StrPair::COMMENT;           break;
+            default:                                                break;
+        }
+        Decode( &node.value, &node.valueLength, flags );
+    }
+    const int valueFlags = _processEntities ? StrPair::ATTRIBUTE_VALUE : StrPair::ATTRIBUTE_VALUE_LEAVE_ENTITIES;
+    for ( int i = 0; i < _attributes.Size(); ++i ) {
+        Attribute& attribute = _attributes[i];
+        Decode( &attribute.name, &attribute.nameLength, StrPair::ATTRIBUTE_NAME );
+        Decode( &attribute.value, &attribute.valueLength, valueFlags );
+    }
+}
+
+
+// Reads the attributes and the end of a tag, from 'p' just past the
+// element name on line 'elementLineNum'. The attributes are added from
+// 'firstAttribute' on.
+char* XMLCompactDocument::ParseTag( char* p, int elementLineNum, int firstAttribute, bool* closed )
+{
+    while ( true ) {
+        p = XMLUtil::SkipWhiteSpace( p, &_parseCurLineNum );
+        if ( !*p ) {
+            SetError( XML_ERROR_PARSING_ELEMENT, elementLineNum );
+            return 0;
+        }
+        if ( XMLUtil::IsNameStartChar( static_cast<unsigned char>( *p ) ) ) {
+            const int lineNum = _parseCurLineNum;
+            char* const name = p;
+            ++p;
+            while ( *p && XMLUtil::IsNameChar( static_cast<unsigned char>( *p ) ) ) {
+                ++p;
+            }
+            const size_t nameLength = p - name;
+            p = XMLUtil::SkipWhiteSpace( p, &_parseCurLineNum );
+            if ( *p != '=' ) {
+                SetError( XML_ERROR_PARSING_ATTRIBUTE, lineNum );
+                return 0;
+            }
+            p = XMLUtil::SkipWhiteSpace( p + 1, &_parseCurLineNum );
+            if ( *p != '\"' && *p != '\'' ) {
+                SetError( XML_ERROR_PARSING_ATTRIBUTE, lineNum );
+                return 0;
+            }
+            const char endTag[2] = { *p, 0 };
+            char* const value = p + 1;
+            p = SkipPast( value, endTag, &_parseCurLineNum );
+            if ( !p ) {
+                SetError( XML_ERROR_PARSING_ATTRIBUTE, lineNum );
+                return 0;
+            }
+
+            for ( int i = firstAttribute; i < _attributes.Size(); ++i ) {
+                const Attribute& other = _attributes[i];
+                if ( other.nameLength == nameLength && memcmp( _charBuffer + other.name, name, nameLength ) == 0 ) {
+                    SetError( XML_ERROR_PARSING_ATTRIBUTE, lineNum );
+                    return 0;
+                }
+            }
+            Attribute* attribute = _attributes.PushArr( 1 );
+            attribute->name = static_cast<uint32_t>( name - _charBuffer );
+            attribute->nameLength = static_cast<uint32_t>( nameLength );
+            attribute->value = static_cast<uint32_t>( value - _charBuffer );
+            attribute->valueLength = static_cast<uint32_t>( p - 1 - value );
+            attribute->lineNum = lineNum;
+        }
+        else if ( *p == '>' ) {
+            *closed = false;
+            return p + 1;
+        }
+        else if ( *p == '/' && *(p+1) == '>' ) {
+            *closed = true;
+            return p + 2;
+        }
+        else {
+            SetError( XML_ERROR_PARSING_ELEMENT, elementLineNum );
+            return 0;
+        }
+    }
+}
+
+
+void XMLCompactDocument::CopyTo( XMLDocument* target ) const
+{
+    TIXMLASSERT( target );
+    target->Clear();
+    target->SetBOM( _writeBOM );
+
+    DynArray< XMLNode*, 32 > parents;
+    parents.Push( target );
+    XMLCompactNode node = FirstChild();
+    while ( !node.IsNull() ) {
+        XMLNode* copy = 0;
+        if ( node.IsElement() ) {
+            XMLElement* element = target->NewElement( node.Value() );
+            const int count = node.AttributeCount();
+            for ( int i = 0; i < count; ++i ) {
+                element->SetAttribute( node.AttributeName( i ), node.AttributeValue( i ) );
+            }
+            copy = element;
+        }
+        else if ( node.IsText() ) {
+            XMLText* text = target->NewText( node.Value() );
+            text->SetCData( node.CData() );
+            copy = text;
+        }
+        else if ( node.IsComment() ) {
+            copy = target->NewComment( node.Value() );
+        }
+        else if ( node.IsDeclaration() ) {
+            copy = target->NewDeclaration( node.Value() );
+        }
+        else {
+            TIXMLASSERT( node.IsUnknown() );
+            copy = target->NewUnknown( node.Value() );
+        }
+        parents.PeekTop()->InsertEndChild( copy );
+
+        // Next in document order.
+        if ( !node.FirstChild().IsNull() ) {
+            parents.Push( copy );
+            node = node.FirstChild();
+            continue;
+        }
+        while ( !node.IsNull() && node.NextSibling().IsNull() ) {
+            node = node.Parent();
+            if ( node.IsDocument() ) {
+                node = XMLCompactNode();
+            }
+            else {
+                parents.Pop();
+            }
+        }
+        if ( !node.IsNull() ) {
+            node = node.NextSibling();
+        }
+    }
+}
+
+
+// --------- XMLFrozenDocument ----------- //
+
+XMLFrozenDocument::XMLFrozenDocument()
+{
+    Clear();
+}
+
+
+void XMLFrozenDocument::Clear()
+{
+    _kinds.Clear();
+    _nameIds.Clear();
+    _parents.Clear();
+    _firstChildren.Clear();
+    _nextSiblings.Clear();
+    _values.Clear();
+    _attributeStarts.Clear();
+    _attributeNameIds.Clear();
+    _attributeValues.Clear();
+    _names.Clear();
+    _strings.Clear();
+
+    // The document node.
+    _kinds.Push( DOCUMENT_NODE );
+    _nameIds.Push( -1 );
+    _parents.Push( 0 );
+    _firstChildren.Push( 0 );
+    _nextSiblings.Push( 0 );
+    _values.Push( 0 );
+    _attributeStarts.Push( 0 );
+    _attributeStarts.Push( 0 );
+}
+
+
+int XMLFrozenDocument::FindNameId( const char* name ) const
+{
+    TIXMLASSERT( name );
+    for ( int i = 0; i < _names.Size(); ++i ) {
+        if ( XMLUtil::StringEqual( Name( i ), name ) ) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+
+const char* XMLFrozenDocument::Attribute( int node, const char* name ) const
+{
+    const int count = AttributeCount( node );
+    for ( int i = 0; i < count; ++i ) {
+        if ( XMLUtil::StringEqual( Name( AttributeNameId( node, i ) ), name ) ) {
+            return AttributeValue( node, i );
+        }
+    }
+    return 0;
+}
+
+
+int XMLFrozenDocument::CountElements( const char* name ) const
+{
+    int count = 0;
+    const int n = NodeCount();
+    if ( name ) {
+        const int nameId = FindNameId( name );
+        if ( nameId < 0 ) {
+            return 0;
+        }
+        const int* nameIds = _nameIds.Mem();
+        for ( int i = 1; i < n; ++i ) {
+            count += ( nameIds[i] == nameId );
+        }
+    }
+    else {
+        const unsigned char* kinds = _kinds.Mem();
+        for ( int i = 1; i < n; ++i ) {
+            count += ( kinds[i] == ELEMENT_NODE );
+        }
+    }
+    return count;
+}
+
+
+int XMLFrozenDocument::FindElement( const char* name, int after ) const
+{
+    TIXMLASSERT( after >= 0 );
+    const int n = NodeCount();
+    if ( name ) {
+        const int nameId = FindNameId( name );
+        if ( nameId < 0 ) {
+            return 0;
+        }
+        const int* nameIds = _nameIds.Mem();
+        for ( int i = after + 1; i < n; ++i ) {
+            if ( nameIds[i] == nameId ) {
+                return i;
+            }
+        }
+    }
+    else {
+        const unsigned char* kinds = _kinds.Mem();
+        for ( int i = after + 1; i < n; ++i ) {
+            if ( kinds[i] == ELEMENT_NODE ) {
+                return i;
+            }
+        }
+    }
+    return 0;
+}
+
+
+bool XMLFrozenDocument::Accept( XMLFrozenVisitor* visitor ) const
+{
+    TIXMLASSERT( visitor );
+    if ( !visitor->VisitEnter( *this, 0 ) ) {
+        return visitor->VisitExit( *this, 0 );
+    }
+    const unsigned char* kinds = _kinds.Mem();
+    const int* parents = _parents.Mem();
+    const int* firstChildren = _firstChildren.Mem();
+    const int* nextSiblings = _nextSiblings.Mem();
+
+    int node = firstChildren[0];
+    while ( node ) {
+        bool more = false;
+        if ( kinds[node] == ELEMENT_NODE ) {
+            if ( visitor->VisitEnter( *this, node ) && firstChildren[node] ) {
+                node = firstChildren[node];
+                continue;
+            }
+            more = visitor->VisitExit( *this, node );
+        }
+        else {
+            more = visitor->Visit( *this, node );
+        }
+        // On to the next sibling, or close the parents that are done.
+        while ( !more || !nextSiblings[node] ) {
+            node = parents[node];
+            if ( node == 0 ) {
+                return visitor->VisitExit( *this, 0 );
+            }
+            more = visitor->VisitExit( *this, node );
+        }
+        node = nextSiblings[node];
+    }
+    return visitor->VisitExit( *this, 0 );
+}
+
+
+// The output function of a printer made with a FILE.
+static void FileOutput( const char* data, size_t size, void* file )
+{
+    fwrite( data, sizeof(char), size, static_cast<FILE*>( file ) );
+}
+
+
+XMLPrinter::XMLPrinter( FILE* file, bool compact, int depth ) :
+    _elementJustOpened( false ),
+    _stack(),
+    _reuseSource( false ),
+    _compactBeforeReuse( compact ),
+    _reused( 0 ),
+    _gaps(),
+    _firstElement( true ),
+    _output( file ? FileOutput : 0 ),
+    _outputContext( file ),
+    _depth( depth ),
+    _textDepth( -1 ),
+    _processEntities( true ),
+    _compactMode( compact ),
+    _buffer(),
+    _chunks(),
+    _allocator( XMLAllocator::Default() )
+{
+    for( int i=0; i<ENTITY_RANGE; ++i ) {
+        _entityFlag[i] = false;
+        _restrictedEntityFlag[i] = false;
+    }
+    for( int i=0; i<NUM_ENTITIES; ++i ) {
+        const char entityValue = entities[i].value;
+        const unsigned char flagIndex = static_cast<unsigned char>(entityValue);
+        TIXMLASSERT( flagIndex < ENTITY_RANGE );
+        _entityFlag[flagIndex] = true;
+    }
+    _restrictedEntityFlag[static_cast<unsigned char>('&')] = true;
+    _restrictedEntityFlag[static_cast<unsigned char>('<')] = true;
+    _restrictedEntityFlag[static_cast<unsigned char>('>')] = true;	// not required, but consistency is nice
+    _buffer.Push( 0 );
+}
+
+
+void XMLPrinter::SetAllocator( XMLAllocator* allocator )
+{
+    if ( !allocator ) {
+        allocator = XMLAllocator::Default();
+    }
+    _stack.SetAllocator( allocator );
+    _buffer.SetAllocator( allocator );
+    _allocator = allocator;
+}
+
+
+XMLPrinter::~XMLPrinter()
+{
+    if ( _output != ChunkOutput ) {
+        Flush();
+    }
+    FreeChunks();
+}
+
+
+void XMLPrinter::SetOutput( OutputFunc func, void* context )
+{
+    Flush();
+    _output = func;
+    _outputContext = context;
+}
+
+
+void XMLPrinter::Flush()
+{
+    if ( _output && _buffer.Size() > 1 ) {
+        _output( _buffer.Mem(), _buffer.Size() - 1, _outputContext );
+        _buffer.Clear();
+        _buffer.Push( 0 );
+    }
+}
+
+
+void XMLPrinter::SetChunked( bool chunked )
+{
+    if ( chunked ) {
+        SetOutput( ChunkOutput, this );
+    }
+    else if ( _output == ChunkOutput ) {
+        _output = 0;
+        _outputContext = 0;
+    }
+}
+
+
+/*static*/ void XMLPrinter::ChunkOutput( const char* data, size_t size, void* printer )
+{
+    XMLPrinter* self = static_cast<XMLPrinter*>( printer );
+    OutputChunk chunk;
+    chunk.mem = static_cast<char*>( self->_allocator->Allocate( size ) );
+    chunk.size = size;
+    chunk.allocator = self->_allocator;
+    memcpy( chunk.mem, data, size );
+    self->_chunks.Push( chunk );
+}
+
+
+void XMLPrinter::FreeChunks()
+{
+    for( int i = 0; i < _chunks.Size(); ++i ) {
+        _chunks[i].allocator->Deallocate( _chunks[i].mem, _chunks[i].size );
+    }
+    _chunks.Clear();
+}
+
+
+int XMLPrinter::ChunkCount() const
+{
+    // What is still in the buffer is the last piece.
+    return _chunks.Size() + ( _buffer.Size() > 1 ? 1 : 0 );
 }
 
 
-void XMLDocument::Print( XMLPrinter* streamer ) const
+const char* XMLPrinter::Chunk( int i, size_t* size ) const
 {
-    if ( streamer ) {
-        Accept( streamer );
-    }
-    else {
-        XMLPrinter stdoutStreamer( stdout );
-        Accept( &stdoutStreamer );
+    TIXMLASSERT( size );
+    TIXMLASSERT( i >= 0 && i < ChunkCount() );
+    if ( i < _chunks.Size() ) {
+        *size = _chunks[i].size;
+        return _chunks[i].mem;
     }
+    *size = _buffer.Size() - 1;
+    return _buffer.Mem();
 }
 
 
-void XMLDocument::ClearError() {
-    _errorID = XML_SUCCESS;
-    _errorLineNum = 0;
-    _errorStr.Reset();
+// An output function that only adds up the size.
+static void CountOutput( const char*, size_t size, void* total )
+{
+    *static_cast<size_t*>( total ) += size;
 }
 
 
-void XMLDocument::SetError( XMLError error, int lineNum, const char* format, ... )
+size_t XMLPrinter::Reserve( const XMLNode& node )
 {
-    TIXMLASSERT( error >= 0 && error < XML_ERROR_COUNT );
-    _errorID = error;
-    _errorLineNum = lineNum;
-	_errorStr.Reset();
+    TIXMLASSERT( _buffer.Size() == 1 );
+    const bool elementJustOpened = _elementJustOpened;
+    const bool firstElement = _firstElement;
+    const int depth = _depth;
+    const int textDepth = _textDepth;
+    OutputFunc const output = _output;
+    void* const outputContext = _outputContext;
 
-    const size_t BUFFER_SIZE = 1000;
-    char* buffer = new char[BUFFER_SIZE];
+    size_t size = 0;
+    _output = CountOutput;
+    _outputContext = &size;
+    node.Accept( this );
+    Flush();
 
-    TIXMLASSERT(sizeof(error) <= sizeof(int));
-    TIXML_SNPRINTF(buffer, BUFFER_SIZE, "Error=%s ErrorID=%d (0x%x) Line number=%d", ErrorIDToName(error), int(error), int(error), lineNum);
+    _elementJustOpened = elementJustOpened;
+    _firstElement = firstElement;
+    _depth = depth;
+    _textDepth = textDepth;
+    _output = output;
+    _outputContext = outputContext;
+    if ( !_output && size < INT_MAX ) {
+        _buffer.Reserve( static_cast<int>( size ) + 1 );
+    }
+    return size;
+}
 
-	if (format) {
-		size_t len = strlen(buffer);
-		TIXML_SNPRINTF(buffer + len, BUFFER_SIZE - len, ": ");
-		len = strlen(buffer);
 
-		va_list va;
-		va_start(va, format);
-		TIXML_VSNPRINTF(buffer + len, BUFFER_SIZE - len, format, va);
-		va_end(va);
-	}
-	_errorStr.SetStr(buffer);
-	delete[] buffer;
-}
+namespace {
 
+// The size of a subtree, for splitting a print between threads.
+struct PrintSize
+{
+    int     nodes;
+    int     size;       // in nodes and attributes
+    bool    text;       // whether it has a text node
+};
 
-/*static*/ const char* XMLDocument::ErrorIDToName(XMLError errorID)
+// A run of siblings printed on another thread. Its printer starts in
+// the state the printer of the document would be in there.
+struct PrintUnit
 {
-	TIXMLASSERT( errorID >= 0 && errorID < XML_ERROR_COUNT );
-    const char* errorName = _errorNames[errorID];
-    TIXMLASSERT( errorName && errorName[0] );
-    return errorName;
-}
+    const XMLNode*  first;
+    int             count;
+    int             size;
+    XMLPrinter*     printer;
+};
 
-const char* XMLDocument::ErrorStr() const
+// A step of printing the document on the calling thread: the start
+// (enter) or end of a node, or the output of units[unit].
+struct PrintStep
 {
-	return _errorStr.Empty() ? "" : _errorStr.GetStr();
-}
+    const XMLNode*  node;
+    bool            enter;
+    int             unit;       // -1 for a node
+};
 
+} // namespace
 
-void XMLDocument::PrintError() const
+struct XMLPrinter::PrintJob
 {
-    printf("%s\n", ErrorStr());
-}
+    DynArray<PrintSize, 64> sizes;      // in document order
+    DynArray<PrintUnit, 64> units;
+    DynArray<PrintStep, 64> steps;
+    int                     grain;
+};
 
-const char* XMLDocument::ErrorName() const
-{
-    return ErrorIDToName(_errorID);
-}
+// Documents of fewer nodes than this are printed on one thread.
+static const int MIN_PARALLEL_PRINT = 4096;
 
-void XMLDocument::Parse()
+// Reads 'node' and its subtree, expanding what was lazily parsed, and
+// pushes the size of each subtree in document order. Returns the index
+// of the one of 'node'.
+static int PreparePrint( const XMLNode* node, DynArray<PrintSize, 64>* sizes )
 {
-    TIXMLASSERT( NoChildren() ); // Clear() must have been called previously
-    TIXMLASSERT( _charBuffer );
-    _parseCurLineNum = 1;
-    _parseLineNum = 1;
-    char* p = _charBuffer;
-    p = XMLUtil::SkipWhiteSpace( p, &_parseCurLineNum );
-    p = const_cast<char*>( XMLUtil::ReadBOM( p, &_writeBOM ) );
-    if ( !*p ) {
-        SetError( XML_ERROR_EMPTY_DOCUMENT, 0, 0 );
-        return;
+    const int index = sizes->Size();
+    PrintSize entry = { 1, 1, node->ToText() != 0 };
+    sizes->Push( entry );
+    if ( const XMLElement* element = node->ToElement() ) {
+        for( const XMLAttribute* a = element->FirstAttribute(); a; a = a->Next() ) {
+            ++entry.size;
+        }
     }
-    ParseDeep(p, 0, &_parseCurLineNum );
+    for( const XMLNode* child = node->FirstChild(); child; child = child->NextSibling() ) {
+        const PrintSize& sub = (*sizes)[PreparePrint( child, sizes )];
+        entry.nodes += sub.nodes;
+        entry.size += sub.size;
+        entry.text = entry.text || sub.text;
+    }
+    (*sizes)[index] = entry;
+    return index;
 }
 
-void XMLDocument::PushDepth()
+
+static void PrintUnits( PrintUnit* units, int count )
 {
-	_parsingDepth++;
-	if (_parsingDepth == TINYXML2_MAX_ELEMENT_DEPTH) {
-		SetError(XML_ELEMENT_DEPTH_EXCEEDED, _parseCurLineNum, "Element nesting is too deep." );
-	}
+    for( int i = 0; i < count; ++i ) {
+        const XMLNode* node = units[i].first;
+        for( int n = 0; n < units[i].count; ++n, node = node->NextSibling() ) {
+            node->Accept( units[i].printer );
+        }
+    }
 }
 
-void XMLDocument::PopDepth()
+
+void XMLPrinter::PrintParallel( const XMLDocument& doc, int threads )
 {
-	TIXMLASSERT(_parsingDepth > 0);
-	--_parsingDepth;
+#if TIXML_THREADS
+    if ( threads <= 0 ) {
+        threads = static_cast<int>( std::thread::hardware_concurrency() );
+    }
+#else
+    threads = 1;
+#endif
+    // Other allocators aren't known to be safe to call from other threads.
+    if ( threads <= 1 || _reuseSource || _allocator != XMLAllocator::Default() ) {
+        doc.Accept( this );
+        return;
+    }
+    PrintJob job;
+    PreparePrint( &doc, &job.sizes );
+    const int total = job.sizes[0].size;
+    if ( total < MIN_PARALLEL_PRINT ) {
+        doc.Accept( this );
+        return;
+    }
+
+    // Find the units by printing the rest with a printer that only
+    // counts, in the state this one is in.
+    job.grain = total / ( threads * 8 ) + 1;
+    {
+        size_t ignored = 0;
+        XMLPrinter plan( 0, _compactMode, _depth );
+        plan._textDepth = _textDepth;
+        plan._elementJustOpened = _elementJustOpened;
+        plan._firstElement = _firstElement;
+        plan.SetOutput( CountOutput, &ignored );
+        const int end = plan.PlanPrint( doc, 0, &job );
+        TIXMLASSERT( end == job.sizes.Size() );
+        (void)end;
+    }
+
+    // Give each thread a run of units of about the same total size.
+    const int units = job.units.Size();
+    if ( threads > units ) {
+        // There may be none, if the big nodes are big for their attributes.
+        threads = units > 0 ? units : 1;
+    }
+    int* first = new int[threads + 1];
+    int unit = 0;
+    int done = 0;
+    for( int i = 0; i < threads; ++i ) {
+        first[i] = unit;
+        const int64_t share = static_cast<int64_t>( total ) * ( i + 1 ) / threads;
+        while( unit < units && ( done < share || i == threads - 1 ) ) {
+            done += job.units[unit].size;
+            ++unit;
+        }
+    }
+    first[threads] = units;
+    TIXMLASSERT( unit == units );
+
+#if TIXML_THREADS
+    std::thread* running = new std::thread[threads];
+    for( int i = 1; i < threads; ++i ) {
+        running[i] = std::thread( PrintUnits, job.units.Mem() + first[i], first[i + 1] - first[i] );
+    }
+    PrintUnits( job.units.Mem(), first[1] );
+    for( int i = 1; i < threads; ++i ) {
+        running[i].join();
+    }
+    delete [] running;
+#else
+    PrintUnits( job.units.Mem(), units );
+#endif
+    delete [] first;
+
+    if ( !_output ) {
+        // Grow the memory buffer once.
+        int64_t size = _buffer.Size();
+        for( int i = 0; i < units; ++i ) {
+            size += job.units[i].printer->CStrSize();
+        }
+        if ( size < INT_MAX ) {
+            _buffer.Reserve( static_cast<int>( size ) );
+        }
+    }
+    for( int i = 0; i < job.steps.Size(); ++i ) {
+        const PrintStep& step = job.steps[i];
+        if ( step.unit >= 0 ) {
+            XMLPrinter* printer = job.units[step.unit].printer;
+            Write( printer->CStr(), printer->CStrSize() - 1 );
+            TIXMLASSERT( _depth == printer->_depth );
+            _elementJustOpened = printer->_elementJustOpened;
+            _firstElement = printer->_firstElement;
+            _textDepth = printer->_textDepth;
+            delete printer;
+            continue;
+        }
+        const XMLElement* element = step.node->ToElement();
+        if ( element && step.enter ) {
+            VisitEnter( *element, element->FirstAttribute() );
+        }
+        else if ( element ) {
+            VisitExit( *element );
+        }
+        else if ( step.enter ) {
+            VisitEnter( *step.node->ToDocument() );
+        }
+        else {
+            VisitExit( *step.node->ToDocument() );
+        }
+    }
 }
 
-XMLPrinter::XMLPrinter( FILE* file, bool compact, int depth ) :
-    _elementJustOpened( false ),
-    _stack(),
-    _firstElement( true ),
-    _fp( file ),
-    _depth( depth ),
-    _textDepth( -1 ),
-    _processEntities( true ),
-    _compactMode( compact ),
-    _buffer()
+
+// Prints 'node', which is a document or an element bigger than the
+// grain of 'job', and pushes the steps of printing it. Its children
+// that aren't bigger are split into runs of units, which start in the
+// state this printer is in where they go; they are skipped, and this
+// printer is put in the state printing them leaves it in. Returns the
+// index in job->sizes after the subtree of 'node'.
+int XMLPrinter::PlanPrint( const XMLNode& node, int index, PrintJob* job )
 {
-    for( int i=0; i<ENTITY_RANGE; ++i ) {
-        _entityFlag[i] = false;
-        _restrictedEntityFlag[i] = false;
+    PrintStep step = { &node, true, -1 };
+    job->steps.Push( step );
+    const XMLElement* element = node.ToElement();
+    if ( element ) {
+        VisitEnter( *element, element->FirstAttribute() );
     }
-    for( int i=0; i<NUM_ENTITIES; ++i ) {
-        const char entityValue = entities[i].value;
-        const unsigned char flagIndex = static_cast<unsigned char>(entityValue);
-        TIXMLASSERT( flagIndex < ENTITY_RANGE );
-        _entityFlag[flagIndex] = true;
+    else {
+        VisitEnter( *node.ToDocument() );
     }
-    _restrictedEntityFlag[static_cast<unsigned char>('&')] = true;
-    _restrictedEntityFlag[static_cast<unsigned char>('<')] = true;
-    _restrictedEntityFlag[static_cast<unsigned char>('>')] = true;	// not required, but consistency is nice
-    _buffer.Push( 0 );
+
+    ++index;
+    int run = -1;
+    for( const XMLNode* child = node.FirstChild(); child; child = child->NextSibling() ) {
+        const PrintSize& size = job->sizes[index];
+        if ( size.size > job->grain ) {
+            run = -1;
+            index = PlanPrint( *child, index, job );
+            continue;
+        }
+        if ( run < 0 || job->units[run].size + size.size > job->grain ) {
+            XMLPrinter* printer = new XMLPrinter( 0, _compactMode, _depth );
+            printer->_processEntities = _processEntities;
+            printer->_textDepth = _textDepth;
+            printer->_elementJustOpened = _elementJustOpened;
+            printer->_firstElement = _firstElement;
+            PrintUnit unit = { child, 0, 0, printer };
+            run = job->units.Size();
+            job->units.Push( unit );
+            PrintStep output = { 0, false, run };
+            job->steps.Push( output );
+        }
+        ++job->units[run].count;
+        job->units[run].size += size.size;
+        index += size.nodes;
+
+        // What printing the child changes.
+        _elementJustOpened = false;
+        if ( child->ToText() ) {
+            _textDepth = _depth - 1;
+        }
+        else {
+            if ( size.text ) {
+                // Closing the element the text is in.
+                _textDepth = -1;
+            }
+            if ( !_compactMode ) {
+                _firstElement = false;
+            }
+        }
+    }
+
+    step.enter = false;
+    job->steps.Push( step );
+    if ( element ) {
+        VisitExit( *element );
+    }
+    else {
+        VisitExit( *node.ToDocument() );
+    }
+    return index;
 }
 
 
@@ -2585,108 +7713,156 @@ XMLPrinter::XMLPrinter( FILE* file, bool compact, int depth ) :
     va_list     va;
     va_start( va, format );
 
-    if ( _fp ) {
-        vfprintf( _fp, format, va );
-    }
-    else {
-        const int len = TIXML_VSCPRINTF( format, va );
-        // Close out and re-start the va-args
-        va_end( va );
-        TIXMLASSERT( len >= 0 );
-        va_start( va, format );
-        TIXMLASSERT( _buffer.Size() > 0 && _buffer[_buffer.Size() - 1] == 0 );
-        char* p = _buffer.PushArr( len ) - 1;	// back up over the null terminator.
-		TIXML_VSNPRINTF( p, len+1, format, va );
-    }
+    const int len = TIXML_VSCPRINTF( format, va );
+    // Close out and re-start the va-args
+    va_end( va );
+    TIXMLASSERT( len >= 0 );
+    va_start( va, format );
+    TIXMLASSERT( _buffer.Size() > 0 && _buffer[_buffer.Size() - 1] == 0 );
+    char* p = _buffer.PushArr( len ) - 1;	// back up over the null terminator.
+    TIXML_VSNPRINTF( p, len+1, format, va );
     va_end( va );
+    if ( _output && _buffer.Size() > OUTPUT_CHUNK ) {
+        Flush();
+    }
 }
 
 
 void XMLPrinter::Write( const char* data, size_t size )
 {
-    if ( _fp ) {
-        fwrite ( data , sizeof(char), size, _fp);
+    if ( _output && size >= OUTPUT_CHUNK ) {
+        // Too big to be worth copying.
+        Flush();
+        _output( data, size, _outputContext );
+        return;
     }
-    else {
-        char* p = _buffer.PushArr( static_cast<int>(size) ) - 1;   // back up over the null terminator.
-        memcpy( p, data, size );
-        p[size] = 0;
+    char* p = _buffer.PushArr( static_cast<int>(size) ) - 1;   // back up over the null terminator.
+    memcpy( p, data, size );
+    p[size] = 0;
+    if ( _output && _buffer.Size() > OUTPUT_CHUNK ) {
+        Flush();
     }
 }
 
 
 void XMLPrinter::Putc( char ch )
 {
-    if ( _fp ) {
-        fputc ( ch, _fp);
-    }
-    else {
-        char* p = _buffer.PushArr( sizeof(char) ) - 1;   // back up over the null terminator.
-        p[0] = ch;
-        p[1] = 0;
+    char* p = _buffer.PushArr( sizeof(char) ) - 1;   // back up over the null terminator.
+    p[0] = ch;
+    p[1] = 0;
+    if ( _output && _buffer.Size() > OUTPUT_CHUNK ) {
+        Flush();
     }
 }
 
 
 void XMLPrinter::PrintSpace( int depth )
 {
-    for( int i=0; i<depth; ++i ) {
-        Write( "    " );
+    // Eight levels at a time.
+    static const char spaces[] = "                                ";
+    const int perWrite = static_cast<int>( sizeof( spaces ) - 1 ) / 4;
+    while ( depth > 0 ) {
+        const int levels = depth < perWrite ? depth : perWrite;
+        Write( spaces, levels * 4 );
+        depth -= levels;
     }
 }
 
 
-void XMLPrinter::PrintString( const char* p, bool restricted )
+#if TIXML_SSE2
+// The index of the lowest bit set in 'mask', which isn't 0.
+static inline int LowestBit( unsigned mask )
 {
-    // Look for runs of bytes between entities to print.
-    const char* q = p;
-
-    if ( _processEntities ) {
-        const bool* flag = restricted ? _restrictedEntityFlag : _entityFlag;
-        while ( *q ) {
-            TIXMLASSERT( p <= q );
-            // Remember, char is sometimes signed. (How many times has that bitten me?)
-            if ( *q > 0 && *q < ENTITY_RANGE ) {
-                // Check for entities. If one is found, flush
-                // the stream up until the entity, write the
-                // entity, and keep looking.
-                if ( flag[static_cast<unsigned char>(*q)] ) {
-                    while ( p < q ) {
-                        const size_t delta = q - p;
-                        const int toPrint = ( INT_MAX < delta ) ? INT_MAX : static_cast<int>(delta);    // todo: 这里false分支需要文件大于INT_MAX（2G），无法在程序中测试
-                        Write( p, toPrint );
-                        p += toPrint;
-                    }
-                    bool entityPatternPrinted = false;
-                    for( int i=0; i<NUM_ENTITIES; ++i ) {   // todo: false分支不可达，因为flag只有5个true，对应了entities的五个元素，不可能发生未找到从而退出
-                        if ( entities[i].value == *q ) {
-                            Putc( '&' );
-                            Write( entities[i].pattern, entities[i].length );
-                            Putc( ';' );
-                            entityPatternPrinted = true;
-                            break;
-                        }
-                    }
-                    if ( !entityPatternPrinted ) {
-                        // TIXMLASSERT( entityPatternPrinted ) causes gcc -Wunused-but-set-variable in release
-                        TIXMLASSERT( false );
-                    }
-                    ++p;
-                }
-            }
-            ++q;
-            TIXMLASSERT( p <= q );
+#if defined(_MSC_VER)
+    unsigned long index = 0;
+    _BitScanForward( &index, mask );
+    return static_cast<int>( index );
+#else
+    return __builtin_ctz( mask );
+#endif
+}
+#endif
+
+
+// The first character of the string at 'p' that 'flag' marks to be
+// written as an entity, or the terminating null at 'end'. 'end' is only
+// read where the string is looked at 16 characters at a time.
+/*static*/ const char* XMLPrinter::FindEntity( const char* p, const char* end, const bool* flag )
+{
+    // Only the characters of the entities are ever marked, and they are
+    // all ASCII: bytes of UTF-8 sequences never match.
+    char marked[NUM_ENTITIES + 1];
+    int count = 0;
+    for( int i=0; i<NUM_ENTITIES; ++i ) {
+        if ( flag[static_cast<unsigned char>( entities[i].value )] ) {
+            marked[count++] = entities[i].value;
         }
-        // Flush the remaining string. This will be the entire
-        // string if an entity wasn't found.
-        if ( p < q ) {  // false 分支会在 *p == 0 时发生，也就是PushAttribute时传入的是空的，只需要某一项参数为空即可
-            const size_t delta = q - p;
-            const int toPrint = ( INT_MAX < delta ) ? INT_MAX : static_cast<int>(delta);    // todo: 这里false分支需要文件大于INT_MAX（2G），无法在程序中测试
-            Write( p, toPrint );
+    }
+    marked[count] = 0;
+    TIXMLASSERT( count > 0 );
+#if TIXML_SSE2
+    if ( end - p >= 16 ) {
+        // Unused comparisons repeat the first character.
+        __m128i wanted[NUM_ENTITIES];
+        for( int i=0; i<NUM_ENTITIES; ++i ) {
+            wanted[i] = _mm_set1_epi8( marked[i < count ? i : 0] );
         }
+        do {
+            const __m128i bytes = _mm_loadu_si128( reinterpret_cast<const __m128i*>( p ) );
+            __m128i found = _mm_cmpeq_epi8( bytes, wanted[0] );
+            for( int i=1; i<NUM_ENTITIES; ++i ) {
+                found = _mm_or_si128( found, _mm_cmpeq_epi8( bytes, wanted[i] ) );
+            }
+            const int mask = _mm_movemask_epi8( found );
+            if ( mask ) {
+                return p + LowestBit( static_cast<unsigned>( mask ) );
+            }
+            p += 16;
+        } while ( end - p >= 16 );
     }
-    else {
+#else
+    (void)end;
+#endif
+    // The C library's search is usually vectorized too.
+    return p + strcspn( p, marked );
+}
+
+
+void XMLPrinter::PrintString( const char* p, bool restricted, StrPair* value )
+{
+    // 'value' is the string of a node 'p' is from: when it is known to
+    // have nothing to escape, no need to look.
+    if ( !_processEntities || ( value && value->NoEscapes( restricted ) ) ) {
         Write( p );
+        return;
+    }
+    // Look for runs of bytes between entities to print.
+    const bool* flag = restricted ? _restrictedEntityFlag : _entityFlag;
+#if TIXML_SSE2
+    const char* const end = p + strlen( p );
+#else
+    const char* const end = 0;
+#endif
+    while ( *p ) {
+        const char* const q = FindEntity( p, end, flag );
+        while ( p < q ) {
+            const size_t delta = q - p;
+            const int toPrint = ( INT_MAX < delta ) ? INT_MAX : static_cast<int>(delta);
+            Write( p, toPrint );
+            p += toPrint;
+        }
+        if ( !*q ) {
+            break;
+        }
+        for( int i=0; i<NUM_ENTITIES; ++i ) {
+            if ( entities[i].value == *q ) {
+                Putc( '&' );
+                Write( entities[i].pattern, entities[i].length );
+                Putc( ';' );
+                break;
+            }
+        }
+        ++p;
     }
 }
 
@@ -2734,12 +7910,18 @@ void XMLPrinter::OpenElement( const char* name, bool compactMode )
 
 
 void XMLPrinter::PushAttribute( const char* name, const char* value )
+{
+    PushAttribute( name, value, 0 );
+}
+
+
+void XMLPrinter::PushAttribute( const char* name, const char* value, StrPair* source )
 {
     TIXMLASSERT( _elementJustOpened );
     Putc ( ' ' );
     Write( name );
     Write( "=\"" );
-    PrintString( value, false );
+    PrintString( value, false, source );
     Putc ( '\"' );
 }
 
@@ -2817,6 +7999,9 @@ void XMLPrinter::CloseElement( bool compactMode )
         Putc( '\n' );
     }
     _elementJustOpened = false;
+    if ( _stack.Empty() || _output == FileOutput ) {
+        Flush();
+    }
 }
 
 
@@ -2831,6 +8016,12 @@ void XMLPrinter::SealElementIfJustOpened()
 
 
 void XMLPrinter::PushText( const char* text, bool cdata )
+{
+    PushText( text, cdata, 0 );
+}
+
+
+void XMLPrinter::PushText( const char* text, bool cdata, StrPair* source )
 {
     _textDepth = _depth-1;
 
@@ -2841,7 +8032,7 @@ void XMLPrinter::PushText( const char* text, bool cdata )
         Write( "]]>" );
     }
     else {
-        PrintString( text, true );
+        PrintString( text, true, source );
     }
 }
 
@@ -2938,12 +8129,119 @@ bool XMLPrinter::VisitEnter( const XMLDocument& doc )
     if ( doc.HasBOM() ) {
         PushHeader( true, false );
     }
+    if ( _reuseSource ) {
+        SourceGap none = { 0, 0, false };
+        _gaps.Clear();
+        _gaps.Push( none );
+        // Changed nodes go between source text as they are, compact.
+        _compactBeforeReuse = _compactMode;
+        if ( doc.SourceText() ) {
+            _compactMode = true;
+        }
+    }
+    return true;
+}
+
+
+bool XMLPrinter::VisitExit( const XMLDocument& doc )
+{
+    if ( _reuseSource ) {
+        // The whitespace after the last node.
+        const char* source = doc.SourceText();
+        size_t offset = 0;
+        size_t length = 0;
+        const XMLNode* last = doc.LastChild();
+        if ( source && last && !last->ToText() && last->GetSourceSpan( &offset, &length ) ) {
+            WriteGap( source, doc.SourceSize() );
+        }
+        _compactMode = _compactBeforeReuse;
+    }
+    Flush();
+    return true;
+}
+
+
+// The length of the whitespace before 'offset' of 'source' that the
+// parser dropped: after markup, or at the start. Whitespace after text
+// belongs to the text.
+static size_t DroppedWhiteSpace( const char* source, size_t offset )
+{
+    size_t start = offset;
+    while ( start > 0 && XMLUtil::IsWhiteSpace( source[start - 1] ) ) {
+        --start;
+    }
+    if ( start == 0 || source[start - 1] == '>' ) {
+        return offset - start;
+    }
+    const unsigned char* bom = reinterpret_cast<const unsigned char*>( source );
+    if ( start == 3 && bom[0] == TIXML_UTF_LEAD_0 && bom[1] == TIXML_UTF_LEAD_1 && bom[2] == TIXML_UTF_LEAD_2 ) {
+        return offset - start;
+    }
+    return 0;
+}
+
+
+// Records the whitespace before 'offset' as the last gap at this depth,
+// and writes it unless it follows text, which it would become part of.
+void XMLPrinter::WriteGap( const char* source, size_t offset )
+{
+    const size_t length = DroppedWhiteSpace( source, offset );
+    bool afterText = false;
+    if ( !_gaps.Empty() ) {
+        SourceGap& gap = _gaps[_gaps.Size() - 1];
+        gap.start = source + offset - length;
+        gap.length = length;
+        afterText = gap.afterText;
+    }
+    if ( length && !afterText ) {
+        Write( source + offset - length, length );
+    }
+}
+
+
+// Writes the whitespace before 'node', and, if it hasn't been modified,
+// its source text. Otherwise returns false, and the node is printed.
+bool XMLPrinter::ReuseSource( const XMLNode& node )
+{
+    SealElementIfJustOpened();
+    const char* source = node.GetDocument()->SourceText();
+    size_t offset = 0;
+    size_t length = 0;
+    const bool hasSpan = source && node.GetSourceSpan( &offset, &length );
+    const XMLText* text = node.ToText();
+    const bool plainText = text && !text->CData();
+    // Whitespace next to text is read back as part of the text.
+    if ( !plainText ) {
+        if ( hasSpan ) {
+            WriteGap( source, offset );
+        }
+        else if ( !_gaps.Empty() && _gaps.PeekTop().length && !_gaps.PeekTop().afterText ) {
+            // A new node goes in like the one before it.
+            Write( _gaps.PeekTop().start, _gaps.PeekTop().length );
+        }
+    }
+    if ( !_gaps.Empty() ) {
+        _gaps[_gaps.Size() - 1].afterText = plainText;
+    }
+    if ( !hasSpan || node.Modified() ) {
+        return false;
+    }
+    Write( source + offset, length );
     return true;
 }
 
 
 bool XMLPrinter::VisitEnter( const XMLElement& element, const XMLAttribute* attribute )
 {
+    if ( _reuseSource ) {
+        if ( ReuseSource( element ) ) {
+            // No children, and VisitExit() writes nothing.
+            _reused = &element;
+            return false;
+        }
+        SourceGap none = { 0, 0, false };
+        _gaps.Push( none );
+    }
     const XMLElement* parentElem = 0;
     if ( element.Parent() ) {
         parentElem = element.Parent()->ToElement();
@@ -2951,7 +8249,7 @@ bool XMLPrinter::VisitEnter( const XMLElement& element, const XMLAttribute* attr
     const bool compactMode = parentElem ? CompactMode( *parentElem ) : _compactMode;
     OpenElement( element.Name(), compactMode );
     while ( attribute ) {
-        PushAttribute( attribute->Name(), attribute->Value() );
+        PushAttribute( attribute->Name(), attribute->Value(), &attribute->_value );
         attribute = attribute->Next();
     }
     return true;
@@ -2960,6 +8258,25 @@ bool XMLPrinter::VisitEnter( const XMLElement& element, const XMLAttribute* attr
 
 bool XMLPrinter::VisitExit( const XMLElement& element )
 {
+    if ( _reuseSource ) {
+        if ( _reused == &element ) {
+            _reused = 0;
+            return true;
+        }
+        const bool afterText = _gaps.PeekTop().afterText;
+        _gaps.Pop();
+        // The whitespace before the end tag.
+        const char* source = element.GetDocument()->SourceText();
+        size_t offset = 0;
+        size_t length = 0;
+        if ( !_elementJustOpened && !afterText && source && element.GetSourceSpan( &offset, &length ) && source[offset + length - 2] != '/' ) {
+            size_t endTag = offset + length - 1;
+            while ( source[endTag] != '<' ) {
+                --endTag;
+            }
+            WriteGap( source, endTag );
+        }
+    }
     CloseElement( CompactMode(element) );
     return true;
 }
@@ -2967,19 +8284,28 @@ bool XMLPrinter::VisitExit( const XMLElement& element )
 
 bool XMLPrinter::Visit( const XMLText& text )
 {
-    PushText( text.Value(), text.CData() );
+    if ( _reuseSource && ReuseSource( text ) ) {
+        return true;
+    }
+    PushText( text.Value(), text.CData(), &text._value );
     return true;
 }
 
 
 bool XMLPrinter::Visit( const XMLComment& comment )
 {
+    if ( _reuseSource && ReuseSource( comment ) ) {
+        return true;
+    }
     PushComment( comment.Value() );
     return true;
 }
 
 bool XMLPrinter::Visit( const XMLDeclaration& declaration )
 {
+    if ( _reuseSource && ReuseSource( declaration ) ) {
+        return true;
+    }
     PushDeclaration( declaration.Value() );
     return true;
 }
@@ -2987,6 +8313,9 @@ bool XMLPrinter::Visit( const XMLDeclaration& declaration )
 
 bool XMLPrinter::Visit( const XMLUnknown& unknown )
 {
+    if ( _reuseSource && ReuseSource( unknown ) ) {
+        return true;
+    }
     PushUnknown( unknown.Value() );
     return true;
 }
@@ -124,6 +124,41 @@ class XMLText;
 class XMLDeclaration;
 class XMLUnknown;
 class XMLPrinter;
+class XMLFrozenDocument;
+class XMLLoad;
+
+/**
+	The source of the memory an XMLDocument or XMLPrinter allocates
+	in bulk: the character buffer of a document, the blocks of its
+	memory pools and string arena, and the storage of its arrays.
+	Derive from it to put that memory somewhere other than the global
+	heap, then pass it to XMLDocument::SetAllocator() or
+	XMLPrinter::SetAllocator(). The allocator must outlive the objects
+	using it.
+
+	Allocate() must return memory aligned for any type, as new does.
+	Deallocate() is passed the size that was allocated.
+*/
+class TINYXML2_LIB XMLAllocator
+{
+public:
+    virtual ~XMLAllocator() {}
+
+    virtual void* Allocate( size_t size ) = 0;
+    virtual void Deallocate( void* mem, size_t size ) = 0;
+    /**
+    	Like Allocate(), but returns null if there isn't the memory. Used
+    	for buffers sized from a file; the default allocator returns null
+    	when new fails, and others by default just call Allocate().
+    */
+    virtual void* TryAllocate( size_t size ) {
+        return Allocate( size );
+    }
+
+    /// The allocator used unless another is set; it calls new and delete.
+    static XMLAllocator* Default();
+};
+
 
 /*
 	A class that wraps strings. Normally stores the start and end
@@ -133,6 +168,8 @@ class XMLPrinter;
 
     Isn't clear why TINYXML2_LIB is needed; but seems to fix #719
 */
+class StrArena;
+
 class TINYXML2_LIB StrPair
 {
 public:
@@ -172,20 +209,52 @@ public:
         _start = const_cast<char*>(str);
     }
 
-    void SetStr( const char* str, int flags=0 );
+    /*
+    	Copies 'str'. With an arena the copy is allocated from it, and is
+    	only released when the arena is; otherwise it is new'd, and
+    	deleted by Reset().
+    */
+    void SetStr( const char* str, int flags=0, StrArena* arena=0 );
+    /*
+    	Points at the string of 'other' without copying it. The memory
+    	the string is in must stay alive as long as this does: see
+    	StrArena::Share(). A string 'other' owns is copied to 'arena'.
+    */
+    void SetShared( StrPair* other, StrArena* arena );
 
     char* ParseText( char* in, const char* endTag, int strFlags, int* curLineNumPtr );
     char* ParseName( char* in );
 
+    // Where the string is, without reading it: in the parsed text until
+    // it is set to another.
+    const char* RawStart() const {
+        return _start;
+    }
+
+    // Whether the string is known to have none of the characters
+    // XMLPrinter writes as entities: &, < and >, and, unless
+    // 'restricted', " and '. ParseText() finds out while it looks for
+    // the end of the string, and SetStr() while it copies it, so that
+    // printing only reads the string.
+    bool NoEscapes( bool restricted ) const {
+        const int known = restricted ? NO_MARKUP : ( NO_MARKUP | NO_QUOTES );
+        return ( _flags & known ) == known;
+    }
+
     void TransferTo( StrPair* other );
 	void Reset();
 
 private:
     void CollapseWhitespace();
+    static int TextFlags( int flags, uint64_t seen );
+    static int EscapeFlags( const char* str, size_t len );
 
     enum {
         NEEDS_FLUSH = 0x100,
-        NEEDS_DELETE = 0x200
+        NEEDS_DELETE = 0x200,
+        IN_ARENA = 0x400,
+        NO_MARKUP = 0x800,      // none of &, < and >
+        NO_QUOTES = 0x1000      // none of " and '
     };
 
     int     _flags;
@@ -209,14 +278,27 @@ public:
     DynArray() :
         _mem( _pool ),
         _allocated( INITIAL_SIZE ),
-        _size( 0 )
+        _size( 0 ),
+        _allocator( XMLAllocator::Default() )
     {
     }
 
     ~DynArray() {
         if ( _mem != _pool ) {
-            delete [] _mem;
+            _allocator->Deallocate( _mem, sizeof(T)*_allocated );
+        }
+    }
+
+    // Moves the storage, if it is on the heap, to the new allocator.
+    void SetAllocator( XMLAllocator* allocator ) {
+        TIXMLASSERT( allocator );
+        if ( _mem != _pool ) {
+            T* newMem = static_cast<T*>( allocator->Allocate( sizeof(T)*_allocated ) );
+            memcpy( newMem, _mem, sizeof(T)*_size );
+            _allocator->Deallocate( _mem, sizeof(T)*_allocated );
+            _mem = newMem;
         }
+        _allocator = allocator;
     }
 
     void Clear() {
@@ -279,6 +361,13 @@ public:
         return _allocated;
     }
 
+    // Makes room for 'cap' objects in all, exactly, if there isn't.
+    void Reserve( int cap ) {
+        if ( cap > _allocated ) {
+            Reallocate( cap );
+        }
+    }
+
 	void SwapRemove(int i) {
 		TIXMLASSERT(i >= 0 && i < _size);
 		TIXMLASSERT(_size > 0);
@@ -304,22 +393,42 @@ private:
         TIXMLASSERT( cap > 0 );
         if ( cap > _allocated ) {
             TIXMLASSERT( cap <= INT_MAX / 2 );
-            const int newAllocated = cap * 2;
-            T* newMem = new T[newAllocated];
-            TIXMLASSERT( newAllocated >= _size );
-            memcpy( newMem, _mem, sizeof(T)*_size );	// warning: not using constructors, only works for PODs
-            if ( _mem != _pool ) {
-                delete [] _mem;
-            }
-            _mem = newMem;
-            _allocated = newAllocated;
+            Reallocate( cap * 2 );
+        }
+    }
+
+    void Reallocate( int newAllocated ) {
+        T* newMem = static_cast<T*>( _allocator->Allocate( sizeof(T)*newAllocated ) );
+        TIXMLASSERT( newAllocated >= _size );
+        memcpy( newMem, _mem, sizeof(T)*_size );	// warning: not using constructors, only works for PODs
+        if ( _mem != _pool ) {
+            _allocator->Deallocate( _mem, sizeof(T)*_allocated );
         }
+        _mem = newMem;
+        _allocated = newAllocated;
     }
 
     T*  _mem;
     T   _pool[INITIAL_SIZE];
     int _allocated;		// objects allocated
     int _size;			// number objects in use
+    XMLAllocator* _allocator;
+};
+
+
+/**
+	Statistics of a memory pool. See XMLDocument::GetPoolStats().
+*/
+struct MemPoolStats
+{
+    MemPoolStats() : itemSize( 0 ), blocks( 0 ), bytes( 0 ), live( 0 ), watermark( 0 ), allocs( 0 ) {}
+
+    int     itemSize;   ///< bytes per item
+    int     blocks;     ///< blocks held
+    size_t  bytes;      ///< bytes held in blocks
+    int     live;       ///< items currently allocated
+    int     watermark;  ///< most items allocated at once
+    int     allocs;     ///< items allocated in total
 };
 
 
@@ -342,29 +451,176 @@ public:
 
 /*
 	Template child class to create pools of the correct type.
+
+	Items are handed out from the current block in address order, so
+	nodes created one after the other (as when parsing) are adjacent
+	in memory. Freed items go on a free list, which is used first once
+	there is anything on it. Blocks start at ITEMS_PER_BLOCK items and
+	double in size up to a limit; see SetBlockSize() and Reserve().
 */
 template< int ITEM_SIZE >
 class MemPoolT : public MemPool
 {
 public:
-    MemPoolT() : _blockPtrs(), _root(0), _currentAllocs(0), _nAllocs(0), _maxAllocs(0), _nUntracked(0)	{}
+    MemPoolT() : _blocks(), _current( -1 ), _root( 0 ), _bump( 0 ), _bumpEnd( 0 ),
+        _nextBlockItems( ITEMS_PER_BLOCK ), _maxBlockItems( ITEMS_PER_BLOCK * 64 ), _bytes( 0 ),
+        _currentAllocs(0), _nAllocs(0), _maxAllocs(0), _nUntracked(0), _allocator( XMLAllocator::Default() )	{}
     ~MemPoolT() {
         MemPoolT< ITEM_SIZE >::Clear();
     }
 
     void Clear() {
         // Delete the blocks.
-        while( !_blockPtrs.Empty()) {
-            Block* lastBlock = _blockPtrs.Pop();
-            delete lastBlock;
+        while( !_blocks.Empty()) {
+            DeleteBlock( _blocks.Pop() );
+        }
+        _current = -1;
+        _root = 0;
+        _bump = 0;
+        _bumpEnd = 0;
+        _bytes = 0;
+        _currentAllocs = 0;
+        _nAllocs = 0;
+        _maxAllocs = 0;
+        _nUntracked = 0;
+    }
+
+    /*
+    	Releases every item at once; nothing allocated from the pool may be
+    	used afterwards. The largest block is kept, so that a document that
+    	is cleared and loaded again doesn't start from small blocks.
+    */
+    void Reset() {
+        if ( !_blocks.Empty() ) {
+            int largest = 0;
+            for( int i = 1; i < _blocks.Size(); ++i ) {
+                if ( _blocks[i].count > _blocks[largest].count ) {
+                    largest = i;
+                }
+            }
+            const Block keep = _blocks[largest];
+            _blocks[largest] = _blocks[0];
+            _blocks[0] = keep;
+            while( _blocks.Size() > 1 ) {
+                DeleteBlock( _blocks.Pop() );
+            }
+            _bytes = keep.count * sizeof( Item );
         }
+        _current = -1;
         _root = 0;
+        _bump = 0;
+        _bumpEnd = 0;
         _currentAllocs = 0;
         _nAllocs = 0;
         _maxAllocs = 0;
         _nUntracked = 0;
     }
 
+    /*
+    	Sets the number of items in the next block to be allocated, and
+    	the size up to which each later block doubles. Pass the same
+    	number twice for blocks of a fixed size.
+    */
+    void SetBlockSize( int items, int maxItems ) {
+        TIXMLASSERT( items > 0 && items <= maxItems );
+        _nextBlockItems = items;
+        _maxBlockItems = maxItems;
+    }
+
+    /*
+    	The number of items up to which blocks grow.
+    */
+    int MaxBlockItems() const {
+        return _maxBlockItems;
+    }
+
+    /*
+    	Sets where blocks come from. The pool must not have any blocks.
+    */
+    void SetAllocator( XMLAllocator* allocator ) {
+        TIXMLASSERT( allocator );
+        TIXMLASSERT( _blocks.Empty() );
+        _allocator = allocator;
+        _blocks.SetAllocator( allocator );
+    }
+
+    /*
+    	Makes sure the next 'items' allocations don't need a new block
+    	(unless items are freed in between, and reused first.)
+    */
+    void Reserve( int items ) {
+        int available = static_cast<int>( _bumpEnd - _bump );
+        for( int i = _current + 1; i < _blocks.Size(); ++i ) {
+            available += _blocks[i].count;
+        }
+        if ( available < items ) {
+            NewBlock( items - available );
+        }
+    }
+
+    /*
+    	Takes over the blocks of 'other', and the items allocated from
+    	them, which are then freed to this pool. Both pools must use the
+    	same allocator. 'other' is left empty.
+    */
+    void Take( MemPoolT& other ) {
+        TIXMLASSERT( &other != this );
+        TIXMLASSERT( _allocator == other._allocator );
+        // The rest of other's current block becomes free items.
+        while ( other._bump != other._bumpEnd ) {
+            Item* item = --other._bumpEnd;
+            item->next = other._root;
+            other._root = item;
+        }
+        if ( other._root ) {
+            Item* last = other._root;
+            while ( last->next ) {
+                last = last->next;
+            }
+            last->next = _root;
+            _root = other._root;
+        }
+        // Used blocks go before the current one, so they are never
+        // taken for unused ones; blocks other hadn't started are dropped.
+        const int used = other._current + 1;
+        for( int i = used; i < other._blocks.Size(); ++i ) {
+            other._bytes -= other._blocks[i].count * sizeof( Item );
+            other.DeleteBlock( other._blocks[i] );
+        }
+        if ( used > 0 ) {
+            _blocks.PushArr( used );
+            for( int i = _blocks.Size() - 1; i >= used; --i ) {
+                _blocks[i] = _blocks[i - used];
+            }
+            for( int i = 0; i < used; ++i ) {
+                _blocks[i] = other._blocks[i];
+            }
+            _current += used;
+        }
+        _bytes += other._bytes;
+        _currentAllocs += other._currentAllocs;
+        if ( _currentAllocs > _maxAllocs ) {
+            _maxAllocs = _currentAllocs;
+        }
+        _nAllocs += other._nAllocs;
+        _nUntracked += other._nUntracked;
+
+        other._blocks.Clear();
+        other._current = -1;
+        other._root = 0;
+        other._bump = 0;
+        other._bumpEnd = 0;
+        other._bytes = 0;
+        other._currentAllocs = 0;
+        other._nAllocs = 0;
+        other._maxAllocs = 0;
+        other._nUntracked = 0;
+    }
+
+    XMLAllocator* Allocator() const {
+        return _allocator;
+    }
+
     virtual int ItemSize() const	{
         return ITEM_SIZE;
     }
@@ -372,22 +628,36 @@ public:
         return _currentAllocs;
     }
 
+    void GetStats( MemPoolStats* stats ) const {
+        TIXMLASSERT( stats );
+        stats->itemSize = ITEM_SIZE;
+        stats->blocks = _blocks.Size();
+        stats->bytes = _bytes;
+        stats->live = _currentAllocs;
+        stats->watermark = _maxAllocs;
+        stats->allocs = _nAllocs;
+    }
+
     virtual void* Alloc() {
-        if ( !_root ) {
-            // Need a new block.
-            Block* block = new Block();
-            _blockPtrs.Push( block );
-
-            Item* blockItems = block->items;
-            for( int i = 0; i < ITEMS_PER_BLOCK - 1; ++i ) {
-                blockItems[i].next = &(blockItems[i + 1]);
+        Item* result = _root;
+        if ( result ) {
+            _root = _root->next;
+        }
+        else {
+            if ( _bump == _bumpEnd ) {
+                // On to the next block that hasn't been used, or a new one.
+                if ( _current + 1 < _blocks.Size() ) {
+                    ++_current;
+                    _bump = _blocks[_current].items;
+                    _bumpEnd = _bump + _blocks[_current].count;
+                }
+                else {
+                    NewBlock( _nextBlockItems );
+                }
             }
-            blockItems[ITEMS_PER_BLOCK - 1].next = 0;
-            _root = blockItems;
+            result = _bump++;
         }
-        Item* const result = _root;
         TIXMLASSERT( result != 0 );
-        _root = _root->next;
 
         ++_currentAllocs;
         if ( _currentAllocs > _maxAllocs ) {
@@ -413,7 +683,7 @@ public:
     void Trace( const char* name ) {
         printf( "Mempool %s watermark=%d [%dk] current=%d size=%d nAlloc=%d blocks=%d\n",
                 name, _maxAllocs, _maxAllocs * ITEM_SIZE / 1024, _currentAllocs,
-                ITEM_SIZE, _nAllocs, _blockPtrs.Size() );
+                ITEM_SIZE, _nAllocs, _blocks.Size() );
     }
 
     void SetTracked() {
@@ -433,6 +703,7 @@ public:
 	//		16k:	5200
 	//		32k:	4300
 	//		64k:	4000	21000
+    // It is now the size of the first block; later blocks grow from it.
     // Declared public because some compilers do not accept to use ITEMS_PER_BLOCK
     // in private part if ITEMS_PER_BLOCK is private
     enum { ITEMS_PER_BLOCK = (4 * 1024) / ITEM_SIZE };
@@ -446,15 +717,157 @@ private:
         char    itemData[ITEM_SIZE];
     };
     struct Block {
-        Item items[ITEMS_PER_BLOCK];
+        Item*   items;
+        int     count;
     };
-    DynArray< Block*, 10 > _blockPtrs;
-    Item* _root;
+
+    // Adds a block after the current one and makes it current; the rest
+    // of the current block goes on the free list, so it isn't lost.
+    void NewBlock( int minItems ) {
+        while ( _bump != _bumpEnd ) {
+            Item* item = _bumpEnd - 1;
+            --_bumpEnd;
+            item->next = _root;
+            _root = item;
+        }
+        Block block;
+        block.count = minItems > _nextBlockItems ? minItems : _nextBlockItems;
+        block.items = static_cast<Item*>( _allocator->Allocate( block.count * sizeof( Item ) ) );
+        _bytes += block.count * sizeof( Item );
+        _blocks.Push( block );
+        // Keep the unused blocks after the current one.
+        const int next = _current + 1;
+        for( int i = _blocks.Size() - 1; i > next; --i ) {
+            _blocks[i] = _blocks[i - 1];
+        }
+        _blocks[next] = block;
+        _current = next;
+        _bump = block.items;
+        _bumpEnd = block.items + block.count;
+
+        if ( _nextBlockItems < _maxBlockItems ) {
+            _nextBlockItems = ( _nextBlockItems > _maxBlockItems / 2 ) ? _maxBlockItems : _nextBlockItems * 2;
+        }
+    }
+
+    void DeleteBlock( const Block& block ) {
+        _allocator->Deallocate( block.items, block.count * sizeof( Item ) );
+    }
+
+    DynArray< Block, 10 > _blocks;
+    int     _current;       // the block _bump is in, -1 before the first
+    Item*   _root;          // the free list
+    Item*   _bump;          // the next unused item of the current block
+    Item*   _bumpEnd;
+    int     _nextBlockItems;
+    int     _maxBlockItems;
+    size_t  _bytes;
 
     int _currentAllocs;
     int _nAllocs;
     int _maxAllocs;
     int _nUntracked;
+    XMLAllocator* _allocator;
+};
+
+
+/*
+	Memory for the strings of a document (see StrPair::SetStr()).
+	Strings are copied one after the other into chunks, which start
+	at 4k and double up to 256k, and are only released together by
+	Reset() or Clear(); a string that is replaced by one no longer
+	than itself is overwritten in place.
+
+	Chunks are reference counted, so that a clone in another document
+	can point at the strings of the original instead of copying them
+	(see Share()). Once an arena is shared its strings are never
+	overwritten in place: a changed string is copied, and the other
+	document keeps the old one.
+*/
+class TINYXML2_LIB StrArena
+{
+public:
+    StrArena() : _chunks(), _next( 0 ), _end( 0 ), _nextChunkSize( MIN_CHUNK_SIZE ), _bytes( 0 ), _allocator( XMLAllocator::Default() ), _shared( false ) {}
+    ~StrArena() {
+        Clear();
+    }
+
+    char* Alloc( size_t size ) {
+        if ( size > static_cast<size_t>( _end - _next ) ) {
+            return NewChunk( size );
+        }
+        char* mem = _next;
+        _next += size;
+        return mem;
+    }
+
+    // Releases every string; keeps the largest chunk for reuse.
+    void Reset();
+    // Releases every string and chunk.
+    void Clear();
+    // Sets where chunks come from. The arena must not have any chunks.
+    void SetAllocator( XMLAllocator* allocator );
+    // Takes over the chunks of 'other'.
+    void Take( StrArena& other );
+    // Takes over the reference to 'buffer', from NewBuffer().
+    void AddBuffer( char* buffer );
+    // Keeps the chunks of 'other' alive until this arena is reset, so
+    // that strings can point into them; 'other' becomes shared.
+    void Share( StrArena& other );
+    // Keeps 'buffer', from NewBuffer(), alive until this arena is reset.
+    void ShareBuffer( char* buffer );
+    // True if strings may point into the chunks from elsewhere.
+    bool Shared() const {
+        return _shared;
+    }
+
+    // Bytes held in chunks.
+    size_t Bytes() const {
+        return _bytes;
+    }
+    int Chunks() const {
+        return _chunks.Size();
+    }
+
+    /*
+    	A reference counted buffer of 'size' bytes, freed to 'allocator'
+    	by the last ReleaseBuffer(). Arena chunks and the character
+    	buffers of documents are all allocated this way.
+    */
+    static char* NewBuffer( XMLAllocator* allocator, size_t size );
+    // As NewBuffer(), but null if XMLAllocator::TryAllocate() is.
+    static char* TryNewBuffer( XMLAllocator* allocator, size_t size );
+    static void ReleaseBuffer( char* buffer );
+
+    enum { MIN_CHUNK_SIZE = 4 * 1024, MAX_CHUNK_SIZE = 256 * 1024 };
+
+private:
+    StrArena( const StrArena& ); // not supported
+    void operator=( const StrArena& ); // not supported
+
+    char* NewChunk( size_t size );
+    void Hold( char* buffer );
+    void Release( char* buffer );
+    bool Holds( char* buffer ) const;
+
+    // Precedes the memory of each buffer.
+    struct BufferHeader {
+        XMLAllocator*   allocator;
+        size_t          size;
+        int             refs;
+        const StrArena* holder;     // the arena that last took a reference
+    };
+    static BufferHeader* HeaderOf( char* buffer ) {
+        return reinterpret_cast<BufferHeader*>( buffer ) - 1;
+    }
+
+    DynArray< char*, 10 > _chunks;
+    char*   _next;
+    char*   _end;
+    size_t  _nextChunkSize;
+    size_t  _bytes;
+    XMLAllocator* _allocator;
+    bool    _shared;
 };
 
 
@@ -540,6 +953,9 @@ enum XMLError {
     XML_CAN_NOT_CONVERT_TEXT,
     XML_NO_TEXT_NODE,
 	XML_ELEMENT_DEPTH_EXCEEDED,
+    XML_ERROR_BAD_SNAPSHOT,
+    XML_ERROR_BAD_PATCH,
+    XML_ERROR_COMPRESSION,
 
 	XML_ERROR_COUNT
 };
@@ -675,6 +1091,8 @@ class TINYXML2_LIB XMLNode
 {
     friend class XMLDocument;
     friend class XMLElement;
+    friend class XMLBuilder;
+    friend class XMLPrinter;
 public:
 
     /// Get the XMLDocument that owns this XMLNode.
@@ -732,6 +1150,24 @@ public:
         return 0;
     }
 
+    /// The kinds of node. See Kind().
+    enum NodeKind {
+        DOCUMENT_NODE,
+        ELEMENT_NODE,
+        TEXT_NODE,
+        COMMENT_NODE,
+        DECLARATION_NODE,
+        UNKNOWN_NODE
+    };
+    /**
+    	The kind of this node. Checking the kind is not a virtual call,
+    	unlike ToElement() and the other conversions, so it is the cheaper
+    	test in tight loops.
+    */
+    NodeKind Kind() const {
+        return static_cast<NodeKind>( _kind );
+    }
+
     /** The meaning of 'value' changes for the specific type.
     	@verbatim
     	Document:	empty (NULL is returned, not an empty string)
@@ -751,6 +1187,33 @@ public:
     /// Gets the line number the node is in, if the document was parsed from a file.
     int GetLineNum() const { return _parseLineNum; }
 
+    /**
+    	Gets where the node is in XMLDocument::SourceText(): the byte
+    	offset of its first character, and the length of all of it (from
+    	the start tag through the end tag, for an element). Returns false
+    	if the document didn't track spans (see XMLDocument::SetTrackSpans())
+    	or the node wasn't parsed from it. The span is of the node as parsed:
+    	a node keeps it when its children or attributes change, but not
+    	when its value is set.
+    */
+    bool GetSourceSpan( size_t* offset, size_t* length ) const;
+
+    /**
+    	Returns the source text of the node, as parsed, without printing it,
+    	and sets 'length' to its length. It is not null terminated. Null
+    	if the node has no span; see GetSourceSpan().
+    */
+    const char* OuterXML( size_t* length ) const;
+
+    /**
+    	Returns true if the node has been changed since it was parsed or
+    	created: its value, its attributes, or the nodes under it. Loading
+    	content, lazily or not, is not a change.
+    */
+    bool Modified() const {
+        return _modified != 0;
+    }
+
     /// Get the parent of this node on the DOM.
     const XMLNode*	Parent() const			{
         return _parent;
@@ -762,15 +1225,18 @@ public:
 
     /// Returns true if this node has no children.
     bool NoChildren() const					{
+        MaterializeChildren();
         return !_firstChild;
     }
 
     /// Get the first child node, or null if none exists.
     const XMLNode*  FirstChild() const		{
+        MaterializeChildren();
         return _firstChild;
     }
 
     XMLNode*		FirstChild()			{
+        MaterializeChildren();
         return _firstChild;
     }
 
@@ -785,10 +1251,12 @@ public:
 
     /// Get the last child node, or null if none exists.
     const XMLNode*	LastChild() const						{
+        MaterializeChildren();
         return _lastChild;
     }
 
     XMLNode*		LastChild()								{
+        MaterializeChildren();
         return _lastChild;
     }
 
@@ -880,6 +1348,11 @@ public:
     	null, then the node returned will be allocated
     	from the current Document. (this->GetDocument())
 
+    	The strings are not copied: the clone points at the strings of
+    	this node, and its document keeps them alive, even after this
+    	document is cleared or deleted. Changing either node afterwards
+    	does not change the other.
+
     	Note: if called on a XMLDocument, this will return null.
     */
     virtual XMLNode* ShallowClone( XMLDocument* document ) const = 0;
@@ -896,8 +1369,17 @@ public:
 		copy a document, since XMLDocuments can have multiple
 		top level XMLNodes. You probably want to use
         XMLDocument::DeepCopy()
+
+		With 'threads' other than 1, a large tree is split into
+		subtrees that are cloned on up to that many threads (0 for one
+		per hardware thread), each into memory of its own that the
+		target takes over at the end. The clone is the same as with
+		one thread. The tree is cloned on the calling thread if it is
+		small, if the target has an allocator other than the default
+		one, or if tinyxml2 was built without threads
+		(TINYXML2_NO_THREADS, or a compiler older than C++11).
 	*/
-	XMLNode* DeepClone( XMLDocument* target ) const;
+	XMLNode* DeepClone( XMLDocument* target, int threads = 1 ) const;
 
     /**
     	Test if 2 nodes are the same, but don't test children.
@@ -907,6 +1389,36 @@ public:
     */
     virtual bool ShallowEqual( const XMLNode* compare ) const = 0;
 
+    /// What DeepEqual() and Hash() leave out of the comparison.
+    enum CompareOptions {
+        COMPARE_ALL             = 0,
+        IGNORE_ATTRIBUTE_ORDER  = 0x01,
+        IGNORE_WHITESPACE       = 0x02,     ///< text that is only whitespace, and runs of whitespace in text
+        IGNORE_COMMENTS         = 0x04
+    };
+
+    /**
+    	Test if 2 nodes, and everything under them, are the same: the
+    	same kinds of node, with the same values and attributes, in the
+    	same order. The nodes do not need to be in the same Document.
+    	'options' is a combination of CompareOptions. Whether text is
+    	CDATA is not compared, as with ShallowEqual().
+    */
+    bool DeepEqual( const XMLNode* compare, int options = COMPARE_ALL ) const;
+
+    /**
+    	A 64 bit hash of this node and everything under it, which is
+    	the same for nodes that DeepEqual() with the same 'options', and
+    	the same on every platform. Different hashes mean different
+    	subtrees; equal ones mean equal subtrees, barring a collision.
+
+    	The hash of each node is kept until it, or something under it,
+    	changes. Hashing a document again after a few changes only
+    	hashes the nodes on the paths to them, from the kept hashes of
+    	their children.
+    */
+    uint64_t Hash( int options = COMPARE_ALL ) const;
+
     /** Accept a hierarchical visit of the nodes in the TinyXML-2 DOM. Every node in the
     	XML tree will be conditionally visited and the host will be called back
     	via the XMLVisitor interface.
@@ -951,10 +1463,34 @@ protected:
 
     virtual char* ParseDeep( char* p, StrPair* parentEndTag, int* curLineNumPtr);
 
+    // Parts of a lazily parsed element that are still only in the
+    // document's character buffer. See XMLDocument::SetLazyParsing().
+    enum {
+        LAZY_ATTRIBUTES = 0x01,
+        LAZY_CHILDREN   = 0x02
+    };
+
+    void MaterializeChildren() const {
+        if ( _lazy & LAZY_CHILDREN ) {
+            ExpandChildren();
+        }
+    }
+
+    // Drops the Hash() of this node and of the nodes above it, and marks
+    // them Modified(). See the definition after XMLDocument.
+    void Changed();
+
+    enum { HASH_VALID = 0x80 };
+
     XMLDocument*	_document;
     XMLNode*		_parent;
     mutable StrPair	_value;
     int             _parseLineNum;
+    mutable unsigned char _lazy;
+    unsigned char   _kind;
+    mutable unsigned char _hashOptions;     // of _hash, with HASH_VALID
+    unsigned char   _modified;
+    mutable uint64_t _hash;
 
     XMLNode*		_firstChild;
     XMLNode*		_lastChild;
@@ -965,7 +1501,8 @@ protected:
 	void*			_userData;
 
 private:
-    MemPool*		_memPool;
+    int             _unlinkedIndex;     // in the document's unlinked list, or -1
+    void ExpandChildren() const;
     void Unlink( XMLNode* child );
     static void DeleteNode( XMLNode* node );
     void InsertChildPreamble( XMLNode* insertThis ) const;
@@ -1004,6 +1541,7 @@ public:
     /// Declare whether this should be CDATA or standard text.
     void SetCData( bool isCData )			{
         _isCData = isCData;
+        Changed();
     }
     /// Returns true if this is a CDATA text element.
     bool CData() const						{
@@ -1014,7 +1552,9 @@ public:
     virtual bool ShallowEqual( const XMLNode* compare ) const;
 
 protected:
-    explicit XMLText( XMLDocument* doc )	: XMLNode( doc ), _isCData( false )	{}
+    explicit XMLText( XMLDocument* doc )	: XMLNode( doc ), _isCData( false )	{
+        _kind = TEXT_NODE;
+    }
     virtual ~XMLText()												{}
 
     char* ParseDeep( char* p, StrPair* parentEndTag, int* curLineNumPtr );
@@ -1140,6 +1680,9 @@ private:
 class TINYXML2_LIB XMLAttribute
 {
     friend class XMLElement;
+    friend class XMLDocument;
+    friend class XMLBuilder;
+    friend class XMLPrinter;
 public:
     /// The name of the attribute.
     const char* Name() const;
@@ -1150,6 +1693,15 @@ public:
     /// Gets the line number the attribute is in, if the document was parsed from a file.
     int GetLineNum() const { return _parseLineNum; }
 
+    /**
+    	Gets where the attribute is in XMLDocument::SourceText(), from its
+    	name through the closing quote; false if it has no span. See
+    	XMLNode::GetSourceSpan(). The name is at the start of it.
+    */
+    bool GetSourceSpan( size_t* offset, size_t* length ) const;
+    /// Gets where the value is in the source text: between the quotes, before entities are read.
+    bool GetValueSpan( size_t* offset, size_t* length ) const;
+
     /// The next attribute in the list.
     const XMLAttribute* Next() const {
         return _next;
@@ -1240,7 +1792,7 @@ public:
 private:
     enum { BUF_SIZE = 200 };
 
-    XMLAttribute() : _name(), _value(),_parseLineNum( 0 ), _next( 0 ), _memPool( 0 ) {}
+    XMLAttribute() : _name(), _value(),_parseLineNum( 0 ), _next( 0 ), _document( 0 ) {}
     virtual ~XMLAttribute()	{}
 
     XMLAttribute( const XMLAttribute& );	// not supported
@@ -1253,7 +1805,7 @@ private:
     mutable StrPair _value;
     int             _parseLineNum;
     XMLAttribute*   _next;
-    MemPool*        _memPool;
+    XMLDocument*    _document;
 };
 
 
@@ -1264,6 +1816,8 @@ private:
 class TINYXML2_LIB XMLElement : public XMLNode
 {
     friend class XMLDocument;
+    friend class XMLNode;
+    friend class XMLBuilder;
 public:
     /// Get the name of an element (which is the Value() of the node.)
     const char* Name() const		{
@@ -1512,6 +2066,7 @@ public:
 
     /// Return the first attribute in the list.
     const XMLAttribute* FirstAttribute() const {
+        MaterializeAttributes();
         return _rootAttribute;
     }
     /// Query a specific attribute in the list.
@@ -1690,11 +2245,24 @@ private:
 
     XMLAttribute* FindOrCreateAttribute( const char* name );
     char* ParseAttributes( char* p, int* curLineNumPtr );
+    char* ParseLazy( char* p, const char* nameStart, StrPair* parentEndTag, int* curLineNumPtr );
     static void DeleteAttribute( XMLAttribute* attribute );
     XMLAttribute* CreateAttribute();
 
+    void MaterializeAttributes() const {
+        if ( _lazy & LAZY_ATTRIBUTES ) {
+            const_cast<XMLElement*>(this)->ExpandAttributes();
+        }
+    }
+    void ExpandAttributes();
+    void ExpandChildren();
+
     enum { BUF_SIZE = 200 };
     ElementClosingType _closingType;
+    // Where the unparsed attributes (or, once those are read, the
+    // unparsed content) of a lazily parsed element start.
+    int     _lazyLineNum;
+    char*   _lazySource;
     // The attribute list is ordered; there is no 'lastAttribute'
     // because the list needs to be scanned for dupes before adding
     // a new attribute.
@@ -1719,6 +2287,8 @@ class TINYXML2_LIB XMLDocument : public XMLNode
     // Gives access to SetError and Push/PopDepth, but over-access for everything else.
     // Wishing C++ had "internal" scope.
     friend class XMLNode;
+    friend class XMLAttribute;
+    friend class XMLBuilder;
     friend class XMLText;
     friend class XMLComment;
     friend class XMLDeclaration;
@@ -1753,6 +2323,11 @@ public:
     	Load an XML file from disk.
     	Returns XML_SUCCESS (0) on success, or
     	an errorID.
+
+    	A file compressed with gzip or zstd is decompressed as it is read,
+    	into a buffer the size the file says it decompresses to. That
+    	depends on how tinyxml2 was built (see XMLCompressor); without the
+    	codec, loading the file fails with XML_ERROR_COMPRESSION.
     */
     XMLError LoadFile( const char* filename );
 
@@ -1769,10 +2344,31 @@ public:
     */
     XMLError LoadFile( FILE* );
 
+    /**
+    	Starts loading an XML file from disk on a thread of its own, and
+    	returns at once; 'load' is the handle to it:
+    	@verbatim
+    	XMLLoad load;
+    	doc.LoadFileAsync( "big.xml", &load );
+    	// ... other work ...
+    	if ( load.Wait() == XML_SUCCESS ) ...
+    	@endverbatim
+    	The document must not be used until the load is over. XMLLoad::Wait()
+    	then returns what LoadFile() would have. A load 'load' was already
+    	the handle to is waited for first.
+
+    	Without threads (see XMLNode::DeepClone()) the file is loaded
+    	before this returns.
+    */
+    void LoadFileAsync( const char* filename, XMLLoad* load );
+
     /**
     	Save the XML file to disk.
     	Returns XML_SUCCESS (0) on success, or
     	an errorID.
+
+    	A file name ending in ".gz" or ".zst" is written compressed with
+    	gzip or zstd, through an XMLCompressor.
     */
     XMLError SaveFile( const char* filename, bool compact = false );
 
@@ -1785,6 +2381,47 @@ public:
     */
     XMLError SaveFile( FILE* fp, bool compact = false );
 
+    /**
+    	Save a binary snapshot of the DOM: the nodes in document order,
+    	their attributes, and one table of the (already decoded) strings.
+    	LoadSnapshot() rebuilds the document from it without tokenizing
+    	or entity processing, which makes it a fast cache for documents
+    	that are loaded over and over.
+
+    	The format is versioned, and records the byte order of the machine
+    	that wrote it. It is not an interchange format: a snapshot can only
+    	be loaded by a machine with the same byte order.
+
+    	Returns XML_SUCCESS (0) on success, or
+    	an errorID.
+    */
+    XMLError SaveSnapshot( const char* filename );
+
+    /**
+    	Save a binary snapshot of the DOM. You are responsible
+    	for providing and closing the FILE*, which should be
+    	opened in binary mode. See SaveSnapshot( const char* ).
+    */
+    XMLError SaveSnapshot( FILE* fp );
+
+    /**
+    	Load a document from a snapshot written by SaveSnapshot().
+    	The result is an ordinary document that can be navigated, changed,
+    	and saved as XML. The file is read with a single read and its
+    	strings are used in place.
+
+    	Returns XML_SUCCESS (0) on success, XML_ERROR_BAD_SNAPSHOT if
+    	the file is not a snapshot this version can read, or another
+    	errorID.
+    */
+    XMLError LoadSnapshot( const char* filename );
+
+    /**
+    	Load a document from a snapshot. You are responsible
+    	for providing and closing the FILE*.
+    */
+    XMLError LoadSnapshot( FILE* fp );
+
     bool ProcessEntities() const		{
         return _processEntities;
     }
@@ -1792,6 +2429,66 @@ public:
         return _whitespaceMode;
     }
 
+    /**
+    	Sets whether Parse() and LoadFile() build the DOM lazily. In lazy
+    	mode the parser reads the name of each element and locates its end
+    	tag, but leaves its attributes, text and children in the document's
+    	buffer. They are parsed the first time they are accessed, through
+    	FirstChild(), FirstAttribute(), GetText() and the like, so the cost
+    	of a load depends on how much of the document is used.
+
+    	Because unread content is not checked, an error inside an element
+    	is reported (through Error() and ErrorID()) when that element is
+    	first expanded rather than by Parse(). Takes effect on the next load.
+    */
+    void SetLazyParsing( bool lazy )	{
+        _lazyParsing = lazy;
+    }
+    /// Returns true if the document parses lazily. See SetLazyParsing().
+    bool LazyParsing() const			{
+        return _lazyParsing;
+    }
+
+    /**
+    	Sets whether Parse() and LoadFile() record where each node and
+    	attribute is in the parsed text, for XMLNode::GetSourceSpan() and
+    	XMLAttribute::GetSourceSpan(). A copy of the text is kept, as
+    	SourceText(), since parsing changes the document's own. Off by
+    	default, when nothing is recorded or kept. Takes effect on the
+    	next load.
+    */
+    void SetTrackSpans( bool track )	{
+        _trackSpans = track;
+    }
+    /// Returns true if loads record spans. See SetTrackSpans().
+    bool TrackSpans() const				{
+        return _trackSpans;
+    }
+    /// The text of the last load if it tracked spans, or null.
+    const char* SourceText() const		{
+        return _source;
+    }
+    /// The length of SourceText().
+    size_t SourceSize() const			{
+        return _source ? _charBufferSize : 0;
+    }
+
+    /**
+    	Updates the document after an edit of its text, parsing again
+    	only the content of the innermost element the edit is in. 'xml'
+    	is the whole new text: SourceText() with the 'replaced' bytes at
+    	'offset' replaced. 'nBytes' is its length, as for Parse(). The
+    	nodes outside that element are kept, and the line numbers and
+    	spans of those after it are moved.
+
+    	It parses all of 'xml', as Parse() does, if spans were not
+    	tracked (see SetTrackSpans()), if the edit is not inside the
+    	content of an element that hasn't been changed since it was
+    	parsed, or if the new content doesn't end at that element's end
+    	tag. Returns XML_SUCCESS (0) on success, or an errorID.
+    */
+    XMLError Reparse( const char* xml, size_t nBytes, size_t offset, size_t replaced );
+
     /**
     	Returns true if this document has a leading Byte Order Mark of UTF8.
     */
@@ -1827,8 +2524,19 @@ public:
     	doc.Print( &printer );
     	// printer.CStr() has a const char* to the XML
     	@endverbatim
+
+    	With 'threads' other than 1, a large document is split into
+    	subtrees that are printed on up to that many threads (0 for one
+    	per hardware thread), each into memory of its own, and then
+    	written to the printer in document order. The output is the same
+    	as with one thread, but only the parts printed on the calling
+    	thread go through the overrides of a class derived from
+    	XMLPrinter. The document is printed on the calling thread if it
+    	is small, if the printer has an allocator other than the default
+    	one or reuses the source text, or if tinyxml2 was built without
+    	threads (see XMLNode::DeepClone()).
     */
-    void Print( XMLPrinter* streamer=0 ) const;
+    void Print( XMLPrinter* streamer=0, int threads=1 ) const;
     virtual bool Accept( XMLVisitor* visitor ) const;
 
     /**
@@ -1905,20 +2613,108 @@ public:
     /// Clear the document, resetting it to the initial state.
     void Clear();
 
+    /**
+    	Fills in the statistics of the memory pools the nodes and
+    	attributes are allocated from. Declarations and unknown nodes
+    	share the comment pool. Any of the pointers may be null.
+    */
+    void GetPoolStats( MemPoolStats* elements, MemPoolStats* attributes, MemPoolStats* texts, MemPoolStats* comments ) const;
+
+    /**
+    	Sets the size in bytes of the next block each memory pool
+    	allocates, and the size blocks double up to after that. The
+    	defaults are 4k and 256k. Use the same value twice for blocks
+    	of a fixed size.
+    */
+    void SetPoolBlockSize( int bytes, int maxBytes );
+
+    /**
+    	Sets where the document gets its memory: the buffer for the
+    	text it parses, the blocks its nodes and attributes are
+    	allocated from, and the chunks its strings are kept in. The
+    	document is cleared, and must be empty afterwards while the
+    	allocator is changed. Passing null restores the default.
+    */
+    void SetAllocator( XMLAllocator* allocator );
+    /// The allocator the document gets its memory from.
+    XMLAllocator* Allocator() const {
+        return _allocator;
+    }
+
 	/**
 		Copies this document to a target document.
 		The target will be completely cleared before the copy.
 		If you want to copy a sub-tree, see XMLNode::DeepClone().
 
 		NOTE: that the 'target' must be non-null.
+
+		'threads' is as for XMLNode::DeepClone().
+	*/
+	void DeepCopy(XMLDocument* target, int threads = 1) const;
+
+	/**
+		Moves a node, and everything under it, from another document
+		to this one, and returns it as a node of this document. The
+		original is deleted from its document, and the returned node
+		is not linked: insert it where it belongs, as with NewElement().
+
+		Unlike DeepClone(), the strings are not allocated one by one:
+		the part of the other document's parsed text they come from is
+		copied in one piece. Strings set after parsing are copied to
+		this document.
+	*/
+	XMLNode* Adopt(XMLNode* node);
+
+	/**
+		Moves every node of another document to this one, and leaves
+		the other document empty. Its top level nodes are appended to
+		the children of 'parent' (this document if null), and its
+		unlinked nodes are unlinked nodes of this document. Returns the
+		first node appended, or null if there were none.
+
+		Nothing is copied when both documents use the same allocator:
+		this document takes over the other's character buffer, memory
+		pool blocks and string chunks. Otherwise each top level node is
+		moved with Adopt().
+	*/
+	XMLNode* Splice(XMLDocument* source, XMLNode* parent = 0);
+
+	/**
+		Writes to 'script' the edits that turn this document into 'to',
+		and returns how many there are. 'script' is cleared first, and
+		is an ordinary document: it can be saved, and parsed back (with
+		whitespace preserved, the default) to be given to Patch().
+
+		Children are matched by Hash() first: a subtree equal in both is
+		not looked into, wherever it has moved. The children left are
+		matched by kind and element name, and compared in turn. Children
+		kept in order cost nothing; the others are moved, inserted or
+		deleted, and attribute and value changes are edits of their own.
+		Text that is CDATA in one document and not the other is changed
+		by a value edit, though DeepEqual() doesn't tell them apart.
+	*/
+	int Diff(const XMLDocument* to, XMLDocument* script) const;
+
+	/**
+		Applies the edits Diff() wrote to 'script' to this document.
+		Returns XML_SUCCESS (0), or XML_ERROR_BAD_PATCH if an edit doesn't
+		fit the document, in which case the edits before it stay applied.
+	*/
+	XMLError Patch(const XMLDocument* script);
+
+	/**
+		Makes an immutable, struct-of-arrays view of this document in
+		'target', which is cleared first. See XMLFrozenDocument. The view
+		holds copies of the strings, so it does not depend on this
+		document afterwards.
 	*/
-	void DeepCopy(XMLDocument* target) const;
+	void Freeze(XMLFrozenDocument* target) const;
 
 	// internal
     char* Identify( char* p, XMLNode** node );
 
 	// internal
-	void MarkInUse(const XMLNode* const);
+	void MarkInUse(XMLNode* node);
 
     virtual XMLNode* ShallowClone( XMLDocument* /*document*/ ) const	{
         return 0;
@@ -1933,11 +2729,14 @@ private:
 
     bool			_writeBOM;
     bool			_processEntities;
+    bool			_lazyParsing;
+    bool			_trackSpans;
     XMLError		_errorID;
     Whitespace		_whitespaceMode;
     mutable StrPair	_errorStr;
     int             _errorLineNum;
     char*			_charBuffer;
+    size_t			_charBufferSize;
     int				_parseCurLineNum;
 	int				_parsingDepth;
 	// Memory tracking does add some overhead.
@@ -1952,10 +2751,36 @@ private:
     MemPoolT< sizeof(XMLAttribute) > _attributePool;
     MemPoolT< sizeof(XMLText) >		 _textPool;
     MemPoolT< sizeof(XMLComment) >	 _commentPool;
+    StrArena _strArena;
+    XMLAllocator* _allocator;
+    // The document DeepClone() is copying from, whose strings are shared.
+    const XMLDocument* _sharingFrom;
+
+    // Where a node or attribute is in _source, found by the address its
+    // value (name, for an attribute) was parsed at. Reparse() keeps the
+    // old buffers, so the keys of the nodes it keeps stay valid.
+    struct SourceSpan {
+        uintptr_t key;
+        size_t  offset;
+        size_t  length;
+    };
+    char*                           _source;        // if tracking spans
+    mutable DynArray<SourceSpan, 16> _spans;
+    mutable bool                    _spansSorted;   // by key
+
+    void AddSpan( const char* key, const char* start, const char* end );
+    int ReserveSpan();
+    void SetSpan( int index, const char* key, const char* start, const char* end );
+    void DropSpans( int index );
+    bool FindSpan( const char* key, size_t* offset, size_t* length ) const;
+    XMLElement* ReparseTarget( size_t start, size_t end, size_t* contentStart, size_t* contentEnd ) const;
+    void ReparseMove( XMLNode* node, const char* oldBuffer, size_t editEnd, size_t newEditEnd, int lines );
 
 	static const char* _errorNames[XML_ERROR_COUNT];
 
     void Parse();
+    size_t ReadFile( FILE* fp );
+    void ParseSnapshot( size_t size );
 
     void SetError( XMLError error, int lineNum, const char* format, ... );
 
@@ -1979,6 +2804,24 @@ private:
 
     template<class NodeType, int PoolElementSize>
     NodeType* CreateUnlinkedNode( MemPoolT<PoolElementSize>& pool );
+    template<class NodeType, int PoolElementSize>
+    NodeType* CreateLinkedNode( MemPoolT<PoolElementSize>& pool );
+    template<class NodeType, int PoolElementSize>
+    NodeType* CreateLastChild( MemPoolT<PoolElementSize>& pool, XMLNode* parent );
+    template<class NodeType, int PoolElementSize>
+    NodeType* CreateSharedClone( MemPoolT<PoolElementSize>& pool, const XMLNode* node );
+    void ShareStrings( XMLDocument* source );
+
+    struct CloneJob;
+    struct CloneWorker;
+    XMLNode* ParallelClone( const XMLNode* node, int threads );
+    int CloneTop( const XMLNode* node, XMLNode* clone, int index, CloneJob* job );
+    void CloneUnits( CloneWorker* worker );
+    XMLNode* CloneSubtree( const XMLNode* node, XMLNode* parent, CloneWorker* worker );
+    void AdoptRange( const XMLNode* node, const char** lo, const char** hi ) const;
+    void SetDocument( XMLNode* node );
+    XMLNode* AdoptCopy( const XMLNode* node, XMLNode* parent, const char* lo, const char* hi, char* copy );
+    MemPool* PoolOf( const XMLNode* node );
 };
 
 template<class NodeType, int PoolElementSize>
@@ -1988,32 +2831,707 @@ inline NodeType* XMLDocument::CreateUnlinkedNode( MemPoolT<PoolElementSize>& poo
     TIXMLASSERT( sizeof( NodeType ) == pool.ItemSize() );
     NodeType* returnNode = new (pool.Alloc()) NodeType( this );
     TIXMLASSERT( returnNode );
-    returnNode->_memPool = &pool;
 
+    returnNode->_unlinkedIndex = _unlinked.Size();
 	_unlinked.Push(returnNode);
     return returnNode;
 }
 
-/**
-	A XMLHandle is a class that wraps a node pointer with null checks; this is
-	an incredibly useful thing. Note that XMLHandle is not part of the TinyXML-2
-	DOM structure. It is a separate utility class.
+// Creates an unlinked node with the value of 'node', for ShallowClone():
+// the value is shared, not copied.
+template<class NodeType, int PoolElementSize>
+inline NodeType* XMLDocument::CreateSharedClone( MemPoolT<PoolElementSize>& pool, const XMLNode* node )
+{
+    ShareStrings( node->_document );
+    NodeType* clone = CreateUnlinkedNode<NodeType>( pool );
+    clone->_value.SetShared( &node->_value, &_strArena );
+    return clone;
+}
 
-	Take an example:
-	@verbatim
-	<Document>
-		<Element attributeA = "valueA">
-			<Child attributeB = "value1" />
-			<Child attributeB = "value2" />
-		</Element>
-	</Document>
-	@endverbatim
+// Creates a node that the caller links without InsertEndChild(), so it
+// never goes on the unlinked list.
+template<class NodeType, int PoolElementSize>
+inline NodeType* XMLDocument::CreateLinkedNode( MemPoolT<PoolElementSize>& pool )
+{
+    TIXMLASSERT( sizeof( NodeType ) == pool.ItemSize() );
+    NodeType* node = new (pool.Alloc()) NodeType( this );
+    TIXMLASSERT( node );
+    pool.SetTracked();
+    return node;
+}
 
-	Assuming you want the value of "attributeB" in the 2nd "Child" element, it's very
-	easy to write a *lot* of code that looks like:
+// The parent of a node with a hash has one, and that of a modified node
+// is modified, so the walk up stops at the first node that is modified
+// and has no hash. The parser adds content that was always there.
+inline void XMLNode::Changed()
+{
+    if ( _document->_parsingDepth ) {
+        return;
+    }
+    for( XMLNode* node = this; node && ( ( node->_hashOptions & HASH_VALID ) || !node->_modified ); node = node->_parent ) {
+        node->_hashOptions = 0;
+        node->_modified = 1;
+    }
+}
 
-	@verbatim
-	XMLElement* root = document.FirstChildElement( "Document" );
+
+// Creates a node already linked as the last child of 'parent', for
+// XMLBuilder.
+template<class NodeType, int PoolElementSize>
+inline NodeType* XMLDocument::CreateLastChild( MemPoolT<PoolElementSize>& pool, XMLNode* parent )
+{
+    TIXMLASSERT( parent && parent->_document == this );
+    NodeType* node = CreateLinkedNode<NodeType>( pool );
+    parent->Changed();
+
+    node->_parent = parent;
+    node->_prev = parent->_lastChild;
+    if ( parent->_lastChild ) {
+        parent->_lastChild->_next = node;
+    }
+    else {
+        parent->_firstChild = node;
+    }
+    parent->_lastChild = node;
+    return node;
+}
+
+
+/**
+	Appends new content to a document, or to a node of it, in
+	document order. It is the quick way to turn a large amount of data
+	into an XMLDocument:
+	@verbatim
+	XMLBuilder builder( &doc );
+	builder.BeginElement( "item" );
+	builder.Attr( "id", 1 );
+	builder.Text( "one" );
+	builder.EndElement();
+	@endverbatim
+	makes the same tree as NewElement(), InsertEndChild(), SetAttribute()
+	and SetText(), but each node is created already linked, so none of the
+	checks those calls make are needed.
+
+	If 'uniqueAttributes' is set, the caller promises not to add an
+	attribute twice to the same element, and Attr() appends without
+	looking for an existing attribute of the name. Otherwise Attr()
+	replaces the value, like XMLElement::SetAttribute().
+*/
+class TINYXML2_LIB XMLBuilder
+{
+public:
+    /// Appends to the children of 'parent', which is a document or an element.
+    XMLBuilder( XMLNode* parent, bool uniqueAttributes = false );
+
+    /// Adds an element, and makes it the one new content goes in.
+    void BeginElement( const char* name );
+    /// Adds an attribute to the current element.
+    void Attr( const char* name, const char* value );
+    void Attr( const char* name, int value );
+    void Attr( const char* name, unsigned value );
+    void Attr( const char* name, int64_t value );
+    void Attr( const char* name, uint64_t value );
+    void Attr( const char* name, bool value );
+    void Attr( const char* name, double value );
+    /// Adds a text node.
+    void Text( const char* text, bool cdata = false );
+    void Text( int value );
+    void Text( unsigned value );
+    void Text( int64_t value );
+    void Text( uint64_t value );
+    void Text( bool value );
+    void Text( double value );
+    /// Goes back to the parent of the current element.
+    void EndElement();
+
+    /// The node new content goes in.
+    XMLNode* Current() const {
+        return _current;
+    }
+    /// The number of elements begun and not yet ended.
+    int Depth() const {
+        return _depth;
+    }
+
+private:
+    XMLBuilder( const XMLBuilder& );	// not supported
+    void operator=( const XMLBuilder& );	// not supported
+
+    enum { BUF_SIZE = 200 };
+
+    XMLDocument*    _document;
+    XMLNode*        _current;
+    XMLAttribute*   _lastAttribute;     // of _current, or null if not known
+    int             _depth;
+    bool            _uniqueAttributes;
+};
+
+
+class XMLCompactDocument;
+
+/**
+	A handle to a node of an XMLCompactDocument. It is two words, is
+	passed by value, and is null (see IsNull()) when the node asked for
+	does not exist, so calls can be chained like those of XMLHandle:
+	@verbatim
+	const char* id = doc.RootElement().FirstChildElement( "item" ).Attribute( "id" );
+	@endverbatim
+
+	A handle is valid as long as its document is not cleared or reloaded.
+*/
+class TINYXML2_LIB XMLCompactNode
+{
+    friend class XMLCompactDocument;
+public:
+    XMLCompactNode() : _document( 0 ), _index( 0 ) {}
+
+    /// True if the handle does not refer to a node.
+    bool IsNull() const {
+        return _document == 0;
+    }
+    bool operator==( const XMLCompactNode& rhs ) const {
+        return _document == rhs._document && _index == rhs._index;
+    }
+    bool operator!=( const XMLCompactNode& rhs ) const {
+        return !( *this == rhs );
+    }
+
+    bool IsDocument() const;
+    bool IsElement() const;
+    /// True for text, including CDATA.
+    bool IsText() const;
+    bool IsComment() const;
+    bool IsDeclaration() const;
+    bool IsUnknown() const;
+    /// True for a CDATA text node.
+    bool CData() const;
+
+    /// The value of the node, as XMLNode::Value(). Null for a null handle.
+    const char* Value() const;
+    /// The length of Value(), in bytes.
+    size_t ValueLength() const;
+    /// The name of an element. Null if this is not an element.
+    const char* Name() const;
+    /// The line the node starts on.
+    int GetLineNum() const;
+
+    XMLCompactNode Parent() const;
+    XMLCompactNode FirstChild() const;
+    XMLCompactNode NextSibling() const;
+    /// The first child element, optionally with the given name.
+    XMLCompactNode FirstChildElement( const char* name = 0 ) const;
+    /// The next sibling element, optionally with the given name.
+    XMLCompactNode NextSiblingElement( const char* name = 0 ) const;
+
+    /// The number of attributes of an element.
+    int AttributeCount() const;
+    /// The name of attribute 'i', in document order.
+    const char* AttributeName( int i ) const;
+    /// The value of attribute 'i', in document order.
+    const char* AttributeValue( int i ) const;
+    /**
+    	Given an attribute name, Attribute() returns the value
+    	for the attribute of that name, or null if none exists.
+    	See XMLElement::Attribute().
+    */
+    const char* Attribute( const char* name, const char* value = 0 ) const;
+    /// The attribute as an int, or 'defaultValue' if it is missing or not an int.
+    int IntAttribute( const char* name, int defaultValue = 0 ) const;
+
+    /// The text of the first child, as XMLElement::GetText().
+    const char* GetText() const;
+
+    /// The index of the node in its document; the document is 0.
+    uint32_t Index() const {
+        return _index;
+    }
+
+private:
+    XMLCompactNode( const XMLCompactDocument* document, uint32_t index ) : _document( document ), _index( index ) {}
+
+    const XMLCompactDocument*   _document;
+    uint32_t                    _index;
+};
+
+
+/**
+	A read-only document with a compact memory layout, for documents
+	too large for an XMLDocument. Nodes are fixed size records in one
+	array and refer to each other by 32 bit index; strings are offsets
+	into the document's character buffer, decoded in place. There are no
+	per-node allocations, virtual functions, or document and pool pointers.
+
+	Nodes are reached through XMLCompactNode handles. The parser follows
+	XMLDocument::Parse() and reports the same error codes; since it does
+	not recurse, nesting depth is not limited. Copy to an XMLDocument
+	(see CopyTo()) to modify or print a document.
+*/
+class TINYXML2_LIB XMLCompactDocument
+{
+    friend class XMLCompactNode;
+public:
+    /// constructor
+    XMLCompactDocument( bool processEntities = true, Whitespace whitespaceMode = PRESERVE_WHITESPACE );
+    ~XMLCompactDocument();
+
+    /**
+    	Parse an XML file from a character string. See XMLDocument::Parse().
+    	Returns XML_SUCCESS (0) on success, or an errorID.
+    */
+    XMLError Parse( const char* xml, size_t nBytes=static_cast<size_t>(-1) );
+
+    /**
+    	Load an XML file from disk.
+    	Returns XML_SUCCESS (0) on success, or an errorID.
+    */
+    XMLError LoadFile( const char* filename );
+
+    /**
+    	Load an XML file from disk. You are responsible
+    	for providing and closing the FILE*.
+    */
+    XMLError LoadFile( FILE* fp );
+
+    /// Clear the document, resetting it to the initial state.
+    void Clear();
+
+    /// The document node.
+    XMLCompactNode Document() const {
+        return XMLCompactNode( this, 0 );
+    }
+    /// The first top level node.
+    XMLCompactNode FirstChild() const {
+        return Document().FirstChild();
+    }
+    /// Return the root element of the document.
+    XMLCompactNode RootElement() const {
+        return Document().FirstChildElement();
+    }
+
+    /**
+    	Copy the document into an XMLDocument, which is cleared first.
+    	Line numbers and the byte order mark are kept.
+    */
+    void CopyTo( XMLDocument* target ) const;
+
+    /// Returns true if the document started with a UTF-8 byte order mark.
+    bool HasBOM() const {
+        return _writeBOM;
+    }
+
+    /// The number of nodes, not counting the document.
+    int NodeCount() const {
+        return _nodes.Size() - 1;
+    }
+    /// The number of attributes.
+    int AttributeCount() const {
+        return _attributes.Size();
+    }
+    /**
+    	Bytes held by the document: the node and attribute arrays
+    	(including unused capacity) and the character buffer.
+    */
+    size_t MemoryUsage() const;
+
+    /// Return true if there was an error parsing the document.
+    bool Error() const {
+        return _errorID != XML_SUCCESS;
+    }
+    /// Return the errorID.
+    XMLError ErrorID() const {
+        return _errorID;
+    }
+    /// The name of the error, as XMLDocument::ErrorName().
+    const char* ErrorName() const {
+        return XMLDocument::ErrorIDToName( _errorID );
+    }
+    /// Return the line where the error occurred, or zero if unknown.
+    int ErrorLineNum() const {
+        return _errorLineNum;
+    }
+
+    bool ProcessEntities() const {
+        return _processEntities;
+    }
+    Whitespace WhitespaceMode() const {
+        return _whitespaceMode;
+    }
+
+private:
+    XMLCompactDocument( const XMLCompactDocument& );	// not supported
+    void operator=( const XMLCompactDocument& );	// not supported
+
+    enum {
+        KIND_DOCUMENT,
+        KIND_ELEMENT,
+        KIND_TEXT,
+        KIND_CDATA,
+        KIND_COMMENT,
+        KIND_DECLARATION,
+        KIND_UNKNOWN,
+
+        KIND_BITS = 4,
+        KIND_MASK = ( 1 << KIND_BITS ) - 1
+    };
+
+    // 0 is the document, so it also serves as "none" for links.
+    struct Node {
+        uint32_t    kindAndAttributes;  // kind in the low KIND_BITS, attribute count above
+        uint32_t    parent;
+        uint32_t    firstChild;
+        uint32_t    nextSibling;
+        uint32_t    value;              // offset in _charBuffer
+        uint32_t    valueLength;
+        uint32_t    firstAttribute;     // index in _attributes
+        int         lineNum;
+    };
+
+    struct Attribute {
+        uint32_t    name;               // offset in _charBuffer
+        uint32_t    nameLength;
+        uint32_t    value;              // offset in _charBuffer
+        uint32_t    valueLength;
+        int         lineNum;
+    };
+
+    const Node& NodeAt( uint32_t index ) const {
+        TIXMLASSERT( index < static_cast<uint32_t>( _nodes.Size() ) );
+        return _nodes[static_cast<int>( index )];
+    }
+    const Attribute& AttributeAt( uint32_t index ) const {
+        TIXMLASSERT( index < static_cast<uint32_t>( _attributes.Size() ) );
+        return _attributes[static_cast<int>( index )];
+    }
+    static int Kind( const Node& node ) {
+        return static_cast<int>( node.kindAndAttributes & KIND_MASK );
+    }
+
+    void Parse();
+    char* ParseTag( char* p, int lineNum, int firstAttribute, bool* closed );
+    uint32_t AddNode( int kind, uint32_t parent, const char* start, const char* end, int lineNum );
+    void Decode( uint32_t* offset, uint32_t* length, int flags );
+    void SetError( XMLError error, int lineNum );
+
+    bool        _processEntities;
+    Whitespace  _whitespaceMode;
+    XMLError    _errorID;
+    int         _errorLineNum;
+    char*       _charBuffer;
+    size_t      _charBufferSize;
+    int         _parseCurLineNum;
+    bool        _writeBOM;
+
+    DynArray< Node, 1 >         _nodes;
+    DynArray< Attribute, 1 >    _attributes;
+    // Last child of each open element, and of the document, while parsing.
+    DynArray< uint32_t, 32 >    _lastChild;
+};
+
+
+/**
+	Visits the nodes of an XMLFrozenDocument; see XMLFrozenDocument::Accept().
+	Nodes are passed as indices, and the same rules as for XMLVisitor apply:
+	returning false from VisitEnter() skips the children of the element,
+	and returning false from any method stops the visit of its siblings.
+	The document (index 0) is passed to VisitEnter() and VisitExit() too.
+*/
+class TINYXML2_LIB XMLFrozenVisitor
+{
+public:
+    virtual ~XMLFrozenVisitor() {}
+
+    /// Visit the document or an element.
+    virtual bool VisitEnter( const XMLFrozenDocument& /*doc*/, int /*node*/ )	{
+        return true;
+    }
+    /// Visit the document or an element.
+    virtual bool VisitExit( const XMLFrozenDocument& /*doc*/, int /*node*/ )	{
+        return true;
+    }
+    /// Visit a text, comment, declaration, or unknown node.
+    virtual bool Visit( const XMLFrozenDocument& /*doc*/, int /*node*/ )		{
+        return true;
+    }
+};
+
+
+/**
+	An immutable view of an XMLDocument, made by XMLDocument::Freeze().
+	Nodes are numbered in document order, with the document as node 0,
+	and each property is a separate contiguous array indexed by node:
+	the kind, the interned name id, the parent, first child and next
+	sibling, and the offset of the value in one block of strings. Counts,
+	searches, and traversals are linear sweeps of these arrays, without
+	pointer chasing or virtual calls, and the arrays can be used directly
+	(see Kinds(), Parents(), and so on).
+
+	Since 0 is the document, which is never a child or a sibling, 0 also
+	means "none" for FirstChild() and NextSibling().
+*/
+class TINYXML2_LIB XMLFrozenDocument
+{
+    friend class XMLDocument;
+public:
+    enum NodeKind {
+        DOCUMENT_NODE,
+        ELEMENT_NODE,
+        TEXT_NODE,
+        CDATA_NODE,
+        COMMENT_NODE,
+        DECLARATION_NODE,
+        UNKNOWN_NODE
+    };
+
+    XMLFrozenDocument();
+    ~XMLFrozenDocument() {}
+
+    /// Clear the view; it will have only the document node.
+    void Clear();
+
+    /// The number of nodes, including the document.
+    int NodeCount() const {
+        return _kinds.Size();
+    }
+    NodeKind Kind( int node ) const {
+        return static_cast<NodeKind>( _kinds[node] );
+    }
+    /// The parent of a node; 0 for the document and top level nodes.
+    int Parent( int node ) const {
+        return _parents[node];
+    }
+    /// The first child of a node, or 0.
+    int FirstChild( int node ) const {
+        return _firstChildren[node];
+    }
+    /// The next sibling of a node, or 0.
+    int NextSibling( int node ) const {
+        return _nextSiblings[node];
+    }
+    /// The name id of an element, or -1 for other nodes.
+    int NameId( int node ) const {
+        return _nameIds[node];
+    }
+    /// The value of a node, as XMLNode::Value(); null for the document.
+    const char* Value( int node ) const {
+        return node ? _strings.Mem() + _values[node] : 0;
+    }
+
+    /// The number of distinct element and attribute names.
+    int NameCount() const {
+        return _names.Size();
+    }
+    /// The name with the given id.
+    const char* Name( int nameId ) const {
+        return _strings.Mem() + _names[nameId];
+    }
+    /// The id of a name, or -1 if no element or attribute has it.
+    int FindNameId( const char* name ) const;
+
+    /// The number of attributes of a node.
+    int AttributeCount( int node ) const {
+        return _attributeStarts[node+1] - _attributeStarts[node];
+    }
+    /// The name id of attribute 'i' of a node, in document order.
+    int AttributeNameId( int node, int i ) const {
+        TIXMLASSERT( i >= 0 && i < AttributeCount( node ) );
+        return _attributeNameIds[_attributeStarts[node] + i];
+    }
+    /// The value of attribute 'i' of a node, in document order.
+    const char* AttributeValue( int node, int i ) const {
+        TIXMLASSERT( i >= 0 && i < AttributeCount( node ) );
+        return _strings.Mem() + _attributeValues[_attributeStarts[node] + i];
+    }
+    /// The value of the named attribute of a node, or null.
+    const char* Attribute( int node, const char* name ) const;
+
+    /// The number of elements, or of elements with the given name.
+    int CountElements( const char* name = 0 ) const;
+    /**
+    	The first element after node 'after' in document order, with
+    	the given name if it is not null. Returns 0 if there is none.
+    	Start with 0 and pass each result back to find them all.
+    */
+    int FindElement( const char* name, int after = 0 ) const;
+
+    /// Visit the nodes in document order. See XMLFrozenVisitor.
+    bool Accept( XMLFrozenVisitor* visitor ) const;
+
+    /// The node arrays, NodeCount() long.
+    const unsigned char* Kinds() const {
+        return _kinds.Mem();
+    }
+    const int* NameIds() const {
+        return _nameIds.Mem();
+    }
+    const int* Parents() const {
+        return _parents.Mem();
+    }
+    const int* FirstChildren() const {
+        return _firstChildren.Mem();
+    }
+    const int* NextSiblings() const {
+        return _nextSiblings.Mem();
+    }
+    /// The offsets of the values in Strings().
+    const uint32_t* ValueOffsets() const {
+        return _values.Mem();
+    }
+    /// The block of null terminated strings.
+    const char* Strings() const {
+        return _strings.Mem();
+    }
+
+private:
+    XMLFrozenDocument( const XMLFrozenDocument& );	// not supported
+    void operator=( const XMLFrozenDocument& );	// not supported
+
+    DynArray< unsigned char, 1 >    _kinds;
+    DynArray< int, 1 >              _nameIds;
+    DynArray< int, 1 >              _parents;
+    DynArray< int, 1 >              _firstChildren;
+    DynArray< int, 1 >              _nextSiblings;
+    DynArray< uint32_t, 1 >         _values;
+    // The attributes of node i are [_attributeStarts[i], _attributeStarts[i+1]).
+    DynArray< int, 1 >              _attributeStarts;
+    DynArray< int, 1 >              _attributeNameIds;
+    DynArray< uint32_t, 1 >         _attributeValues;
+    DynArray< uint32_t, 1 >         _names;     // offsets in _strings, by name id
+    DynArray< char, 1 >             _strings;
+};
+
+
+/**
+	Traverse a node and its descendants with a statically dispatched
+	visitor. The visitor is called exactly as XMLNode::Accept() calls an
+	XMLVisitor, with the same return value rules, but its methods do not
+	have to be virtual and are called directly, so the compiler can inline
+	them. The node kinds are tested with XMLNode::Kind(), so there are no
+	virtual calls at all.
+
+	The visitor can be any class with the methods of XMLVisitor. Deriving
+	from XMLStaticVisitor provides defaults for the ones it doesn't need.
+*/
+template< class Visitor >
+bool Traverse( const XMLNode& node, Visitor& visitor )
+{
+    switch ( node.Kind() ) {
+        case XMLNode::ELEMENT_NODE:
+        {
+            const XMLElement& element = static_cast<const XMLElement&>( node );
+            if ( visitor.VisitEnter( element, element.FirstAttribute() ) ) {
+                for ( const XMLNode* child = node.FirstChild(); child; child = child->NextSibling() ) {
+                    if ( !Traverse( *child, visitor ) ) {
+                        break;
+                    }
+                }
+            }
+            return visitor.VisitExit( element );
+        }
+        case XMLNode::TEXT_NODE:
+            return visitor.Visit( static_cast<const XMLText&>( node ) );
+        case XMLNode::COMMENT_NODE:
+            return visitor.Visit( static_cast<const XMLComment&>( node ) );
+        case XMLNode::DOCUMENT_NODE:
+        {
+            const XMLDocument& document = static_cast<const XMLDocument&>( node );
+            if ( visitor.VisitEnter( document ) ) {
+                for ( const XMLNode* child = node.FirstChild(); child; child = child->NextSibling() ) {
+                    if ( !Traverse( *child, visitor ) ) {
+                        break;
+                    }
+                }
+            }
+            return visitor.VisitExit( document );
+        }
+        case XMLNode::DECLARATION_NODE:
+            return visitor.Visit( static_cast<const XMLDeclaration&>( node ) );
+        case XMLNode::UNKNOWN_NODE:
+            return visitor.Visit( static_cast<const XMLUnknown&>( node ) );
+    }
+    return true;
+}
+
+
+/**
+	An optional base for visitors used with Traverse(). It provides the
+	XMLVisitor methods, non-virtual, all returning true, and Traverse()
+	as a member:
+	@verbatim
+	struct CountElements : public XMLStaticVisitor< CountElements > {
+		using XMLStaticVisitor< CountElements >::VisitEnter;
+		CountElements() : count( 0 ) {}
+		bool VisitEnter( const XMLElement&, const XMLAttribute* ) { ++count; return true; }
+		int count;
+	};
+
+	CountElements counter;
+	counter.Traverse( doc );
+	@endverbatim
+
+	As the example shows, a visitor that defines one overload of VisitEnter(),
+	VisitExit() or Visit() hides the others, and needs a using declaration to
+	bring the defaults back.
+*/
+template< class Derived >
+class XMLStaticVisitor
+{
+public:
+    /// Traverse a node with this visitor. See tinyxml2::Traverse().
+    bool Traverse( const XMLNode& node ) {
+        return tinyxml2::Traverse( node, static_cast<Derived&>( *this ) );
+    }
+
+    bool VisitEnter( const XMLDocument& /*doc*/ )			{
+        return true;
+    }
+    bool VisitExit( const XMLDocument& /*doc*/ )			{
+        return true;
+    }
+    bool VisitEnter( const XMLElement& /*element*/, const XMLAttribute* /*firstAttribute*/ )	{
+        return true;
+    }
+    bool VisitExit( const XMLElement& /*element*/ )			{
+        return true;
+    }
+    bool Visit( const XMLDeclaration& /*declaration*/ )		{
+        return true;
+    }
+    bool Visit( const XMLText& /*text*/ )					{
+        return true;
+    }
+    bool Visit( const XMLComment& /*comment*/ )				{
+        return true;
+    }
+    bool Visit( const XMLUnknown& /*unknown*/ )				{
+        return true;
+    }
+
+protected:
+    XMLStaticVisitor() {}
+    ~XMLStaticVisitor() {}
+};
+
+
+/**
+	A XMLHandle is a class that wraps a node pointer with null checks; this is
+	an incredibly useful thing. Note that XMLHandle is not part of the TinyXML-2
+	DOM structure. It is a separate utility class.
+
+	Take an example:
+	@verbatim
+	<Document>
+		<Element attributeA = "valueA">
+			<Child attributeB = "value1" />
+			<Child attributeB = "value2" />
+		</Element>
+	</Document>
+	@endverbatim
+
+	Assuming you want the value of "attributeB" in the 2nd "Child" element, it's very
+	easy to write a *lot* of code that looks like:
+
+	@verbatim
+	XMLElement* root = document.FirstChildElement( "Document" );
 	if ( root )
 	{
 		XMLElement* element = root->FirstChildElement( "Element" );
@@ -2236,15 +3754,61 @@ private:
 */
 class TINYXML2_LIB XMLPrinter : public XMLVisitor
 {
+    friend class XMLDocument;
 public:
     /** Construct the printer. If the FILE* is specified,
-    	this will print to the FILE. Else it will print
-    	to memory, and the result is available in CStr().
+    	this will print to the FILE, through a buffer that is
+    	written out at the end of each element, and by Flush()
+    	(see SetOutput()); CStr() then has only what hasn't been
+    	written yet. Else it will print to memory, and the
+    	result is available in CStr().
     	If 'compact' is set to true, then output is created
     	with only required whitespace and newlines.
     */
     XMLPrinter( FILE* file=0, bool compact = false, int depth = 0 );
-    virtual ~XMLPrinter()	{}
+    virtual ~XMLPrinter();
+
+    /**
+    	Takes the output of a printer, 'size' bytes at 'data'. 'context'
+    	is the pointer given to SetOutput().
+    */
+    typedef void (*OutputFunc)( const char* data, size_t size, void* context );
+
+    /**
+    	Sends the output to 'func' instead of the FILE or memory: to a
+    	file descriptor, a socket or a compressor, say. The output is
+    	collected in the printer's buffer and passed on in large pieces:
+    	when the buffer fills up, when a top level element is closed, at
+    	the end of a document, and on Flush(). Printing to a FILE works
+    	the same way, except that the output is also passed on at the end
+    	of each element, so that the FILE has it when code in between
+    	reads it or hands it on; a FILE has a buffer of its own. Passing
+    	null prints to memory again.
+    */
+    void SetOutput( OutputFunc func, void* context );
+    /// Passes the output in the buffer on to the FILE or SetOutput() function.
+    void Flush();
+
+    /**
+    	Sets whether printing to memory keeps the output in pieces of
+    	about 64k rather than in one buffer, which has to be copied each
+    	time it grows and is limited to 2G. The pieces are read with
+    	ChunkCount() and Chunk(), to be written out with writev() or
+    	the like; CStr() then only has what isn't in a piece yet.
+    */
+    void SetChunked( bool chunked );
+    /// The number of pieces of output; see SetChunked().
+    int ChunkCount() const;
+    /// Piece 'i' of the output, and its size in 'size'; see SetChunked().
+    const char* Chunk( int i, size_t* size ) const;
+
+    /**
+    	Prints 'node' without keeping the output, to find its size, and
+    	makes the memory buffer that big: printing it afterwards then
+    	allocates once. Call it before printing anything. Returns the
+    	size, without the terminating null.
+    */
+    size_t Reserve( const XMLNode& node );
 
     /** If streaming, write the BOM and declaration. */
     void PushHeader( bool writeBOM, bool writeDeclaration );
@@ -2287,9 +3851,7 @@ public:
     void PushUnknown( const char* value );
 
     virtual bool VisitEnter( const XMLDocument& /*doc*/ );
-    virtual bool VisitExit( const XMLDocument& /*doc*/ )			{
-        return true;
-    }
+    virtual bool VisitExit( const XMLDocument& doc );
 
     virtual bool VisitEnter( const XMLElement& element, const XMLAttribute* attribute );
     virtual bool VisitExit( const XMLElement& element );
@@ -2314,6 +3876,19 @@ public:
     int CStrSize() const {
         return _buffer.Size();
     }
+    /**
+    	Sets whether to write the nodes that haven't been Modified() since
+    	they were parsed as their source text, when the document kept it
+    	(see XMLDocument::SetTrackSpans()). Only the changed parts are
+    	printed, so saving after a small edit costs about what copying the
+    	file does, and the rest of it stays as it was, byte for byte. The
+    	changed parts of such a document are printed compact, with the
+    	whitespace the source has around them.
+    */
+    void SetReuseSource( bool reuse ) {
+        _reuseSource = reuse;
+    }
+
     /**
     	If in print to memory mode, reset the buffer to the
     	beginning.
@@ -2321,9 +3896,16 @@ public:
     void ClearBuffer( bool resetToFirstElement = true ) {
         _buffer.Clear();
         _buffer.Push(0);
+        FreeChunks();
 		_firstElement = resetToFirstElement;
     }
 
+    /**
+    	Sets where the memory for the output buffer and the element
+    	stack comes from. Passing null restores the default.
+    */
+    void SetAllocator( XMLAllocator* allocator );
+
 protected:
 	virtual bool CompactMode( const XMLElement& )	{ return _compactMode; }
 
@@ -2347,10 +3929,33 @@ private:
        just opened, and writing any whitespace necessary if not in compact mode.
      */
     void PrepareForNewNode( bool compactMode );
-    void PrintString( const char*, bool restrictedEntitySet );	// prints out, after detecting entities.
+    void PrintString( const char*, bool restrictedEntitySet, StrPair* value = 0 );	// prints out, after detecting entities.
+    void PushAttribute( const char* name, const char* value, StrPair* source );
+    void PushText( const char* text, bool cdata, StrPair* source );
+    static const char* FindEntity( const char* p, const char* end, const bool* flag );
+    bool ReuseSource( const XMLNode& node );
+    void WriteGap( const char* source, size_t offset );
+    static void ChunkOutput( const char* data, size_t size, void* printer );
+    void FreeChunks();
+
+    struct PrintJob;
+    void PrintParallel( const XMLDocument& doc, int threads );
+    int PlanPrint( const XMLNode& node, int index, PrintJob* job );
+
+    // Whitespace of the source, written before a node.
+    struct SourceGap {
+        const char* start;
+        size_t      length;
+        bool        afterText;  // the last node written at this depth is text
+    };
+    bool _reuseSource;
+    bool _compactBeforeReuse;               // restored after the document
+    const XMLElement* _reused;              // written as source text
+    DynArray< SourceGap, 10 > _gaps;        // the last one at each depth
 
     bool _firstElement;
-    FILE* _fp;
+    OutputFunc _output;
+    void* _outputContext;
     int _depth;
     int _textDepth;
     bool _processEntities;
@@ -2358,19 +3963,114 @@ private:
 
     enum {
         ENTITY_RANGE = 64,
-        BUF_SIZE = 200
+        BUF_SIZE = 200,
+        OUTPUT_CHUNK = 64 * 1024    // buffered before it is passed on
     };
     bool _entityFlag[ENTITY_RANGE];
     bool _restrictedEntityFlag[ENTITY_RANGE];
 
     DynArray< char, 20 > _buffer;
 
+    // Output moved out of _buffer, if chunked.
+    struct OutputChunk {
+        char*           mem;
+        size_t          size;
+        XMLAllocator*   allocator;
+    };
+    DynArray< OutputChunk, 4 > _chunks;
+    XMLAllocator* _allocator;
+
     // Prohibit cloning, intentionally not implemented
     XMLPrinter( const XMLPrinter& );
     XMLPrinter& operator=( const XMLPrinter& );
 };
 
 
+/**
+	Compresses what an XMLPrinter prints with gzip or zstd, and writes
+	it to a FILE:
+	@verbatim
+	XMLCompressor compressor( fp, XMLCompressor::GZIP );
+	XMLPrinter printer;
+	printer.SetOutput( XMLCompressor::Output, &compressor );
+	doc.Print( &printer );
+	XMLError error = compressor.Finish();
+	@endverbatim
+	With threads (see XMLNode::DeepClone()), the output is compressed on
+	a thread of its own while printing goes on.
+
+	The codecs are optional: tinyxml2 has gzip when it is built with
+	TINYXML2_ZLIB defined and linked with zlib, and zstd with
+	TINYXML2_ZSTD and libzstd.
+*/
+class TINYXML2_LIB XMLCompressor
+{
+public:
+    enum Format {
+        GZIP,
+        ZSTD
+    };
+
+    /// 'level' is the compression level of the codec, or 0 for its default.
+    XMLCompressor( FILE* fp, Format format, int level = 0 );
+    /// Calls Finish(), if it wasn't.
+    ~XMLCompressor();
+
+    /// Whether tinyxml2 was built with the codec for 'format'.
+    static bool Supported( Format format );
+
+    /// Takes output to compress: an XMLPrinter::OutputFunc, with the compressor as the context.
+    static void Output( const char* data, size_t size, void* compressor );
+
+    /**
+    	Compresses what is left, ends the stream, and waits for it to
+    	be written. Returns XML_SUCCESS, or XML_ERROR_COMPRESSION if the
+    	codec isn't there, fails, or the file can't be written.
+    */
+    XMLError Finish();
+
+private:
+    XMLCompressor( const XMLCompressor& );	// not supported
+    void operator=( const XMLCompressor& );	// not supported
+
+    struct Pipeline;
+    Pipeline* _pipeline;
+    XMLError _error;
+};
+
+
+/**
+	A handle to a load on a thread of its own; see
+	XMLDocument::LoadFileAsync(). It can be used for one load after
+	another.
+*/
+class TINYXML2_LIB XMLLoad
+{
+public:
+    XMLLoad();
+    /// Waits for the load, if there is one.
+    ~XMLLoad();
+
+    /// Whether the load is over, so that Wait() returns at once.
+    bool Ready() const;
+
+    /**
+    	Waits for the load to be over, and returns its error: that of
+    	XMLDocument::LoadFile(). XML_SUCCESS if there was no load.
+    */
+    XMLError Wait();
+
+private:
+    friend class XMLDocument;
+    XMLLoad( const XMLLoad& );	// not supported
+    void operator=( const XMLLoad& );	// not supported
+
+    struct Task;
+    Task* _task;
+    XMLError _error;
+};
+
+
 }	// tinyxml2
 
 #if defined(_MSC_VER)